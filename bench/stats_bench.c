@@ -0,0 +1,231 @@
+/**
+ * @file stats_bench.c
+ * @brief Microbenchmark of the per-block statistics of the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "daemon.h"
+#include "fg_definitions.h"
+#include "fg_time.h"
+
+/** Number of flows the blocks are spread over. */
+#define BENCH_FLOWS 4096
+
+/** Default number of blocks accounted per layout and round. */
+#define BENCH_BLOCKS 100000000L
+
+/** Number of rounds each layout is measured in. */
+#define BENCH_ROUNDS 3
+
+/** Size of the accounted blocks. */
+#define BENCH_BLOCK_SIZE 8192
+
+/**
+ * Statistics of a flow as the daemon kept them before it accounted each
+ * block once: a full copy for the interval report and one for the final
+ * report, both updated for each block.
+ */
+struct double_statistics {
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned request_blocks_read;
+	unsigned request_blocks_written;
+	unsigned response_blocks_read;
+	unsigned response_blocks_written;
+
+	double iat_min;
+	double iat_max;
+	double iat_sum;
+	double delay_min;
+	double delay_max;
+	double delay_sum;
+	double rtt_min;
+	double rtt_max;
+	double rtt_sum;
+	double rtt_intended_min;
+	double rtt_intended_max;
+	double rtt_intended_sum;
+
+	unsigned schedule_slips;
+	double schedule_slip_max;
+	double schedule_slip_sum;
+
+	unsigned response_queue_max;
+
+	unsigned query_rounds;
+	double qct_min;
+	double qct_max;
+	double qct_sum;
+
+	int has_tcp_info;
+	struct fg_tcp_info tcp_info;
+};
+
+/** Flow with the statistics of the former layout. */
+struct double_flow {
+	struct double_statistics statistics[2];
+};
+
+/** Pseudo random state picking the flow and RTT of each block. */
+static unsigned bench_seed;
+
+static inline unsigned bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed;
+}
+
+/**
+ * Account a block written and its response read with the former layout, as
+ * write_data(), read_data() and process_rtt() did.
+ */
+static void __attribute__((noinline))
+account_double(struct double_flow *flow, int rc, double rtt)
+{
+	for (int i = INTERVAL; i <= FINAL; i++) {
+		flow->statistics[i].bytes_written += rc;
+		flow->statistics[i].request_blocks_written++;
+	}
+	for (int i = INTERVAL; i <= FINAL; i++) {
+		flow->statistics[i].bytes_read += rc;
+		flow->statistics[i].response_blocks_read++;
+	}
+	for (int i = INTERVAL; i <= FINAL; i++) {
+		ASSIGN_MIN(flow->statistics[i].rtt_min, rtt);
+		ASSIGN_MAX(flow->statistics[i].rtt_max, rtt);
+		flow->statistics[i].rtt_sum += rtt;
+		ASSIGN_MIN(flow->statistics[i].rtt_intended_min, rtt);
+		ASSIGN_MAX(flow->statistics[i].rtt_intended_max, rtt);
+		flow->statistics[i].rtt_intended_sum += rtt;
+	}
+}
+
+/**
+ * Account a block written and its response read with the statistics of
+ * struct flow, as write_data(), read_data() and process_rtt() do.
+ */
+static void __attribute__((noinline))
+account_single(struct flow *flow, int rc, double rtt)
+{
+	struct extremes *e = &flow->extremes[INTERVAL];
+
+	flow->statistics.bytes_written += rc;
+	flow->statistics.request_blocks_written++;
+	flow->statistics.bytes_read += rc;
+	flow->statistics.response_blocks_read++;
+	ASSIGN_MIN(e->rtt_min, rtt);
+	ASSIGN_MAX(e->rtt_max, rtt);
+	flow->statistics.rtt_sum += rtt;
+	ASSIGN_MIN(e->rtt_intended_min, rtt);
+	ASSIGN_MAX(e->rtt_intended_max, rtt);
+	flow->statistics.rtt_intended_sum += rtt;
+}
+
+static double bench_double(struct double_flow *flows, long blocks)
+{
+	struct timespec start, end;
+	unsigned r;
+
+	bench_seed = 1;
+	gettime(&start);
+	for (long i = 0; i < blocks; i++) {
+		r = bench_rand();
+		account_double(&flows[r % BENCH_FLOWS], BENCH_BLOCK_SIZE,
+			       ((r >> 8) & 1023) * 1e-6);
+	}
+	gettime(&end);
+
+	return time_diff(&start, &end) / blocks * 1e9;
+}
+
+static double bench_single(struct flow *flows, long blocks)
+{
+	struct timespec start, end;
+	unsigned r;
+
+	bench_seed = 1;
+	gettime(&start);
+	for (long i = 0; i < blocks; i++) {
+		r = bench_rand();
+		account_single(&flows[r % BENCH_FLOWS], BENCH_BLOCK_SIZE,
+			       ((r >> 8) & 1023) * 1e-6);
+	}
+	gettime(&end);
+
+	return time_diff(&start, &end) / blocks * 1e9;
+}
+
+/**
+ * Account blocks spread over many flows with the former and the current
+ * layout of the flow statistics and print the time taken per block.
+ *
+ * The number of blocks per round can be given as the only argument.
+ */
+int main(int argc, char *argv[])
+{
+	long blocks = argc > 1 ? atol(argv[1]) : BENCH_BLOCKS;
+	struct double_flow *double_flows;
+	struct flow *flows;
+
+	if (blocks <= 0) {
+		fprintf(stderr, "usage: %s [blocks]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double_flows = calloc(BENCH_FLOWS, sizeof(struct double_flow));
+	flows = calloc(BENCH_FLOWS, sizeof(struct flow));
+	if (!double_flows || !flows) {
+		fprintf(stderr, "could not allocate memory for flows\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < BENCH_FLOWS; i++) {
+		for (int j = INTERVAL; j <= FINAL; j++) {
+			double_flows[i].statistics[j].rtt_min = FLT_MAX;
+			double_flows[i].statistics[j].rtt_max = FLT_MIN;
+			double_flows[i].statistics[j].rtt_intended_min = FLT_MAX;
+			double_flows[i].statistics[j].rtt_intended_max = FLT_MIN;
+			flows[i].extremes[j].rtt_min = FLT_MAX;
+			flows[i].extremes[j].rtt_max = FLT_MIN;
+			flows[i].extremes[j].rtt_intended_min = FLT_MAX;
+			flows[i].extremes[j].rtt_intended_max = FLT_MIN;
+		}
+	}
+
+	printf("# %ld blocks over %d flows, ns per block\n", blocks,
+	       BENCH_FLOWS);
+	for (int round = 0; round < BENCH_ROUNDS; round++)
+		printf("interval and final copy: %6.2f  single copy: %6.2f\n",
+		       bench_double(double_flows, blocks),
+		       bench_single(flows, blocks));
+
+	free(double_flows);
+	free(flows);
+	return EXIT_SUCCESS;
+}
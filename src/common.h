@@ -70,11 +70,35 @@
 /** Ensures extra options are limited in length on both controller and deamon. */
 #define MAX_EXTRA_SOCKET_OPTION_VALUE_LENGTH 16
 
+/** Max number of segments of a rate schedule. */
+#define MAX_RATE_SEGMENTS 4096
+
 #ifndef TCP_CA_NAME_MAX
 /** Max size of the congestion control algorithm specifier string. */
 #define TCP_CA_NAME_MAX 16
 #endif /* TCP_CA_NAME_MAX */
 
+/** Size of a TCP state sample as shipped to the controller and written to
+ * the time series file (option --sample). All fields are big endian:
+ *
+ *   offset  size  field
+ *        0     8  time since the start of the flow, in ns
+ *        8     4  connection of the flow
+ *       12     4  congestion window, in segments
+ *       16     4  slow start threshold, in segments
+ *       20     4  smoothed RTT, in microseconds
+ *       24     4  RTT variance, in microseconds
+ *       28     4  unacknowledged segments
+ *       32     8  pacing rate, in bytes/s
+ *       40     8  delivery rate, in bytes/s */
+#define TCP_SAMPLE_SIZE 48
+
+/** Request size of a response block. */
+#define RESPONSE_BLOCK -1
+
+/** Request size of an empty response to a declined request. */
+#define DECLINED_RESPONSE_BLOCK -2
+
 /** Minium block (message) size we can send. */
 #define MIN_BLOCK_SIZE (signed) sizeof (struct block)
 
@@ -153,13 +177,25 @@ struct block {
 	 *  Size of the response block we request.
 	 *
 	 *  0 indicates that we don't request a response block. <BR>
-	 * -1 indicates this is a response block (needed for parsing data). */
+	 * -1 indicates this is a response block (needed for parsing data). <BR>
+	 * -2 indicates an empty response to a request the peer declined to
+	 *    answer, e.g. as its block limit is reached. */
 	int32_t request_block_size;
 
 	/** Sending timestap for calculating delay and RTT. */
 	struct timespec data;
 	/** Used to access 64bit timespec on 32bit arch. */
 	struct timespec data2;
+	/** Scheduled sending time, equals @p data for unpaced flows. */
+	struct timespec intended;
+};
+
+/** Segment of a rate schedule (option --rate-schedule). */
+struct rate_segment {
+	/** Duration of the segment in seconds. */
+	double duration;
+	/** Sending rate during the segment in bytes per second. */
+	double rate;
 };
 
 /** Options for stochastic traffic generation. */
@@ -216,8 +252,37 @@ struct flow_settings {
 
 	/** Send at specified rate per second (option -R). */
 	const char *write_rate_str;
-	/** The actual rate we should send. */
-	int write_rate;
+	/** The actual rate we should send, in bytes per second. */
+	double write_rate;
+	/** Let the kernel pace at the sending rate (option -O SO_MAX_PACING_RATE). */
+	int kernel_pacing;
+	/** Token bucket shared with other flows on the daemon to draw the
+	 * sending rate from, 0 for none (option --rate-group). */
+	int rate_group;
+	/** Aggregate rate of the rate group in bytes per second. */
+	double rate_group_rate;
+	/** Bucket size of the rate group in bytes, 0 for the default. */
+	int rate_group_burst;
+	/** Sending rate varying over time (option --rate-schedule). Not
+	 * shared between flows, every flow owns its copy. */
+	struct rate_segment *rate_schedule;
+	/** Number of segments of the rate schedule, 0 for none. */
+	int num_rate_segments;
+	/** Restart the rate schedule after its last segment. Otherwise the
+	 * rate of the last segment is kept. */
+	int rate_schedule_loop;
+	/** Send only while this gate of the daemon is open, 0 for no gate
+	 * (option --gate). */
+	int gate;
+	/** Issue requests in rounds synchronized with the other flows of this
+	 * query group on the daemon, 0 for none (option --query). */
+	int query_group;
+	/** Rounds per second started by the query group, 0 to start the next
+	 * round as soon as the previous one completed. */
+	double query_rate;
+	/** Number of connections in the query group, computed by the
+	 * controller. */
+	int query_fanin;
 
 	/** Random seed to use (default: read /dev/urandom) (option -J). */
 	unsigned random_seed;
@@ -231,6 +296,34 @@ struct flow_settings {
   /** Total number of blocks to send before stopping (options -Z and -X). */
   int total_blocks[2];
 
+	/** Maximum number of requests awaiting their response, 0 for no limit
+	 * (option --window). */
+	int request_window;
+
+	/** Number of parallel connections of the flow (option --connections). */
+	int connections;
+
+	/** Coflow the flow belongs to, 0 for none (option --coflow). The flows
+	 * of a coflow start at the time scheduled by the controller. */
+	int coflow;
+
+	/** Period in seconds to sample the TCP state at, 0 for no sampling
+	 * (option --sample). */
+	double sample_period;
+	/** Trace the TCP events of the flow with eBPF (option
+	 * --kernel-trace). */
+	int kernel_trace;
+	/** Sum the interval reports of the flow up into the aggregate report
+	 * of this report group on the daemon, 0 for none (option
+	 * --aggregate). */
+	int report_group;
+	/** Test the report group belongs to, drawn by the controller, so that
+	 * concurrent tests on a daemon may use the same group IDs. */
+	int report_scope;
+	/** Send only the aggregate report instead of the interval reports of
+	 * the flow itself (option --aggregate-only). */
+	int aggregate_only;
+
 	/** Sets SO_DEBUG on test socket (option -O). */
 	int cork;
 	/** Disable nagle algorithm on test socket (option -O). */
@@ -283,11 +376,31 @@ struct fg_tcp_info {
 	int tcpi_backoff;
 	int tcpi_snd_mss;
 	int tcpi_ca_state;
+	/** Path MTU, only used within the daemon. */
+	int tcpi_pmtu;
+	/** Most recent delivery rate, in bytes/s. */
+	uint64_t tcpi_delivery_rate;
+	/** Bytes acknowledged by the peer. */
+	uint64_t tcpi_bytes_acked;
+	/** Time busy sending data, in microseconds. */
+	uint64_t tcpi_busy_time;
+	/** Time limited by the receive window, in microseconds. */
+	uint64_t tcpi_rwnd_limited;
+	/** Time limited by the send buffer, in microseconds. */
+	uint64_t tcpi_sndbuf_limited;
+	/** Set if ECN was negotiated. */
+	int tcpi_ecn;
+	/** Packets delivered with the CE mark. */
+	int tcpi_delivered_ce;
+	/** Pacing rate, in bytes/s, only used within the daemon. */
+	uint64_t tcpi_pacing_rate;
 };
 
 /* Report (measurement sample) of a flow */
 struct report {
 	int id;
+	/** Connection of a multi-connection flow the report belongs to */
+	int connection;
 	/** Daemon endpoint - either source or destination */
 	enum endpoint_t endpoint;
 	/** Report type - either INTERVAL or FINAL report */
@@ -326,6 +439,19 @@ struct report {
 	double rtt_max;
 	/** Accumulated round-trip time. */
 	double rtt_sum;
+	/** Minimum round-trip time measured from the scheduled sending time. */
+	double rtt_intended_min;
+	/** Maximum round-trip time measured from the scheduled sending time. */
+	double rtt_intended_max;
+	/** Accumulated round-trip time measured from the scheduled sending time. */
+	double rtt_intended_sum;
+
+	/** Number of blocks sent after their scheduled sending time. */
+	unsigned schedule_slips;
+	/** Maximum delay of a block behind its schedule. */
+	double schedule_slip_max;
+	/** Accumulated delay of blocks behind their schedule. */
+	double schedule_slip_sum;
 
 	/* on the Daemon this is filled from the os specific
 	 * tcp_info struct */
@@ -336,6 +462,67 @@ struct report {
 	/** Interface MTU */
 	unsigned imtu;
 
+	/** Responses waiting for transmission at the end of the report */
+	unsigned response_queue_depth;
+	/** Maximum number of responses waiting for transmission */
+	unsigned response_queue_max;
+
+	/** Time from connect() until the test connection was established */
+	double connect_time;
+	/** Failed connect attempts of the test connection which were retried */
+	unsigned connect_retries;
+
+	/** Bytes the rate schedule allowed in the report period */
+	double scheduled_bytes;
+
+	/** Query rounds completed in the report period, only reported by one
+	 * flow of the query group */
+	unsigned query_rounds;
+	/** Minimum query completion time */
+	double qct_min;
+	/** Maximum query completion time */
+	double qct_max;
+	/** Accumulated query completion time */
+	double qct_sum;
+	/** Median query completion time of the whole test (final report) */
+	double qct_p50;
+	/** 99th percentile of query completion time (final report) */
+	double qct_p99;
+	/** 99.9th percentile of query completion time (final report) */
+	double qct_p999;
+
+	/** TCP state samples taken since the previous report, TCP_SAMPLE_SIZE
+	 * bytes each */
+	unsigned char *samples;
+	/** Size of the samples in bytes */
+	size_t samples_size;
+	/** Samples lost since the previous report because the ring buffer of
+	 * the daemon overflowed */
+	unsigned samples_lost;
+
+	/** Packets missing in the traffic dump (final report): dropped by the
+	 * kernel on the interface while the flow was captured */
+	unsigned dump_kernel_drops;
+	/** Packets dropped by the writer of the dump file (final report) */
+	unsigned dump_writer_drops;
+
+	/** Number of flow reports summed up into this aggregate report of a
+	 * report group, 0 for the report of a flow. The ID is the one of the
+	 * report group then */
+	unsigned aggregated;
+	/** Flow reports of the aggregate report with TCP info. The TCP info of
+	 * an aggregate report is their mean, or for the delivery rate and the
+	 * acknowledged bytes their sum */
+	unsigned aggregated_tcp_info;
+	/** Distribution of the congestion window over the flows of the
+	 * aggregate report */
+	int tcpi_snd_cwnd_min;
+	int tcpi_snd_cwnd_max;
+	/** Distribution of the RTT of the kernel over the flows of the
+	 * aggregate report */
+	int tcpi_rtt_min;
+	int tcpi_rtt_max;
+
 	int status;
 
 	struct report* next;
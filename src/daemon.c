@@ -62,19 +62,34 @@
 #include "fg_error.h"
 #include "fg_math.h"
 #include "fg_definitions.h"
+#include "fg_endian.h"
 #include "fg_socket.h"
 #include "fg_time.h"
 #include "fg_log.h"
+#include "fg_gate.h"
+#include "fg_stats.h"
 #include "daemon.h"
 #include "source.h"
 #include "destination.h"
 #include "trafgen.h"
 #include <poll.h>
+#ifdef __LINUX__
+#include <sys/prctl.h>
+#endif /* __LINUX__ */
 
 #ifdef HAVE_LIBPCAP
 #include "fg_pcap.h"
 #endif /* HAVE_LIBPCAP */
 
+#ifdef HAVE_INET_DIAG
+#include <sys/stat.h>
+#include "fg_tcp_diag.h"
+#endif /* HAVE_INET_DIAG */
+
+#ifdef HAVE_LIBBPF
+#include "fg_bpf.h"
+#endif /* HAVE_LIBBPF */
+
 #ifndef SOL_TCP
 #define SOL_TCP IPPROTO_TCP
 #endif /* SOL_TCP */
@@ -97,20 +112,58 @@ struct report* reports = 0;
 struct report* reports_last = 0;
 unsigned pending_reports = 0;
 
+/** Set if interval reports were deferred for lack of room in the report
+ * queue. Protected by the mutex like the queue. */
+static int reports_deferred = 0;
+
+unsigned schedule_quantum = DEFAULT_SCHEDULE_QUANTUM;
+
+int shared_listen = 0;
+unsigned connect_rate = 0;
+
+/** Earliest time the connect rate allows the next connect. */
+static struct timespec next_connect_slot;
+
+/** Time the daemon loop has to wake up at the latest, e.g. for the next
+ * scheduled block of a paced flow. */
+static struct timespec next_wakeup;
+
 struct linked_list flows;
+struct linked_list shared_listeners;
+struct linked_list pending_connections;
+struct linked_list rate_buckets;
+struct linked_list query_groups;
+struct linked_list report_groups;
+
+struct fg_gate_region *gates = NULL;
+int gate_fifo = -1;
+
+/** Gate states as last seen by the daemon. */
+static uint8_t gate_state[MAX_GATES];
+/** Time each gate was last opened. */
+static struct timespec gate_opened[MAX_GATES];
 
 char started = 0;
 
+#ifdef HAVE_INET_DIAG
+/** Netlink socket for TCP statistics dumps, -1 if unavailable. */
+static int tcp_diag_fd = -1;
+#endif /* HAVE_INET_DIAG */
+
 /* Forward declarations */
 static int write_data(struct flow *flow);
 static int read_data(struct flow *flow);
 static void process_rtt(struct flow* flow);
+static void process_schedule(struct flow* flow);
 static void process_iat(struct flow* flow);
 static void process_delay(struct flow* flow);
 static void report_flow(struct flow* flow, int type);
-static void send_response(struct flow* flow,
-			  int requested_response_block_size);
+static int queue_response(struct flow* flow,
+			  int requested_response_block_size, int declined);
+static int send_responses(struct flow* flow);
+static int send_handshake(struct flow* flow);
 int get_tcp_info(struct flow *flow, struct fg_tcp_info *info);
+static void collect_final_tcp_info(struct flow *flow);
 
 
 void poll_fd_zero() {
@@ -147,49 +200,891 @@ void request_error(struct request *request, const char *fmt, ...)
 	strcpy(request->error, str);
 }
 
-static inline int flow_in_delay(struct timespec *now, struct flow *flow,
-				int direction)
+static inline int flow_in_delay(struct timespec *now, struct flow *flow,
+				int direction)
+{
+	return time_is_after(&flow->start_timestamp[direction], now);
+}
+
+
+static inline int flow_sending(struct timespec *now, struct flow *flow,
+			       int direction)
+{
+	return !flow_in_delay(now, flow, direction) &&
+		(flow->settings.duration[direction] < 0 ||
+		 time_diff_now(&flow->stop_timestamp[direction]) < 0.0);
+}
+
+static inline int flow_block_scheduled(struct timespec *now, struct flow *flow)
+{
+	return time_is_after(now, &flow->next_write_block_timestamp);
+}
+
+/**
+ * Check if the request window of @p flow allows to issue another request.
+ */
+static inline int flow_window_open(struct flow *flow)
+{
+	return !flow->settings.request_window ||
+		flow->outstanding_requests <
+		(unsigned)flow->settings.request_window;
+}
+
+/**
+ * Check if @p flow may issue the request of the current round of its query
+ * group. Flows outside of a query group always may.
+ */
+static inline int flow_query_due(struct flow *flow)
+{
+	return !flow->query_group ||
+		flow->query_round != flow->query_group->round;
+}
+
+/**
+ * Check if the writes of @p flow follow a schedule, i.e. if it is rate
+ * limited or uses an interpacket gap.
+ */
+static inline int flow_paced(struct flow *flow)
+{
+	return (flow->settings.write_rate && !flow->settings.kernel_pacing) ||
+		flow->settings.num_rate_segments ||
+		flow->settings.interpacket_gap_trafgen_options.param_one;
+}
+
+/**
+ * Check if the gate of @p flow lets it send. Flows without a gate always may.
+ */
+static inline int flow_gate_open(struct flow *flow)
+{
+	return !flow->settings.gate || gates->open[flow->settings.gate - 1];
+}
+
+/**
+ * Account @p bytes written by @p flow to the counters of its gate.
+ */
+static inline void gate_account(struct flow *flow, int bytes)
+{
+	if (flow->settings.gate)
+		gates->stats[flow->settings.gate - 1].bytes += bytes;
+}
+
+static inline int flow_response_pending(struct flow *flow)
+{
+	return flow->response_queue_length ||
+		flow->current_response_bytes_written;
+}
+
+/**
+ * Check if the interval reports of @p flow are only summed up into those of
+ * its report group or of its connections, rather than sent on their own.
+ */
+static inline int flow_aggregate_only(const struct flow *flow)
+{
+	return flow->settings.aggregate_only &&
+		(flow->report_group || flow->connection_group);
+}
+
+static inline int flow_response_queue_full(struct flow *flow)
+{
+	return flow->response_queue_length >= RESPONSE_QUEUE_MAX;
+}
+
+static inline int flow_connect_due(struct timespec *now, struct flow *flow)
+{
+	return flow->endpoint == SOURCE && flow->fd != -1 &&
+		!flow->connect_called &&
+		(!flow->source_settings.late_connect || flow->start_called) &&
+		!time_is_after(&flow->next_connect_timestamp, now);
+}
+
+static inline int flow_handshake_pending(struct flow *flow)
+{
+	return flow->source_settings.handshake &&
+		flow->handshake_bytes_written < FLOW_HANDSHAKE_SIZE;
+}
+
+/**
+ * Grant @p flow its quantum for the current scheduling round.
+ *
+ * @return non-zero if the flow may transfer data in direction @p io
+ */
+static inline int flow_replenish(struct flow *flow, enum io_t io)
+{
+	if (!schedule_quantum)
+		return 1;
+	flow->deficit[io] += schedule_quantum;
+	return flow->deficit[io] > 0;
+}
+
+/**
+ * Check if @p flow has budget left in direction @p io in this round.
+ */
+static inline int flow_budget_left(struct flow *flow, enum io_t io)
+{
+	return !schedule_quantum || flow->deficit[io] > 0;
+}
+
+/**
+ * Take a slot of the connect rate limit.
+ *
+ * Slots not used while the daemon was idle are saved up for at most one
+ * poll timeout, which lets a loop iteration connect a batch of flows without
+ * exceeding the rate on average.
+ *
+ * @return non-zero if a connect may be issued now
+ */
+int connect_slot_available(void)
+{
+	struct timespec now, earliest;
+
+	if (!connect_rate)
+		return 1;
+
+	gettime(&now);
+	if (time_is_after(&next_connect_slot, &now))
+		return 0;
+
+	earliest = now;
+	time_add(&earliest, -DEFAULT_SELECT_TIMEOUT / 1e9);
+	if (time_is_after(&earliest, &next_connect_slot))
+		next_connect_slot = earliest;
+	time_add(&next_connect_slot, 1.0 / connect_rate);
+
+	return 1;
+}
+
+/**
+ * Let @p flow draw its sending rate from the token bucket of its rate group.
+ *
+ * The bucket is created by the first flow of the group and shared by all
+ * later ones, so tokens not used by idle flows go to the active ones.
+ *
+ * @return 0 on success, -1 if the group exists with different parameters
+ */
+int join_rate_group(struct flow *flow)
+{
+	struct rate_bucket *bucket;
+	double burst;
+
+	if (!flow->settings.rate_group)
+		return 0;
+
+	burst = flow->settings.rate_group_burst ? :
+		flow->settings.rate_group_rate * RATE_BUCKET_DEFAULT_BURST;
+
+	const struct list_node *node = fg_list_front(&rate_buckets);
+	while (node) {
+		bucket = node->data;
+		node = node->next;
+
+		if (bucket->group != flow->settings.rate_group)
+			continue;
+
+		if (bucket->rate != flow->settings.rate_group_rate ||
+		    bucket->burst != burst) {
+			flow_error(flow, "rate group %d already exists with a "
+				   "different rate or burst size",
+				   bucket->group);
+			return -1;
+		}
+		bucket->flows++;
+		flow->rate_bucket = bucket;
+		return 0;
+	}
+
+	bucket = malloc(sizeof(struct rate_bucket));
+	if (!bucket) {
+		logging(LOG_ALERT, "could not allocate memory for rate bucket");
+		flow_error(flow, "could not allocate memory for rate bucket");
+		return -1;
+	}
+	bucket->group = flow->settings.rate_group;
+	bucket->rate = flow->settings.rate_group_rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	gettime(&bucket->last_refill);
+	bucket->flows = 1;
+
+	fg_list_push_back(&rate_buckets, bucket);
+	flow->rate_bucket = bucket;
+
+	DEBUG_MSG(LOG_NOTICE, "created rate group %d: %.0f B/s, burst %.0f B",
+		  bucket->group, bucket->rate, bucket->burst);
+	return 0;
+}
+
+/**
+ * Stop @p flow from drawing from its rate group. The bucket is freed with
+ * the last flow of the group.
+ */
+static void leave_rate_group(struct flow *flow)
+{
+	struct rate_bucket *bucket = flow->rate_bucket;
+
+	if (!bucket)
+		return;
+
+	flow->rate_bucket = NULL;
+	if (--bucket->flows)
+		return;
+
+	fg_list_remove(&rate_buckets, bucket);
+	free(bucket);
+}
+
+/**
+ * Check if the rate group of @p flow has tokens left, adding the tokens
+ * accrued since the last check.
+ *
+ * If the bucket is empty, the daemon is woken up once it has refilled.
+ */
+static int flow_tokens_left(struct timespec *now, struct flow *flow)
+{
+	struct rate_bucket *bucket = flow->rate_bucket;
+	struct timespec refill;
+
+	if (!bucket)
+		return 1;
+
+	if (time_is_after(now, &bucket->last_refill)) {
+		bucket->tokens = MIN(bucket->burst, bucket->tokens +
+				     bucket->rate *
+				     time_diff(&bucket->last_refill, now));
+		bucket->last_refill = *now;
+	}
+	if (bucket->tokens > 0)
+		return 1;
+
+	/* the smallest step past zero, so the bucket is not empty then */
+	refill = *now;
+	time_add(&refill, -bucket->tokens / bucket->rate + 1e-6);
+	if (time_is_after(&next_wakeup, &refill))
+		next_wakeup = refill;
+	return 0;
+}
+
+/**
+ * Add @p flow to its query group, creating the group with its first flow.
+ * The first flow also reports the statistics of the group.
+ *
+ * @return 0 on success, -1 if the group exists with different parameters
+ */
+int join_query_group(struct flow *flow)
+{
+	struct query_group *group;
+
+	if (!flow->settings.query_group)
+		return 0;
+
+	const struct list_node *node = fg_list_front(&query_groups);
+	while (node) {
+		group = node->data;
+		node = node->next;
+
+		if (group->group != flow->settings.query_group)
+			continue;
+
+		if (group->fanin != (unsigned)flow->settings.query_fanin ||
+		    group->rate != flow->settings.query_rate) {
+			flow_error(flow, "query group %d already exists with a "
+				   "different fan-in or round rate",
+				   group->group);
+			return -1;
+		}
+		if (group->flows == group->fanin) {
+			flow_error(flow, "query group %d is already complete",
+				   group->group);
+			return -1;
+		}
+		group->flows++;
+		flow->query_group = group;
+		return 0;
+	}
+
+	group = calloc(1, sizeof(struct query_group));
+	if (group)
+		group->qct = malloc(QUERY_GROUP_QCT_SIZE * sizeof(double));
+	if (!group || !group->qct) {
+		free(group);
+		logging(LOG_ALERT, "could not allocate memory for query group");
+		flow_error(flow, "could not allocate memory for query group");
+		return -1;
+	}
+	group->group = flow->settings.query_group;
+	group->fanin = flow->settings.query_fanin;
+	group->rate = flow->settings.query_rate;
+	group->qct_capacity = QUERY_GROUP_QCT_SIZE;
+	group->flows = 1;
+	group->leader = flow;
+
+	fg_list_push_back(&query_groups, group);
+	flow->query_group = group;
+
+	DEBUG_MSG(LOG_NOTICE, "created query group %d: fan-in %u, %.1f "
+		  "rounds/s", group->group, group->fanin, group->rate);
+	return 0;
+}
+
+/**
+ * Account the response of @p flow to the current round of its query group as
+ * missing, as the flow left the group or its request was declined. The round
+ * still completes once all other responses arrived, but without a query
+ * completion time.
+ */
+static void drop_query_response(struct flow *flow)
+{
+	struct query_group *group = flow->query_group;
+
+	if (!group->outstanding || flow->query_answered == group->round)
+		return;
+
+	flow->query_answered = group->round;
+	group->round_incomplete = 1;
+	if (!--group->outstanding)
+		logging(LOG_NOTICE, "query group %d completed round %u with "
+			"responses missing", group->group, group->round);
+}
+
+/**
+ * Remove @p flow from its query group. A response of the flow still missing
+ * in the current round is given up. Before its first round a group waits for
+ * all its flows, once its rounds started the remaining flows carry on without
+ * @p flow. The group is freed with its last flow.
+ */
+static void leave_query_group(struct flow *flow)
+{
+	struct query_group *group = flow->query_group;
+
+	if (!group)
+		return;
+
+	drop_query_response(flow);
+	if (group->round && group->fanin)
+		group->fanin--;
+	flow->query_group = NULL;
+	if (group->leader == flow)
+		group->leader = NULL;
+	if (--group->flows)
+		return;
+
+	fg_list_remove(&query_groups, group);
+	free(group->qct);
+	free(group);
+}
+
+/**
+ * Start the next round of every query group which is due. A round starts
+ * once the previous one completed, the round rate allows it and all flows
+ * of the group are connected and sending.
+ */
+static void start_query_rounds(struct timespec *now)
+{
+	const struct list_node *node = fg_list_front(&query_groups);
+	while (node) {
+		struct query_group *group = node->data;
+		unsigned ready = 0;
+		node = node->next;
+
+		if (group->flows < group->fanin || group->outstanding)
+			continue;
+
+		if (time_is_after(&group->next_round, now)) {
+			if (time_is_after(&next_wakeup, &group->next_round))
+				next_wakeup = group->next_round;
+			continue;
+		}
+
+		const struct list_node *fnode = fg_list_front(&flows);
+		while (fnode) {
+			struct flow *flow = fnode->data;
+			fnode = fnode->next;
+
+			if (flow->query_group == group && flow->connected &&
+			    !flow_handshake_pending(flow) &&
+			    flow_sending(now, flow, WRITE))
+				ready++;
+		}
+		if (ready < group->fanin)
+			continue;
+
+		group->round++;
+		group->outstanding = group->fanin;
+		group->round_incomplete = 0;
+		group->round_start = *now;
+		group->next_round = *now;
+		if (group->rate)
+			time_add(&group->next_round, 1.0 / group->rate);
+
+		DEBUG_MSG(LOG_DEBUG, "query group %d starts round %u",
+			  group->group, group->round);
+	}
+}
+
+/**
+ * Account the response @p flow read to the current round of its query group
+ * and record the query completion time if it was the last one missing.
+ */
+static void process_query_response(struct flow *flow)
+{
+	struct query_group *group = flow->query_group;
+	struct timespec now;
+	double qct;
+
+	if (flow->query_round != group->round || !group->outstanding ||
+	    flow->query_answered == group->round)
+		return;
+
+	flow->query_answered = group->round;
+	if (--group->outstanding)
+		return;
+
+	if (group->round_incomplete) {
+		logging(LOG_NOTICE, "query group %d completed round %u with "
+			"responses missing", group->group, group->round);
+		return;
+	}
+
+	gettime(&now);
+	qct = time_diff(&group->round_start, &now);
+
+	if (group->num_qct == group->qct_capacity) {
+		double *qct_new = realloc(group->qct, 2 * group->qct_capacity *
+					  sizeof(double));
+		if (qct_new) {
+			group->qct = qct_new;
+			group->qct_capacity *= 2;
+		}
+	}
+	if (group->num_qct < group->qct_capacity)
+		group->qct[group->num_qct++] = qct;
+
+	if (group->leader) {
+		struct flow *leader = group->leader;
+
+		leader->statistics.query_rounds++;
+		ASSIGN_MIN(leader->extremes[INTERVAL].qct_min, qct);
+		ASSIGN_MAX(leader->extremes[INTERVAL].qct_max, qct);
+		leader->statistics.qct_sum += qct;
+	}
+
+	DEBUG_MSG(LOG_NOTICE, "query group %d completed round %u in %.3lfms",
+		  group->group, group->round, qct * 1e3);
+}
+
+/**
+ * Fill in the percentiles of the query completion times of the query group
+ * of @p flow into @p report.
+ */
+static void report_qct_percentiles(struct flow *flow, struct report *report)
+{
+	struct query_group *group = flow->query_group;
+	double *sorted;
+	unsigned n = group->num_qct;
+
+	report->qct_p50 = report->qct_p99 = report->qct_p999 = 0.0;
+	if (!n)
+		return;
+
+	sorted = malloc(n * sizeof(double));
+	if (!sorted) {
+		logging(LOG_WARNING, "could not allocate memory for query "
+			"completion times of flow %d", flow->id);
+		return;
+	}
+	memcpy(sorted, group->qct, n * sizeof(double));
+	fg_sort_samples(sorted, n);
+
+	report->qct_p50 = fg_percentile(sorted, n, 50);
+	report->qct_p99 = fg_percentile(sorted, n, 99);
+	report->qct_p999 = fg_percentile(sorted, n, 99.9);
+	free(sorted);
+}
+
+/**
+ * Add @p flow to its report group, creating the group with its first flow.
+ *
+ * @return 0 on success, -1 if the group exists with a different reporting
+ * interval
+ */
+int join_report_group(struct flow *flow)
+{
+	struct report_group *group;
+
+	if (!flow->settings.report_group)
+		return 0;
+
+	const struct list_node *node = fg_list_front(&report_groups);
+	while (node) {
+		group = node->data;
+		node = node->next;
+
+		if (group->connection_group ||
+		    group->group != flow->settings.report_group ||
+		    group->scope != flow->settings.report_scope ||
+		    group->endpoint != flow->endpoint)
+			continue;
+
+		if (group->reporting_interval !=
+		    flow->settings.reporting_interval) {
+			flow_error(flow, "report group %d already exists with "
+				   "a different reporting interval",
+				   group->group);
+			return -1;
+		}
+		group->flows++;
+		flow->report_group = group;
+		return 0;
+	}
+
+	group = calloc(1, sizeof(struct report_group));
+	if (!group) {
+		logging(LOG_ALERT, "could not allocate memory for report group");
+		flow_error(flow, "could not allocate memory for report group");
+		return -1;
+	}
+	group->group = flow->settings.report_group;
+	group->scope = flow->settings.report_scope;
+	group->endpoint = flow->endpoint;
+	group->reporting_interval = flow->settings.reporting_interval;
+	group->flows = 1;
+
+	fg_list_push_back(&report_groups, group);
+	flow->report_group = group;
+
+	DEBUG_MSG(LOG_NOTICE, "created report group %d", group->group);
+	return 0;
+}
+
+/**
+ * Add @p flow to the group summing up the interval reports of all connections
+ * of its flow, creating the group with the first connection. The aggregate
+ * report carries the flow ID and connection -1.
+ *
+ * @return 0 on success, -1 on error
+ */
+int join_connection_group(struct flow *flow)
+{
+	struct report_group *group;
+
+	if (flow->settings.connections < 2 ||
+	    !flow->settings.reporting_interval)
+		return 0;
+
+	const struct list_node *node = fg_list_front(&report_groups);
+	while (node) {
+		group = node->data;
+		node = node->next;
+
+		if (!group->connection_group || group->group != flow->id ||
+		    group->scope != flow->settings.report_scope ||
+		    group->endpoint != flow->endpoint)
+			continue;
+
+		group->flows++;
+		flow->connection_group = group;
+		return 0;
+	}
+
+	group = calloc(1, sizeof(struct report_group));
+	if (!group) {
+		logging(LOG_ALERT, "could not allocate memory for connection "
+			"group");
+		flow_error(flow, "could not allocate memory for connection "
+			   "group");
+		return -1;
+	}
+	group->group = flow->id;
+	group->scope = flow->settings.report_scope;
+	group->connection_group = 1;
+	group->endpoint = flow->endpoint;
+	group->reporting_interval = flow->settings.reporting_interval;
+	group->flows = 1;
+
+	fg_list_push_back(&report_groups, group);
+	flow->connection_group = group;
+
+	DEBUG_MSG(LOG_NOTICE, "created connection group of flow %d", flow->id);
+	return 0;
+}
+
+/**
+ * Send the aggregate report of @p group, if any flow contributed to it.
+ */
+static void send_report_group(struct report_group *group)
+{
+	struct report *report;
+	unsigned n;
+
+	if (!group->report.aggregated)
+		return;
+
+	report = malloc(sizeof(struct report));
+	if (!report) {
+		logging(LOG_ALERT, "could not allocate memory for aggregate "
+			"report");
+		group->report.aggregated = 0;
+		return;
+	}
+	*report = group->report;
+	group->report.aggregated = 0;
+
+	n = report->aggregated_tcp_info;
+	if (n) {
+		struct fg_tcp_info *info = &report->tcp_info;
+
+		info->tcpi_snd_cwnd = group->cwnd_sum / n;
+		info->tcpi_snd_ssthresh = group->ssthresh_sum / n;
+		info->tcpi_unacked = group->unacked_sum / n;
+		info->tcpi_sacked = group->sacked_sum / n;
+		info->tcpi_lost = group->lost_sum / n;
+		info->tcpi_retrans = group->retrans_sum / n;
+		info->tcpi_retransmits = group->retransmits_sum / n;
+		info->tcpi_reordering = group->reordering_sum / n;
+		info->tcpi_backoff = group->backoff_sum / n;
+		info->tcpi_rtt = group->rtt_sum / n;
+		info->tcpi_rttvar = group->rttvar_sum / n;
+		info->tcpi_rto = group->rto_sum / n;
+		info->tcpi_snd_mss = group->mss_sum / n;
+		info->tcpi_busy_time /= n;
+		info->tcpi_rwnd_limited /= n;
+		info->tcpi_sndbuf_limited /= n;
+	}
+
+	add_report(report);
+}
+
+/**
+ * Sum the interval @p report of a flow up into the aggregate report of its
+ * report @p group.
+ *
+ * Counters and accumulated values are summed up, extreme values and the
+ * reporting period are widened. Of the TCP info, the mean over the flows is
+ * reported, but for the delivery rate and the acknowledged bytes, which are
+ * summed up.
+ *
+ * @param[in,out] group report group of the flow
+ * @param[in] report interval report of the flow
+ * @param[in] has_tcp_info set if the TCP info of @p report is valid
+ */
+static void aggregate_report(struct report_group *group,
+			     const struct report *report, int has_tcp_info)
+{
+	struct report *r = &group->report;
+	const struct fg_tcp_info *info = &report->tcp_info;
+
+	if (!r->aggregated) {
+		*r = *report;
+		r->id = group->group;
+		r->connection = group->connection_group ? -1 : 0;
+		r->samples = NULL;
+		r->samples_size = 0;
+		r->samples_lost = 0;
+		r->aggregated = 1;
+		r->aggregated_tcp_info = 0;
+		memset(&r->tcp_info, 0, sizeof(r->tcp_info));
+		group->cwnd_sum = group->ssthresh_sum = group->unacked_sum = 0;
+		group->sacked_sum = group->lost_sum = group->retrans_sum = 0;
+		group->retransmits_sum = group->reordering_sum = 0;
+		group->backoff_sum = group->rtt_sum = group->rttvar_sum = 0;
+		group->rto_sum = group->mss_sum = 0;
+
+		/* Flows which started late get half an interval to report */
+		group->deadline = report->end;
+		time_add(&group->deadline, group->reporting_interval / 2);
+	} else {
+		if (time_is_after(&r->begin, &report->begin))
+			r->begin = report->begin;
+		if (time_is_after(&report->end, &r->end))
+			r->end = report->end;
+
+		r->bytes_read += report->bytes_read;
+		r->bytes_written += report->bytes_written;
+		r->request_blocks_read += report->request_blocks_read;
+		r->request_blocks_written += report->request_blocks_written;
+		r->response_blocks_read += report->response_blocks_read;
+		r->response_blocks_written += report->response_blocks_written;
+		r->scheduled_bytes += report->scheduled_bytes;
+
+		ASSIGN_MIN(r->iat_min, report->iat_min);
+		ASSIGN_MAX(r->iat_max, report->iat_max);
+		r->iat_sum += report->iat_sum;
+		ASSIGN_MIN(r->delay_min, report->delay_min);
+		ASSIGN_MAX(r->delay_max, report->delay_max);
+		r->delay_sum += report->delay_sum;
+		ASSIGN_MIN(r->rtt_min, report->rtt_min);
+		ASSIGN_MAX(r->rtt_max, report->rtt_max);
+		r->rtt_sum += report->rtt_sum;
+		ASSIGN_MIN(r->rtt_intended_min, report->rtt_intended_min);
+		ASSIGN_MAX(r->rtt_intended_max, report->rtt_intended_max);
+		r->rtt_intended_sum += report->rtt_intended_sum;
+
+		r->schedule_slips += report->schedule_slips;
+		ASSIGN_MAX(r->schedule_slip_max, report->schedule_slip_max);
+		r->schedule_slip_sum += report->schedule_slip_sum;
+
+		r->response_queue_depth += report->response_queue_depth;
+		ASSIGN_MAX(r->response_queue_max, report->response_queue_max);
+
+		r->query_rounds += report->query_rounds;
+		ASSIGN_MIN(r->qct_min, report->qct_min);
+		ASSIGN_MAX(r->qct_max, report->qct_max);
+		r->qct_sum += report->qct_sum;
+
+		if (report->pmtu && (!r->pmtu || report->pmtu < r->pmtu))
+			r->pmtu = report->pmtu;
+		r->aggregated++;
+	}
+
+	if (!has_tcp_info)
+		return;
+
+	if (!r->aggregated_tcp_info++) {
+		r->tcpi_snd_cwnd_min = r->tcpi_snd_cwnd_max =
+			info->tcpi_snd_cwnd;
+		r->tcpi_rtt_min = r->tcpi_rtt_max = info->tcpi_rtt;
+	} else {
+		ASSIGN_MIN(r->tcpi_snd_cwnd_min, info->tcpi_snd_cwnd);
+		ASSIGN_MAX(r->tcpi_snd_cwnd_max, info->tcpi_snd_cwnd);
+		ASSIGN_MIN(r->tcpi_rtt_min, info->tcpi_rtt);
+		ASSIGN_MAX(r->tcpi_rtt_max, info->tcpi_rtt);
+	}
+
+	group->cwnd_sum += info->tcpi_snd_cwnd;
+	group->ssthresh_sum += info->tcpi_snd_ssthresh;
+	group->unacked_sum += info->tcpi_unacked;
+	group->sacked_sum += info->tcpi_sacked;
+	group->lost_sum += info->tcpi_lost;
+	group->retrans_sum += info->tcpi_retrans;
+	group->retransmits_sum += info->tcpi_retransmits;
+	group->reordering_sum += info->tcpi_reordering;
+	group->backoff_sum += info->tcpi_backoff;
+	group->rtt_sum += info->tcpi_rtt;
+	group->rttvar_sum += info->tcpi_rttvar;
+	group->rto_sum += info->tcpi_rto;
+	group->mss_sum += info->tcpi_snd_mss;
+
+	/* The worst congestion avoidance state of any flow */
+	ASSIGN_MAX(r->tcp_info.tcpi_ca_state, info->tcpi_ca_state);
+	r->tcp_info.tcpi_delivery_rate += info->tcpi_delivery_rate;
+	r->tcp_info.tcpi_bytes_acked += info->tcpi_bytes_acked;
+	r->tcp_info.tcpi_busy_time += info->tcpi_busy_time;
+	r->tcp_info.tcpi_rwnd_limited += info->tcpi_rwnd_limited;
+	r->tcp_info.tcpi_sndbuf_limited += info->tcpi_sndbuf_limited;
+	r->tcp_info.tcpi_ecn |= info->tcpi_ecn;
+	r->tcp_info.tcpi_delivered_ce += info->tcpi_delivered_ce;
+}
+
+/**
+ * Remove a flow from report @p group. The group is freed with its last flow,
+ * after sending its pending aggregate report.
+ */
+static void release_report_group(struct report_group *group)
+{
+	if (!group || --group->flows)
+		return;
+
+	send_report_group(group);
+	fg_list_remove(&report_groups, group);
+	free(group);
+}
+
+/**
+ * Remove @p flow from its report group and the group of its connections.
+ */
+static void leave_report_group(struct flow *flow)
+{
+	release_report_group(flow->report_group);
+	release_report_group(flow->connection_group);
+	flow->report_group = NULL;
+	flow->connection_group = NULL;
+}
+
+/**
+ * Send the aggregate report of every report group which is due: all flows
+ * of the group contributed, or the deadline for late flows passed.
+ *
+ * @param[in] now current time
+ */
+static void send_report_groups(struct timespec *now)
 {
-	return time_is_after(&flow->start_timestamp[direction], now);
-}
+	const struct list_node *node = fg_list_front(&report_groups);
+	while (node) {
+		struct report_group *group = node->data;
+		node = node->next;
 
+		if (group->report.aggregated &&
+		    (group->report.aggregated >= group->flows ||
+		     time_is_after(now, &group->deadline)))
+			send_report_group(group);
+	}
+}
 
-static inline int flow_sending(struct timespec *now, struct flow *flow,
-			       int direction)
+/**
+ * Give @p flow its own copy of the rate schedule referenced by its settings.
+ *
+ * Must be called right after the settings were copied into the flow, as
+ * uninit_flow() frees the schedule of the flow.
+ */
+int dup_rate_schedule(struct flow *flow)
 {
-	return !flow_in_delay(now, flow, direction) &&
-		(flow->settings.duration[direction] < 0 ||
-		 time_diff_now(&flow->stop_timestamp[direction]) < 0.0);
+	const struct rate_segment *schedule = flow->settings.rate_schedule;
+	size_t size = flow->settings.num_rate_segments *
+		sizeof(struct rate_segment);
+
+	flow->settings.rate_schedule = NULL;
+	if (!size)
+		return 0;
+
+	flow->settings.rate_schedule = malloc(size);
+	if (!flow->settings.rate_schedule) {
+		flow->settings.num_rate_segments = 0;
+		logging(LOG_ALERT, "could not allocate memory for rate schedule");
+		flow_error(flow, "could not allocate memory for rate schedule");
+		return -1;
+	}
+	memcpy(flow->settings.rate_schedule, schedule, size);
+	return 0;
 }
 
-static inline int flow_block_scheduled(struct timespec *now, struct flow *flow)
+/**
+ * Give each connection of a multi-connection @p flow its share of the sending
+ * rate, so all connections together offer the load configured for the flow.
+ *
+ * Must be called once per flow endpoint, after dup_rate_schedule(). Further
+ * connections copy the settings of a connection that got its share already.
+ */
+void split_connection_rate(struct flow *flow)
 {
-	return time_is_after(now, &flow->next_write_block_timestamp);
+	const int connections = flow->settings.connections;
+
+	if (connections < 2)
+		return;
+
+	flow->settings.write_rate /= connections;
+	for (int i = 0; i < flow->settings.num_rate_segments; i++)
+		flow->settings.rate_schedule[i].rate /= connections;
 }
 
 void uninit_flow(struct flow *flow)
 {
 	DEBUG_MSG(LOG_DEBUG,"uninit_flow() called for flow %d",flow->id);
+	release_source_port(flow);
+	leave_rate_group(flow);
+	leave_query_group(flow);
+	leave_report_group(flow);
+#ifdef HAVE_LIBBPF
+	fg_bpf_trace_stop(flow);
+#endif /* HAVE_LIBBPF */
+#ifdef HAVE_LIBPCAP
+	fg_pcap_stop(flow);
+#endif /* HAVE_LIBPCAP */
 	if (flow->fd != -1)
 		close(flow->fd);
 	if (flow->listenfd_data != -1)
 		close(flow->listenfd_data);
-#ifdef HAVE_LIBPCAP
-	int rc;
-	if (flow->settings.traffic_dump && flow->pcap_thread) {
-		rc = pthread_cancel(flow->pcap_thread);
-		if (rc)
-			logging(LOG_WARNING, "failed to cancel dump thread: %s",
-				strerror(rc));
-
-		/* wait for the dump thread to react to the cancellation request */
-		rc = pthread_join(flow->pcap_thread, NULL);
-		if (rc)
-			logging(LOG_WARNING, "failed to join dump thread: %s",
-				strerror(rc));
-	}
-#endif /* HAVE_LIBPCAP */
-	free_all(flow->read_block, flow->write_block, flow->addr, flow->error);
+	free_all(flow->read_block, flow->write_block, flow->response_block,
+		 flow->response_queue, flow->addr, flow->error,
+		 flow->settings.rate_schedule, flow->samples);
 	free_math_functions(flow);
 }
 
@@ -205,6 +1100,39 @@ static void prepare_wfds(struct timespec *now, struct flow *flow)
 {
 	int rc = 0;
 
+	/* Nothing else goes out before the destination knows the flow */
+	if (flow_handshake_pending(flow))
+		return;
+
+	/* A flow with a fixed number of blocks ends once they are all written
+	 * and answered, rather than idling until its duration is up */
+	if (flow->endpoint == SOURCE && flow->settings.total_blocks[SOURCE] &&
+	    flow->total_blocks_written[WRITE] >=
+	    flow->settings.total_blocks[SOURCE] &&
+	    !flow->outstanding_requests && !flow->current_block_bytes_written &&
+	    flow_sending(now, flow, WRITE))
+		flow->stop_timestamp[WRITE] = *now;
+
+	/* Nothing goes out while the gate of the flow is closed */
+	if (!flow_gate_open(flow)) {
+		if (!flow->gate_blocked && (flow_response_pending(flow) ||
+					    flow_sending(now, flow, WRITE))) {
+			gates->stats[flow->settings.gate - 1].blocked++;
+			flow->gate_blocked = 1;
+		}
+		return;
+	}
+	flow->gate_blocked = 0;
+
+	/* Responses are sent regardless of our own write schedule */
+	if (flow_response_pending(flow)) {
+		DEBUG_MSG(LOG_DEBUG, "adding sock of flow %d to wfds for "
+			  "%u pending responses", flow->id,
+			  flow->response_queue_length);
+		poll_fds[flow->fd].fd = flow->fd;
+		poll_fds[flow->fd].events |= POLLOUT;
+	}
+
 	if (flow_in_delay(now, flow, WRITE)) {
 		DEBUG_MSG(LOG_WARNING, "flow %i not started yet (delayed)",
 			  flow->id);
@@ -213,7 +1141,25 @@ static void prepare_wfds(struct timespec *now, struct flow *flow)
 
 	if (flow_sending(now, flow, WRITE)) {
 		assert(!flow->finished[WRITE]);
-		if (flow_block_scheduled(now, flow)) {
+		if (flow->current_block_bytes_written ||
+		    !flow_window_open(flow)) {
+			/* a partially written block is always completed */
+			if (flow->current_block_bytes_written) {
+				poll_fds[flow->fd].fd = flow->fd;
+				poll_fds[flow->fd].events |= POLLOUT;
+			} else {
+				DEBUG_MSG(LOG_DEBUG, "request window of flow "
+					  "%d full (%u outstanding)", flow->id,
+					  flow->outstanding_requests);
+			}
+		} else if (!flow_query_due(flow)) {
+			DEBUG_MSG(LOG_DEBUG, "flow %d waits for the next round "
+				  "of query group %d", flow->id,
+				  flow->settings.query_group);
+		} else if (!flow_tokens_left(now, flow)) {
+			DEBUG_MSG(LOG_DEBUG, "rate group %d of flow %d out of "
+				  "tokens", flow->settings.rate_group, flow->id);
+		} else if (flow_block_scheduled(now, flow)) {
 			DEBUG_MSG(LOG_DEBUG, "adding sock of flow %d to wfds",
 				  flow->id);
 			poll_fds[flow->fd].fd = flow->fd;
@@ -221,6 +1167,9 @@ static void prepare_wfds(struct timespec *now, struct flow *flow)
 		} else {
 			DEBUG_MSG(LOG_DEBUG, "no block for flow %d scheduled "
 				  "yet", flow->id);
+			if (time_is_after(&next_wakeup,
+					  &flow->next_write_block_timestamp))
+				next_wakeup = flow->next_write_block_timestamp;
 		}
 	} else if (!flow->finished[WRITE]) {
 		flow->finished[WRITE] = 1;
@@ -250,18 +1199,16 @@ static int prepare_rfds(struct timespec *now, struct flow *flow)
 		}
 	}
 
-	if (flow->source_settings.late_connect && !flow->connect_called ) {
-		DEBUG_MSG(LOG_ERR, "late connecting test socket for flow %d "
-			  "after %.3fs delay",
-			  flow->id, flow->settings.delay[WRITE]);
-		if (do_connect(flow) == -1) {
-			return -1;
-		}
-	}
-
 	/* Altough the server flow might be finished we keep the socket in
 	 * rfd in order to check for buggy servers */
 	if (flow->connect_called && !flow->finished[READ]) {
+		/* Backpressure: leave further requests in the socket until
+		 * the queued responses went out */
+		if (flow_response_queue_full(flow)) {
+			DEBUG_MSG(LOG_DEBUG, "response queue of flow %d full, "
+				  "not reading", flow->id);
+			return 0;
+		}
 		DEBUG_MSG(LOG_DEBUG, "adding sock of flow %d to rfds",
 			  flow->id);
 		poll_fds[flow->fd].fd = flow->fd;
@@ -271,6 +1218,56 @@ static int prepare_rfds(struct timespec *now, struct flow *flow)
 	return 0;
 }
 
+/**
+ * Send empty final reports for the connections of the destination @p flow
+ * that were never accepted.
+ *
+ * The controller waits for a final report of every connection of a flow
+ * before it considers the flow done, so a connection that never came up
+ * must still be accounted for when the flow ends.
+ *
+ * @param[in] flow first connection of a destination flow
+ */
+static void report_missing_connections(struct flow *flow)
+{
+	struct report *report;
+	struct timespec now;
+
+	if (flow->endpoint != DESTINATION || flow->connection)
+		return;
+
+	gettime(&now);
+	for (int c = MAX(flow->connections_accepted, 1);
+	     c < flow->settings.connections; c++) {
+		logging(LOG_WARNING, "connection %d of flow %d was never "
+			"established", c, flow->id);
+
+		report = calloc(1, sizeof(struct report));
+		if (!report) {
+			logging(LOG_ALERT, "could not allocate memory for "
+				"report");
+			return;
+		}
+		report->id = flow->id;
+		report->connection = c;
+		report->endpoint = flow->endpoint;
+		report->type = FINAL;
+		report->begin = flow->first_report_time;
+		report->end = now;
+		report->iat_min = report->delay_min = FLT_MAX;
+		report->rtt_min = report->rtt_intended_min = FLT_MAX;
+		report->qct_min = FLT_MAX;
+		report->iat_max = report->delay_max = FLT_MIN;
+		report->rtt_max = report->rtt_intended_max = FLT_MIN;
+		report->qct_max = FLT_MIN;
+		/* Nothing was read or written, like a flow that finished */
+		report->status =
+			(flow->settings.duration[READ] ? 'f' : 'o') << 8 |
+			(flow->settings.duration[WRITE] ? 'f' : 'o');
+		add_report(report);
+	}
+}
+
 static int prepare_fds() {
 
 	DEBUG_MSG(LOG_DEBUG, "prepare_fds() called, number of flows: %zu",
@@ -282,15 +1279,35 @@ static int prepare_fds() {
 	poll_fds[daemon_pipe[0]].events = POLLIN;
 	maxfd = daemon_pipe[0];
 
+	if (gate_fifo != -1) {
+		poll_fds[gate_fifo].fd = gate_fifo;
+		poll_fds[gate_fifo].events = POLLIN;
+		maxfd = MAX(maxfd, gate_fifo);
+	}
+
+#ifdef HAVE_LIBBPF
+	int bpf_fd = fg_bpf_fd();
+	if (bpf_fd != -1) {
+		poll_fds[bpf_fd].fd = bpf_fd;
+		poll_fds[bpf_fd].events = POLLIN;
+		maxfd = MAX(maxfd, bpf_fd);
+	}
+#endif /* HAVE_LIBBPF */
+
 	struct timespec now;
 	gettime(&now);
 
+	next_wakeup = now;
+	time_add(&next_wakeup, DEFAULT_SELECT_TIMEOUT / 1e9);
+
+	start_query_rounds(&now);
+
 	const struct list_node *node = fg_list_front(&flows);
 	while (node) {
 		struct flow *flow = node->data;
 		node = node->next;
 
-		if (started &&
+		if (flow->start_called &&
 		    (flow->finished[READ] ||
 		     !flow->settings.duration[READ] ||
 		     (!flow_in_delay(&now, flow, READ) &&
@@ -300,32 +1317,56 @@ static int prepare_fds() {
 		     (!flow_in_delay(&now, flow, WRITE) &&
 		      !flow_sending(&now, flow, WRITE)))) {
 
-			/* On Other OSes than Linux or FreeBSD, tcp_info will contain all zeroes */
-			flow->statistics[FINAL].has_tcp_info =
-				get_tcp_info(flow,
-					     &flow->statistics[FINAL].tcp_info)
-					? 0 : 1;
-
+			collect_final_tcp_info(flow);
 			flow->pmtu = get_pmtu(flow->fd);
 
 			if (flow->settings.reporting_interval)
 				report_flow(flow, INTERVAL);
+			report_missing_connections(flow);
 			report_flow(flow, FINAL);
 			uninit_flow(flow);
 			remove_flow(flow);
 			continue;
 		}
 
-		if (flow->state == GRIND_WAIT_ACCEPT &&
-		    flow->listenfd_data != -1) {
+		/* The listen socket stays open until all connections of
+		 * the flow are accepted */
+		if (flow->listenfd_data != -1) {
 		        poll_fds[flow->listenfd_data].fd = flow->listenfd_data;
 			poll_fds[flow->listenfd_data].events = POLLIN;
 			maxfd = MAX(maxfd, flow->listenfd_data);
 		}
 
-		if (!started)
+		/* Late connects and connects held back by the connect rate
+		 * or a retry backoff */
+		if (flow_connect_due(&now, flow) && connect_slot_available()) {
+			DEBUG_MSG(LOG_DEBUG, "connecting test socket for flow "
+				  "%d", flow->id);
+			if (do_connect(flow) == -1 &&
+			    retry_connect(flow) == -1) {
+				report_flow(flow, FINAL);
+				uninit_flow(flow);
+				remove_flow(flow);
+				continue;
+			}
+		}
+
+		/* Watch for the connection to be established, then send the
+		 * handshake right away */
+		if (flow->fd != -1 && flow->connect_called &&
+		    (!flow->connected || flow_handshake_pending(flow))) {
+			poll_fds[flow->fd].fd = flow->fd;
+			poll_fds[flow->fd].events = POLLOUT;
+			maxfd = MAX(maxfd, flow->fd);
+		}
+
+		if (!flow->start_called)
 			continue;
 
+		if (flow->settings.sample_period && flow->fd != -1 &&
+		    time_is_after(&next_wakeup, &flow->next_sample_time))
+			next_wakeup = flow->next_sample_time;
+
 		if (flow->fd != -1) {
 			maxfd = MAX(maxfd, flow->fd);
 			prepare_wfds(&now, flow);
@@ -333,29 +1374,56 @@ static int prepare_fds() {
 		}
 	}
 
+	node = fg_list_front(&shared_listeners);
+	while (node) {
+		struct shared_listener *listener = node->data;
+		node = node->next;
+
+		poll_fds[listener->fd].fd = listener->fd;
+		poll_fds[listener->fd].events = POLLIN;
+		maxfd = MAX(maxfd, listener->fd);
+	}
+
+	node = fg_list_front(&pending_connections);
+	while (node) {
+		struct pending_connection *pc = node->data;
+		node = node->next;
+
+		poll_fds[pc->fd].fd = pc->fd;
+		poll_fds[pc->fd].events = POLLIN;
+		maxfd = MAX(maxfd, pc->fd);
+	}
+
 	return fg_list_size(&flows);
 }
 
 static void start_flows(struct request_start_flows *request)
 {
-	struct timespec start;
-	gettime(&start);
+	struct timespec now, scheduled;
+	gettime(&now);
 
-#if 0
-	if (start.tv_sec < request->start_timestamp) {
-		/* If the clock is synchronized between nodes, all nodes will
-		 * start at the same time regardless of any RPC delays */
-		start.tv_sec = request->start_timestamp;
-		start.tv_nsec = 0;
+	/* Flows of a coflow start at the scheduled time. If the clock is
+	 * synchronized between nodes, all nodes will start them at the same
+	 * time regardless of any RPC delays. Other flows start right away.
+	 * Flows already started keep running, so flows may be added to a
+	 * running test and started with a further call */
+	scheduled = now;
+	if (scheduled.tv_sec < request->start_timestamp) {
+		scheduled.tv_sec = request->start_timestamp;
+		scheduled.tv_nsec = 0;
 	}
-#else /* 0 */
-	UNUSED_ARGUMENT(request);
-#endif /* 0 */
 
 	const struct list_node *node = fg_list_front(&flows);
 	while (node) {
 		struct flow *flow = node->data;
+		const struct timespec start =
+			flow->settings.coflow ? scheduled : now;
 		node = node->next;
+
+		if (flow->start_called)
+			continue;
+		flow->start_called = 1;
+
 		/* initalize random number generator etc */
 		init_math_functions(flow, flow->settings.random_seed);
 
@@ -373,6 +1441,7 @@ static void start_flows(struct request_start_flows *request)
 		}
 		flow->next_write_block_timestamp =
 			flow->start_timestamp[WRITE];
+		flow->next_sample_time = start;
 
 		/* gettime(&flow->last_report_time); */
 		flow->last_report_time = start;
@@ -404,14 +1473,12 @@ static void stop_flow(struct request_stop_flow *request)
 			struct flow *flow = node->data;
 			node = node->next;
 
-			flow->statistics[FINAL].has_tcp_info =
-				get_tcp_info(flow,
-					     &flow->statistics[FINAL].tcp_info)
-					? 0 : 1;
+			collect_final_tcp_info(flow);
 			flow->pmtu = get_pmtu(flow->fd);
 
 			if (flow->settings.reporting_interval)
 				report_flow(flow, INTERVAL);
+			report_missing_connections(flow);
 			report_flow(flow, FINAL);
 
 			uninit_flow(flow);
@@ -421,31 +1488,35 @@ static void stop_flow(struct request_stop_flow *request)
 		return;
 	}
 
+	/* Stop all connections of the flow */
+	int found = 0;
+	enum endpoint_t endpoint = SOURCE;
 	const struct list_node *node = fg_list_front(&flows);
 	while (node) {
 		struct flow *flow = node->data;
 		node = node->next;
 
-		if (flow->id != request->flow_id)
+		if (flow->id != request->flow_id ||
+		    (found && flow->endpoint != endpoint))
 			continue;
 
-		/* On Other OSes than Linux or FreeBSD, tcp_info will contain all zeroes */
-		flow->statistics[FINAL].has_tcp_info =
-			get_tcp_info(flow,
-				     &flow->statistics[FINAL].tcp_info)
-				? 0 : 1;
+		found = 1;
+		endpoint = flow->endpoint;
+
+		collect_final_tcp_info(flow);
 		flow->pmtu = get_pmtu(flow->fd);
 
 		if (flow->settings.reporting_interval)
 			report_flow(flow, INTERVAL);
+		report_missing_connections(flow);
 		report_flow(flow, FINAL);
 
 		uninit_flow(flow);
 		remove_flow(flow);
-		return;
 	}
 
-	request_error(&request->r, "Unknown flow id");
+	if (!found)
+		request_error(&request->r, "Unknown flow id");
 }
 
 /**
@@ -497,6 +1568,8 @@ static void process_requests()
 					(struct request_get_status *)request;
 				r->started = started;
 				r->num_flows = fg_list_size(&flows);
+				get_source_port_usage(&r->source_ports_in_use,
+						      &r->source_ports_total);
 			}
 			break;
 		case REQUEST_GET_UUID:
@@ -518,6 +1591,115 @@ static void process_requests()
 	DEBUG_MSG(LOG_DEBUG, "process_requests unlocked mutex");
 }
 
+/**
+ * Move the TCP state samples of @p flow into @p report, encoded as described
+ * for #TCP_SAMPLE_SIZE.
+ *
+ * @param[in,out] flow flow to take the samples of
+ * @param[out] report report to ship the samples with
+ */
+static void report_samples(struct flow *flow, struct report *report)
+{
+	report->samples = NULL;
+	report->samples_size = 0;
+	report->samples_lost = flow->samples_lost;
+	flow->samples_lost = 0;
+
+	if (!flow->num_samples)
+		return;
+
+	report->samples = malloc((size_t)flow->num_samples * TCP_SAMPLE_SIZE);
+	if (!report->samples) {
+		logging(LOG_ALERT, "could not allocate memory for TCP state "
+			"samples");
+		report->samples_lost += flow->num_samples;
+		flow->num_samples = 0;
+		return;
+	}
+
+	for (unsigned n = 0; n < flow->num_samples; n++) {
+		const struct tcp_sample *sample = &flow->samples[
+			(flow->sample_head + n) % flow->sample_capacity];
+		unsigned char *buf = report->samples + report->samples_size;
+		double time = time_diff(&flow->first_report_time,
+					&sample->time);
+
+		put_be(buf, (int64_t)(time * 1e9), 8);
+		put_be(buf + 8, flow->connection, 4);
+		put_be(buf + 12, sample->cwnd, 4);
+		put_be(buf + 16, sample->ssthresh, 4);
+		put_be(buf + 20, sample->rtt, 4);
+		put_be(buf + 24, sample->rttvar, 4);
+		put_be(buf + 28, sample->unacked, 4);
+		put_be(buf + 32, sample->pacing_rate, 8);
+		put_be(buf + 40, sample->delivery_rate, 8);
+		report->samples_size += TCP_SAMPLE_SIZE;
+	}
+	flow->sample_head = 0;
+	flow->num_samples = 0;
+}
+
+/**
+ * Subtract the statistics @p b taken earlier from @p a.
+ */
+static void subtract_statistics(struct statistics *a,
+				const struct statistics *b)
+{
+	a->bytes_read -= b->bytes_read;
+	a->bytes_written -= b->bytes_written;
+	a->request_blocks_read -= b->request_blocks_read;
+	a->request_blocks_written -= b->request_blocks_written;
+	a->response_blocks_read -= b->response_blocks_read;
+	a->response_blocks_written -= b->response_blocks_written;
+	a->iat_sum -= b->iat_sum;
+	a->delay_sum -= b->delay_sum;
+	a->rtt_sum -= b->rtt_sum;
+	a->rtt_intended_sum -= b->rtt_intended_sum;
+	a->schedule_slips -= b->schedule_slips;
+	a->schedule_slip_sum -= b->schedule_slip_sum;
+	a->query_rounds -= b->query_rounds;
+	a->qct_sum -= b->qct_sum;
+}
+
+/**
+ * Reset the extreme values @p e for a new reporting interval, which starts
+ * with @p response_queue_length responses waiting for transmission.
+ */
+static void reset_extremes(struct extremes *e, unsigned response_queue_length)
+{
+	e->iat_min = FLT_MAX;
+	e->iat_max = FLT_MIN;
+	e->delay_min = FLT_MAX;
+	e->delay_max = FLT_MIN;
+	e->rtt_min = FLT_MAX;
+	e->rtt_max = FLT_MIN;
+	e->rtt_intended_min = FLT_MAX;
+	e->rtt_intended_max = FLT_MIN;
+	e->schedule_slip_max = 0.0F;
+	e->response_queue_max = response_queue_length;
+	e->qct_min = FLT_MAX;
+	e->qct_max = FLT_MIN;
+}
+
+/**
+ * Widen the extreme values @p e by those of @p o.
+ */
+static void fold_extremes(struct extremes *e, const struct extremes *o)
+{
+	ASSIGN_MIN(e->iat_min, o->iat_min);
+	ASSIGN_MAX(e->iat_max, o->iat_max);
+	ASSIGN_MIN(e->delay_min, o->delay_min);
+	ASSIGN_MAX(e->delay_max, o->delay_max);
+	ASSIGN_MIN(e->rtt_min, o->rtt_min);
+	ASSIGN_MAX(e->rtt_max, o->rtt_max);
+	ASSIGN_MIN(e->rtt_intended_min, o->rtt_intended_min);
+	ASSIGN_MAX(e->rtt_intended_max, o->rtt_intended_max);
+	ASSIGN_MAX(e->schedule_slip_max, o->schedule_slip_max);
+	ASSIGN_MAX(e->response_queue_max, o->response_queue_max);
+	ASSIGN_MIN(e->qct_min, o->qct_min);
+	ASSIGN_MAX(e->qct_max, o->qct_max);
+}
+
 /**
  * To prepare a report, report type is either INTERVAL or FINAL.
  *
@@ -539,6 +1721,9 @@ static void report_flow(struct flow* flow, int type)
 		(struct report*)malloc(sizeof(struct report));
 
 	report->id = flow->id;
+	report->connection = flow->connection;
+	report->connect_time = flow->connect_time;
+	report->connect_retries = flow->connect_retries;
 	report->endpoint = flow->endpoint;
 	report->type = type;
 
@@ -568,34 +1753,90 @@ static void report_flow(struct flow* flow, int type)
 		return;
 	}
 
-	report->bytes_read = flow->statistics[type].bytes_read;
-	report->bytes_written = flow->statistics[type].bytes_written;
-	report->request_blocks_read =
-		flow->statistics[type].request_blocks_read;
-	report->response_blocks_read =
-		flow->statistics[type].response_blocks_read;
-	report->request_blocks_written =
-		flow->statistics[type].request_blocks_written;
-	report->response_blocks_written =
-		flow->statistics[type].response_blocks_written;
-
-	report->rtt_min = flow->statistics[type].rtt_min;
-	report->rtt_max = flow->statistics[type].rtt_max;
-	report->rtt_sum = flow->statistics[type].rtt_sum;
-	report->iat_min = flow->statistics[type].iat_min;
-	report->iat_max = flow->statistics[type].iat_max;
-	report->iat_sum = flow->statistics[type].iat_sum;
-	report->delay_min = flow->statistics[type].delay_min;
-	report->delay_max = flow->statistics[type].delay_max;
-	report->delay_sum = flow->statistics[type].delay_sum;
+	/* Counters since the last interval report, or since the start of the
+	 * flow for the final report */
+	struct statistics stats = flow->statistics;
+	struct extremes *e = &flow->extremes[type];
+	const struct fg_tcp_info *tcp_info;
+	int has_tcp_info;
+	if (type == INTERVAL)
+		subtract_statistics(&stats, &flow->snapshot);
+	else
+		fold_extremes(e, &flow->extremes[INTERVAL]);
+
+	report->bytes_read = stats.bytes_read;
+	report->bytes_written = stats.bytes_written;
+	report->scheduled_bytes =
+		rate_schedule_bytes(&flow->settings,
+				    time_diff(&flow->start_timestamp[WRITE],
+					      &report->begin),
+				    time_diff(&flow->start_timestamp[WRITE],
+					      &report->end));
+	report->request_blocks_read = stats.request_blocks_read;
+	report->response_blocks_read = stats.response_blocks_read;
+	report->request_blocks_written = stats.request_blocks_written;
+	report->response_blocks_written = stats.response_blocks_written;
+
+	report->rtt_min = e->rtt_min;
+	report->rtt_max = e->rtt_max;
+	report->rtt_sum = stats.rtt_sum;
+	report->rtt_intended_min = e->rtt_intended_min;
+	report->rtt_intended_max = e->rtt_intended_max;
+	report->rtt_intended_sum = stats.rtt_intended_sum;
+	report->schedule_slips = stats.schedule_slips;
+	report->schedule_slip_max = e->schedule_slip_max;
+	report->schedule_slip_sum = stats.schedule_slip_sum;
+	report->iat_min = e->iat_min;
+	report->iat_max = e->iat_max;
+	report->iat_sum = stats.iat_sum;
+	report->delay_min = e->delay_min;
+	report->delay_max = e->delay_max;
+	report->delay_sum = stats.delay_sum;
 
 	/* Currently this will only contain useful information on Linux
 	 * and FreeBSD */
-	report->tcp_info = flow->statistics[type].tcp_info;
+	has_tcp_info = type == FINAL ? flow->has_final_tcp_info :
+				       flow->has_tcp_info;
+	tcp_info = type == FINAL ? &flow->final_tcp_info : &flow->tcp_info;
+	report->tcp_info = *tcp_info;
+
+	report->query_rounds = stats.query_rounds;
+	report->qct_min = e->qct_min;
+	report->qct_max = e->qct_max;
+	report->qct_sum = stats.qct_sum;
+	if (type == FINAL && flow->query_group &&
+	    flow->query_group->leader == flow)
+		report_qct_percentiles(flow, report);
+	else
+		report->qct_p50 = report->qct_p99 = report->qct_p999 = 0.0;
+
+	report->response_queue_depth = flow->response_queue_length;
+	report->response_queue_max = e->response_queue_max;
+
+	/* Interval reports of aggregate-only flows are not sent, their samples
+	 * ship with the next report that is */
+	if (type == INTERVAL && flow_aggregate_only(flow)) {
+		report->samples = NULL;
+		report->samples_size = 0;
+		report->samples_lost = 0;
+	} else {
+		report_samples(flow, report);
+	}
+
+	report->dump_kernel_drops = 0;
+	report->dump_writer_drops = 0;
+#ifdef HAVE_LIBPCAP
+	if (type == FINAL)
+		fg_pcap_drops(flow, &report->dump_kernel_drops,
+			      &report->dump_writer_drops);
+#endif /* HAVE_LIBPCAP */
 
 	if (flow->fd != -1) {
-		/* Get latest MTU */
-		flow->pmtu = get_pmtu(flow->fd);
+		/* Get latest MTU, from the TCP statistics if they have it */
+		if (has_tcp_info && tcp_info->tcpi_pmtu > 0)
+			flow->pmtu = tcp_info->tcpi_pmtu;
+		else
+			flow->pmtu = get_pmtu(flow->fd);
 		report->pmtu = flow->pmtu;
 		if (type == FINAL)
 			report->imtu = get_imtu(flow->fd);
@@ -608,7 +1849,7 @@ static void report_flow(struct flow* flow, int type)
 	/* Add status flags to report */
 	report->status = 0;
 
-	if (flow->statistics[type].bytes_read == 0) {
+	if (stats.bytes_read == 0) {
 		if (flow_in_delay(&report->end, flow, READ))
 			report->status |= 'd';
 		else if (flow_sending(&report->end, flow, READ))
@@ -625,7 +1866,7 @@ static void report_flow(struct flow* flow, int type)
 	}
 	report->status <<= 8;
 
-	if (flow->statistics[type].bytes_written == 0) {
+	if (stats.bytes_written == 0) {
 		if (flow_in_delay(&report->end, flow, WRITE))
 			report->status |= 'd';
 		else if (flow_sending(&report->end, flow, WRITE))
@@ -641,84 +1882,304 @@ static void report_flow(struct flow* flow, int type)
 			report->status |= 'n';
 	}
 
-	/* New report interval, reset old data */
-	if (type == INTERVAL) {
-		flow->statistics[INTERVAL].bytes_read = 0;
-		flow->statistics[INTERVAL].bytes_written = 0;
+	if (type == INTERVAL && flow->report_group)
+		aggregate_report(flow->report_group, report,
+				 flow->has_tcp_info);
+	if (type == INTERVAL && flow->connection_group)
+		aggregate_report(flow->connection_group, report,
+				 flow->has_tcp_info);
 
-		flow->statistics[INTERVAL].request_blocks_read = 0;
-		flow->statistics[INTERVAL].response_blocks_read = 0;
+	/* New report interval, take a snapshot and reset the extreme values */
+	if (type == INTERVAL) {
+		flow->snapshot = flow->statistics;
+		fold_extremes(&flow->extremes[FINAL], e);
+		reset_extremes(e, flow->response_queue_length);
+	}
 
-		flow->statistics[INTERVAL].request_blocks_written = 0;
-		flow->statistics[INTERVAL].response_blocks_written = 0;
+	/* The last flow of a report group sends the pending aggregate report
+	 * before its final report, after which the controller may stop */
+	if (type == FINAL && flow->report_group &&
+	    flow->report_group->flows == 1)
+		send_report_group(flow->report_group);
+	if (type == FINAL && flow->connection_group &&
+	    flow->connection_group->flows == 1)
+		send_report_group(flow->connection_group);
 
-		flow->statistics[INTERVAL].rtt_min = FLT_MAX;
-		flow->statistics[INTERVAL].rtt_max = FLT_MIN;
-		flow->statistics[INTERVAL].rtt_sum = 0.0F;
-		flow->statistics[INTERVAL].iat_min = FLT_MAX;
-		flow->statistics[INTERVAL].iat_max = FLT_MIN;
-		flow->statistics[INTERVAL].iat_sum = 0.0F;
-		flow->statistics[INTERVAL].delay_min = FLT_MAX;
-		flow->statistics[INTERVAL].delay_max = FLT_MIN;
-		flow->statistics[INTERVAL].delay_sum = 0.0F;
+	if (type == INTERVAL && flow_aggregate_only(flow)) {
+		free(report);
+		return;
 	}
-
-	add_report(report);
+	/* Samples of a dropped report are accounted with the next one */
+	flow->samples_lost += add_report(report);
 	DEBUG_MSG(LOG_DEBUG, "report_flow finished for flow %d (type %d)",
 		  flow->id, type);
 }
 
-/* Fills the given _fg_tcp_info with the values of the OS specific tcp_info,
- * returns 0 on success */
-int get_tcp_info(struct flow *flow, struct fg_tcp_info *info)
-{
-#ifdef HAVE_TCP_INFO
-	struct tcp_info tmp_info;
-	socklen_t info_len = sizeof(tmp_info);
-	int rc;
-	memset(info, 0, sizeof(struct fg_tcp_info));
+/* Fills the given _fg_tcp_info with the values of the OS specific tcp_info,
+ * returns 0 on success */
+int get_tcp_info(struct flow *flow, struct fg_tcp_info *info)
+{
+#ifdef HAVE_INET_DIAG
+	/* The kernel's struct tcp_info has more fields than the C library's */
+	if (fg_tcp_diag_get(flow->fd, info) == -1) {
+		warn("getsockopt() failed");
+		return -1;
+	}
+#elif defined HAVE_TCP_INFO
+	struct tcp_info tmp_info;
+	socklen_t info_len = sizeof(tmp_info);
+	int rc;
+	memset(info, 0, sizeof(struct fg_tcp_info));
+
+	rc = getsockopt(flow->fd, IPPROTO_TCP, TCP_INFO, &tmp_info, &info_len);
+	if (rc == -1) {
+		warn("getsockopt() failed");
+		return -1;
+	}
+	#define CPY_INFO_MEMBER(a) info->a = (int) tmp_info.a;
+	CPY_INFO_MEMBER(tcpi_snd_cwnd);
+	CPY_INFO_MEMBER(tcpi_snd_ssthresh);
+	CPY_INFO_MEMBER(tcpi_rtt);
+	CPY_INFO_MEMBER(tcpi_rttvar);
+	CPY_INFO_MEMBER(tcpi_rto);
+	CPY_INFO_MEMBER(tcpi_snd_mss);
+
+	/* TODO FreeBSD 9.1 doesn't fill these members, but maybe FreeBSD 10.0
+	 * will fill it, so get rid of this ifdef */
+#ifdef __LINUX__
+	CPY_INFO_MEMBER(tcpi_backoff);
+	CPY_INFO_MEMBER(tcpi_unacked);
+	CPY_INFO_MEMBER(tcpi_sacked);
+	CPY_INFO_MEMBER(tcpi_lost);
+	CPY_INFO_MEMBER(tcpi_retrans);
+	CPY_INFO_MEMBER(tcpi_retransmits);
+	CPY_INFO_MEMBER(tcpi_fackets);
+	CPY_INFO_MEMBER(tcpi_reordering);
+	CPY_INFO_MEMBER(tcpi_ca_state);
+#endif /* __LINUX__ */
+#else /* HAVE_TCP_INFO */
+	UNUSED_ARGUMENT(flow);
+	memset(info, 0, sizeof(struct fg_tcp_info));
+#endif /* HAVE_TCP_INFO */
+	return 0;
+}
+
+/**
+ * Collect the TCP info of @p flow as it ends.
+ *
+ * The final report takes it from its own copy, as each interval report
+ * refreshes the TCP info it is built from. The interval report sent right
+ * before the final one gets the same values.
+ *
+ * @param[in,out] flow flow whose test connection is about to be closed
+ */
+static void collect_final_tcp_info(struct flow *flow)
+{
+	/* On Other OSes than Linux or FreeBSD, tcp_info will contain all zeroes */
+	flow->has_final_tcp_info =
+		get_tcp_info(flow, &flow->final_tcp_info) ? 0 : 1;
+	flow->has_tcp_info = flow->has_final_tcp_info;
+	flow->tcp_info = flow->final_tcp_info;
+}
+
+/**
+ * Whether the interval report of @p flow is to be built at @p now.
+ *
+ * Each report the flow puts into the report queue takes one of the @p room
+ * slots left in the queue. Without a free slot the report is deferred: its
+ * interval keeps accumulating until the controller fetched reports, instead
+ * of building a report that would be dropped. Flows which only report to
+ * their report group do not take a slot.
+ *
+ * @param[in] now current time
+ * @param[in] flow flow to check
+ * @param[in,out] room free slots in the report queue
+ */
+static bool interval_report_due(const struct timespec *now,
+				const struct flow *flow, unsigned *room)
+{
+	if (!flow->start_called || !flow->settings.reporting_interval ||
+	    !time_is_after(now, &flow->next_report_time))
+		return false;
+
+	if (flow_aggregate_only(flow))
+		return true;
+	if (!*room)
+		return false;
+	(*room)--;
+	return true;
+}
+
+#ifdef HAVE_INET_DIAG
+/**
+ * Collect the TCP statistics of all flows with an interval report due with a
+ * single dump per address family, rather than one getsockopt() per flow.
+ *
+ * @param[in] now current time
+ * @param[in] room free slots in the report queue, see interval_report_due()
+ */
+static void collect_tcp_info(struct timespec *now, unsigned room)
+{
+	static struct fg_tcp_diag_entry *entries = NULL;
+	static size_t capacity = 0;
+	size_t num = 0;
+
+	if (tcp_diag_fd == -1)
+		return;
+
+	const struct list_node *node = fg_list_front(&flows);
+	while (node) {
+		struct flow *flow = node->data;
+		node = node->next;
+
+		if (!interval_report_due(now, flow, &room) || flow->fd == -1)
+			continue;
+
+		if (!flow->inode) {
+			struct stat st;
+
+			if (fstat(flow->fd, &st) == -1)
+				continue;
+			flow->inode = st.st_ino;
+		}
+
+		if (num == capacity) {
+			size_t size = capacity ? 2 * capacity : 1024;
+			struct fg_tcp_diag_entry *tmp =
+				realloc(entries, size * sizeof(*entries));
+
+			if (!tmp) {
+				logging(LOG_ALERT, "could not allocate memory "
+					"for TCP statistics dump");
+				return;
+			}
+			entries = tmp;
+			capacity = size;
+		}
+		entries[num].inode = flow->inode;
+		entries[num].data = flow;
+		num++;
+	}
+
+	if (num < TCP_DIAG_MIN_FLOWS)
+		return;
+
+	fg_tcp_diag_sort(entries, num);
+	if (fg_tcp_diag_dump(tcp_diag_fd, entries, num) == -1) {
+		logging(LOG_WARNING, "TCP statistics dump failed, falling back "
+			"to getsockopt(): %s", strerror(errno));
+		close(tcp_diag_fd);
+		tcp_diag_fd = -1;
+		return;
+	}
+
+	for (size_t i = 0; i < num; i++) {
+		struct flow *flow = entries[i].data;
+
+		if (!entries[i].found)
+			continue;
+		flow->tcp_info = entries[i].info;
+		flow->has_tcp_info = 1;
+		flow->tcp_info_collected = 1;
+	}
+}
+#endif /* HAVE_INET_DIAG */
+
+/**
+ * Sample the TCP state of all flows with a sample due (option --sample).
+ *
+ * Samples are kept in a ring buffer per flow until the next report of the
+ * flow. The ring buffer holds twice the samples of a reporting interval, if
+ * the reports are still late, the oldest samples are lost.
+ *
+ * @param[in] now current time
+ */
+static void sample_tcp_state(struct timespec *now)
+{
+	const struct list_node *node = fg_list_front(&flows);
+	while (node) {
+		struct flow *flow = node->data;
+		node = node->next;
+
+		if (!flow->start_called || !flow->settings.sample_period ||
+		    flow->fd == -1 ||
+		    !time_is_after(now, &flow->next_sample_time))
+			continue;
+
+		if (!flow->samples) {
+			const double interval =
+				flow->settings.reporting_interval;
+			double size = interval ? 2 * interval /
+				flow->settings.sample_period :
+				TCP_SAMPLE_RING_MAX;
+
+			flow->sample_capacity =
+				MAX(MIN(size, TCP_SAMPLE_RING_MAX),
+				    TCP_SAMPLE_RING_MIN);
+			flow->samples = calloc(flow->sample_capacity,
+					       sizeof(struct tcp_sample));
+			if (!flow->samples) {
+				logging(LOG_ALERT, "could not allocate memory "
+					"for TCP state samples");
+				flow->settings.sample_period = 0;
+				continue;
+			}
+		}
+
+		struct fg_tcp_info info;
+		if (get_tcp_info(flow, &info) == 0) {
+			struct tcp_sample *sample;
 
-	rc = getsockopt(flow->fd, IPPROTO_TCP, TCP_INFO, &tmp_info, &info_len);
-	if (rc == -1) {
-		warn("getsockopt() failed");
-		return -1;
-	}
-	#define CPY_INFO_MEMBER(a) info->a = (int) tmp_info.a;
-	CPY_INFO_MEMBER(tcpi_snd_cwnd);
-	CPY_INFO_MEMBER(tcpi_snd_ssthresh);
-	CPY_INFO_MEMBER(tcpi_rtt);
-	CPY_INFO_MEMBER(tcpi_rttvar);
-	CPY_INFO_MEMBER(tcpi_rto);
-	CPY_INFO_MEMBER(tcpi_snd_mss);
+			if (flow->num_samples == flow->sample_capacity) {
+				flow->sample_head = (flow->sample_head + 1) %
+					flow->sample_capacity;
+				flow->num_samples--;
+				flow->samples_lost++;
+			}
+			sample = &flow->samples[(flow->sample_head +
+						 flow->num_samples++) %
+						flow->sample_capacity];
+			sample->time = *now;
+			sample->cwnd = info.tcpi_snd_cwnd;
+			sample->ssthresh = info.tcpi_snd_ssthresh;
+			sample->rtt = info.tcpi_rtt;
+			sample->rttvar = info.tcpi_rttvar;
+			sample->unacked = info.tcpi_unacked;
+			sample->pacing_rate = info.tcpi_pacing_rate;
+			sample->delivery_rate = info.tcpi_delivery_rate;
+		}
 
-	/* TODO FreeBSD 9.1 doesn't fill these members, but maybe FreeBSD 10.0
-	 * will fill it, so get rid of this ifdef */
-#ifdef __LINUX__
-	CPY_INFO_MEMBER(tcpi_backoff);
-	CPY_INFO_MEMBER(tcpi_unacked);
-	CPY_INFO_MEMBER(tcpi_sacked);
-	CPY_INFO_MEMBER(tcpi_lost);
-	CPY_INFO_MEMBER(tcpi_retrans);
-	CPY_INFO_MEMBER(tcpi_retransmits);
-	CPY_INFO_MEMBER(tcpi_fackets);
-	CPY_INFO_MEMBER(tcpi_reordering);
-	CPY_INFO_MEMBER(tcpi_ca_state);
-#endif /* __LINUX__ */
-#else /* HAVE_TCP_INFO */
-	UNUSED_ARGUMENT(flow);
-	memset(info, 0, sizeof(struct fg_tcp_info));
-#endif /* HAVE_TCP_INFO */
-	return 0;
+		/* Skip samples we were too late for */
+		do {
+			time_add(&flow->next_sample_time,
+				 flow->settings.sample_period);
+		} while (time_is_after(now, &flow->next_sample_time));
+	}
 }
 
 static void timer_check()
 {
 	struct timespec now;
+	unsigned room, reserved, deferred = 0;
 
 	if (!started)
 		return;
 
 	gettime(&now);
+	sample_tcp_state(&now);
+
+	/* Build no more interval reports than the controller will fetch. A
+	 * slot is kept for the aggregate report of every report group, which
+	 * add_report() would drop as well once the queue is full. */
+	reserved = fg_list_size(&report_groups);
+	pthread_mutex_lock(&mutex);
+	room = pending_reports + reserved < MAX_PENDING_REPORTS ?
+		MAX_PENDING_REPORTS - pending_reports - reserved : 0;
+	pthread_mutex_unlock(&mutex);
+
+#ifdef HAVE_INET_DIAG
+	collect_tcp_info(&now, room);
+#endif /* HAVE_INET_DIAG */
 	const struct list_node *node = fg_list_front(&flows);
 	while (node) {
 		struct flow *flow = node->data;
@@ -727,18 +2188,19 @@ static void timer_check()
 		DEBUG_MSG(LOG_DEBUG, "processing timer_check() for flow %d",
 			  flow->id);
 
-		if (!flow->settings.reporting_interval)
-			continue;
-
-		if (!time_is_after(&now, &flow->next_report_time))
+		if (!interval_report_due(&now, flow, &room)) {
+			if (flow->start_called &&
+			    flow->settings.reporting_interval &&
+			    time_is_after(&now, &flow->next_report_time))
+				deferred++;
 			continue;
+		}
 
 		/* On Other OSes than Linux or FreeBSD, tcp_info will contain all zeroes */
-		if (flow->fd != -1)
-			flow->statistics[INTERVAL].has_tcp_info =
-				get_tcp_info(flow,
-					     &flow->statistics[INTERVAL].tcp_info)
-					? 0 : 1;
+		if (flow->fd != -1 && !flow->tcp_info_collected)
+			flow->has_tcp_info =
+				get_tcp_info(flow, &flow->tcp_info) ? 0 : 1;
+		flow->tcp_info_collected = 0;
 		report_flow(flow, INTERVAL);
 
 		do {
@@ -746,6 +2208,13 @@ static void timer_check()
 				 flow->settings.reporting_interval);
 		} while (time_is_after(&now, &flow->next_report_time));
 	}
+	send_report_groups(&now);
+
+	pthread_mutex_lock(&mutex);
+	reports_deferred = deferred > 0;
+	pthread_mutex_unlock(&mutex);
+	if (deferred)
+		DEBUG_MSG(LOG_DEBUG, "deferred %u interval reports", deferred);
 	DEBUG_MSG(LOG_DEBUG, "finished timer_check()");
 }
 
@@ -762,12 +2231,9 @@ static void process_select()
 		if (flow->listenfd_data != -1 &&
 		    (poll_fds[flow->listenfd_data].revents & POLLIN)) {
 			DEBUG_MSG(LOG_DEBUG, "ready for accept");
-			if (flow->state == GRIND_WAIT_ACCEPT) {
-				if (accept_data(flow) == -1) {
-					DEBUG_MSG(LOG_ERR, "accept_data() "
-						  "failed");
-					goto remove;
-				}
+			if (accept_data(flow) == -1) {
+				DEBUG_MSG(LOG_ERR, "accept_data() failed");
+				goto remove;
 			}
 		}
 
@@ -789,20 +2255,76 @@ static void process_select()
 				}
 				if (error_number != 0) {
 					warnc(error_number, "connect");
-					goto remove;
+					if (flow->connected ||
+					    retry_connect(flow) == -1)
+						goto remove;
+					continue;
 				}
 			}
-			if (poll_fds[flow->fd].revents & POLLOUT)
-			  if (!flow->settings.total_blocks[flow->endpoint] ||
-			      flow->total_blocks_written[flow->endpoint] <
-			      flow->settings.total_blocks[flow->endpoint]) {
-				if (write_data(flow) == -1) {
-					DEBUG_MSG(LOG_ERR, "write_data() failed");
+			if (!flow->connected &&
+			    (poll_fds[flow->fd].revents & POLLOUT)) {
+				struct timespec now;
+
+				gettime(&now);
+				flow->connected = 1;
+				flow->connect_time =
+					time_diff(&flow->connect_timestamp, &now);
+				DEBUG_MSG(LOG_DEBUG, "flow %d connected after "
+					  "%.3fms", flow->id,
+					  flow->connect_time * 1e3);
+#ifdef HAVE_LIBBPF
+				fg_bpf_trace_start(flow);
+#endif /* HAVE_LIBBPF */
+			}
+			if ((poll_fds[flow->fd].revents & POLLOUT) &&
+			    flow_handshake_pending(flow)) {
+				if (send_handshake(flow) == -1) {
+					DEBUG_MSG(LOG_ERR, "send_handshake() "
+						  "failed");
 					goto remove;
 				}
-			  }
+			/* A flow which overran its quantum in a previous
+			 * round sits out until its deficit is paid back */
+			} else if ((poll_fds[flow->fd].revents & POLLOUT) &&
+				   flow_gate_open(flow) &&
+				   flow_replenish(flow, WRITE)) {
+				struct timespec now;
+
+				/* Pending responses go first, but never
+				 * interrupt a partially written request */
+				if (!flow->current_block_bytes_written &&
+				    send_responses(flow) == -1) {
+					DEBUG_MSG(LOG_ERR, "send_responses() "
+						  "failed");
+					goto remove;
+				}
+
+				gettime(&now);
+				if (!flow->current_response_bytes_written &&
+				    flow_budget_left(flow, WRITE) &&
+				    flow_sending(&now, flow, WRITE) &&
+				    flow_block_scheduled(&now, flow) &&
+				    (flow->current_block_bytes_written ||
+				     (flow_window_open(flow) &&
+				      flow_query_due(flow) &&
+				      flow_tokens_left(&now, flow))) &&
+				    (!flow->settings.total_blocks[flow->endpoint] ||
+				     flow->total_blocks_written[flow->endpoint] <
+				     flow->settings.total_blocks[flow->endpoint]))
+					if (write_data(flow) == -1) {
+						DEBUG_MSG(LOG_ERR, "write_data() "
+							  "failed");
+						goto remove;
+					}
+
+				/* Only unfinished work carries its deficit
+				 * over to the next round */
+				if (flow_budget_left(flow, WRITE))
+					flow->deficit[WRITE] = 0;
+			}
 
-			if (poll_fds[flow->fd].revents & POLLIN)
+			if ((poll_fds[flow->fd].revents & POLLIN) &&
+			    flow_replenish(flow, READ))
 				if (read_data(flow) == -1) {
 					DEBUG_MSG(LOG_ERR, "read_data() failed");
 					goto remove;
@@ -810,12 +2332,8 @@ static void process_select()
 		}
 		continue;
 remove:
-		if (flow->fd != -1) {
-			flow->statistics[FINAL].has_tcp_info =
-				get_tcp_info(flow,
-					     &flow->statistics[FINAL].tcp_info)
-					? 0 : 1;
-		}
+		if (flow->fd != -1)
+			collect_final_tcp_info(flow);
 		flow->pmtu = get_pmtu(flow->fd);
 		report_flow(flow, FINAL);
 		uninit_flow(flow);
@@ -824,14 +2342,123 @@ remove:
 	}
 }
 
+/**
+ * Pick up gates opened or closed by the scheduler and update their counters.
+ */
+static void process_gates()
+{
+	struct timespec now;
+	char buf[64];
+
+	if (!gates)
+		return;
+
+	/* the FIFO only wakes us up, the gates are in the shared memory */
+	if (poll_fds[gate_fifo].revents & POLLIN)
+		while (read(gate_fifo, buf, sizeof(buf)) > 0)
+			;
+
+	gettime(&now);
+	for (int i = 0; i < MAX_GATES; i++) {
+		uint8_t open = gates->open[i] ? 1 : 0;
+
+		if (open == gate_state[i])
+			continue;
+		gate_state[i] = open;
+
+		if (open) {
+			gates->stats[i].opens++;
+			gate_opened[i] = now;
+		} else {
+			gates->stats[i].open_ns +=
+				time_diff(&gate_opened[i], &now) * 1e9;
+		}
+		DEBUG_MSG(LOG_DEBUG, "gate %d %s", i + 1,
+			  open ? "opened" : "closed");
+	}
+}
+
+/**
+ * Accept connections on shared listen sockets and hand them over to their
+ * flows once the handshake is received.
+ */
+static void process_shared_listeners()
+{
+	const struct list_node *node = fg_list_front(&shared_listeners);
+	while (node) {
+		struct shared_listener *listener = node->data;
+		node = node->next;
+
+		if (poll_fds[listener->fd].revents & POLLIN)
+			accept_shared(listener);
+	}
+
+	node = fg_list_front(&pending_connections);
+	while (node) {
+		struct pending_connection *pc = node->data;
+		struct flow *flow;
+		int rc;
+		node = node->next;
+
+		if (!(poll_fds[pc->fd].revents & POLLIN)) {
+			if (time_diff_now(&pc->accepted) <
+			    FLOW_HANDSHAKE_TIMEOUT)
+				continue;
+			logging(LOG_WARNING, "no handshake from %s within %d "
+				"seconds", fg_nameinfo((struct sockaddr *)
+				&pc->addr, pc->addr_len),
+				FLOW_HANDSHAKE_TIMEOUT);
+			close(pc->fd);
+			fg_list_remove(&pending_connections, pc);
+			free(pc);
+			continue;
+		}
+
+		rc = read_handshake(pc, &flow);
+		if (!rc)
+			continue;
+
+		fg_list_remove(&pending_connections, pc);
+		free(pc);
+
+		if (rc == -1) {
+			collect_final_tcp_info(flow);
+			flow->pmtu = get_pmtu(flow->fd);
+			report_flow(flow, FINAL);
+			uninit_flow(flow);
+			DEBUG_MSG(LOG_ERR, "removing flow %d", flow->id);
+			remove_flow(flow);
+		}
+	}
+}
+
 void* daemon_main(void* ptr __attribute__((unused)))
 {
-	struct timespec timeout;
+	struct timespec timeout, now;
+
+#ifdef __LINUX__
+	/* Do not let the kernel defer our wakeups for scheduled blocks */
+	if (prctl(PR_SET_TIMERSLACK, 1UL) == -1)
+		logging(LOG_WARNING, "failed to set timer slack: %s",
+			strerror(errno));
+#endif /* __LINUX__ */
+
+#ifdef HAVE_INET_DIAG
+	tcp_diag_fd = fg_tcp_diag_open();
+	if (tcp_diag_fd == -1)
+		logging(LOG_WARNING, "failed to open inet_diag socket, TCP "
+			"statistics are collected per flow: %s",
+			strerror(errno));
+#endif /* HAVE_INET_DIAG */
+
 	for (;;) {
 		int need_timeout = prepare_fds();
 
-		timeout.tv_sec = 0;
-		timeout.tv_nsec = DEFAULT_SELECT_TIMEOUT;
+		/* Wake up in time for the next scheduled block */
+		gettime(&now);
+		double wait = MAX(time_diff(&now, &next_wakeup), 0.0);
+		timeout.tv_sec = (time_t)wait;
+		timeout.tv_nsec = (long)((wait - timeout.tv_sec) * 1e9);
 		DEBUG_MSG(LOG_DEBUG, "calling pselect() need_timeout: %i",
 			  need_timeout);
 		int rc = ppoll(poll_fds, maxfd + 1,
@@ -843,24 +2470,48 @@ void* daemon_main(void* ptr __attribute__((unused)))
 		}
 		DEBUG_MSG(LOG_DEBUG, "pselect() finished");
 
+		process_gates();
+
+#ifdef HAVE_LIBBPF
+		/* The tracer wakes us up only once many events piled up,
+		 * fewer are written whenever we are awake anyway */
+		fg_bpf_consume();
+#endif /* HAVE_LIBBPF */
+
 		if (poll_fds[daemon_pipe[0]].revents & POLLIN)
 			process_requests();
 
 		timer_check();
 		process_select();
+		process_shared_listeners();
 	}
 }
 
-void add_report(struct report* report)
+/**
+ * Queue @p report for the controller.
+ *
+ * Once too many reports are pending, reports other than final ones are
+ * dropped along with the TCP state samples they carry.
+ *
+ * @param[in] report report to queue, owned by the queue afterwards
+ * @return number of TCP state samples lost with a dropped report, 0 if
+ * @p report was queued
+ */
+unsigned add_report(struct report* report)
 {
+	unsigned samples_lost;
+
 	DEBUG_MSG(LOG_DEBUG, "add_report trying to lock mutex");
 	pthread_mutex_lock(&mutex);
 	DEBUG_MSG(LOG_DEBUG, "add_report aquired mutex");
 	/* Do not keep too much data */
-	if (pending_reports >= 250 && report->type != FINAL) {
-		free(report);
+	if (pending_reports >= MAX_PENDING_REPORTS && report->type != FINAL) {
 		pthread_mutex_unlock(&mutex);
-		return;
+		samples_lost = report->samples_lost +
+			report->samples_size / TCP_SAMPLE_SIZE;
+		free(report->samples);
+		free(report);
+		return samples_lost;
 	}
 
 	report->next = 0;
@@ -875,6 +2526,7 @@ void add_report(struct report* report)
 
 	pthread_mutex_unlock(&mutex);
 	DEBUG_MSG(LOG_DEBUG, "add_report unlocked mutex");
+	return 0;
 }
 
 struct report* get_reports(int *has_more)
@@ -905,6 +2557,14 @@ struct report* get_reports(int *has_more)
 		*has_more = 1;
 	}
 
+	/* Let the daemon thread build the deferred reports right away, so
+	 * they are ready for the next fetch */
+	if (ret && reports_deferred) {
+		reports_deferred = 0;
+		if (write(daemon_pipe[1], "r", 1) != 1)
+			logging(LOG_WARNING, "failed to wake up daemon thread");
+	}
+
 	pthread_mutex_unlock(&mutex);
 	DEBUG_MSG(LOG_DEBUG, "get_reports unlocked mutex");
 	return ret;
@@ -940,27 +2600,122 @@ void init_flow(struct flow* flow, int is_source)
 
   flow->total_blocks_written[READ] = flow->total_blocks_written[WRITE] = 0;
 
-	foreach(int *i, INTERVAL, FINAL) {
-		flow->statistics[*i].bytes_read = 0;
-		flow->statistics[*i].bytes_written = 0;
+	/* The statistics and their snapshot are zeroed above */
+	reset_extremes(&flow->extremes[INTERVAL], 0);
+	reset_extremes(&flow->extremes[FINAL], 0);
+
+	DEBUG_MSG(LOG_NOTICE, "called init flow %d", flow->id);
+}
 
-		flow->statistics[*i].request_blocks_read = 0;
-		flow->statistics[*i].request_blocks_written = 0;
-		flow->statistics[*i].response_blocks_read = 0;
-		flow->statistics[*i].response_blocks_written = 0;
+/**
+ * Add another connection to the multi-connection flow @p flow.
+ *
+ * The new connection shares the flow ID and settings of @p flow, but has
+ * its own socket, buffers and statistics. If the test is already running,
+ * it inherits the schedule of @p flow.
+ *
+ * @param[in,out] flow first connection of the flow
+ * @param[in] connection index of the new connection
+ * @return new connection, or NULL on error (the error is set on @p flow)
+ */
+struct flow *add_flow_connection(struct flow *flow, int connection)
+{
+	struct flow *conn;
+
+	if (fg_list_size(&flows) >= MAX_FLOWS_DAEMON) {
+		logging(LOG_WARNING, "can not accept another connection, "
+			"already handling %zu flows", fg_list_size(&flows));
+		flow_error(flow, "can not accept another connection, "
+			   "already handling %zu flows", fg_list_size(&flows));
+		return NULL;
+	}
 
-		flow->statistics[*i].rtt_min = FLT_MAX;
-		flow->statistics[*i].rtt_max = FLT_MIN;
-		flow->statistics[*i].rtt_sum = 0.0F;
-		flow->statistics[*i].iat_min = FLT_MAX;
-		flow->statistics[*i].iat_max = FLT_MIN;
-		flow->statistics[*i].iat_sum = 0.0F;
-		flow->statistics[*i].delay_min = FLT_MAX;
-		flow->statistics[*i].delay_max = FLT_MIN;
-		flow->statistics[*i].delay_sum = 0.0F;
+	conn = malloc(sizeof(struct flow));
+	if (!conn) {
+		logging(LOG_ALERT, "could not allocate memory for flow");
+		flow_error(flow, "could not allocate memory for connection");
+		return NULL;
 	}
 
-	DEBUG_MSG(LOG_NOTICE, "called init flow %d", flow->id);
+	init_flow(conn, flow->endpoint == SOURCE);
+
+	conn->id = flow->id;
+	conn->connection = connection;
+	conn->settings = flow->settings;
+	if (dup_rate_schedule(conn) == -1) {
+		flow_error(flow, "%s", conn->error);
+		uninit_flow(conn);
+		free(conn);
+		return NULL;
+	}
+	/* do not let all connections draw the same random numbers */
+	conn->settings.random_seed += connection;
+	conn->source_settings = flow->source_settings;
+	if (flow->rate_bucket) {
+		conn->rate_bucket = flow->rate_bucket;
+		conn->rate_bucket->flows++;
+	}
+	if (flow->query_group) {
+		conn->query_group = flow->query_group;
+		conn->query_group->flows++;
+	}
+	if (flow->report_group) {
+		conn->report_group = flow->report_group;
+		conn->report_group->flows++;
+	}
+	if (flow->connection_group) {
+		conn->connection_group = flow->connection_group;
+		conn->connection_group->flows++;
+	}
+	conn->requested_server_test_port = flow->requested_server_test_port;
+	conn->real_listen_send_buffer_size = flow->real_listen_send_buffer_size;
+	conn->real_listen_receive_buffer_size =
+		flow->real_listen_receive_buffer_size;
+
+	conn->write_block = calloc(1, conn->settings.maximum_block_size);
+	conn->read_block = calloc(1, conn->settings.maximum_block_size);
+	conn->response_block = calloc(1, conn->settings.maximum_block_size);
+	if (conn->write_block == NULL || conn->read_block == NULL ||
+	    conn->response_block == NULL) {
+		logging(LOG_ALERT, "could not allocate memory for read/write "
+			"blocks");
+		flow_error(flow, "could not allocate memory for read/write "
+			   "blocks");
+		uninit_flow(conn);
+		free(conn);
+		return NULL;
+	}
+	if (conn->settings.byte_counting)
+		for (int byte_idx = 0;
+		     byte_idx < conn->settings.maximum_block_size; byte_idx++)
+			*(conn->write_block + byte_idx) =
+				*(conn->response_block + byte_idx) =
+				(unsigned char)(byte_idx & 0xff);
+
+	conn->start_called = flow->start_called;
+	if (flow->start_called) {
+		struct timespec now;
+		gettime(&now);
+
+		init_math_functions(conn, conn->settings.random_seed);
+		foreach(int *i, READ, WRITE) {
+			conn->start_timestamp[*i] = flow->start_timestamp[*i];
+			conn->stop_timestamp[*i] = flow->stop_timestamp[*i];
+		}
+		/* a late connection must not catch up on blocks it missed */
+		if (time_is_after(&now, &conn->start_timestamp[WRITE]))
+			conn->next_write_block_timestamp = now;
+		else
+			conn->next_write_block_timestamp =
+				conn->start_timestamp[WRITE];
+		conn->first_report_time = flow->first_report_time;
+		conn->last_report_time = flow->last_report_time;
+		conn->next_report_time = flow->next_report_time;
+	}
+
+	fg_list_push_back(&flows, conn);
+
+	return conn;
 }
 
 static int write_data(struct flow *flow)
@@ -972,9 +2727,21 @@ static int write_data(struct flow *flow)
 
 		/* fill buffer with new data */
 		if (flow->current_block_bytes_written == 0) {
+			/* wait for responses before issuing more requests */
+			if (!flow_window_open(flow))
+				break;
+
+			/* one request per round of the query group */
+			if (!flow_query_due(flow))
+				break;
+			if (flow->query_group)
+				flow->query_round = flow->query_group->round;
+
 			flow->current_write_block_size =
 				next_request_block_size(flow);
 			response_block_size = next_response_block_size(flow);
+			if (response_block_size >= (signed)MIN_BLOCK_SIZE)
+				flow->outstanding_requests++;
 			/* serialize data:
 			 * this_block_size */
 			((struct block *)flow->write_block)->this_block_size =
@@ -986,6 +2753,15 @@ static int write_data(struct flow *flow)
 			 * in the response packet) */
 			gettime((struct timespec *)
 				(flow->write_block + 2 * (sizeof (int32_t))));
+			/* also echoed back: the time the block was scheduled
+			 * for. Measuring from it includes the time the block
+			 * was held back, e.g. by congestion (no coordinated
+			 * omission) */
+			if (flow_paced(flow))
+				process_schedule(flow);
+			else
+				((struct block *)flow->write_block)->intended =
+					((struct block *)flow->write_block)->data;
 
 			DEBUG_MSG(LOG_DEBUG, "wrote new request data to out "
 				  "buffer bs = %d, rqs = %d, on flow %d",
@@ -1025,10 +2801,13 @@ static int write_data(struct flow *flow)
 			  flow->current_write_block_size,
 			  flow->current_block_bytes_written);
 
-		foreach(int *i, INTERVAL, FINAL)
-			flow->statistics[*i].bytes_written += rc;
+		flow->statistics.bytes_written += rc;
 
 		flow->current_block_bytes_written += rc;
+		flow->deficit[WRITE] -= rc;
+		if (flow->rate_bucket)
+			flow->rate_bucket->tokens -= rc;
+		gate_account(flow, rc);
 
 		if (flow->current_block_bytes_written >=
 		    flow->current_write_block_size) {
@@ -1038,12 +2817,12 @@ static int write_data(struct flow *flow)
 			flow->current_block_bytes_written = 0;
 			gettime(&flow->last_block_written);
 
-			foreach(int *i, INTERVAL, FINAL)
-				flow->statistics[*i].request_blocks_written++;
+			flow->statistics.request_blocks_written++;
 
       flow->total_blocks_written[WRITE]++;
 
 			interpacket_gap = next_interpacket_gap(flow);
+			flow->interpacket_gap = interpacket_gap;
 
 			/* if we calculated a non-zero packet add relative time
 			 * to the next write stamp which is then checked in the
@@ -1078,6 +2857,20 @@ static int write_data(struct flow *flow)
 
 		if (!flow->settings.pushy)
 			break;
+
+		/* quantum used up, continue in the next round */
+		if (!flow_budget_left(flow, WRITE))
+			break;
+
+		/* the gate closed, continue when it opens again */
+		if (!flow_gate_open(flow))
+			break;
+
+		/* leave the remaining tokens to the other flows of the
+		 * group, a started block is completed though */
+		if (flow->rate_bucket && !flow->current_block_bytes_written &&
+		    flow->rate_bucket->tokens <= 0)
+			break;
 	}
 	return 0;
 }
@@ -1119,7 +2912,7 @@ static inline int try_read_n_bytes(struct flow *flow, int bytes)
 	if (rc == 0) {
 		DEBUG_MSG(LOG_ERR, "server shut down test socket of flow %d",
 			  flow->id);
-		if (!flow->finished[READ] || !flow->settings.shutdown)
+		if (!flow->finished[READ] && !flow->settings.shutdown)
 			warnx("premature shutdown of server flow");
 		flow->finished[READ] = 1;
 		return -1;
@@ -1128,9 +2921,9 @@ static inline int try_read_n_bytes(struct flow *flow, int bytes)
 	DEBUG_MSG(LOG_DEBUG, "flow %d received %u bytes", flow->id, rc);
 
 	flow->current_block_bytes_read += rc;
+	flow->deficit[READ] -= rc;
 
-	foreach(int *i, INTERVAL, FINAL)
-		flow->statistics[*i].bytes_read += rc;
+	flow->statistics.bytes_read += rc;
 
 #ifdef DEBUG
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
@@ -1148,6 +2941,12 @@ static int read_data(struct flow *flow)
 	int requested_response_block_size = 0;
 
 	for (;;) {
+		/* Do not start on another block while the response queue
+		 * is full */
+		if (!flow->current_block_bytes_read &&
+		    flow_response_queue_full(flow))
+			break;
+
 		/* make sure to read block header for new block */
 		if (flow->current_block_bytes_read < MIN_BLOCK_SIZE) {
 			rc = try_read_n_bytes(flow,
@@ -1169,7 +2968,8 @@ static int read_data(struct flow *flow)
 
 		/* parse and check current request size for validity */
 		optint = ntohl( ((struct block *)flow->read_block)->request_block_size );
-		if (optint == -1 || optint == 0  ||
+		if (optint == RESPONSE_BLOCK ||
+		    optint == DECLINED_RESPONSE_BLOCK || optint == 0  ||
 		    (optint >= MIN_BLOCK_SIZE &&
 		     optint <= flow->settings.maximum_block_size))
 			requested_response_block_size = optint;
@@ -1209,42 +3009,73 @@ static int read_data(struct flow *flow)
 			if (requested_response_block_size == -1) {
 				/* this is a response block, consider DATA as
 				 * RTT  */
-				foreach(int *i, INTERVAL, FINAL)
-					flow->statistics[*i].response_blocks_read++;
+				flow->statistics.response_blocks_read++;
+				if (flow->outstanding_requests)
+					flow->outstanding_requests--;
 				process_rtt(flow);
+				if (flow->query_group)
+					process_query_response(flow);
+			} else if (requested_response_block_size ==
+				   DECLINED_RESPONSE_BLOCK) {
+				/* the peer will not answer the request, it
+				 * only leaves the request window */
+				if (flow->outstanding_requests)
+					flow->outstanding_requests--;
+				if (flow->query_group &&
+				    flow->query_round == flow->query_group->round)
+					drop_query_response(flow);
 			} else {
 				/* this is a request block, calculate IAT */
-				foreach(int *i, INTERVAL, FINAL)
-					flow->statistics[*i].request_blocks_read++;
+				flow->statistics.request_blocks_read++;
 				process_iat(flow);
 				process_delay(flow);
 
-				/* send response if requested */
+				/* queue response if requested. A request
+				 * beyond our block limit is declined with an
+				 * empty response, as the peer may hold back
+				 * further requests until it is answered */
 				if (requested_response_block_size >=
-				    (signed)MIN_BLOCK_SIZE && !flow->finished[READ])
-				  if (!flow->settings.total_blocks[flow->endpoint] ||
-				      flow->total_blocks_written[flow->endpoint] <
-				      flow->settings.total_blocks[flow->endpoint]) {
-					send_response(flow,
-						      requested_response_block_size);
-				  }
+				    (signed)MIN_BLOCK_SIZE) {
+					int declined = flow->finished[READ] ||
+						(flow->settings.total_blocks[flow->endpoint] &&
+						 flow->total_blocks_written[flow->endpoint] +
+						 flow->response_queue_length +
+						 (flow->current_response_bytes_written > 0) >=
+						 (unsigned)flow->settings.total_blocks[flow->endpoint]);
+					if (queue_response(flow,
+							   requested_response_block_size,
+							   declined) == -1)
+						return -1;
+				}
 			}
 		}
 		if (!flow->settings.pushy)
 			break;
+
+		/* quantum used up, continue in the next round */
+		if (!flow_budget_left(flow, READ))
+			break;
 	}
+
+	/* Only unfinished work carries its deficit over to the next round */
+	if (flow_budget_left(flow, READ))
+		flow->deficit[READ] = 0;
+
 	return rc;
 }
 
 static void process_rtt(struct flow* flow)
 {
 	double current_rtt = .0;
+	double intended_rtt = .0;
 	struct timespec now;
 	struct timespec *data = (struct timespec *)
 		(flow->read_block + 2*(sizeof (int32_t)));
 
 	gettime(&now);
 	current_rtt = time_diff(data, &now);
+	intended_rtt = time_diff(&((struct block *)flow->read_block)->intended,
+				 &now);
 
 	if (current_rtt < 0) {
 		logging(LOG_CRIT, "received malformed rtt block of flow %d "
@@ -1254,18 +3085,53 @@ static void process_rtt(struct flow* flow)
 
 	flow->last_block_read = now;
 
+	/* a block cannot be sent before it was scheduled */
+	if (!isnan(current_rtt) && intended_rtt < current_rtt)
+		intended_rtt = current_rtt;
+
 	if (!isnan(current_rtt)) {
-		foreach(int *i, INTERVAL, FINAL) {
-			ASSIGN_MIN(flow->statistics[*i].rtt_min, current_rtt);
-			ASSIGN_MAX(flow->statistics[*i].rtt_max, current_rtt);
-			flow->statistics[*i].rtt_sum += current_rtt;
-		}
+		struct extremes *e = &flow->extremes[INTERVAL];
+
+		ASSIGN_MIN(e->rtt_min, current_rtt);
+		ASSIGN_MAX(e->rtt_max, current_rtt);
+		flow->statistics.rtt_sum += current_rtt;
+		ASSIGN_MIN(e->rtt_intended_min, intended_rtt);
+		ASSIGN_MAX(e->rtt_intended_max, intended_rtt);
+		flow->statistics.rtt_intended_sum += intended_rtt;
 	}
 
 	DEBUG_MSG(LOG_NOTICE, "processed RTT of flow %d (%.3lfms)",
 		  flow->id, current_rtt * 1e3);
 }
 
+/**
+ * Stamp the scheduled sending time into the current write block of the
+ * paced @p flow and account for the block being late.
+ *
+ * @param[in,out] flow flow which is about to send a new block
+ */
+static void process_schedule(struct flow* flow)
+{
+	struct block *block = (struct block *)flow->write_block;
+	double slip = time_diff(&flow->next_write_block_timestamp,
+				&block->data);
+
+	block->intended = flow->next_write_block_timestamp;
+
+	/* Blocks are sent once the daemon woke up after their scheduled time,
+	 * so only a delay beyond the wakeup latency, or a tenth of the gap
+	 * between blocks if larger, makes a block late */
+	if (slip <= MAX(SCHEDULE_SLIP_TOLERANCE, flow->interpacket_gap / 10))
+		return;
+
+	flow->statistics.schedule_slips++;
+	ASSIGN_MAX(flow->extremes[INTERVAL].schedule_slip_max, slip);
+	flow->statistics.schedule_slip_sum += slip;
+
+	DEBUG_MSG(LOG_NOTICE, "block of flow %d sent %.3lfms behind schedule",
+		  flow->id, slip * 1e3);
+}
+
 static void process_iat(struct flow* flow)
 {
 	double current_iat = .0;
@@ -1289,11 +3155,9 @@ static void process_iat(struct flow* flow)
 	flow->last_block_read = now;
 
 	if (!isnan(current_iat)) {
-		foreach(int *i, INTERVAL, FINAL) {
-			ASSIGN_MIN(flow->statistics[*i].iat_min, current_iat);
-			ASSIGN_MAX(flow->statistics[*i].iat_max, current_iat);
-			flow->statistics[*i].iat_sum += current_iat;
-		}
+		ASSIGN_MIN(flow->extremes[INTERVAL].iat_min, current_iat);
+		ASSIGN_MAX(flow->extremes[INTERVAL].iat_max, current_iat);
+		flow->statistics.iat_sum += current_iat;
 	}
 	DEBUG_MSG(LOG_NOTICE, "processed IAT of flow %d (%.3lfms)",
 		  flow->id, current_iat * 1e3);
@@ -1317,98 +3181,230 @@ static void process_delay(struct flow* flow)
 	}
 
 	if (!isnan(current_delay)) {
-		foreach(int *i, INTERVAL, FINAL) {
-			ASSIGN_MIN(flow->statistics[*i].delay_min,
-				   current_delay);
-			ASSIGN_MAX(flow->statistics[*i].delay_max,
-				   current_delay);
-			flow->statistics[*i].delay_sum += current_delay;
-		}
+		ASSIGN_MIN(flow->extremes[INTERVAL].delay_min, current_delay);
+		ASSIGN_MAX(flow->extremes[INTERVAL].delay_max, current_delay);
+		flow->statistics.delay_sum += current_delay;
 	}
 
 	DEBUG_MSG(LOG_NOTICE, "processed delay of flow %d (%.3lfms)",
 		  flow->id, current_delay * 1e3);
 }
 
-static void send_response(struct flow* flow, int requested_response_block_size)
+/**
+ * Append a response to the response queue of @p flow.
+ *
+ * The timestamp of the request block just read is saved with the response,
+ * so the read buffer can be reused before the response is transmitted. The
+ * queue grows on demand, responses are never dropped.
+ *
+ * @param[in,out] flow flow the request block was read from
+ * @param[in] requested_response_block_size size of the response block
+ * @param[in] declined the request is declined, an empty response of minimum
+ * size is sent instead
+ * @return 0 on success, -1 if the queue could not be enlarged
+ */
+static int queue_response(struct flow* flow, int requested_response_block_size,
+			  int declined)
 {
-	int rc;
-	int try = 0;
+	struct pending_response *response;
+
+	if (flow->response_queue_length == flow->response_queue_capacity) {
+		unsigned capacity = flow->response_queue_capacity ?
+			2 * flow->response_queue_capacity : RESPONSE_QUEUE_SIZE;
+		struct pending_response *queue =
+			malloc(capacity * sizeof(struct pending_response));
+
+		if (!queue) {
+			logging(LOG_ALERT, "could not allocate memory for "
+				"response queue of flow %d", flow->id);
+			flow_error(flow, "could not allocate memory for "
+				   "response queue");
+			return -1;
+		}
 
-	assert(!flow->current_block_bytes_written);
+		/* unwrap the ring into the new buffer */
+		for (unsigned i = 0; i < flow->response_queue_length; i++)
+			queue[i] = flow->response_queue[
+				(flow->response_queue_head + i) %
+				flow->response_queue_capacity];
 
-	/* write requested block size as current size */
-	((struct block *)flow->write_block)->this_block_size =
-		htonl(requested_response_block_size);
-	/* rqs = -1 indicates response block */
-	((struct block *)flow->write_block)->request_block_size = htonl(-1);
+		free(flow->response_queue);
+		flow->response_queue = queue;
+		flow->response_queue_capacity = capacity;
+		flow->response_queue_head = 0;
+	}
+
+	response = &flow->response_queue[(flow->response_queue_head +
+					  flow->response_queue_length) %
+					 flow->response_queue_capacity];
+	response->size = declined ? MIN_BLOCK_SIZE :
+		requested_response_block_size;
+	response->declined = declined;
 	/* copy rtt data from received block to response block (echo back) */
-	((struct block *)flow->write_block)->data =
-		((struct block *)flow->read_block)->data;
+	response->data = ((struct block *)flow->read_block)->data;
 	/* workaround for 64bit sender and 32bit receiver: we check if the
 	 * timespec is 64bit and then echo the missing 32bit back, too */
-	if ((((struct block *)flow->write_block)->data.tv_sec) ||
-	    ((struct block *)flow->write_block)->data.tv_nsec)
-		((struct block *)flow->write_block)->data2 =
-			((struct block *)flow->read_block)->data2;
-
-	DEBUG_MSG(LOG_DEBUG, "wrote new response data to out buffer bs = %d, "
-		  "rqs = %d on flow %d",
-		  ntohl(((struct block *)flow->write_block)->this_block_size),
-		  ntohl(((struct block *)flow->write_block)->request_block_size),
-		  flow->id);
-
-	/* send data out until block is finished (or abort if 0 zero bytes are
-	 * send CONGESTION_LIMIT times) */
-	for (;;) {
+	if (response->data.tv_sec || response->data.tv_nsec)
+		response->data2 = ((struct block *)flow->read_block)->data2;
+	else
+		memset(&response->data2, 0, sizeof(response->data2));
+	response->intended = ((struct block *)flow->read_block)->intended;
+
+	flow->response_queue_length++;
+	ASSIGN_MAX(flow->extremes[INTERVAL].response_queue_max,
+		   flow->response_queue_length);
+
+	DEBUG_MSG(LOG_DEBUG, "queued response (rqs %d) on flow %d, %u "
+		  "responses pending", requested_response_block_size,
+		  flow->id, flow->response_queue_length);
+
+	return 0;
+}
+
+/**
+ * Write queued responses of @p flow until the queue is empty or the socket
+ * would block.
+ *
+ * A partially written response block is continued on the next call, thus
+ * this function never blocks the daemon thread.
+ *
+ * @param[in,out] flow flow with pending responses
+ * @return 0 on success, -1 on a fatal socket error
+ */
+static int send_responses(struct flow* flow)
+{
+	int rc;
+
+	while (flow_response_pending(flow)) {
+		/* fill buffer with the next queued response */
+		if (!flow->current_response_bytes_written) {
+			struct pending_response *response =
+				&flow->response_queue[flow->response_queue_head];
+
+			flow->current_response_block_size = response->size;
+			/* write requested block size as current size */
+			((struct block *)flow->response_block)->this_block_size =
+				htonl(response->size);
+			/* rqs = -1 indicates response block */
+			((struct block *)flow->response_block)->request_block_size =
+				htonl(response->declined ?
+				      DECLINED_RESPONSE_BLOCK : RESPONSE_BLOCK);
+			((struct block *)flow->response_block)->data =
+				response->data;
+			((struct block *)flow->response_block)->data2 =
+				response->data2;
+			((struct block *)flow->response_block)->intended =
+				response->intended;
+
+			flow->response_queue_head = (flow->response_queue_head + 1) %
+				flow->response_queue_capacity;
+			flow->response_queue_length--;
+
+			DEBUG_MSG(LOG_DEBUG, "wrote new response data to out "
+				  "buffer bs = %d, rqs = %d on flow %d",
+				  ntohl(((struct block *)flow->response_block)->this_block_size),
+				  ntohl(((struct block *)flow->response_block)->request_block_size),
+				  flow->id);
+		}
+
 		rc = write(flow->fd,
-			   flow->write_block + flow->current_block_bytes_written,
-			   requested_response_block_size -
-				flow->current_block_bytes_written);
+			   flow->response_block +
+			   flow->current_response_bytes_written,
+			   flow->current_response_block_size -
+			   flow->current_response_bytes_written);
 
-		DEBUG_MSG(LOG_NOTICE, "send %d bytes response (rqs %d) on flow "
-			  "%d", rc, requested_response_block_size,flow->id);
+		DEBUG_MSG(LOG_NOTICE, "send %d bytes response (rqs %u) on flow "
+			  "%d", rc, flow->current_response_block_size, flow->id);
 
 		if (rc == -1) {
 			if (errno == EAGAIN) {
-				DEBUG_MSG(LOG_DEBUG, "%s, still trying to send "
-					  "response block (write queue hit "
-					  "limit)", strerror(errno));
-				try++;
-				if (try >= CONGESTION_LIMIT &&
-				    !flow->current_block_bytes_written) {
-					logging(LOG_WARNING, "tried to send "
-						"response block %d times without "
-						"success, dropping (%s)",
-						try, strerror(errno));
-						break;
-				}
-			} else {
-				logging(LOG_WARNING, "premature end of test: "
-					"%s, abort flow", strerror(errno));
-				flow->finished[READ] = 1;
+				DEBUG_MSG(LOG_DEBUG, "write queue limit hit, "
+					  "%u responses pending on flow %d",
+					  flow->response_queue_length,
+					  flow->id);
 				break;
 			}
-		} else {
-			flow->current_block_bytes_written += rc;
-			foreach(int *i, INTERVAL, FINAL)
-				flow->statistics[*i].bytes_written += rc;
-
-			if (flow->current_block_bytes_written >=
-			    (unsigned)requested_response_block_size) {
-				assert(flow->current_block_bytes_written ==
-					(unsigned)requested_response_block_size);
-				/* just finish sending response block */
-				flow->current_block_bytes_written = 0;
-				gettime(&flow->last_block_written);
-				foreach(int *i, INTERVAL, FINAL)
-					flow->statistics[*i].response_blocks_written++;
-
-        flow->total_blocks_written[READ]++;
-				break;
+			logging(LOG_WARNING, "premature end of test: %s, abort "
+				"flow", strerror(errno));
+			flow_error(flow, "premature end of test: %s",
+				   strerror(errno));
+			return -1;
+		}
+
+		if (rc == 0) {
+			DEBUG_MSG(LOG_CRIT, "flow %d sent zero bytes. what "
+				  "does that mean?", flow->id);
+			break;
+		}
+
+		flow->current_response_bytes_written += rc;
+		flow->deficit[WRITE] -= rc;
+		/* responses are owed to the peer and never held back, but
+		 * they count against the rate of the group */
+		if (flow->rate_bucket)
+			flow->rate_bucket->tokens -= rc;
+		gate_account(flow, rc);
+		flow->statistics.bytes_written += rc;
+
+		if (flow->current_response_bytes_written >=
+		    flow->current_response_block_size) {
+			assert(flow->current_response_bytes_written ==
+			       flow->current_response_block_size);
+			/* just finish sending response block */
+			flow->current_response_bytes_written = 0;
+			gettime(&flow->last_block_written);
+
+			/* an empty response does not count as block */
+			if ((int32_t)ntohl(((struct block *)
+					    flow->response_block)->request_block_size) !=
+			    DECLINED_RESPONSE_BLOCK) {
+				flow->statistics.response_blocks_written++;
+				flow->total_blocks_written[READ]++;
 			}
 		}
+
+		/* quantum used up, continue in the next round */
+		if (!flow_budget_left(flow, WRITE))
+			break;
+
+		if (!flow_gate_open(flow))
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Send the handshake which tells a destination with a shared listen socket
+ * the flow the connection belongs to, by the token the destination issued.
+ *
+ * @param[in,out] flow source flow connected to a shared listen socket
+ * @return 0 on success or if the socket would block, -1 on error
+ */
+static int send_handshake(struct flow* flow)
+{
+	unsigned char handshake[FLOW_HANDSHAKE_SIZE];
+	uint32_t magic = htonl(FLOW_HANDSHAKE_MAGIC);
+	uint32_t token = htonl((uint32_t)flow->source_settings.handshake);
+	int rc;
+
+	memcpy(handshake, &magic, sizeof(magic));
+	memcpy(handshake + sizeof(magic), &token, sizeof(token));
+
+	rc = write(flow->fd, handshake + flow->handshake_bytes_written,
+		   FLOW_HANDSHAKE_SIZE - flow->handshake_bytes_written);
+	if (rc == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		flow_error(flow, "failed to send handshake: %s",
+			   strerror(errno));
+		return -1;
 	}
+
+	flow->handshake_bytes_written += rc;
+	DEBUG_MSG(LOG_DEBUG, "flow %d sent %d handshake bytes", flow->id, rc);
+
+	return 0;
 }
 
 
@@ -1510,6 +3506,19 @@ int set_flow_tcp_options(struct flow *flow)
 			   strerror(errno));
 		return -1;
 	}
+	if (flow->settings.kernel_pacing &&
+	    set_max_pacing_rate(flow->fd, flow->settings.write_rate) == -1) {
+		flow_error(flow, "Unable to set SO_MAX_PACING_RATE: %s",
+			   strerror(errno));
+		return -1;
+	}
+	/* Keep the send buffer of a gated flow shallow, so that little data
+	 * still leaves once its gate closed. Without the option gating works
+	 * at write() granularity only. */
+	if (flow->settings.gate &&
+	    set_tcp_notsent_lowat(flow->fd, GATE_NOTSENT_LOWAT) == -1)
+		logging(LOG_WARNING, "Unable to set TCP_NOTSENT_LOWAT on gated "
+			"flow %d: %s", flow->id, strerror(errno));
 	if (flow->settings.ipmtudiscover &&
 	    set_ip_mtu_discover(flow->fd) == -1) {
 		flow_error(flow, "Unable to set IP_MTU_DISCOVER value: %s",
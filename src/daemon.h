@@ -50,6 +50,97 @@
 /** Time select() will block waiting for a file descriptor to become ready. */
 #define DEFAULT_SELECT_TIMEOUT  10000000
 
+/** Delay behind its schedule up to which a block does not count as late, in
+ * seconds. Covers the wakeup latency of poll(), as a paced block cannot be
+ * sent before the daemon woke up after its scheduled time. */
+#define SCHEDULE_SLIP_TOLERANCE 0.0001
+
+/** Number of reports the daemon keeps for the controller to fetch. */
+#define MAX_PENDING_REPORTS 250
+
+/** Initial number of slots in the per-flow response queue. */
+#define RESPONSE_QUEUE_SIZE 16
+
+/** Number of queued responses at which a flow stops reading requests until
+ * the queue drained, so a peer pipelining requests faster than the responses
+ * go out cannot grow the queue without bound. */
+#define RESPONSE_QUEUE_MAX 4096
+
+/** Default number of bytes a flow may transfer per direction and round. */
+#define DEFAULT_SCHEDULE_QUANTUM 262144
+
+/** Magic number opening the flow handshake on a shared listen socket. */
+#define FLOW_HANDSHAKE_MAGIC 0x46474853
+
+/** Size of the flow handshake: magic number and token, 32bit each. */
+#define FLOW_HANDSHAKE_SIZE 8
+
+/** Seconds a connection on a shared listen socket may take to complete its
+ * handshake before it is dropped. */
+#define FLOW_HANDSHAKE_TIMEOUT 5
+
+/** Number of times a failed connect is retried before the flow is given up. */
+#define CONNECT_RETRIES 8
+
+/** Delay before the first retry of a failed connect, doubled for each retry. */
+#define CONNECT_BACKOFF 0.1
+
+/** Default bucket size of a rate group, in seconds worth of its rate. */
+#define RATE_BUCKET_DEFAULT_BURST 0.02
+
+/** Initial number of query completion times stored per query group. */
+#define QUERY_GROUP_QCT_SIZE 1024
+
+/** Minimum number of flows with interval reports due for the TCP statistics
+ * to be dumped via inet_diag. A dump walks all TCP sockets of the host, so
+ * for fewer flows one getsockopt() each is cheaper. */
+#define TCP_DIAG_MIN_FLOWS 32
+
+/** Maximum number of TCP state samples kept per flow between two reports.
+ * If the ring buffer is full, the oldest sample is overwritten. */
+#define TCP_SAMPLE_RING_MAX 65536
+
+/** Minimum number of TCP state samples kept per flow between two reports. */
+#define TCP_SAMPLE_RING_MIN 64
+
+/** Time a resolved destination address is cached, in seconds. */
+#define ADDRINFO_CACHE_TTL 60
+
+/** Time a released source port is not handed out again, in seconds. Covers
+ * the TIME_WAIT state of the previous connection. */
+#define SOURCE_PORT_QUARANTINE 60
+
+/** Interval reports of flows summed up into the aggregate report of a report
+ * group. The aggregate report is sent once per reporting interval, rather
+ * than one report per flow. */
+struct report_group
+{
+	/** Report group ID given by the controller. */
+	int group;
+	/** Test the group belongs to, given by the controller. */
+	int scope;
+	/** Set for the group of the connections of a multi-connection flow,
+	 * whose ID is the one of the flow. */
+	int connection_group;
+	/** Endpoint of the flows of the group. */
+	enum endpoint_t endpoint;
+	/** Reporting interval of the flows of the group. */
+	double reporting_interval;
+	/** Number of flows in the group. */
+	unsigned flows;
+
+	/** Aggregate report of the current interval, unused while its
+	 * aggregated member is 0. */
+	struct report report;
+	/** Sums of the TCP info of the flow reports, for their mean. */
+	double cwnd_sum, ssthresh_sum, unacked_sum, sacked_sum, lost_sum;
+	double retrans_sum, retransmits_sum, reordering_sum, backoff_sum;
+	double rtt_sum, rttvar_sum, rto_sum, mss_sum;
+	/** Time the aggregate report is sent at the latest, if not all flows
+	 * of the group contributed to it before. */
+	struct timespec deadline;
+};
+
 enum flow_state_t
 {
 	/* SOURCE */
@@ -66,13 +157,159 @@ struct flow_source_settings
 	int destination_port;
 
 	int late_connect;
+	/** Token the destination issued for the handshake on its shared listen
+	 * socket, or 0 if the destination expects no handshake. */
+	int handshake;
 
 	pthread_cond_t* add_source_condition;
 };
 
+/** Listen socket shared by all destination flows with the same bind address. */
+struct shared_listener
+{
+	int fd;
+	unsigned short port;
+	char bind_address[64];
+};
+
+/** Local address source flows bind to, with an optional port range. */
+struct source_address
+{
+	/** Address with port zero. */
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	/** Port range, or zero if the kernel chooses the port. */
+	unsigned port_low;
+	unsigned port_high;
+	/** Port to try first on the next allocation. */
+	unsigned next_port;
+
+	/** Per port of the range: port is bound by a flow. */
+	char *in_use;
+	/** Per port of the range: time the port was released. */
+	time_t *released;
+
+	/** Sockets bound to this address. */
+	unsigned sockets;
+
+	struct source_address *next;
+};
+
+/** Connection accepted on a shared listen socket, awaiting its handshake. */
+struct pending_connection
+{
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	/** Time the connection was accepted. */
+	struct timespec accepted;
+
+	/** Handshake received so far. */
+	unsigned char handshake[FLOW_HANDSHAKE_SIZE];
+	unsigned handshake_bytes_read;
+};
+
+/** Token bucket shared by the flows of a rate group. */
+struct rate_bucket
+{
+	/** Rate group ID given by the controller. */
+	int group;
+	/** Refill rate in bytes per second. */
+	double rate;
+	/** Maximum number of tokens in bytes. */
+	double burst;
+	/** Available tokens in bytes. Negative after a block overdrew it. */
+	double tokens;
+	/** Time tokens were last added. */
+	struct timespec last_refill;
+	/** Number of flows drawing from the bucket. */
+	unsigned flows;
+};
+
+/** Flows issuing their requests in synchronized rounds, e.g. an aggregator
+ * querying its workers (partition/aggregate). A round is complete once
+ * every flow of the group got the response to its request. */
+struct query_group
+{
+	/** Query group ID given by the controller. */
+	int group;
+	/** Number of flows in the group, i.e. responses completing a round. */
+	unsigned fanin;
+	/** Rounds started per second, 0 to start the next round as soon as
+	 * the previous one completed. */
+	double rate;
+	/** Number of flows which joined the group. */
+	unsigned flows;
+	/** Flow reporting the statistics of the group. */
+	struct flow *leader;
+
+	/** Number of the current round, 0 before the first one. */
+	unsigned round;
+	/** Responses of the current round which are still missing. */
+	unsigned outstanding;
+	/** A flow of the current round left the group or its request was
+	 * declined, so the round completes without a completion time. */
+	int round_incomplete;
+	/** Time the current round started. */
+	struct timespec round_start;
+	/** Earliest time the next round may start. */
+	struct timespec next_round;
+
+	/** Completion times of all rounds, for their distribution. */
+	double *qct;
+	unsigned num_qct;
+	unsigned qct_capacity;
+};
+
+/** Sample of the TCP state of a flow (option --sample). */
+struct tcp_sample
+{
+	/** Time the sample was taken. */
+	struct timespec time;
+	/** Congestion window and slow start threshold, in segments. */
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	/** Smoothed RTT and its variance, in microseconds. */
+	uint32_t rtt;
+	uint32_t rttvar;
+	/** Unacknowledged segments. */
+	uint32_t unacked;
+	/** Pacing and delivery rate, in bytes/s. */
+	uint64_t pacing_rate;
+	uint64_t delivery_rate;
+};
+
+/** Response block waiting to be sent back to the requesting endpoint. */
+struct pending_response
+{
+	/** Size of the response block as requested by the peer. */
+	int size;
+	/** Timestamp of the request, echoed back for RTT calculation. */
+	struct timespec data;
+	/** Upper half of a 64bit timestamp sent by a 32bit peer. */
+	struct timespec data2;
+	/** Scheduled sending time of the request, echoed back as well. */
+	struct timespec intended;
+	/** The request is declined, an empty response only releases it from
+	 * the request window of the peer. */
+	int declined;
+};
+
 struct flow
 {
 	int id;
+	/** Index of the connection within a multi-connection flow. */
+	int connection;
+	/** Connections accepted on the listen socket of the flow. */
+	int connections_accepted;
+	/** Connections are accepted on a shared listen socket. */
+	int shared_listen;
+	/** Token connections present in their handshake to be matched to the
+	 * flow on a shared listen socket. */
+	uint32_t handshake_token;
+	/** Bytes of the flow handshake sent to a shared listen socket. */
+	unsigned handshake_bytes_written;
 
 	enum flow_state_t state;
 	enum endpoint_t endpoint;
@@ -89,10 +326,16 @@ struct flow
 	struct timespec last_block_written;
 
 	struct timespec first_report_time;
+	/** End of the last interval report, begin of the next one. */
 	struct timespec last_report_time;
+	/** Boundary from which on the next interval report is due. It stays
+	 * passed while the report is deferred for lack of room in the report
+	 * queue, the interval then extends until the report is built. */
 	struct timespec next_report_time;
 
 	struct timespec next_write_block_timestamp;
+	/** Gap between the scheduled sending times of the last two blocks. */
+	double interpacket_gap;
 
 	char *read_block;
 	char *write_block;
@@ -103,6 +346,20 @@ struct flow
 	unsigned current_block_bytes_read;
 	unsigned current_block_bytes_written;
 
+	/** Buffer of the response block currently being transmitted. */
+	char *response_block;
+	unsigned current_response_block_size;
+	unsigned current_response_bytes_written;
+
+	/** Ring buffer of responses not yet handed to the socket. */
+	struct pending_response *response_queue;
+	/** Number of slots allocated for the response queue. */
+	unsigned response_queue_capacity;
+	/** Slot of the oldest queued response. */
+	unsigned response_queue_head;
+	/** Number of queued responses. */
+	unsigned response_queue_length;
+
 	unsigned short requested_server_test_port;
 
 	unsigned real_listen_send_buffer_size;
@@ -111,16 +368,79 @@ struct flow
   int total_blocks_written[2];
 
 	char connect_called;
+	/** The controller started the flow. */
+	char start_called;
 	char finished[2];
 
 	int pmtu;
 
+	/** Inode of the socket, to find it in TCP statistics dumps. */
+	ino_t inode;
+	/** TCP statistics of the interval report were collected by a dump. */
+	char tcp_info_collected;
+
+	/** Ring buffer of TCP state samples not yet reported, allocated with
+	 * the first sample. */
+	struct tcp_sample *samples;
+	/** Number of slots allocated for the samples. */
+	unsigned sample_capacity;
+	/** Slot of the oldest sample. */
+	unsigned sample_head;
+	/** Number of samples in the ring buffer. */
+	unsigned num_samples;
+	/** Samples overwritten since the previous report. */
+	unsigned samples_lost;
+	/** Time the next sample is due. */
+	struct timespec next_sample_time;
+
 	unsigned congestion_counter;
 
+	/** Requests written for which no response has been read yet. */
+	unsigned outstanding_requests;
+
+	/** Deficit counters of the round-robin scheduler (WRITE, READ). */
+	int deficit[2];
+
 	/* Used for do_connect for source flows */
 	struct sockaddr *addr;
 	socklen_t addr_len;
 
+	/** Connection is established. */
+	char connected;
+	/** Time connect() was called. */
+	struct timespec connect_timestamp;
+	/** Earliest time for the next connect attempt. */
+	struct timespec next_connect_timestamp;
+	/** Time from connect() until the connection was established. */
+	double connect_time;
+	/** Failed connect attempts which have been retried. */
+	unsigned connect_retries;
+
+	/** Source address the test socket is bound to. */
+	struct source_address *source_address;
+	/** Source port allocated from the port range of the source address. */
+	unsigned source_port;
+
+	/** Token bucket of the rate group the flow draws from. */
+	struct rate_bucket *rate_bucket;
+	/** Flow was held back by its closed gate, counted once per closing. */
+	int gate_blocked;
+	/** Query group the flow issues its requests in. */
+	struct query_group *query_group;
+	/** Last round of the query group the flow issued its request in. */
+	unsigned query_round;
+	/** Last round of the query group the flow is accounted for in, by its
+	 * response or as missing. */
+	unsigned query_answered;
+	/** Report group the interval reports of the flow are summed up in. */
+	struct report_group *report_group;
+	/** Group the interval reports of all connections of the flow are
+	 * summed up in, NULL for a flow with a single connection. */
+	struct report_group *connection_group;
+
+	/** Counters and sums of the flow since its start. Each transferred
+	 * block and each delay sample is accounted once. The values of an
+	 * interval report are the difference to #snapshot. */
 	struct statistics {
 #ifdef HAVE_UNSIGNED_LONG_LONG_INT
 		unsigned long long bytes_read;
@@ -134,41 +454,86 @@ struct flow
 		unsigned response_blocks_read;
 		unsigned response_blocks_written;
 
+		/** Accumulated interarrival time. */
+		double iat_sum;
+		/** Accumulated one-way delay. */
+		double delay_sum;
+		/** Accumulated round-trip time. */
+		double rtt_sum;
+		/** Accumulated round-trip time from the scheduled sending time. */
+		double rtt_intended_sum;
+
+		/** Number of blocks sent after their scheduled sending time. */
+		unsigned schedule_slips;
+		/** Accumulated delay of blocks behind their schedule. */
+		double schedule_slip_sum;
+
+		/** Query rounds completed, only counted for the group leader. */
+		unsigned query_rounds;
+		/** Accumulated query completion time. */
+		double qct_sum;
+	} statistics;
+
+	/** Extreme values, which cannot be derived by subtraction. Those of
+	 * the current reporting interval (INTERVAL) are updated as the flow
+	 * runs and folded into those of the whole flow (FINAL) with each
+	 * interval report. */
+	struct extremes {
 		/* TODO Create an array for IAT / RTT and delay */
 
 		/** Minimum interarrival time. */
 		double iat_min;
 		/** Maximum interarrival time. */
 		double iat_max;
-		/** Accumulated interarrival time. */
-		double iat_sum;
 		/** Minimum one-way delay. */
 		double delay_min;
 		/** Maximum one-way delay. */
 		double delay_max;
-		/** Accumulated one-way delay. */
-		double delay_sum;
 		/** Minimum round-trip time. */
 		double rtt_min;
 		/** Maximum round-trip time. */
 		double rtt_max;
-		/** Accumulated round-trip time. */
-		double rtt_sum;
-
-		int has_tcp_info;
-		struct fg_tcp_info tcp_info;
-	} statistics[2];
+		/** Minimum round-trip time from the scheduled sending time. */
+		double rtt_intended_min;
+		/** Maximum round-trip time from the scheduled sending time. */
+		double rtt_intended_max;
+		/** Maximum delay of a block behind its schedule. */
+		double schedule_slip_max;
+		/** Maximum number of responses waiting for transmission. */
+		unsigned response_queue_max;
+		/** Minimum query completion time. */
+		double qct_min;
+		/** Maximum query completion time. */
+		double qct_max;
+	} extremes[2];
+
+	/** #statistics at the end of the last interval report. */
+	struct statistics snapshot;
+
+	/** TCP info for the next report is valid. */
+	int has_tcp_info;
+	/** TCP info for the next report, collected right before it. */
+	struct fg_tcp_info tcp_info;
+	/** TCP info for the final report is valid. */
+	int has_final_tcp_info;
+	/** TCP info for the final report, collected when the flow ends. Kept
+	 * apart from #tcp_info, which each interval report refreshes. */
+	struct fg_tcp_info final_tcp_info;
 
 #ifdef HAVE_LIBPCAP
-	pthread_t pcap_thread;
-	struct pcap_t *pcap_handle;
-	struct pcap_dumper_t *pcap_dumper;
+	/** Captured test connection, NULL if not captured. */
+	struct fg_pcap_conn *pcap_conn;
 #endif /* HAVE_LIBPCAP */
 
 #ifdef HAVE_LIBGSL
 	gsl_rng * r;
 #endif /* HAVE_LIBGSL */
 
+#ifdef HAVE_LIBBPF
+	/** Kernel trace of the connection, NULL if not traced. */
+	struct fg_bpf_flow *bpf_trace;
+#endif /* HAVE_LIBBPF */
+
 	char* error;
 };
 
@@ -201,6 +566,7 @@ struct request_add_flow_destination
 	/* The request reply */
 	int flow_id;
 	int listen_data_port;
+	int handshake;
 	int real_listen_send_buffer_size;
 	int real_listen_read_buffer_size;
 };
@@ -252,6 +618,10 @@ struct request_get_status
 
 	int started;
 	int num_flows;
+	/** Source ports bound by flows and total size of the port ranges,
+	 * see get_source_port_usage(). */
+	unsigned source_ports_in_use;
+	unsigned source_ports_total;
 };
 
 pthread_t daemon_thread;
@@ -266,6 +636,28 @@ extern struct report* reports;
 extern struct report* reports_last;
 extern unsigned pending_reports;
 
+/** Bytes a flow may transfer per direction in one scheduling round. Zero
+ * disables the budget, i.e. pushy flows run until the socket blocks. */
+extern unsigned schedule_quantum;
+
+/** Accept test connections of all destination flows on one shared listen
+ * socket instead of one listen socket per flow. */
+extern int shared_listen;
+
+/** Maximum number of connects per second issued by the daemon. Zero
+ * disables the limit. */
+extern unsigned connect_rate;
+extern struct linked_list shared_listeners;
+extern struct linked_list pending_connections;
+extern struct linked_list rate_buckets;
+extern struct linked_list query_groups;
+extern struct linked_list report_groups;
+
+/** Gate region shared with an external scheduler, NULL if not enabled. */
+extern struct fg_gate_region *gates;
+/** FIFO through which the scheduler wakes us up after changing gates. */
+extern int gate_fifo;
+
 /* Gets 50 reports. There may be more pending but there's a limit on how
  * large a reply can get */
 struct report* get_reports(int *has_more);
@@ -275,10 +667,18 @@ char *dump_prefix;
 char *dump_dir;
 
 void *daemon_main(void* ptr);
-void add_report(struct report* report);
+unsigned add_report(struct report* report);
 void flow_error(struct flow *flow, const char *fmt, ...);
 void request_error(struct request *request, const char *fmt, ...);
 int set_flow_tcp_options(struct flow *flow);
+struct flow *add_flow_connection(struct flow *flow, int connection);
+int connect_slot_available(void);
+int join_rate_group(struct flow *flow);
+int join_query_group(struct flow *flow);
+int join_report_group(struct flow *flow);
+int join_connection_group(struct flow *flow);
+int dup_rate_schedule(struct flow *flow);
+void split_connection_rate(struct flow *flow);
 
 /** Dispatch a request to daemon loop.
  * Is called by the rpc server to feed in requests to the daemon. */
@@ -65,6 +65,10 @@
 #include "fg_pcap.h"
 #endif /* HAVE_LIBPCAP */
 
+#ifdef HAVE_LIBBPF
+#include "fg_bpf.h"
+#endif /* HAVE_LIBBPF */
+
 void remove_flow(unsigned i);
 
 #ifdef HAVE_TCP_INFO
@@ -74,9 +78,10 @@ int get_tcp_info(struct flow *flow, struct tcp_info *info);
 void init_flow(struct flow* flow, int is_source);
 void uninit_flow(struct flow *flow);
 
-/* listen_port will receive the port of the created socket */
+/* listen_port will receive the port of the created socket. A shared listen
+ * socket serves many flows, thus options of @p flow are not applied to it */
 static int create_listen_socket(struct flow *flow, char *bind_addr,
-				unsigned short *listen_port)
+				unsigned short *listen_port, int shared)
 {
 	int port;
 	int rc;
@@ -121,10 +126,10 @@ static int create_listen_socket(struct flow *flow, char *bind_addr,
 	freeaddrinfo(ressave);
 
 	/* we need to set sockopt mtcp before we start listen() */
-	if (flow->settings.mtcp)
+	if (!shared && flow->settings.mtcp)
 		set_tcp_mtcp(fd);
 
-	if (flow->settings.cc_alg)
+	if (!shared && flow->settings.cc_alg)
 		set_congestion_control(fd, flow->settings.cc_alg);
 
 	if (listen(fd, 2048) < 0) {
@@ -147,6 +152,107 @@ static int create_listen_socket(struct flow *flow, char *bind_addr,
 	return fd;
 }
 
+/**
+ * Get the shared listen socket for bind address @p bind_addr.
+ *
+ * The listen socket is created on first use and kept open for the lifetime
+ * of the daemon, so that subsequent tests reuse it.
+ *
+ * @param[in,out] flow flow on whose behalf the socket is requested
+ * @param[in] bind_addr address to bind to, or NULL for any address
+ * @return shared listen socket, or NULL on error (the error is set on @p flow)
+ */
+static struct shared_listener *get_shared_listener(struct flow *flow,
+						   char *bind_addr)
+{
+	struct shared_listener *listener;
+
+	const struct list_node *node = fg_list_front(&shared_listeners);
+	while (node) {
+		listener = node->data;
+		node = node->next;
+
+		if (!strcmp(listener->bind_address, bind_addr ? bind_addr : ""))
+			return listener;
+	}
+
+	listener = malloc(sizeof(struct shared_listener));
+	if (!listener) {
+		logging(LOG_ALERT, "could not allocate memory for listener");
+		flow_error(flow, "could not allocate memory for listener");
+		return NULL;
+	}
+	strcpy(listener->bind_address, bind_addr ? bind_addr : "");
+
+	listener->fd = create_listen_socket(flow, bind_addr, &listener->port,
+					    1);
+	if (listener->fd == -1) {
+		free(listener);
+		return NULL;
+	}
+	/* FIXME: currently we use portable select() API, which
+	 * is limited by the number of bits in an fd_set */
+	if (listener->fd >= MAX_FLOWS_DAEMON) {
+		flow_error(flow, "failed to add listen socket: too many"
+			   "file descriptors in use by this daemon");
+		close(listener->fd);
+		free(listener);
+		return NULL;
+	}
+	DEBUG_MSG(LOG_WARNING, "shared listen socket on %s port %u (fd=%u)",
+		  listener->bind_address, listener->port, listener->fd);
+
+	fg_list_push_back(&shared_listeners, listener);
+	return listener;
+}
+
+/**
+ * Draw a new token for the handshake on a shared listen socket.
+ *
+ * The token is random, so that a connection can not claim a flow just by
+ * guessing its controller-chosen ID, and unique among the flows waiting for
+ * connections. It fits into a positive XML-RPC integer.
+ *
+ * @param[in,out] flow flow the token is drawn for
+ * @return 0 on success, -1 on error (the error is set on @p flow)
+ */
+static int new_handshake_token(struct flow *flow)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1) {
+		flow_error(flow, "could not open /dev/urandom: %s",
+			   strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		uint32_t token;
+		if (read(fd, &token, sizeof(token)) != sizeof(token)) {
+			flow_error(flow, "could not read /dev/urandom");
+			close(fd);
+			return -1;
+		}
+		token &= 0x7fffffff;
+		if (!token)
+			continue;
+
+		int in_use = 0;
+		const struct list_node *node = fg_list_front(&flows);
+		while (node && !in_use) {
+			struct flow *other = node->data;
+			node = node->next;
+			in_use = other->shared_listen &&
+				 other->handshake_token == token;
+		}
+		if (in_use)
+			continue;
+
+		flow->handshake_token = token;
+		close(fd);
+		return 0;
+	}
+}
+
 /**
  * To set daemon flow as destination endpoint
  *
@@ -177,11 +283,19 @@ void add_flow_destination(struct request_add_flow_destination *request)
 	init_flow(flow, 0);
 
 	flow->settings = request->settings;
+	if (dup_rate_schedule(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return;
+	}
+	split_connection_rate(flow);
 	flow->write_block = calloc(1, flow->settings.maximum_block_size );
 	flow->read_block = calloc(1, flow->settings.maximum_block_size );
+	flow->response_block = calloc(1, flow->settings.maximum_block_size );
 	/* Controller flow ID is set in the daemon */
 	flow->id=flow->settings.flow_id;
-	if (flow->write_block == NULL || flow->read_block == NULL) {
+	if (flow->write_block == NULL || flow->read_block == NULL ||
+	    flow->response_block == NULL) {
 		logging(LOG_ALERT, "could not allocate memory for read/write "
 			"blocks");
 		request_error(&request->r, "could not allocate memory "
@@ -195,15 +309,73 @@ void add_flow_destination(struct request_add_flow_destination *request)
 		for (byte_idx = 0; byte_idx < flow->settings.maximum_block_size;
 		     byte_idx++)
 			*(flow->write_block + byte_idx) =
+				*(flow->response_block + byte_idx) =
 				(unsigned char)(byte_idx & 0xff);
 	}
 
+	if (join_rate_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return;
+	}
+
+	if (join_query_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return;
+	}
+
+	if (join_report_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return;
+	}
+
+	if (join_connection_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return;
+	}
+
+	/* Connections are matched to the flow by their handshake */
+	if (shared_listen) {
+		struct shared_listener *listener =
+			get_shared_listener(flow, flow->settings.bind_address[0]
+						  ? flow->settings.bind_address
+						  : 0);
+		if (!listener) {
+			request_error(&request->r, "could not create listen "
+				      "socket for data connection: %s",
+				      flow->error);
+			uninit_flow(flow);
+			return;
+		}
+		if (new_handshake_token(flow) == -1) {
+			request_error(&request->r, "%s", flow->error);
+			uninit_flow(flow);
+			return;
+		}
+		flow->shared_listen = 1;
+
+		/* Requested buffer sizes are applied once accepted */
+		request->listen_data_port = (int)listener->port;
+		request->handshake = (int)flow->handshake_token;
+		request->real_listen_send_buffer_size =
+			set_window_size_directed(listener->fd, 0, SO_SNDBUF);
+		request->real_listen_read_buffer_size =
+			set_window_size_directed(listener->fd, 0, SO_RCVBUF);
+		request->flow_id = flow->id;
+
+		fg_list_push_back(&flows, flow);
+		return;
+	}
+
 	/* Create listen socket for data connection */
 	if ((flow->listenfd_data =
 			create_listen_socket(flow,
 					     flow->settings.bind_address[0]
 						? flow->settings.bind_address : 0,
-					     &server_data_port)) == -1) {
+					     &server_data_port, 0)) == -1) {
 		logging(LOG_ALERT, "could not create listen socket for "
 			"data connection: %s", flow->error);
 		request_error(&request->r, "could not create listen socket "
@@ -236,6 +408,7 @@ void add_flow_destination(struct request_add_flow_destination *request)
 					 SO_RCVBUF);
 
 	request->listen_data_port = (int)server_data_port;
+	request->handshake = 0;
 	request->real_listen_send_buffer_size =
 		flow->real_listen_send_buffer_size;
 	request->real_listen_read_buffer_size =
@@ -247,42 +420,46 @@ void add_flow_destination(struct request_add_flow_destination *request)
 	return;
 }
 
-int accept_data(struct flow *flow)
+/**
+ * Attach the accepted test connection @p fd to the destination flow
+ * @p listener, or to a further connection of it.
+ *
+ * @param[in,out] listener destination flow the connection belongs to
+ * @param[in] fd accepted test connection
+ * @param[in] caddr address of the peer
+ * @param[in] addrlen length of @p caddr
+ * @return 0 on success, -1 on error (the error is set on the flow)
+ */
+static int attach_connection(struct flow *listener, int fd,
+			     struct sockaddr_storage *caddr, socklen_t addrlen)
 {
-	struct sockaddr_storage caddr;
-	socklen_t addrlen = sizeof(caddr);
+	struct flow *flow = listener;
 	unsigned real_send_buffer_size;
 	unsigned real_receive_buffer_size;
 
-	flow->fd = accept(flow->listenfd_data, (struct sockaddr *)&caddr,
-			  &addrlen);
-	if (flow->fd == -1) {
-		/* try again later .... */
-		if (errno == EINTR || errno == EAGAIN)
-			return 0;
-		logging(LOG_ALERT, "accept() failed: %s", strerror(errno));
-		return -1;
+	/* Further connections of a multi-connection flow */
+	if (listener->state != GRIND_WAIT_ACCEPT) {
+		flow = add_flow_connection(listener,
+					   listener->connections_accepted);
+		if (!flow) {
+			close(fd);
+			return -1;
+		}
 	}
+	flow->fd = fd;
 
-	/* FIXME: currently we use portable select() API, which
-	 * is limited by the number of bits in an fd_set */
-	if (flow->fd >= MAX_FLOWS_DAEMON) {
-		logging(LOG_ALERT, "too many file descriptors are "
-			"already in use by this daemon (FD number=%u)", flow->fd);
-		flow_error(flow, "failed to add test connection: too many"
-			"file descriptors in use by this daemon");
-		close(flow->fd);
-		return -1;
+	if (++listener->connections_accepted >=
+	    listener->settings.connections && listener->listenfd_data != -1) {
+		if (close(listener->listenfd_data) == -1)
+			logging(LOG_WARNING, "close() failed");
+		listener->listenfd_data = -1;
 	}
 
-	if (close(flow->listenfd_data) == -1)
-		logging(LOG_WARNING, "close() failed");
-	flow->listenfd_data = -1;
-
 	logging(LOG_NOTICE, "client %s connected for testing (fd=%u)",
-		fg_nameinfo((struct sockaddr *)&caddr, addrlen), flow->fd);
+		fg_nameinfo((struct sockaddr *)caddr, addrlen), flow->fd);
 
 #ifdef HAVE_LIBPCAP
+	/* the connections of a flow share its dump file */
 	fg_pcap_go(flow);
 #endif /* HAVE_LIBPCAP */
 
@@ -316,6 +493,164 @@ int accept_data(struct flow *flow)
 	DEBUG_MSG(LOG_NOTICE, "data socket accepted");
 	flow->state = GRIND;
 	flow->connect_called = 1;
+	flow->connected = 1;
+#ifdef HAVE_LIBBPF
+	fg_bpf_trace_start(flow);
+#endif /* HAVE_LIBBPF */
 
 	return 0;
 }
+
+int accept_data(struct flow *flow)
+{
+	struct sockaddr_storage caddr;
+	socklen_t addrlen = sizeof(caddr);
+	int fd;
+
+	fd = accept(flow->listenfd_data, (struct sockaddr *)&caddr, &addrlen);
+	if (fd == -1) {
+		/* try again later .... */
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		logging(LOG_ALERT, "accept() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	/* FIXME: currently we use portable select() API, which
+	 * is limited by the number of bits in an fd_set */
+	if (fd >= MAX_FLOWS_DAEMON) {
+		logging(LOG_ALERT, "too many file descriptors are "
+			"already in use by this daemon (FD number=%u)", fd);
+		flow_error(flow, "failed to add test connection: too many"
+			"file descriptors in use by this daemon");
+		close(fd);
+		return -1;
+	}
+
+	return attach_connection(flow, fd, &caddr, addrlen);
+}
+
+/**
+ * Accept all pending connections on the shared listen socket @p listener.
+ *
+ * The connections are kept aside until their handshake tells the flow they
+ * belong to.
+ *
+ * @param[in] listener shared listen socket
+ */
+void accept_shared(struct shared_listener *listener)
+{
+	for (;;) {
+		struct pending_connection *pc;
+		struct sockaddr_storage caddr;
+		socklen_t addrlen = sizeof(caddr);
+		int fd;
+
+		fd = accept(listener->fd, (struct sockaddr *)&caddr, &addrlen);
+		if (fd == -1) {
+			if (errno != EINTR && errno != EAGAIN)
+				logging(LOG_WARNING, "accept() failed: %s",
+					strerror(errno));
+			return;
+		}
+
+		/* FIXME: currently we use portable select() API, which
+		 * is limited by the number of bits in an fd_set */
+		if (fd >= MAX_FLOWS_DAEMON) {
+			logging(LOG_ALERT, "too many file descriptors are "
+				"already in use by this daemon (FD number=%u)",
+				fd);
+			close(fd);
+			return;
+		}
+
+		pc = malloc(sizeof(struct pending_connection));
+		if (!pc) {
+			logging(LOG_ALERT, "could not allocate memory for "
+				"connection");
+			close(fd);
+			return;
+		}
+		set_non_blocking(fd);
+		pc->fd = fd;
+		pc->addr = caddr;
+		pc->addr_len = addrlen;
+		gettime(&pc->accepted);
+		pc->handshake_bytes_read = 0;
+
+		DEBUG_MSG(LOG_NOTICE, "client %s connected to shared listen "
+			  "socket (fd=%u)", fg_nameinfo((struct sockaddr *)
+			  &caddr, addrlen), fd);
+		fg_list_push_back(&pending_connections, pc);
+	}
+}
+
+/**
+ * Read the handshake of the pending connection @p pc and attach the
+ * connection to its flow once complete.
+ *
+ * @param[in,out] pc connection accepted on a shared listen socket
+ * @param[out] flow flow which failed to take over the connection
+ * @return 0 if the handshake is incomplete, 1 if the connection has been
+ * attached or dropped, and -1 if @p flow failed to take over the connection
+ */
+int read_handshake(struct pending_connection *pc, struct flow **flow)
+{
+	ssize_t rc;
+	uint32_t magic, token;
+
+	*flow = NULL;
+
+	rc = recv(pc->fd, pc->handshake + pc->handshake_bytes_read,
+		  FLOW_HANDSHAKE_SIZE - pc->handshake_bytes_read, 0);
+	if (rc == -1 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (rc <= 0) {
+		DEBUG_MSG(LOG_WARNING, "connection closed before handshake "
+			  "(fd=%u)", pc->fd);
+		close(pc->fd);
+		return 1;
+	}
+
+	pc->handshake_bytes_read += rc;
+	if (pc->handshake_bytes_read < FLOW_HANDSHAKE_SIZE)
+		return 0;
+
+	memcpy(&magic, pc->handshake, sizeof(magic));
+	memcpy(&token, pc->handshake + sizeof(magic), sizeof(token));
+	magic = ntohl(magic);
+	token = ntohl(token);
+
+	if (magic != FLOW_HANDSHAKE_MAGIC) {
+		logging(LOG_WARNING, "invalid handshake from %s",
+			fg_nameinfo((struct sockaddr *)&pc->addr,
+				    pc->addr_len));
+		close(pc->fd);
+		return 1;
+	}
+
+	const struct list_node *node = fg_list_front(&flows);
+	while (node) {
+		struct flow *listener = node->data;
+		node = node->next;
+
+		if (listener->handshake_token != token ||
+		    listener->endpoint != DESTINATION ||
+		    !listener->shared_listen || listener->connection ||
+		    listener->connections_accepted >=
+		    listener->settings.connections)
+			continue;
+
+		if (attach_connection(listener, pc->fd, &pc->addr,
+				      pc->addr_len) == -1) {
+			*flow = listener;
+			return -1;
+		}
+		return 1;
+	}
+
+	logging(LOG_WARNING, "handshake with unknown token from %s",
+		fg_nameinfo((struct sockaddr *)&pc->addr, pc->addr_len));
+	close(pc->fd);
+	return 1;
+}
@@ -34,5 +34,7 @@
 
 void add_flow_destination(struct request_add_flow_destination *request);
 int accept_data(struct flow *flow);
+void accept_shared(struct shared_listener *listener);
+int read_handshake(struct pending_connection *pc, struct flow **flow);
 
 #endif /* _DESTINATION_H_ */
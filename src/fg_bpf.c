@@ -0,0 +1,410 @@
+/**
+ * @file fg_bpf.c
+ * @brief Tracing of TCP events with eBPF for the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "debug.h"
+#include "fg_definitions.h"
+#include "fg_endian.h"
+#include "fg_log.h"
+#include "fg_string.h"
+#include "fg_time.h"
+#include "daemon.h"
+#include "fg_bpf_trace.h"
+#include "fg_bpf.h"
+#include "fg_bpf_trace.skel.h"
+
+/** Size of the header of a trace file. All fields are big endian:
+ *
+ *   offset  size  field
+ *        0     4  magic "FGKT"
+ *        4     2  version, 1
+ *        6     2  size of a record
+ *        8     4  flow ID
+ *       12     2  endpoint, 0 for source and 1 for destination
+ *       14     2  connection of the flow */
+#define FG_BPF_HEADER_SIZE 16
+
+/** Size of a record of a trace file. All fields are big endian:
+ *
+ *   offset  size  field
+ *        0     8  time since tracing started, in ns
+ *        8     4  event, 0 for ACK received and 1 for retransmission
+ *       12     4  payload of the received segment, in bytes
+ *       16     4  next sequence number to send
+ *       20     4  oldest unacknowledged sequence number
+ *       24     4  congestion window, in segments
+ *       28     4  slow start threshold, in segments
+ *       32     4  smoothed RTT, in microseconds
+ *       36     4  send window, in bytes
+ *       40     4  receive window, in bytes */
+#define FG_BPF_RECORD_SIZE 44
+
+/** Traced connection. */
+struct fg_bpf_flow {
+	/** Handle of the connection in the map of the tracer. */
+	__u32 handle;
+	/** Key of the connection in the map of the tracer. */
+	struct fg_bpf_key key;
+	/** Trace file. */
+	FILE *file;
+	/** Time tracing started (CLOCK_MONOTONIC), in ns. */
+	__u64 start;
+	/** ID of the traced flow. */
+	int id;
+};
+
+/** Loading the tracer was not tried yet, succeeded or failed. */
+static enum {
+	BPF_UNTRIED = 0,
+	BPF_LOADED,
+	BPF_UNAVAILABLE,
+} bpf_state = BPF_UNTRIED;
+
+/** Tracer loaded into the kernel. */
+static struct fg_bpf_trace_bpf *skel = NULL;
+
+/** Ring buffer the events are read from. */
+static struct ring_buffer *ringbuf = NULL;
+
+/** Traced connections by their handle. */
+static struct fg_bpf_flow *traced[FG_BPF_MAX_FLOWS];
+
+/** Events lost in the ring buffer which were already logged. */
+static __u64 lost_logged = 0;
+
+/**
+ * Pass the warnings of libbpf on to our log.
+ */
+static int print_libbpf(enum libbpf_print_level level, const char *fmt,
+			va_list ap)
+{
+	if (level == LIBBPF_WARN)
+		vlogging(LOG_WARNING, fmt, ap);
+	return 0;
+}
+
+/**
+ * Write the event @p data of the ring buffer to the trace file of its flow.
+ */
+static int handle_event(void *ctx, void *data, size_t size)
+{
+	const struct fg_bpf_event *event = data;
+	unsigned char buf[FG_BPF_RECORD_SIZE];
+	struct fg_bpf_flow *trace;
+
+	UNUSED_ARGUMENT(ctx);
+
+	if (size < sizeof(*event) || event->handle >= FG_BPF_MAX_FLOWS)
+		return 0;
+	/* The connection may have been untraced in the meantime */
+	trace = traced[event->handle];
+	if (!trace)
+		return 0;
+
+	put_be(buf, (int64_t)(event->time - trace->start), 8);
+	put_be(buf + 8, event->type, 4);
+	put_be(buf + 12, event->data_len, 4);
+	put_be(buf + 16, event->snd_nxt, 4);
+	put_be(buf + 20, event->snd_una, 4);
+	put_be(buf + 24, event->snd_cwnd, 4);
+	put_be(buf + 28, event->ssthresh, 4);
+	put_be(buf + 32, event->srtt, 4);
+	put_be(buf + 36, event->snd_wnd, 4);
+	put_be(buf + 40, event->rcv_wnd, 4);
+
+	if (fwrite(buf, sizeof(buf), 1, trace->file) != 1)
+		logging(LOG_WARNING, "failed to write kernel trace of flow "
+			"%d: %s", trace->id, strerror(errno));
+	return 0;
+}
+
+/**
+ * Load the tracer into the kernel and attach it to the TCP tracepoints, once.
+ *
+ * @return 0 on success, or -1 if the tracer is not available
+ */
+static int load_tracer(void)
+{
+	int rc;
+
+	if (bpf_state != BPF_UNTRIED)
+		return bpf_state == BPF_LOADED ? 0 : -1;
+	bpf_state = BPF_UNAVAILABLE;
+
+	libbpf_set_print(print_libbpf);
+
+	skel = fg_bpf_trace_bpf__open_and_load();
+	if (!skel) {
+		logging(LOG_WARNING, "failed to load eBPF TCP tracer, flows "
+			"run untraced: %s", strerror(errno));
+		return -1;
+	}
+
+	rc = fg_bpf_trace_bpf__attach(skel);
+	if (rc) {
+		logging(LOG_WARNING, "failed to attach eBPF TCP tracer, flows "
+			"run untraced: %s", strerror(-rc));
+		goto destroy;
+	}
+
+	ringbuf = ring_buffer__new(bpf_map__fd(skel->maps.fg_events),
+				   handle_event, NULL, NULL);
+	if (!ringbuf) {
+		logging(LOG_WARNING, "failed to open ring buffer of eBPF TCP "
+			"tracer, flows run untraced: %s", strerror(errno));
+		goto destroy;
+	}
+
+	DEBUG_MSG(LOG_NOTICE, "eBPF TCP tracer loaded");
+	bpf_state = BPF_LOADED;
+	return 0;
+
+destroy:
+	fg_bpf_trace_bpf__destroy(skel);
+	skel = NULL;
+	return -1;
+}
+
+/**
+ * Store the address and port of @p ss as they appear in the tracepoints.
+ *
+ * @return 0 on success, or -1 if the address family is not supported
+ */
+static int key_address(const struct sockaddr_storage *ss, __u8 *addr,
+		       __u16 *port)
+{
+	if (ss->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+
+		memset(addr, 0, 10);
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &sin->sin_addr, 4);
+		*port = ntohs(sin->sin_port);
+	} else if (ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)ss;
+
+		memcpy(addr, &sin6->sin6_addr, 16);
+		*port = ntohs(sin6->sin6_port);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Fill @p key with the addresses and ports of the connection of socket @p fd.
+ *
+ * @return 0 on success, or -1 on error
+ */
+static int connection_key(int fd, struct fg_bpf_key *key)
+{
+	struct sockaddr_storage local, remote;
+	socklen_t len;
+
+	len = sizeof(local);
+	if (getsockname(fd, (struct sockaddr *)&local, &len) == -1)
+		return -1;
+	len = sizeof(remote);
+	if (getpeername(fd, (struct sockaddr *)&remote, &len) == -1)
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	if (key_address(&local, key->local, &key->local_port) == -1 ||
+	    key_address(&remote, key->remote, &key->remote_port) == -1) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Create the trace file of @p flow in the dump directory and write its header.
+ *
+ * @return trace file, or NULL on error
+ */
+static FILE *open_trace_file(struct flow *flow)
+{
+	unsigned char header[FG_BPF_HEADER_SIZE];
+	char *filename = NULL;
+	char timestamp[30] = "";
+	char hostname[128] = "";
+	FILE *file;
+
+	if (dump_dir)
+		asprintf_append(&filename, "%s", dump_dir);
+	if (dump_prefix)
+		asprintf_append(&filename, "%s", dump_prefix);
+	ctimenow_r(timestamp, sizeof(timestamp), false);
+	asprintf_append(&filename, "%s", timestamp);
+	if (!gethostname(hostname, sizeof(hostname)))
+		asprintf_append(&filename, "-%s", hostname);
+	asprintf_append(&filename, "-%d-%c", flow->id,
+			flow->endpoint == SOURCE ? 's' : 'd');
+	if (flow->connection)
+		asprintf_append(&filename, "-%d", flow->connection);
+	asprintf_append(&filename, ".fgkt");
+
+	DEBUG_MSG(LOG_NOTICE, "tracing flow %d to \"%s\"", flow->id, filename);
+
+	file = fopen(filename, "w");
+	if (!file) {
+		logging(LOG_WARNING, "failed to open kernel trace file %s: %s",
+			filename, strerror(errno));
+		free(filename);
+		return NULL;
+	}
+	free(filename);
+
+	memcpy(header, "FGKT", 4);
+	put_be(header + 4, 1, 2);
+	put_be(header + 6, FG_BPF_RECORD_SIZE, 2);
+	put_be(header + 8, flow->id, 4);
+	put_be(header + 12, flow->endpoint, 2);
+	put_be(header + 14, flow->connection, 2);
+	if (fwrite(header, sizeof(header), 1, file) != 1) {
+		logging(LOG_WARNING, "failed to write kernel trace of flow "
+			"%d: %s", flow->id, strerror(errno));
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+int fg_bpf_trace_start(struct flow *flow)
+{
+	struct fg_bpf_flow *trace;
+	struct timespec now;
+	__u32 handle;
+
+	if (!flow->settings.kernel_trace || flow->bpf_trace)
+		return 0;
+	if (load_tracer() == -1)
+		return -1;
+
+	for (handle = 0; handle < FG_BPF_MAX_FLOWS && traced[handle]; handle++)
+		;
+	if (handle == FG_BPF_MAX_FLOWS) {
+		logging(LOG_WARNING, "can not trace more than %d connections, "
+			"flow %d runs untraced", FG_BPF_MAX_FLOWS, flow->id);
+		return -1;
+	}
+
+	trace = calloc(1, sizeof(struct fg_bpf_flow));
+	if (!trace) {
+		logging(LOG_ALERT, "could not allocate memory for kernel trace");
+		return -1;
+	}
+	trace->handle = handle;
+	trace->id = flow->id;
+
+	if (connection_key(flow->fd, &trace->key) == -1) {
+		logging(LOG_WARNING, "failed to determine connection of flow "
+			"%d, flow runs untraced: %s", flow->id,
+			strerror(errno));
+		free(trace);
+		return -1;
+	}
+
+	trace->file = open_trace_file(flow);
+	if (!trace->file) {
+		free(trace);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	trace->start = (__u64)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	if (bpf_map_update_elem(bpf_map__fd(skel->maps.fg_flows), &trace->key,
+				&handle, BPF_NOEXIST)) {
+		logging(LOG_WARNING, "failed to trace flow %d: %s", flow->id,
+			strerror(errno));
+		fclose(trace->file);
+		free(trace);
+		return -1;
+	}
+
+	traced[handle] = trace;
+	flow->bpf_trace = trace;
+	return 0;
+}
+
+void fg_bpf_trace_stop(struct flow *flow)
+{
+	struct fg_bpf_flow *trace = flow->bpf_trace;
+	__u32 zero = 0;
+	__u64 lost;
+
+	if (!trace)
+		return;
+
+	if (bpf_map_delete_elem(bpf_map__fd(skel->maps.fg_flows), &trace->key))
+		logging(LOG_WARNING, "failed to untrace flow %d: %s", flow->id,
+			strerror(errno));
+	/* write the events still pending before the file is closed */
+	fg_bpf_consume();
+
+	if (!bpf_map_lookup_elem(bpf_map__fd(skel->maps.fg_lost), &zero,
+				 &lost) && lost > lost_logged) {
+		logging(LOG_WARNING, "%llu kernel trace events lost, the ring "
+			"buffer was full", (unsigned long long)(lost -
+								lost_logged));
+		lost_logged = lost;
+	}
+
+	traced[trace->handle] = NULL;
+	if (fclose(trace->file) == EOF)
+		logging(LOG_WARNING, "failed to close kernel trace of flow "
+			"%d: %s", flow->id, strerror(errno));
+	free(trace);
+	flow->bpf_trace = NULL;
+}
+
+int fg_bpf_fd(void)
+{
+	return ringbuf ? ring_buffer__epoll_fd(ringbuf) : -1;
+}
+
+void fg_bpf_consume(void)
+{
+	if (ringbuf && ring_buffer__consume(ringbuf) < 0)
+		logging(LOG_WARNING, "failed to read kernel trace events");
+}
@@ -0,0 +1,69 @@
+/**
+ * @file fg_bpf.h
+ * @brief Tracing of TCP events with eBPF for the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_BPF_H_
+#define _FG_BPF_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "daemon.h"
+
+/**
+ * Start tracing the TCP events of the connection of @p flow into a trace
+ * file of its own.
+ *
+ * The tracer is loaded into the kernel with the first traced flow. If the
+ * flow was not configured for tracing or is already traced, the function does
+ * nothing. If the tracer is not available, e.g. due to missing privileges or
+ * kernel support, a log message is created and the flow runs untraced.
+ *
+ * @param[in,out] flow connected flow to trace
+ * @return 0 on success, or -1 if the flow is not traced
+ */
+int fg_bpf_trace_start(struct flow *flow);
+
+/**
+ * Stop tracing @p flow. Pending events of the flow are written to its trace
+ * file before it is closed.
+ *
+ * @param[in,out] flow flow to stop tracing, may be untraced
+ */
+void fg_bpf_trace_stop(struct flow *flow);
+
+/**
+ * Get a file descriptor which becomes readable once many events wait in the
+ * ring buffer of the tracer.
+ *
+ * @return file descriptor to poll, or -1 if the tracer is not loaded
+ */
+int fg_bpf_fd(void);
+
+/**
+ * Write the events waiting in the ring buffer of the tracer to the trace
+ * files of their flows.
+ */
+void fg_bpf_consume(void);
+
+#endif /* _FG_BPF_H_ */
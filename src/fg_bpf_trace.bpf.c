@@ -0,0 +1,171 @@
+/**
+ * @file fg_bpf_trace.bpf.c
+ * @brief eBPF program tracing the TCP events of the flows of the daemon
+ *
+ * Compiled with clang -target bpf and linked into the daemon as a libbpf
+ * skeleton. It hooks the TCP tracepoints, looks up the connection of each
+ * event in the map of traced flows and passes the events of traced flows
+ * through a ring buffer to the daemon.
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+
+#include "fg_bpf_trace.h"
+
+/* Not part of the BTF of the kernel, as these are macros */
+#define AF_INET 2
+#define AF_INET6 10
+
+char LICENSE[] SEC("license") = "GPL";
+
+/** Traced connections, mapped to their handle. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, FG_BPF_MAX_FLOWS);
+	__type(key, struct fg_bpf_key);
+	__type(value, __u32);
+} fg_flows SEC(".maps");
+
+/** Events of the traced connections. */
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, FG_BPF_RINGBUF_SIZE);
+} fg_events SEC(".maps");
+
+/** Number of events lost because the ring buffer was full. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} fg_lost SEC(".maps");
+
+/** Store the IPv4 address @p v4 as IPv4-mapped IPv6 address in @p addr. */
+static __always_inline void map_v4(__u8 *addr, const __u8 *v4)
+{
+	__builtin_memset(addr, 0, 10);
+	addr[10] = addr[11] = 0xff;
+	__builtin_memcpy(addr + 12, v4, 4);
+}
+
+/** Reserve an event for the traced connection @p key, NULL if the
+ * connection is not traced or the ring buffer is full. */
+static __always_inline struct fg_bpf_event *
+reserve_event(const struct fg_bpf_key *key, __u32 type)
+{
+	struct fg_bpf_event *event;
+	__u32 zero = 0, *handle;
+	__u64 *lost;
+
+	handle = bpf_map_lookup_elem(&fg_flows, key);
+	if (!handle)
+		return NULL;
+
+	event = bpf_ringbuf_reserve(&fg_events, sizeof(*event), 0);
+	if (!event) {
+		lost = bpf_map_lookup_elem(&fg_lost, &zero);
+		if (lost)
+			__sync_fetch_and_add(lost, 1);
+		return NULL;
+	}
+
+	event->time = bpf_ktime_get_ns();
+	event->handle = *handle;
+	event->type = type;
+	return event;
+}
+
+/** Pass @p event to the daemon, waking it up only if enough data piled up. */
+static __always_inline void submit_event(struct fg_bpf_event *event)
+{
+	__u64 flags = BPF_RB_NO_WAKEUP;
+
+	if (bpf_ringbuf_query(&fg_events, BPF_RB_AVAIL_DATA) >=
+	    FG_BPF_WAKEUP_DATA)
+		flags = BPF_RB_FORCE_WAKEUP;
+	bpf_ringbuf_submit(event, flags);
+}
+
+SEC("tp/tcp/tcp_probe")
+int fg_tcp_probe(struct trace_event_raw_tcp_probe *ctx)
+{
+	struct fg_bpf_key key = {};
+	struct fg_bpf_event *event;
+
+	/* The addresses are a struct sockaddr_in or sockaddr_in6 */
+	if (ctx->family == AF_INET) {
+		map_v4(key.local, ctx->saddr + 4);
+		map_v4(key.remote, ctx->daddr + 4);
+	} else if (ctx->family == AF_INET6) {
+		__builtin_memcpy(key.local, ctx->saddr + 8, 16);
+		__builtin_memcpy(key.remote, ctx->daddr + 8, 16);
+	} else {
+		return 0;
+	}
+	key.local_port = ctx->sport;
+	key.remote_port = ctx->dport;
+
+	event = reserve_event(&key, FG_BPF_EVENT_PROBE);
+	if (!event)
+		return 0;
+
+	event->data_len = ctx->data_len;
+	event->snd_nxt = ctx->snd_nxt;
+	event->snd_una = ctx->snd_una;
+	event->snd_cwnd = ctx->snd_cwnd;
+	event->ssthresh = ctx->ssthresh;
+	event->srtt = ctx->srtt;
+	event->snd_wnd = ctx->snd_wnd;
+	event->rcv_wnd = ctx->rcv_wnd;
+	submit_event(event);
+	return 0;
+}
+
+SEC("tp/tcp/tcp_retransmit_skb")
+int fg_tcp_retransmit(struct trace_event_raw_tcp_event_sk_skb *ctx)
+{
+	const struct tcp_sock *tp = ctx->skaddr;
+	struct fg_bpf_key key = {};
+	struct fg_bpf_event *event;
+
+	/* IPv4 addresses are stored mapped to IPv6 as well */
+	__builtin_memcpy(key.local, ctx->saddr_v6, 16);
+	__builtin_memcpy(key.remote, ctx->daddr_v6, 16);
+	key.local_port = ctx->sport;
+	key.remote_port = ctx->dport;
+
+	event = reserve_event(&key, FG_BPF_EVENT_RETRANSMIT);
+	if (!event)
+		return 0;
+
+	event->data_len = 0;
+	event->snd_nxt = BPF_CORE_READ(tp, snd_nxt);
+	event->snd_una = BPF_CORE_READ(tp, snd_una);
+	event->snd_cwnd = BPF_CORE_READ(tp, snd_cwnd);
+	event->ssthresh = BPF_CORE_READ(tp, snd_ssthresh);
+	event->srtt = BPF_CORE_READ(tp, srtt_us) >> 3;
+	event->snd_wnd = BPF_CORE_READ(tp, snd_wnd);
+	event->rcv_wnd = BPF_CORE_READ(tp, rcv_wnd);
+	submit_event(event);
+	return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file fg_bpf_trace.h
+ * @brief Definitions shared by the eBPF TCP tracer and the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_BPF_TRACE_H_
+#define _FG_BPF_TRACE_H_
+
+/* This header is included by the BPF program as well, so it must not include
+ * anything. The includer provides the __u8 ... __u64 types */
+
+/** Maximum number of connections traced at once. */
+#define FG_BPF_MAX_FLOWS 4096
+
+/** Size of the ring buffer the events are passed through, in bytes. */
+#define FG_BPF_RINGBUF_SIZE (4 << 20)
+
+/** Data in the ring buffer, in bytes, from which on the daemon is woken up.
+ * Below, the daemon drains the ring buffer whenever it runs anyway, which
+ * saves a wakeup per ACK. */
+#define FG_BPF_WAKEUP_DATA (256 << 10)
+
+/** Kind of traced event. */
+enum fg_bpf_event_type {
+	/** ACK received (tracepoint tcp:tcp_probe). */
+	FG_BPF_EVENT_PROBE = 0,
+	/** Segment retransmitted (tracepoint tcp:tcp_retransmit_skb). */
+	FG_BPF_EVENT_RETRANSMIT,
+};
+
+/** Connection of a traced flow. IPv4 addresses are mapped to IPv6, ports
+ * are in host byte order. */
+struct fg_bpf_key {
+	__u8 local[16];
+	__u8 remote[16];
+	__u16 local_port;
+	__u16 remote_port;
+};
+
+/** Event passed from the tracer to the daemon. */
+struct fg_bpf_event {
+	/** Time of the event (CLOCK_MONOTONIC), in ns. */
+	__u64 time;
+	/** Handle of the traced connection, the value of its key. */
+	__u32 handle;
+	/** Kind of the event, enum fg_bpf_event_type. */
+	__u32 type;
+	/** Payload of the received segment, in bytes. */
+	__u32 data_len;
+	/** Next sequence number to send and oldest unacknowledged one. */
+	__u32 snd_nxt;
+	__u32 snd_una;
+	/** Congestion window and slow start threshold, in segments. */
+	__u32 snd_cwnd;
+	__u32 ssthresh;
+	/** Smoothed RTT, in microseconds. */
+	__u32 srtt;
+	/** Send window and receive window, in bytes. */
+	__u32 snd_wnd;
+	__u32 rcv_wnd;
+};
+
+#endif /* _FG_BPF_TRACE_H_ */
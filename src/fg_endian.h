@@ -0,0 +1,40 @@
+/**
+ * @file fg_endian.h
+ * @brief Byte order helpers for the binary files written by the daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_ENDIAN_H_
+#define _FG_ENDIAN_H_
+
+#include <stdint.h>
+
+/**
+ * Store @p value big endian in the @p size bytes at @p buf.
+ */
+static inline void put_be(unsigned char *buf, uint64_t value, unsigned size)
+{
+	while (size--) {
+		buf[size] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+#endif /* _FG_ENDIAN_H_ */
@@ -0,0 +1,113 @@
+/**
+ * @file fg_gate.c
+ * @brief Shared memory gates to start and stop sending from another process
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fg_gate.h"
+
+struct fg_gate_region *fg_gate_map(const char *path)
+{
+	struct fg_gate_region *region;
+	struct stat st;
+
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1)
+		goto error;
+
+	if (st.st_size == 0 &&
+	    ftruncate(fd, sizeof(struct fg_gate_region)) == -1)
+		goto error;
+
+	if (st.st_size != 0 &&
+	    (size_t)st.st_size != sizeof(struct fg_gate_region)) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	region = mmap(NULL, sizeof(struct fg_gate_region),
+		      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED)
+		goto error;
+	close(fd);
+
+	if (!region->magic) {
+		region->num_gates = MAX_GATES;
+		region->magic = FG_GATE_MAGIC;
+	} else if (region->magic != FG_GATE_MAGIC ||
+		   region->num_gates != MAX_GATES) {
+		munmap(region, sizeof(struct fg_gate_region));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return region;
+
+error:
+	close(fd);
+	return NULL;
+}
+
+int fg_gate_open_fifo(const char *path)
+{
+	char *fifo;
+	int fd;
+
+	if (asprintf(&fifo, "%s.fifo", path) == -1)
+		return -1;
+
+	if (mkfifo(fifo, 0666) == -1 && errno != EEXIST) {
+		free(fifo);
+		return -1;
+	}
+
+	/* Read-write, so the FIFO neither blocks on open nor reports a
+	 * hangup while no other process has it open */
+	fd = open(fifo, O_RDWR | O_NONBLOCK);
+	free(fifo);
+	return fd;
+}
+
+int fg_gate_notify(int fd)
+{
+	const char c = 0;
+
+	/* A full FIFO wakes up the daemon as well */
+	if (write(fd, &c, 1) == -1 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file fg_gate.h
+ * @brief Shared memory gates to start and stop sending from another process
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_GATE_H_
+#define _FG_GATE_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdint.h>
+
+/** Magic number identifying a gate region ("FGGT"). */
+#define FG_GATE_MAGIC 0x46474754
+
+/** Number of gates in a gate region. Gate IDs start at 1. */
+#define MAX_GATES 64
+
+/** Unsent bytes a gated flow may leave in its send buffer. Closing the gate
+ * stops further writes, but not the data TCP already holds. */
+#define GATE_NOTSENT_LOWAT 16384
+
+/** Counters of a gate, maintained by the daemon. */
+struct fg_gate_stats {
+	/** Number of times the gate was opened. */
+	uint64_t opens;
+	/** Total time the gate was open, in nanoseconds. */
+	uint64_t open_ns;
+	/** Bytes written by the flows of the gate. */
+	uint64_t bytes;
+	/** Times a flow had data to send while its gate was closed. */
+	uint64_t blocked;
+};
+
+/**
+ * Gate region shared between flowgrindd and the process that schedules the
+ * gates, e.g. flowgrind-gate.
+ *
+ * The scheduler writes @p open and then writes a byte to the FIFO of the
+ * region to wake up the daemon. The daemon writes @p stats.
+ */
+struct fg_gate_region {
+	uint32_t magic;
+	uint32_t num_gates;
+	/** Non-zero while the gate is open. Written by the scheduler. */
+	volatile uint8_t open[MAX_GATES];
+	/** Written by the daemon. */
+	struct fg_gate_stats stats[MAX_GATES];
+};
+
+/**
+ * Map the gate region stored in the file @p path, e.g. on a tmpfs like
+ * /dev/shm. A missing or empty file is created and initialized with all
+ * gates closed.
+ *
+ * @param[in] path file of the gate region
+ * @return mapped region, or NULL for failure
+ */
+struct fg_gate_region *fg_gate_map(const char *path);
+
+/**
+ * Open the FIFO used to wake up the daemon after gates changed. It is
+ * created next to the region as @p path with the suffix ".fifo".
+ *
+ * @param[in] path file of the gate region
+ * @return non-blocking file descriptor, or -1 for failure
+ */
+int fg_gate_open_fifo(const char *path);
+
+/**
+ * Wake up the daemon after gates of the region were changed.
+ *
+ * @param[in] fd file descriptor returned by fg_gate_open_fifo()
+ * @return return 0 for success, or -1 for failure
+ */
+int fg_gate_notify(int fd);
+
+#endif /* _FG_GATE_H_ */
@@ -32,11 +32,9 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
-#include <netinet/in_systm.h>
-#include <netinet/ip.h>
 #include <arpa/inet.h>
-#include <netinet/if_ether.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <syslog.h>
 #include <stdlib.h>
@@ -44,45 +42,171 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <poll.h>
 #include <pcap.h>
-#include <netdb.h>
+
+#ifdef __LINUX__
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#ifdef TPACKET3_HDRLEN
+/** Capture into a TPACKET_V3 ring shared with the kernel. */
+#define USE_TPACKET_V3
+#endif /* TPACKET3_HDRLEN */
+#endif /* __LINUX__ */
 
 #include "debug.h"
+#include "fg_affinity.h"
 #include "fg_socket.h"
 #include "fg_time.h"
 #include "fg_string.h"
 #include "fg_log.h"
 #include "daemon.h"
 #include "fg_pcap.h"
+#include "fg_pcap_writer.h"
 
-/* OS X hasn't defined pthread_barrier */
-#ifndef HAVE_PTHREAD_BARRIER
-#include "fg_barrier.h"
-#endif
+/** Maximum size of the IP and TCP headers of a segment. Of each segment, the
+ * headers and the configured number of payload bytes are dumped. */
+#define PCAP_HEADER_MAX (60 + 60)
 
-/* PCAP snapshot length */
-#define PCAP_SNAPLEN 130
+/** Maximum size of the link layer headers captured by libpcap. */
+#define PCAP_LINK_HEADER_MAX 16
 
-/* PCAP filter string */
-#define PCAP_FILTER "tcp"
-
-/* Flag whether to use promiscuous mode */
+/** Flag whether to use promiscuous mode. */
 #define PCAP_PROMISC 0
 
+/** Maximum number of connections of an interface matched one by one by the
+ * capture filter. Beyond, the filter would exceed the size limit of BPF
+ * programs, so all TCP segments pass it and are matched by the capture
+ * thread only. */
+#define PCAP_FILTER_MAX_CONNS 128
+
+/** Number of buckets of the connection table of an interface, a power of 2. */
+#define PCAP_HASH_SIZE 256
+
+/** Time a connection is still captured after its flow stopped, to catch the
+ * segments of the connection teardown, in seconds. */
+#define PCAP_LINGER 0.5
+
+/** Interval in which an idle capture thread wakes up, in milliseconds. */
+#define PCAP_POLL_TIMEOUT 50
+
+#ifdef USE_TPACKET_V3
+/** Size of a block of the capture ring. The kernel hands blocks over to the
+ * capture thread as a whole. */
+#define PCAP_BLOCK_SIZE (1 << 20)
+
+/** Number of blocks of the capture ring. */
+#define PCAP_BLOCK_NR 64
+
+/** Frame size the ring is laid out for. TPACKET_V3 packs packets of any size
+ * into the blocks, but the kernel still checks the layout. */
+#define PCAP_FRAME_SIZE 2048
+
+/** Time after which the kernel hands over a partially filled block, in
+ * milliseconds. */
+#define PCAP_BLOCK_TIMEOUT 10
+#endif /* USE_TPACKET_V3 */
+
+/** Dump file of a flow endpoint, shared by the connections of the endpoint
+ * captured on the same interface. */
+struct pcap_output {
+	/** ID of the flow. */
+	int id;
+	/** Endpoint of the flow, as source and destination of a flow may run
+	 * on the same daemon. */
+	enum endpoint_t endpoint;
+	/** Number of connections written to the dump file. */
+	unsigned refs;
+	struct fg_pcap_writer *writer;
+
+	struct pcap_output *next;
+};
+
+/** Connection of a dumped flow. Addresses and ports are stored in network
+ * byte order, IPv4-mapped IPv6 addresses as IPv4 addresses. */
+struct fg_pcap_conn {
+	int family;
+	uint8_t remote[16];
+	uint16_t remote_port;
+	uint16_t local_port;
+
+	struct capture_engine *engine;
+	struct pcap_output *output;
+
+	/** Flag if the flow stopped. The connection is removed after lingering
+	 * for PCAP_LINGER seconds. */
+	bool stopped;
+	struct timespec stop_time;
+	/** Packets dropped by the kernel on the interface when the capture of
+	 * the connection started. */
+	unsigned long long kernel_drops;
+
+	struct fg_pcap_conn *next;
+};
+
+/**
+ * Capture engine of an interface.
+ *
+ * A single thread captures the connections of all dumped flows on the
+ * interface. The capture filter only passes the segments of these connections,
+ * the thread demultiplexes them into the dump files of their flows. Thus the
+ * capture cost does not grow with the number of dumped flows.
+ */
+struct capture_engine {
+	/** Name of the interface, "any" to capture on all interfaces. */
+	char *name;
+	/** Link type of the captured packets, DLT_ value of libpcap. */
+	int linktype;
+	/** Link type of the dump files, enum pcap_linktype. */
+	unsigned file_linktype;
+	/** Offset of the network header within the captured packets. */
+	unsigned net_offset;
+	/** Maximum number of bytes captured per packet. */
+	unsigned snaplen;
+	/** Handle the capture filter is compiled with. */
+	pcap_t *compiler;
+
+	pthread_t thread;
+	/** Protects the connections and dump files against the capture thread. */
+	pthread_mutex_t lock;
+
+	struct fg_pcap_conn *conns[PCAP_HASH_SIZE];
+	unsigned num_conns;
+	unsigned num_stopped;
+	struct pcap_output *outputs;
+	/** Packets dropped by the kernel since the engine started. */
+	unsigned long long kernel_drops;
+
+#ifdef USE_TPACKET_V3
+	/** Packet socket the ring belongs to. */
+	int fd;
+	uint8_t *ring;
+#endif /* USE_TPACKET_V3 */
+
+	struct capture_engine *next;
+};
+
 /* Error message buffer filled by the pcap library in case of an error */
 static char errbuf[PCAP_ERRBUF_SIZE] = "";
 
-/* Barrier to block fg_pcap_go() until worker thread reaches its main loop */
-static pthread_barrier_t pcap_barrier;
-
 /* Pointer to the first element in a list containing all 'pcapable' devices */
 static pcap_if_t *alldevs;
 
-/* Flag if traffic is currently dumped */
-static bool dumping;
+/** Capture engines started so far. They run until the daemon exits. */
+static struct capture_engine *engines;
 
-int fg_pcap_init(void)
+/** Options of the packet capture. */
+static struct fg_pcap_options options = { .core = -1 };
+
+int fg_pcap_init(const struct fg_pcap_options *opts)
 {
+	options = *opts;
+	fg_pcap_writer_init(&options);
+
 	/* initalize *alldevs for later use */
 	if (pcap_findalldevs(&alldevs, errbuf) == -1) {
 		logging(LOG_WARNING,"error in pcap_findalldevs: %s\n", errbuf);
@@ -110,139 +234,687 @@ int fg_pcap_init(void)
 	}
 #endif /* DEBUG*/
 
-	pthread_barrier_init(&pcap_barrier, NULL, 2);
 	return 0;
 }
 
+/** Bucket of the connection with ports @p a and @p b. The hash is symmetric,
+ * so segments of both directions end up in the same bucket. */
+static inline unsigned conn_hash(uint16_t a, uint16_t b)
+{
+	return (ntohs(a) ^ ntohs(b)) & (PCAP_HASH_SIZE - 1);
+}
+
 /**
- * Cleanup method to be called after dumping of the specified flow has finished.
+ * Look up the connection of a captured segment.
  *
- * It closes the handle to the savefile and the handle to the device whose
- * traffic was captured.
+ * @param[in] engine capture engine the segment was captured by
+ * @param[in] family address family of the segment
+ * @param[in] remote address of the remote endpoint of the connection
+ * @param[in] remote_port port of the remote endpoint of the connection
+ * @param[in] local_port port of the local endpoint of the connection
+ * @return the connection, or NULL if the segment belongs to none
+ */
+static struct fg_pcap_conn *find_conn(struct capture_engine *engine,
+				      int family, const uint8_t *remote,
+				      uint16_t remote_port, uint16_t local_port)
+{
+	size_t len = family == AF_INET ? 4 : 16;
+
+	for (struct fg_pcap_conn *conn =
+	     engine->conns[conn_hash(remote_port, local_port)]; conn;
+	     conn = conn->next)
+		if (conn->remote_port == remote_port &&
+		    conn->local_port == local_port && conn->family == family &&
+		    !memcmp(conn->remote, remote, len))
+			return conn;
+	return NULL;
+}
+
+/**
+ * Write the headers of a captured packet to the dump files of its flows.
+ *
+ * The engine lock must be held.
  *
- * @param[in] arg pointer to the flow whose dumping finished
+ * @param[in] engine capture engine the packet was captured by
+ * @param[in] sec seconds of the capture timestamp
+ * @param[in] nsec nanoseconds of the capture timestamp
+ * @param[in] packet the captured packet
+ * @param[in] caplen number of captured bytes
+ * @param[in] wirelen length of the packet on the wire
  */
-void fg_pcap_cleanup(void *arg)
+static void capture_packet(struct capture_engine *engine, uint32_t sec,
+			   uint32_t nsec, const u_char *packet,
+			   unsigned caplen, unsigned wirelen)
 {
-	/* signature of pthread_create() requires that all arguments must be
-	 * passed by reference and cast to (void *) */
-	struct flow *flow = (struct flow *) arg;
+	const u_char *ip = packet + engine->net_offset;
+	struct fg_pcap_conn *received, *sent;
+	const u_char *src, *dst, *tcp;
+	unsigned len, ihl, keep;
+	uint16_t sport, dport;
+	int family;
 
-	if (!dumping)
+	if (caplen <= engine->net_offset)
 		return;
+	len = caplen - engine->net_offset;
 
-	DEBUG_MSG(LOG_DEBUG, "fg_pcap_cleanup() called for flow %d", flow->id);
-	if (flow->pcap_dumper)
-		pcap_dump_close((pcap_dumper_t *)flow->pcap_dumper);
-	flow->pcap_dumper = NULL;
+	switch (ip[0] >> 4) {
+	case 4:
+		ihl = (ip[0] & 0x0f) * 4;
+		if (len < ihl + 4 || ip[9] != IPPROTO_TCP)
+			return;
+		family = AF_INET;
+		src = ip + 12;
+		dst = ip + 16;
+		tcp = ip + ihl;
+		break;
+	case 6:
+		/* The filter passes no extension headers */
+		if (len < 40 + 4 || ip[6] != IPPROTO_TCP)
+			return;
+		family = AF_INET6;
+		src = ip + 8;
+		dst = ip + 24;
+		tcp = ip + 40;
+		break;
+	default:
+		return;
+	}
+	memcpy(&sport, tcp, sizeof(sport));
+	memcpy(&dport, tcp + 2, sizeof(dport));
 
-	if (flow->pcap_handle)
-		pcap_close((pcap_t *)flow->pcap_handle);
-	flow->pcap_handle = NULL;
-	dumping = false;
+	/* Received and sent segment. Both endpoints of a connection between
+	 * flows of this daemon see the same segment, in opposite directions */
+	received = find_conn(engine, family, src, sport, dport);
+	sent = find_conn(engine, family, dst, dport, sport);
+	if (!received && !sent)
+		return;
+
+	/* Headers and the configured part of the payload */
+	keep = tcp - packet + options.payload;
+	if ((unsigned)(tcp - ip) + 13 <= len)
+		keep += (tcp[12] >> 4) * 4;
+	if (caplen > keep)
+		caplen = keep;
+	if (received)
+		fg_pcap_writer_write(received->output->writer, sec, nsec,
+				     packet, caplen, wirelen);
+	if (sent && (!received || sent->output != received->output))
+		fg_pcap_writer_write(sent->output->writer, sec, nsec, packet,
+				     caplen, wirelen);
 }
 
 /**
- * Worker method performing actual packet capturing for the provided flow.
+ * Remove the connections which lingered long enough after their flow stopped
+ * and close the dump files no connection is written to anymore.
  *
- * It prepares the flow for packet capturing by figuring out the correct
- * device, constructing the pcap filter, etc. and finally starts capturing.
- * Synchronizes with fg_pcap_go() after initialization before starting
- * capturing.
+ * The engine lock must be held.
  *
- * @param[in] arg pointer to the flow whose traffic should be captured
+ * @param[in,out] engine capture engine to clean up
  */
-static void* fg_pcap_work(void *arg)
+static void reap_conns(struct capture_engine *engine)
 {
-	/* note: all the wierd casts in this function are completely useless,
-	 * execpt they cirumvent strange compiler warnings because of libpcap
-	 * typedef woo's */
+	struct timespec now;
 
-	/* signature of pthread_create() requires that all arguments must be
-	 * passed by reference and cast to (void *) */
-	struct flow *flow = (struct flow *) arg;
-
-	DEBUG_MSG(LOG_DEBUG, "fg_pcap_thread() called for flow %d", flow->id);
+	if (!engine->num_stopped)
+		return;
 
-	/* make sure all resources are released when finished */
-	pthread_cleanup_push(fg_pcap_cleanup, (void*) flow);
+	gettime(&now);
+	for (unsigned i = 0; i < PCAP_HASH_SIZE; i++) {
+		struct fg_pcap_conn **pconn = &engine->conns[i];
 
-	struct addrinfo *ainf = NULL;
-	int rc = getaddrinfo(flow->settings.bind_address, NULL, NULL, &ainf);
-	if (rc) {
-		logging(LOG_WARNING, "getaddrinfo() failed (%s). Eliding "
-			"packet capture for flow", gai_strerror(rc));
-		goto remove;
-	}
+		while (*pconn) {
+			struct fg_pcap_conn *conn = *pconn;
+			struct pcap_output *output = conn->output;
 
-	/* find appropriate (used for test) interface to dump */
-	bool found = false;
-	pcap_if_t *d = NULL;
-	for (d = alldevs; d; d = d->next) {
-		for (pcap_addr_t *a = d->addresses; a; a = a->next) {
-			if (!a->addr)
+			if (!conn->stopped ||
+			    time_diff(&conn->stop_time, &now) < PCAP_LINGER) {
+				pconn = &conn->next;
 				continue;
-			if (sockaddr_compare(a->addr, ainf->ai_addr)) {
-				DEBUG_MSG(LOG_NOTICE, "pcap: data connection "
-					  "inbound from %s (%s)", d->name,
-					  fg_nameinfo(a->addr,
-						      sizeof(struct sockaddr)));
-				found = true;
-				break;
 			}
+
+			*pconn = conn->next;
+			engine->num_conns--;
+			engine->num_stopped--;
+			free(conn);
+
+			if (--output->refs)
+				continue;
+			for (struct pcap_output **pout = &engine->outputs;
+			     *pout; pout = &(*pout)->next)
+				if (*pout == output) {
+					*pout = output->next;
+					break;
+				}
+			DEBUG_MSG(LOG_DEBUG, "pcap: closing dump file of flow "
+				  "%d on %s", output->id, engine->name);
+			fg_pcap_writer_close(output->writer);
+			free(output);
 		}
-		if (found)
-			break;
 	}
+}
 
-	if (!found) {
-		logging(LOG_WARNING, "failed to determine interface for data "
-			"connection. No pcap support");
-		goto remove;
+/** Update the count of packets the kernel dropped on the interface of
+ * @p engine. */
+static void update_kernel_drops(struct capture_engine *engine);
+
+/**
+ * Housekeeping of the capture thread: account the packets dropped by the
+ * kernel, pass buffered packets of slow flows on to the I/O thread and
+ * remove stopped connections.
+ *
+ * The engine lock must be held.
+ *
+ * @param[in,out] engine capture engine of the capture thread
+ */
+static void maintain_engine(struct capture_engine *engine)
+{
+	update_kernel_drops(engine);
+	for (struct pcap_output *output = engine->outputs; output;
+	     output = output->next)
+		fg_pcap_writer_flush(output->writer);
+	reap_conns(engine);
+}
+
+#ifdef USE_TPACKET_V3
+/**
+ * Process the packets of a block of the capture ring.
+ *
+ * The engine lock must be held.
+ *
+ * @param[in] engine capture engine the ring belongs to
+ * @param[in] desc block handed over by the kernel
+ */
+static void walk_block(struct capture_engine *engine,
+		       struct tpacket_block_desc *desc)
+{
+	struct tpacket3_hdr *tp = (struct tpacket3_hdr *)
+		((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+
+	for (unsigned i = 0; i < desc->hdr.bh1.num_pkts; i++) {
+		const struct sockaddr_ll *sll = (const struct sockaddr_ll *)
+			((uint8_t *)tp + TPACKET_ALIGN(sizeof(*tp)));
+
+		/* On loopback each packet is seen when sent and received */
+		if (sll->sll_pkttype != PACKET_OUTGOING ||
+		    sll->sll_hatype != ARPHRD_LOOPBACK)
+			capture_packet(engine, tp->tp_sec, tp->tp_nsec,
+				       (uint8_t *)tp + tp->tp_net,
+				       tp->tp_snaplen, tp->tp_len);
+		tp = (struct tpacket3_hdr *)((uint8_t *)tp +
+					     tp->tp_next_offset);
 	}
+}
 
-	flow->pcap_handle = (struct pcap_t *)pcap_open_live(
-				d->name, PCAP_SNAPLEN, PCAP_PROMISC,
-				0, errbuf); /* 0 = no read timeout */
+/**
+ * Capture thread of an interface, working through the blocks of the
+ * capture ring as the kernel hands them over.
+ *
+ * @param[in] arg capture engine of the interface
+ */
+static void *capture_work(void *arg)
+{
+	struct capture_engine *engine = (struct capture_engine *)arg;
+	struct pollfd pfd = { .fd = engine->fd, .events = POLLIN | POLLERR };
+	unsigned block = 0;
 
-	if (!flow->pcap_handle) {
-		logging(LOG_WARNING, "failed to init pcap on device %s: %s",
-			d->name, errbuf);
-		goto remove;
+	for (;;) {
+		struct tpacket_block_desc *desc = (struct tpacket_block_desc *)
+			(engine->ring + (size_t)block * PCAP_BLOCK_SIZE);
+
+		if (!(__atomic_load_n(&desc->hdr.bh1.block_status,
+				      __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			poll(&pfd, 1, PCAP_POLL_TIMEOUT);
+			pthread_mutex_lock(&engine->lock);
+			maintain_engine(engine);
+			pthread_mutex_unlock(&engine->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&engine->lock);
+		walk_block(engine, desc);
+		maintain_engine(engine);
+		pthread_mutex_unlock(&engine->lock);
+
+		/* Return the block to the kernel */
+		__atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		block = (block + 1) % PCAP_BLOCK_NR;
+	}
+
+	return NULL;
+}
+
+/**
+ * Open the packet socket of @p engine and map its capture ring.
+ *
+ * The socket captures the packets without link layer header, so the engine
+ * works alike on all interfaces, including "any".
+ *
+ * @param[in,out] engine capture engine to open
+ * @return 0 on success, or -1 on failure
+ */
+static int open_engine(struct capture_engine *engine)
+{
+	/* Pass nothing until the filter of the dumped connections is set */
+	struct sock_filter drop = { BPF_RET | BPF_K, 0, 0, 0 };
+	struct sock_fprog prog = { .len = 1, .filter = &drop };
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	int version = TPACKET_V3;
+
+	engine->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+	if (engine->fd == -1) {
+		logging(LOG_WARNING, "pcap: failed to open packet socket: %s",
+			strerror(errno));
+		return -1;
+	}
+	if (setsockopt(engine->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) == -1 ||
+	    setsockopt(engine->fd, SOL_PACKET, PACKET_VERSION, &version,
+		       sizeof(version)) == -1) {
+		logging(LOG_WARNING, "pcap: failed to set up packet socket: %s",
+			strerror(errno));
+		goto close;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PCAP_BLOCK_SIZE;
+	req.tp_block_nr = PCAP_BLOCK_NR;
+	req.tp_frame_size = PCAP_FRAME_SIZE;
+	req.tp_frame_nr = PCAP_BLOCK_SIZE / PCAP_FRAME_SIZE * PCAP_BLOCK_NR;
+	req.tp_retire_blk_tov = PCAP_BLOCK_TIMEOUT;
+	if (setsockopt(engine->fd, SOL_PACKET, PACKET_RX_RING, &req,
+		       sizeof(req)) == -1) {
+		logging(LOG_WARNING, "pcap: failed to set up capture ring: %s",
+			strerror(errno));
+		goto close;
+	}
+	engine->ring = mmap(NULL, (size_t)PCAP_BLOCK_SIZE * PCAP_BLOCK_NR,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, engine->fd, 0);
+	if (engine->ring == MAP_FAILED) {
+		logging(LOG_WARNING, "pcap: failed to map capture ring: %s",
+			strerror(errno));
+		goto close;
+	}
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_ALL);
+	if (strcmp(engine->name, "any"))
+		ll.sll_ifindex = if_nametoindex(engine->name);
+	if (bind(engine->fd, (struct sockaddr *)&ll, sizeof(ll)) == -1) {
+		logging(LOG_WARNING, "pcap: failed to bind packet socket to "
+			"%s: %s", engine->name, strerror(errno));
+		munmap(engine->ring, (size_t)PCAP_BLOCK_SIZE * PCAP_BLOCK_NR);
+		goto close;
+	}
+
+	/* The filter truncates the packets to the snap length */
+	engine->linktype = DLT_RAW;
+	engine->file_linktype = LINKTYPE_RAW;
+	engine->net_offset = 0;
+	engine->snaplen = PCAP_HEADER_MAX + options.payload;
+	engine->compiler = pcap_open_dead(engine->linktype, engine->snaplen);
+	if (!engine->compiler) {
+		munmap(engine->ring, (size_t)PCAP_BLOCK_SIZE * PCAP_BLOCK_NR);
+		goto close;
+	}
+	return 0;
+
+close:
+	close(engine->fd);
+	return -1;
+}
+
+/**
+ * Release the packet socket and capture ring of the opened @p engine.
+ *
+ * @param[in,out] engine capture engine to close
+ */
+static void close_engine(struct capture_engine *engine)
+{
+	pcap_close(engine->compiler);
+	munmap(engine->ring, (size_t)PCAP_BLOCK_SIZE * PCAP_BLOCK_NR);
+	close(engine->fd);
+}
+
+static void update_kernel_drops(struct capture_engine *engine)
+{
+	struct tpacket_stats_v3 stats;
+	socklen_t len = sizeof(stats);
+
+	/* the kernel resets the counters when reading them */
+	if (getsockopt(engine->fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+		       &len) == 0)
+		engine->kernel_drops += stats.tp_drops;
+}
+
+/**
+ * Set the compiled capture filter @p program on @p engine.
+ *
+ * @param[in] engine capture engine to set the filter on
+ * @param[in] program compiled capture filter
+ * @return 0 on success, or -1 on failure
+ */
+static int set_filter(struct capture_engine *engine,
+		      struct bpf_program *program)
+{
+	/* struct bpf_insn and struct sock_filter share their layout */
+	struct sock_fprog prog = {
+		.len = program->bf_len,
+		.filter = (struct sock_filter *)program->bf_insns,
+	};
+
+	if (setsockopt(engine->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) == -1) {
+		logging(LOG_WARNING, "pcap: failed to set filter on %s: %s",
+			engine->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+#else /* USE_TPACKET_V3 */
+/**
+ * Callback of pcap_dispatch() passing a captured packet on to
+ * capture_packet().
+ *
+ * @param[in] user capture engine the packet was captured by
+ * @param[in] hdr capture header of the packet
+ * @param[in] packet the captured packet
+ */
+static void dispatch_packet(u_char *user, const struct pcap_pkthdr *hdr,
+			    const u_char *packet)
+{
+	capture_packet((struct capture_engine *)user, hdr->ts.tv_sec,
+		       hdr->ts.tv_usec * 1000, packet, hdr->caplen, hdr->len);
+}
+
+/**
+ * Capture thread of an interface, dispatching the packets libpcap captures.
+ *
+ * @param[in] arg capture engine of the interface
+ */
+static void *capture_work(void *arg)
+{
+	struct capture_engine *engine = (struct capture_engine *)arg;
+	struct pollfd pfd = {
+		.fd = pcap_get_selectable_fd(engine->compiler),
+		.events = POLLIN,
+	};
+
+	for (;;) {
+		poll(&pfd, 1, PCAP_POLL_TIMEOUT);
+
+		pthread_mutex_lock(&engine->lock);
+		if (pcap_dispatch(engine->compiler, -1, dispatch_packet,
+				  (u_char *)engine) < 0)
+			logging(LOG_WARNING, "pcap_dispatch() failed on %s: %s",
+				engine->name, pcap_geterr(engine->compiler));
+		maintain_engine(engine);
+		pthread_mutex_unlock(&engine->lock);
 	}
 
-	uint32_t net = 0, mask = 0;
-	if (pcap_lookupnet(d->name, &net, &mask, errbuf) < 0) {
-		logging(LOG_WARNING, "pcap: netmask lookup failed: %s", errbuf);
-		goto remove;
+	return NULL;
+}
+
+/**
+ * Open the libpcap handle of @p engine.
+ *
+ * @param[in,out] engine capture engine to open
+ * @return 0 on success, or -1 on failure
+ */
+static int open_engine(struct capture_engine *engine)
+{
+	engine->snaplen = PCAP_LINK_HEADER_MAX + PCAP_HEADER_MAX +
+			  options.payload;
+	engine->compiler = pcap_open_live(engine->name, engine->snaplen,
+					  PCAP_PROMISC, PCAP_POLL_TIMEOUT,
+					  errbuf);
+	if (!engine->compiler) {
+		logging(LOG_WARNING, "failed to init pcap on device %s: %s",
+			engine->name, errbuf);
+		return -1;
 	}
 
 	/* we rely on a non-blocking dispatch loop */
-	if (pcap_setnonblock((pcap_t *)flow->pcap_handle, 1, errbuf) < 0) {
+	if (pcap_setnonblock(engine->compiler, 1, errbuf) < 0) {
 		logging(LOG_WARNING, "pcap: failed to set non-blocking: %s",
 			errbuf);
-		goto remove;
+		goto close;
 	}
 
-	/* compile filter */
-	struct bpf_program pcap_program;
-	if (pcap_compile((pcap_t *)flow->pcap_handle,
-			 &pcap_program, PCAP_FILTER, 1, mask) < 0) {
-		logging(LOG_WARNING, "pcap: failed compiling filter '%s': %s",
-			PCAP_FILTER, pcap_geterr((pcap_t *)flow->pcap_handle));
-		goto remove;
+	engine->linktype = pcap_datalink(engine->compiler);
+	switch (engine->linktype) {
+	case DLT_EN10MB:
+		engine->file_linktype = LINKTYPE_ETHERNET;
+		engine->net_offset = 14;
+		break;
+	case DLT_NULL:
+		engine->file_linktype = LINKTYPE_NULL;
+		engine->net_offset = 4;
+		break;
+	case DLT_LOOP:
+		engine->file_linktype = LINKTYPE_LOOP;
+		engine->net_offset = 4;
+		break;
+	case DLT_RAW:
+		engine->file_linktype = LINKTYPE_RAW;
+		engine->net_offset = 0;
+		break;
+	default:
+		logging(LOG_WARNING, "pcap: unsupported link type %d on %s",
+			engine->linktype, engine->name);
+		goto close;
 	}
+	return 0;
+
+close:
+	pcap_close(engine->compiler);
+	return -1;
+}
+
+/**
+ * Release the libpcap handle of the opened @p engine.
+ *
+ * @param[in,out] engine capture engine to close
+ */
+static void close_engine(struct capture_engine *engine)
+{
+	pcap_close(engine->compiler);
+}
 
-	/* attach filter to interface */
-	if (pcap_setfilter((pcap_t *)flow->pcap_handle,
-			   &pcap_program) < 0) {
+static void update_kernel_drops(struct capture_engine *engine)
+{
+	struct pcap_stat stats;
+
+	if (pcap_stats(engine->compiler, &stats) == 0)
+		engine->kernel_drops = stats.ps_drop;
+}
+
+/**
+ * Set the compiled capture filter @p program on @p engine.
+ *
+ * @param[in] engine capture engine to set the filter on
+ * @param[in] program compiled capture filter
+ * @return 0 on success, or -1 on failure
+ */
+static int set_filter(struct capture_engine *engine,
+		      struct bpf_program *program)
+{
+	int rc;
+
+	pthread_mutex_lock(&engine->lock);
+	rc = pcap_setfilter(engine->compiler, program);
+	pthread_mutex_unlock(&engine->lock);
+	if (rc < 0) {
 		logging(LOG_WARNING, "pcap: failed to set filter: %s",
-			pcap_geterr((pcap_t *)flow->pcap_handle));
-		goto remove;
+			pcap_geterr(engine->compiler));
+		return -1;
 	}
+	return 0;
+}
+#endif /* USE_TPACKET_V3 */
+
+/**
+ * Generate the capture filter of @p engine from the connections of the
+ * dumped flows and set it.
+ *
+ * Lingering connections remain in the filter to capture their teardown.
+ * Connections removed later on remain in the filter until it is updated
+ * the next time, their segments are dropped by the capture thread.
+ *
+ * @param[in] engine capture engine whose filter to update
+ */
+static void update_filter(struct capture_engine *engine)
+{
+	struct bpf_program program;
+	char *filter = NULL;
 
-	/* generate a nice filename */
+	pthread_mutex_lock(&engine->lock);
+	if (engine->num_conns > PCAP_FILTER_MAX_CONNS) {
+		asprintf_append(&filter, "tcp");
+	} else {
+		for (unsigned i = 0; i < PCAP_HASH_SIZE; i++) {
+			for (struct fg_pcap_conn *conn = engine->conns[i];
+			     conn; conn = conn->next) {
+				char host[INET6_ADDRSTRLEN] = "";
+				unsigned rport = ntohs(conn->remote_port);
+				unsigned lport = ntohs(conn->local_port);
+
+				inet_ntop(conn->family, conn->remote, host,
+					  sizeof(host));
+				asprintf_append(&filter, "%s(src host %s and "
+						"src port %u and dst port %u) "
+						"or (dst host %s and dst port "
+						"%u and src port %u)",
+						filter ? " or " : "tcp and (",
+						host, rport, lport, host, rport,
+						lport);
+			}
+		}
+		asprintf_append(&filter, ")");
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	DEBUG_MSG(LOG_DEBUG, "pcap: filter on %s is '%s'", engine->name,
+		  filter);
+
+	if (pcap_compile(engine->compiler, &program, filter, 1,
+			 PCAP_NETMASK_UNKNOWN) < 0) {
+		logging(LOG_WARNING, "pcap: failed compiling filter '%s': %s",
+			filter, pcap_geterr(engine->compiler));
+		free(filter);
+		return;
+	}
+	set_filter(engine, &program);
+	pcap_freecode(&program);
+	free(filter);
+}
+
+/**
+ * Get the capture engine of the interface @p name, starting it if needed.
+ *
+ * @param[in] name name of the interface
+ * @return capture engine, or NULL if capturing on the interface failed
+ */
+static struct capture_engine *get_engine(const char *name)
+{
+	struct capture_engine *engine;
+	int rc;
+
+	for (engine = engines; engine; engine = engine->next)
+		if (!strcmp(engine->name, name))
+			return engine;
+
+	engine = calloc(1, sizeof(*engine));
+	if (!engine) {
+		logging(LOG_ALERT, "could not allocate memory for capture "
+			"engine");
+		return NULL;
+	}
+	engine->name = strdup(name);
+	pthread_mutex_init(&engine->lock, NULL);
+
+	if (open_engine(engine) == -1)
+		goto free;
+
+	rc = pthread_create(&engine->thread, NULL, capture_work, engine);
+	if (rc) {
+		logging(LOG_WARNING, "could not start pcap thread: %s",
+			strerror(rc));
+		close_engine(engine);
+		goto free;
+	}
+	if (options.core >= 0 &&
+	    pthread_setaffinity(engine->thread, options.core) == -1)
+		logging(LOG_WARNING, "failed to bind pcap thread to CPU %d",
+			options.core);
+
+	logging(LOG_NOTICE, "pcap: capturing dumped flows on %s", name);
+	engine->next = engines;
+	engines = engine;
+	return engine;
+
+free:
+	pthread_mutex_destroy(&engine->lock);
+	free(engine->name);
+	free(engine);
+	return NULL;
+}
+
+/**
+ * Find the interface with the local address @p addr of a test connection.
+ *
+ * @param[in] addr local address of the test connection
+ * @return name of the interface, or NULL if no interface has the address
+ */
+static const char *find_device(const struct sockaddr *addr)
+{
+	for (pcap_if_t *d = alldevs; d; d = d->next) {
+		for (pcap_addr_t *a = d->addresses; a; a = a->next) {
+			if (!a->addr)
+				continue;
+			if (sockaddr_compare(a->addr, addr)) {
+				DEBUG_MSG(LOG_NOTICE, "pcap: data connection "
+					  "inbound from %s (%s)", d->name,
+					  fg_nameinfo(a->addr,
+						      sizeof(struct sockaddr)));
+				return d->name;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Get the dump file of @p flow on @p engine, creating it if needed.
+ *
+ * The engine lock must be held.
+ *
+ * @param[in,out] engine capture engine of the interface
+ * @param[in] flow flow to dump
+ * @return dump file, or NULL on failure
+ */
+static struct pcap_output *get_output(struct capture_engine *engine,
+				      const struct flow *flow)
+{
+	struct pcap_output *output;
 	char *dump_filename = NULL;
+	char timestamp[30] = "";
+	char hostname[128] = "";
+
+	for (output = engine->outputs; output; output = output->next)
+		if (output->id == flow->id &&
+		    output->endpoint == flow->endpoint)
+			return output;
+
+	output = calloc(1, sizeof(*output));
+	if (!output) {
+		logging(LOG_ALERT, "could not allocate memory for dump file");
+		return NULL;
+	}
+	output->id = flow->id;
+	output->endpoint = flow->endpoint;
 
 	/* dir and prefix */
 	if (dump_dir)
@@ -250,89 +922,204 @@ static void* fg_pcap_work(void *arg)
 	if (dump_prefix)
 		asprintf_append(&dump_filename, "%s", dump_prefix);
 
-	/* timestamp - we need to use the thread-safe version ctimenow_r() */
-	char timestamp[30] = "";
 	ctimenow_r(timestamp, sizeof(timestamp), false);
 	asprintf_append(&dump_filename, "%s", timestamp);
-
-	/* hostname */
-	char hostname[128] = "";
 	if (!gethostname(hostname, sizeof(hostname)))
 		asprintf_append(&dump_filename, "-%s", hostname);
 
-	/* interface and suffix */
-	asprintf_append(&dump_filename, "-%s.pcap", d->name);
-
-	DEBUG_MSG(LOG_NOTICE, "dumping to \"%s\"", dump_filename);
+	/* interface and flow, the writer adds the suffix */
+	asprintf_append(&dump_filename, "-%s-%d-%c", engine->name, flow->id,
+			flow->endpoint == SOURCE ? 's' : 'd');
 
-	flow->pcap_dumper = (struct pcap_dumper_t *)pcap_dump_open(
-				(pcap_t *)flow->pcap_handle, dump_filename);
+	output->writer = fg_pcap_writer_open(dump_filename,
+					     engine->file_linktype,
+					     engine->snaplen);
 	free(dump_filename);
-
-	if (!flow->pcap_dumper) {
-		logging(LOG_WARNING, "pcap: failed to open dump file writing: %s",
-			pcap_geterr((pcap_t *)flow->pcap_handle));
-		goto remove;
+	if (!output->writer) {
+		free(output);
+		return NULL;
 	}
 
-	/* barrier: dump is ready */
-	pthread_barrier_wait(&pcap_barrier);
+	output->next = engine->outputs;
+	engine->outputs = output;
+	return output;
+}
 
-	for (;;) {
-		int rc = pcap_dispatch((pcap_t *)flow->pcap_handle, -1,
-				       &pcap_dump, (u_char *)flow->pcap_dumper);
-
-		if (rc < 0) {
-			logging(LOG_WARNING, "pcap_dispatch() failed. Packet "
-				"dumping stopped for flow %d", flow->id);
-			/* cleanup automatically called */
-			pthread_exit(0);
+/**
+ * Store the address @p addr and port of the remote endpoint of @p conn.
+ *
+ * @param[out] conn connection to set the remote endpoint of
+ * @param[in] addr address of the remote endpoint
+ */
+static void set_remote(struct fg_pcap_conn *conn, const struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sin =
+			(const struct sockaddr_in *)addr;
+
+		conn->family = AF_INET;
+		memcpy(conn->remote, &sin->sin_addr, 4);
+		conn->remote_port = sin->sin_port;
+	} else {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)addr;
+
+		/* IPv4 connections of IPv6 sockets */
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			conn->family = AF_INET;
+			memcpy(conn->remote, &sin6->sin6_addr.s6_addr[12], 4);
+		} else {
+			conn->family = AF_INET6;
+			memcpy(conn->remote, &sin6->sin6_addr, 16);
 		}
-#ifdef DEBUG
-		struct pcap_stat p_stats;
-		pcap_stats((pcap_t *)flow->pcap_handle, &p_stats);
-#endif /* DEBUG */
-		DEBUG_MSG(LOG_NOTICE, "pcap: finished dumping %d packets for "
-			  "flow %d", rc, flow->id);
-		DEBUG_MSG(LOG_NOTICE, "pcap: %d packets received by filter for "
-			  "flow %d", p_stats.ps_recv, flow->id);
-		DEBUG_MSG(LOG_NOTICE, "pcap: %d packets dropped by kernel for "
-			  "flow %d", p_stats.ps_drop, flow->id);
-		if (rc == 0)
-			/* if no packets are received try if we should cancel */
-			pthread_testcancel();
+		conn->remote_port = sin6->sin6_port;
 	}
+}
 
-remove: ;
-
-	pthread_cleanup_pop(1);
+/** Port of the socket address @p addr, in network byte order. */
+static uint16_t sockaddr_port(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return ((const struct sockaddr_in *)addr)->sin_port;
+	return ((const struct sockaddr_in6 *)addr)->sin6_port;
+}
 
-	pthread_barrier_wait(&pcap_barrier);
-	return 0;
+/** Whether the socket address @p addr is the wildcard address. */
+static bool sockaddr_is_any(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return ((const struct sockaddr_in *)addr)->sin_addr.s_addr ==
+			htonl(INADDR_ANY);
+	return IN6_IS_ADDR_UNSPECIFIED(
+		&((const struct sockaddr_in6 *)addr)->sin6_addr);
 }
 
 void fg_pcap_go(struct flow *flow)
 {
+	struct sockaddr_storage local, remote;
+	socklen_t local_len = sizeof(local), remote_len = sizeof(remote);
+	struct capture_engine *engine;
+	struct fg_pcap_conn *conn;
+	const char *device = NULL;
+	unsigned hash;
+
 	if (!flow->settings.traffic_dump)
 		return;
 
-	if (dumping) {
-		logging(LOG_WARNING, "pcap: dumping already in progress on "
-			"this host");
+	DEBUG_MSG(LOG_DEBUG, "called fg_pcap_go() for flow %d", flow->id);
+
+	/* reconnect of a source flow */
+	fg_pcap_stop(flow);
+
+	if (flow->endpoint == SOURCE) {
+		memcpy(&remote, flow->addr, flow->addr_len);
+	} else if (getpeername(flow->fd, (struct sockaddr *)&remote,
+			       &remote_len) == -1) {
+		logging(LOG_WARNING, "getpeername() failed (%s). Eliding "
+			"packet capture for flow %d", strerror(errno),
+			flow->id);
 		return;
 	}
 
-	DEBUG_MSG(LOG_DEBUG, "called fg_pcap_go() for flow %d", flow->id);
-	dumping = true;
+	if (getsockname(flow->fd, (struct sockaddr *)&local,
+			&local_len) == -1) {
+		logging(LOG_WARNING, "getsockname() failed (%s). Eliding "
+			"packet capture for flow %d", strerror(errno),
+			flow->id);
+		return;
+	}
+	/* Without a port the filter would miss the SYN, so take an ephemeral
+	 * port now rather than at connect() */
+	if (!sockaddr_port(&local)) {
+		memset(&local, 0, sizeof(local));
+		local.ss_family = remote.ss_family;
+		local_len = remote.ss_family == AF_INET ?
+			sizeof(struct sockaddr_in) :
+			sizeof(struct sockaddr_in6);
+		if (bind(flow->fd, (struct sockaddr *)&local,
+			 local_len) == -1 ||
+		    getsockname(flow->fd, (struct sockaddr *)&local,
+				&local_len) == -1) {
+			logging(LOG_WARNING, "failed to bind test socket "
+				"(%s). Eliding packet capture for flow %d",
+				strerror(errno), flow->id);
+			return;
+		}
+	}
 
-	int rc = pthread_create(&flow->pcap_thread, NULL, fg_pcap_work,
-				(void*)flow);
+	/* a wildcard address would match any interface */
+	if (!sockaddr_is_any(&local))
+		device = find_device((struct sockaddr *)&local);
+	if (!device) {
+#ifdef USE_TPACKET_V3
+		device = "any";
+#else /* USE_TPACKET_V3 */
+		logging(LOG_WARNING, "failed to determine interface for data "
+			"connection. No pcap support");
+		return;
+#endif /* USE_TPACKET_V3 */
+	}
+	engine = get_engine(device);
+	if (!engine)
+		return;
 
-	/* barrier: dump thread is ready (or aborted) */
-	pthread_barrier_wait(&pcap_barrier);
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		logging(LOG_ALERT, "could not allocate memory for dumped "
+			"connection");
+		return;
+	}
+	set_remote(conn, (struct sockaddr *)&remote);
+	conn->local_port = sockaddr_port(&local);
+	conn->engine = engine;
 
-	if (rc)
-		logging(LOG_WARNING, "could not start pcap thread: %s",
-			strerror(rc) );
+	pthread_mutex_lock(&engine->lock);
+	conn->output = get_output(engine, flow);
+	if (!conn->output) {
+		pthread_mutex_unlock(&engine->lock);
+		free(conn);
+		return;
+	}
+	conn->output->refs++;
+	conn->kernel_drops = engine->kernel_drops;
+	hash = conn_hash(conn->remote_port, conn->local_port);
+	conn->next = engine->conns[hash];
+	engine->conns[hash] = conn;
+	engine->num_conns++;
+	pthread_mutex_unlock(&engine->lock);
+
+	update_filter(engine);
+	flow->pcap_conn = conn;
 }
 
+void fg_pcap_stop(struct flow *flow)
+{
+	struct fg_pcap_conn *conn = flow->pcap_conn;
+
+	if (!conn)
+		return;
+
+	/* the capture thread removes the connection after lingering */
+	pthread_mutex_lock(&conn->engine->lock);
+	conn->stopped = true;
+	gettime(&conn->stop_time);
+	conn->engine->num_stopped++;
+	pthread_mutex_unlock(&conn->engine->lock);
+	flow->pcap_conn = NULL;
+}
+
+void fg_pcap_drops(const struct flow *flow, unsigned *kernel_drops,
+		   unsigned *writer_drops)
+{
+	struct fg_pcap_conn *conn = flow->pcap_conn;
+
+	*kernel_drops = 0;
+	*writer_drops = 0;
+	if (!conn)
+		return;
+
+	pthread_mutex_lock(&conn->engine->lock);
+	*kernel_drops = conn->engine->kernel_drops - conn->kernel_drops;
+	*writer_drops = fg_pcap_writer_drops(conn->output->writer);
+	pthread_mutex_unlock(&conn->engine->lock);
+}
@@ -34,6 +34,30 @@
 
 #include "daemon.h"
 
+/** Compression of the dump files. */
+enum fg_pcap_compression {
+	/** Plain pcap files. */
+	PCAP_COMPRESS_NONE = 0,
+	/** Gzip compressed pcap files (.pcap.gz). */
+	PCAP_COMPRESS_GZIP,
+	/** Zstandard compressed pcap files (.pcap.zst). */
+	PCAP_COMPRESS_ZSTD,
+};
+
+/** Options of the packet capture, given on the command line of the daemon. */
+struct fg_pcap_options {
+	/** CPU core to bind the capture threads to, -1 to not bind them. */
+	int core;
+	/** Bytes of payload kept beyond the TCP header of each segment. */
+	unsigned payload;
+	/** Compression of the dump files. */
+	enum fg_pcap_compression compression;
+	/** Size in bytes after which a dump file is rotated, 0 for no limit. */
+	unsigned long long rotate_size;
+	/** Age in seconds after which a dump file is rotated, 0 for no limit. */
+	double rotate_time;
+};
+
 /**
  * Initialize flowgrind's pcap library.
  *
@@ -41,20 +65,50 @@
  * depend.  It is therefore crucial to call it before any call to other methods
  * of this library.
  *
+ * @param[in] options options of the packet capture
  * @return return 0 for success, or -1 for failure
  */
-int fg_pcap_init(void);
+int fg_pcap_init(const struct fg_pcap_options *options);
 
 /**
- * Start a tcpdump to capture traffic of the provided flow.
+ * Start capturing the traffic of the test connection of the provided flow.
+ *
+ * The connection is added to the capture engine of its interface, which is
+ * started with the first dumped connection. A single engine per interface
+ * captures the connections of all dumped flows and writes them into one dump
+ * file per flow. A source flow has to call this before connect() to capture
+ * the SYN, the function binds the test socket to an ephemeral port if it is
+ * unbound.
  *
- * If the flow was not configured for tcp dumping or dumping is already in
- * progress the method will do nothing and return immediately. Otherwise the
- * method blocks until the actual capturing starts. In case an error occurs a
- * log message is created.
+ * If the flow was not configured for tcp dumping the method will do nothing.
+ * In case an error occurs a log message is created and the flow runs
+ * without being captured.
  *
- * @param[in] flow the flow whose traffic should be captured
+ * @param[in,out] flow the flow whose traffic should be captured
  */
 void fg_pcap_go(struct flow *flow);
 
+/**
+ * Stop capturing the traffic of the test connection of the provided flow.
+ *
+ * The connection is still captured for a moment to catch its teardown.
+ * Afterwards, the dump file of the flow is closed once no other connection of
+ * the flow is captured anymore.
+ *
+ * @param[in,out] flow the flow to stop capturing, may be uncaptured
+ */
+void fg_pcap_stop(struct flow *flow);
+
+/**
+ * Get the number of packets missing in the dump of the provided flow.
+ *
+ * @param[in] flow the flow whose dump to check
+ * @param[out] kernel_drops packets the kernel dropped on the interface of the
+ * flow since its capture started, as the capture ring was full
+ * @param[out] writer_drops packets of the flow dropped as the dump file could
+ * not be written fast enough, or at all
+ */
+void fg_pcap_drops(const struct flow *flow, unsigned *kernel_drops,
+		   unsigned *writer_drops);
+
 #endif /* _FG_PCAP_H_ */
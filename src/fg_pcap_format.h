@@ -0,0 +1,71 @@
+/**
+ * @file fg_pcap_format.h
+ * @brief Format of the dump files of the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_PCAP_FORMAT_H_
+#define _FG_PCAP_FORMAT_H_
+
+/* Shared by the daemon and flowgrind-pcap, so it must not depend on libpcap */
+
+#include <stdint.h>
+
+/** Magic number of pcap files with timestamps in microseconds. */
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+
+/** Magic number of pcap files with timestamps in nanoseconds, as written by
+ * the daemon. */
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+/** Link types of pcap files, which differ from the DLT_ values of libpcap
+ * on some systems. */
+enum pcap_linktype {
+	/** BSD loopback, 4 byte address family in host byte order. */
+	LINKTYPE_NULL = 0,
+	/** Ethernet. */
+	LINKTYPE_ETHERNET = 1,
+	/** Raw IPv4 or IPv6, without link layer header. */
+	LINKTYPE_RAW = 101,
+	/** OpenBSD loopback, 4 byte address family in network byte order. */
+	LINKTYPE_LOOP = 108,
+};
+
+/** Header of a pcap file. */
+struct pcap_file_header_ns {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+/** Header of a packet within a pcap file. */
+struct pcap_record_header_ns {
+	uint32_t ts_sec;
+	/** Nanoseconds, or microseconds with magic number #PCAP_MAGIC_USEC. */
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+#endif /* _FG_PCAP_FORMAT_H_ */
@@ -0,0 +1,637 @@
+/**
+ * @file fg_pcap_writer.c
+ * @brief Asynchronous writer of the dump files of the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif /* HAVE_LIBZ */
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif /* HAVE_LIBZSTD */
+
+#include "debug.h"
+#include "fg_definitions.h"
+#include "fg_error.h"
+#include "fg_log.h"
+#include "fg_string.h"
+#include "fg_time.h"
+#include "fg_pcap_writer.h"
+
+/** Size of the chunks packets are buffered in. Every dumped flow holds a
+ * chunk for up to #WRITER_FLUSH_INTERVAL, so they are kept small. */
+#define WRITER_CHUNK_SIZE (1 << 16)
+
+/** Alignment of the chunks, the page size of common systems. */
+#define WRITER_CHUNK_ALIGN 4096
+
+/** Maximum number of chunks, bounding the memory used if the disk can not
+ * keep up to 256 MiB. Packets beyond are dropped rather than stalling the
+ * capture thread, which would let the kernel drop packets of all flows. */
+#define WRITER_MAX_CHUNKS 4096
+
+/** Bytes the I/O thread gathers from the queued chunks of a writer and
+ * writes at once. */
+#define WRITER_BATCH_SIZE (1 << 20)
+
+/** Time after which a partially filled chunk is handed over to the I/O
+ * thread, in seconds. */
+#define WRITER_FLUSH_INTERVAL 1.0
+
+/** Chunk of buffered packets, queued for the I/O thread. */
+struct writer_chunk {
+	/** Writer the packets belong to. */
+	struct fg_pcap_writer *writer;
+	/** Buffered pcap records, NULL if the chunk only closes the writer. */
+	unsigned char *data;
+	size_t len;
+	/** Number of buffered packets. */
+	unsigned packets;
+	/** Flag if the writer is closed after writing the chunk. */
+	bool close;
+
+	struct writer_chunk *next;
+};
+
+struct fg_pcap_writer {
+	char *basename;
+	unsigned linktype;
+	unsigned snaplen;
+
+	/* Used by the capture thread */
+	/** Chunk currently filled, NULL if none. */
+	struct writer_chunk *chunk;
+	/** Time the current chunk was started. */
+	struct timespec chunk_time;
+	/** Packets dropped, updated by both threads. */
+	unsigned drops;
+
+	/* Used by the I/O thread */
+	/** Current dump file, -1 if the writer failed. */
+	int fd;
+	/** Index of the current file if files are rotated. */
+	unsigned file_index;
+	/** Bytes written to the current file, 0 before its header. */
+	unsigned long long file_bytes;
+	/** Time the current file was started. */
+	struct timespec file_time;
+#ifdef HAVE_LIBZ
+	z_stream zstream;
+#endif /* HAVE_LIBZ */
+#ifdef HAVE_LIBZSTD
+	ZSTD_CCtx *zctx;
+#endif /* HAVE_LIBZSTD */
+};
+
+/** Options of the packet capture. */
+static struct fg_pcap_options options;
+
+/** Protects the queue and the free chunks. */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signals chunks queued for the I/O thread. */
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+/** Chunks waiting for the I/O thread, in order. */
+static struct writer_chunk *queue_head, *queue_tail;
+
+/** Chunks not in use. */
+static struct writer_chunk *free_chunks;
+
+/** Number of chunks allocated. */
+static unsigned num_chunks;
+
+static pthread_t writer_thread;
+static bool writer_started;
+
+/** Chunks of one writer gathered for a single write, used by the I/O
+ * thread only. */
+static unsigned char batch_buf[WRITER_BATCH_SIZE];
+
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+/** Output buffer of the compressors, used by the I/O thread only. */
+static unsigned char compress_buf[WRITER_BATCH_SIZE];
+#endif /* HAVE_LIBZ || HAVE_LIBZSTD */
+
+void fg_pcap_writer_init(const struct fg_pcap_options *opts)
+{
+	options = *opts;
+#ifndef HAVE_LIBZ
+	if (options.compression == PCAP_COMPRESS_GZIP) {
+		logging(LOG_WARNING, "pcap: no gzip support, dump files are "
+			"not compressed");
+		options.compression = PCAP_COMPRESS_NONE;
+	}
+#endif /* HAVE_LIBZ */
+#ifndef HAVE_LIBZSTD
+	if (options.compression == PCAP_COMPRESS_ZSTD) {
+		logging(LOG_WARNING, "pcap: no zstd support, dump files are "
+			"not compressed");
+		options.compression = PCAP_COMPRESS_NONE;
+	}
+#endif /* HAVE_LIBZSTD */
+}
+
+/**
+ * Write @p len bytes at @p buf to the current file of @p writer.
+ *
+ * @return 0 on success, or -1 on failure
+ */
+static int write_all(struct fg_pcap_writer *writer, const unsigned char *buf,
+		     size_t len)
+{
+	while (len) {
+		ssize_t rc = write(writer->fd, buf, len);
+
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			logging(LOG_WARNING, "pcap: failed to write dump file "
+				"%s: %s", writer->basename, strerror(errno));
+			return -1;
+		}
+		buf += rc;
+		len -= rc;
+		writer->file_bytes += rc;
+	}
+	return 0;
+}
+
+/**
+ * Write @p len bytes at @p buf to the current file of @p writer, compressed
+ * if configured. With @p finish the compressed stream is terminated.
+ *
+ * @return 0 on success, or -1 on failure
+ */
+static int write_output(struct fg_pcap_writer *writer,
+			const unsigned char *buf, size_t len, bool finish)
+{
+	switch (options.compression) {
+#ifdef HAVE_LIBZ
+	case PCAP_COMPRESS_GZIP:
+		writer->zstream.next_in = (Bytef *)buf;
+		writer->zstream.avail_in = len;
+		do {
+			writer->zstream.next_out = compress_buf;
+			writer->zstream.avail_out = sizeof(compress_buf);
+			if (deflate(&writer->zstream, finish ? Z_FINISH :
+				    Z_NO_FLUSH) == Z_STREAM_ERROR)
+				return -1;
+			if (write_all(writer, compress_buf, sizeof(compress_buf) -
+				      writer->zstream.avail_out) == -1)
+				return -1;
+		} while (!writer->zstream.avail_out);
+		return 0;
+#endif /* HAVE_LIBZ */
+#ifdef HAVE_LIBZSTD
+	case PCAP_COMPRESS_ZSTD: {
+		ZSTD_inBuffer in = { buf, len, 0 };
+		size_t remaining;
+
+		do {
+			ZSTD_outBuffer out = { compress_buf,
+					       sizeof(compress_buf), 0 };
+
+			remaining = ZSTD_compressStream2(writer->zctx, &out,
+				&in, finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining)) {
+				logging(LOG_WARNING, "pcap: failed to compress "
+					"dump file %s: %s", writer->basename,
+					ZSTD_getErrorName(remaining));
+				return -1;
+			}
+			if (write_all(writer, compress_buf, out.pos) == -1)
+				return -1;
+		} while (finish ? remaining != 0 : in.pos < in.size);
+		return 0;
+	}
+#endif /* HAVE_LIBZSTD */
+	default:
+		/* nothing to terminate */
+		UNUSED_ARGUMENT(finish);
+		return write_all(writer, buf, len);
+	}
+}
+
+/**
+ * Terminate the compressed stream of the current dump file of @p writer and
+ * close the file.
+ */
+static void finish_file(struct fg_pcap_writer *writer)
+{
+	write_output(writer, NULL, 0, true);
+#ifdef HAVE_LIBZ
+	if (options.compression == PCAP_COMPRESS_GZIP)
+		deflateEnd(&writer->zstream);
+#endif /* HAVE_LIBZ */
+	if (close(writer->fd) == -1)
+		logging(LOG_WARNING, "pcap: failed to close dump file %s: %s",
+			writer->basename, strerror(errno));
+	writer->fd = -1;
+}
+
+/**
+ * Open the next dump file of @p writer and write the pcap file header.
+ *
+ * @return 0 on success, or -1 on failure
+ */
+static int start_file(struct fg_pcap_writer *writer)
+{
+	struct pcap_file_header_ns header = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = writer->snaplen,
+		.linktype = writer->linktype,
+	};
+	const char *suffix[] = {
+		[PCAP_COMPRESS_NONE] = "",
+		[PCAP_COMPRESS_GZIP] = ".gz",
+		[PCAP_COMPRESS_ZSTD] = ".zst",
+	};
+	char *filename = NULL;
+
+	asprintf_append(&filename, "%s", writer->basename);
+	if (options.rotate_size || options.rotate_time)
+		asprintf_append(&filename, "-%04u", writer->file_index++);
+	asprintf_append(&filename, ".pcap%s", suffix[options.compression]);
+
+	DEBUG_MSG(LOG_NOTICE, "dumping to \"%s\"", filename);
+
+	writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (writer->fd == -1) {
+		logging(LOG_WARNING, "pcap: failed to open dump file %s: %s",
+			filename, strerror(errno));
+		free(filename);
+		return -1;
+	}
+	free(filename);
+
+	switch (options.compression) {
+#ifdef HAVE_LIBZ
+	case PCAP_COMPRESS_GZIP:
+		memset(&writer->zstream, 0, sizeof(writer->zstream));
+		/* 16 added to the window bits selects the gzip format */
+		if (deflateInit2(&writer->zstream, Z_BEST_SPEED, Z_DEFLATED,
+				 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto close;
+		break;
+#endif /* HAVE_LIBZ */
+#ifdef HAVE_LIBZSTD
+	case PCAP_COMPRESS_ZSTD:
+		if (!writer->zctx) {
+			writer->zctx = ZSTD_createCCtx();
+			if (!writer->zctx)
+				goto close;
+			ZSTD_CCtx_setParameter(writer->zctx,
+					       ZSTD_c_compressionLevel, 1);
+		}
+		ZSTD_CCtx_reset(writer->zctx, ZSTD_reset_session_only);
+		break;
+#endif /* HAVE_LIBZSTD */
+	default:
+		break;
+	}
+
+	writer->file_bytes = 0;
+	gettime(&writer->file_time);
+	if (write_output(writer, (const unsigned char *)&header,
+			 sizeof(header), false) == -1) {
+		finish_file(writer);
+		return -1;
+	}
+	return 0;
+
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+close:
+	logging(LOG_WARNING, "pcap: failed to set up compression of dump file "
+		"%s", writer->basename);
+	close(writer->fd);
+	writer->fd = -1;
+	return -1;
+#endif /* HAVE_LIBZ || HAVE_LIBZSTD */
+}
+
+/** Whether the current dump file of @p writer reached a rotation limit. */
+static bool rotation_due(const struct fg_pcap_writer *writer)
+{
+	return (options.rotate_size &&
+		writer->file_bytes >= options.rotate_size) ||
+	       (options.rotate_time &&
+		time_diff_now(&writer->file_time) >= options.rotate_time);
+}
+
+/** Return @p chunk to the free chunks. */
+static void release_chunk(struct writer_chunk *chunk)
+{
+	pthread_mutex_lock(&writer_lock);
+	chunk->next = free_chunks;
+	free_chunks = chunk;
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Free @p writer after its last chunk was written, closing its dump file.
+ */
+static void close_writer(struct fg_pcap_writer *writer)
+{
+	if (writer->fd != -1)
+		finish_file(writer);
+#ifdef HAVE_LIBZSTD
+	ZSTD_freeCCtx(writer->zctx);
+#endif /* HAVE_LIBZSTD */
+	if (writer->drops)
+		logging(LOG_WARNING, "pcap: %u packets dropped writing dump "
+			"file %s", writer->drops, writer->basename);
+	free(writer->basename);
+	free(writer);
+}
+
+/**
+ * Take the next chunks of one writer from the queue: the first queued chunk
+ * and, up to #WRITER_BATCH_SIZE bytes in total, the later chunks of its
+ * writer. The chunks of a writer keep their order.
+ *
+ * The writer lock must be held and the queue must not be empty.
+ *
+ * @return the chunks, linked in order
+ */
+static struct writer_chunk *dequeue_batch(void)
+{
+	struct writer_chunk *batch = queue_head, *last = batch;
+	struct writer_chunk **pnext, *prev;
+	size_t len = batch->len;
+
+	queue_head = batch->next;
+	prev = NULL;
+	pnext = &queue_head;
+	while (*pnext && !last->close) {
+		struct writer_chunk *chunk = *pnext;
+
+		if (chunk->writer != batch->writer) {
+			prev = chunk;
+			pnext = &chunk->next;
+			continue;
+		}
+		if (len + chunk->len > WRITER_BATCH_SIZE)
+			break;
+		len += chunk->len;
+		*pnext = chunk->next;
+		last->next = chunk;
+		last = chunk;
+	}
+	last->next = NULL;
+
+	/* Having scanned the whole queue, the tail may have been taken */
+	if (!*pnext)
+		queue_tail = prev;
+
+	return batch;
+}
+
+/**
+ * Write chunks of one writer taken from the queue to its dump file.
+ *
+ * @param[in] batch chunks to write, linked in order
+ */
+static void write_batch(struct writer_chunk *batch)
+{
+	struct fg_pcap_writer *writer = batch->writer;
+	bool close = false;
+	unsigned packets = 0;
+	size_t len = 0;
+
+	while (batch) {
+		struct writer_chunk *chunk = batch;
+
+		batch = chunk->next;
+		close = chunk->close;
+		if (!chunk->data) {
+			free(chunk);
+			continue;
+		}
+		memcpy(batch_buf + len, chunk->data, chunk->len);
+		len += chunk->len;
+		packets += chunk->packets;
+		chunk->len = 0;
+		chunk->packets = 0;
+		chunk->close = false;
+		release_chunk(chunk);
+	}
+
+	if (len) {
+		if (writer->fd != -1 && rotation_due(writer)) {
+			finish_file(writer);
+			start_file(writer);
+		}
+		if (writer->fd == -1 ||
+		    write_output(writer, batch_buf, len, false) == -1)
+			__atomic_add_fetch(&writer->drops, packets,
+					   __ATOMIC_RELAXED);
+	}
+
+	if (close)
+		close_writer(writer);
+}
+
+/**
+ * I/O thread, writing the queued chunks of all writers.
+ *
+ * @param[in] arg unused
+ */
+static void *writer_work(void *arg)
+{
+	UNUSED_ARGUMENT(arg);
+
+	for (;;) {
+		struct writer_chunk *batch;
+
+		pthread_mutex_lock(&writer_lock);
+		while (!queue_head)
+			pthread_cond_wait(&writer_cond, &writer_lock);
+		batch = dequeue_batch();
+		pthread_mutex_unlock(&writer_lock);
+
+		write_batch(batch);
+	}
+
+	return NULL;
+}
+
+/** Queue @p chunk for the I/O thread. */
+static void queue_chunk(struct writer_chunk *chunk)
+{
+	chunk->next = NULL;
+	pthread_mutex_lock(&writer_lock);
+	if (queue_tail)
+		queue_tail->next = chunk;
+	else
+		queue_head = chunk;
+	queue_tail = chunk;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Get a free chunk for @p writer, allocating one if the limit allows.
+ *
+ * @return the chunk, or NULL if all chunks are in use
+ */
+static struct writer_chunk *get_chunk(struct fg_pcap_writer *writer)
+{
+	struct writer_chunk *chunk = NULL;
+
+	pthread_mutex_lock(&writer_lock);
+	if (free_chunks) {
+		chunk = free_chunks;
+		free_chunks = chunk->next;
+	} else if (num_chunks < WRITER_MAX_CHUNKS) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (chunk && posix_memalign((void **)&chunk->data,
+					    WRITER_CHUNK_ALIGN,
+					    WRITER_CHUNK_SIZE)) {
+			free(chunk);
+			chunk = NULL;
+		}
+		if (chunk)
+			num_chunks++;
+	}
+	pthread_mutex_unlock(&writer_lock);
+
+	if (chunk)
+		chunk->writer = writer;
+	return chunk;
+}
+
+struct fg_pcap_writer *fg_pcap_writer_open(const char *basename,
+					   unsigned linktype, unsigned snaplen)
+{
+	struct fg_pcap_writer *writer;
+	int rc;
+
+	if (!writer_started) {
+		rc = pthread_create(&writer_thread, NULL, writer_work, NULL);
+		if (rc) {
+			logging(LOG_WARNING, "could not start pcap writer "
+				"thread: %s", strerror(rc));
+			return NULL;
+		}
+		writer_started = true;
+	}
+
+	writer = calloc(1, sizeof(*writer));
+	if (!writer) {
+		logging(LOG_ALERT, "could not allocate memory for dump file");
+		return NULL;
+	}
+	writer->basename = strdup(basename);
+	writer->linktype = linktype;
+	writer->snaplen = snaplen;
+
+	/* Opened here to report failures right away, all further I/O is done
+	 * by the I/O thread */
+	if (start_file(writer) == -1) {
+		free(writer->basename);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+void fg_pcap_writer_write(struct fg_pcap_writer *writer, uint32_t sec,
+			  uint32_t nsec, const unsigned char *packet,
+			  unsigned caplen, unsigned len)
+{
+	struct pcap_record_header_ns header;
+	struct writer_chunk *chunk = writer->chunk;
+
+	/* A record always fits into an empty chunk */
+	if (caplen > WRITER_CHUNK_SIZE - sizeof(header))
+		caplen = WRITER_CHUNK_SIZE - sizeof(header);
+	header.ts_sec = sec;
+	header.ts_nsec = nsec;
+	header.caplen = caplen;
+	header.len = len;
+
+	if (chunk && chunk->len + sizeof(header) + caplen > WRITER_CHUNK_SIZE) {
+		queue_chunk(chunk);
+		chunk = writer->chunk = NULL;
+	}
+	if (!chunk) {
+		chunk = writer->chunk = get_chunk(writer);
+		if (!chunk) {
+			__atomic_add_fetch(&writer->drops, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		gettime(&writer->chunk_time);
+	}
+
+	memcpy(chunk->data + chunk->len, &header, sizeof(header));
+	memcpy(chunk->data + chunk->len + sizeof(header), packet, caplen);
+	chunk->len += sizeof(header) + caplen;
+	chunk->packets++;
+}
+
+void fg_pcap_writer_flush(struct fg_pcap_writer *writer)
+{
+	if (!writer->chunk ||
+	    time_diff_now(&writer->chunk_time) < WRITER_FLUSH_INTERVAL)
+		return;
+	queue_chunk(writer->chunk);
+	writer->chunk = NULL;
+}
+
+unsigned fg_pcap_writer_drops(const struct fg_pcap_writer *writer)
+{
+	return __atomic_load_n(&writer->drops, __ATOMIC_RELAXED);
+}
+
+void fg_pcap_writer_close(struct fg_pcap_writer *writer)
+{
+	struct writer_chunk *chunk = writer->chunk;
+
+	/* Closing must not fail for lack of chunks */
+	if (!chunk) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			critx("could not allocate memory to close dump file");
+		chunk->writer = writer;
+	}
+	writer->chunk = NULL;
+	chunk->close = true;
+	queue_chunk(chunk);
+}
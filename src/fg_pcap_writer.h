@@ -0,0 +1,102 @@
+/**
+ * @file fg_pcap_writer.h
+ * @brief Asynchronous writer of the dump files of the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_PCAP_WRITER_H_
+#define _FG_PCAP_WRITER_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "fg_pcap.h"
+#include "fg_pcap_format.h"
+
+/** Writer of a dump file. */
+struct fg_pcap_writer;
+
+/**
+ * Initialize the dump file writers.
+ *
+ * @param[in] options options of the packet capture
+ */
+void fg_pcap_writer_init(const struct fg_pcap_options *options);
+
+/**
+ * Open a dump file.
+ *
+ * The writer buffers the packets in small page aligned chunks, which a
+ * separate I/O thread shared by all writers gathers into large batches,
+ * compresses and writes. Thus the capture thread never waits for the disk. If the file is rotated,
+ * an index is appended to @p basename.
+ *
+ * @param[in] basename name of the dump file without suffix
+ * @param[in] linktype link type of the packets, enum pcap_linktype
+ * @param[in] snaplen maximum number of bytes stored per packet
+ * @return writer of the dump file, or NULL on failure
+ */
+struct fg_pcap_writer *fg_pcap_writer_open(const char *basename,
+					   unsigned linktype, unsigned snaplen);
+
+/**
+ * Append a packet to the dump file of @p writer.
+ *
+ * If all buffers are in use since the I/O thread falls behind, the packet is
+ * dropped and counted. Must not be called concurrently for one writer.
+ *
+ * @param[in,out] writer writer of the dump file
+ * @param[in] sec seconds of the capture timestamp
+ * @param[in] nsec nanoseconds of the capture timestamp
+ * @param[in] packet captured bytes of the packet
+ * @param[in] caplen number of captured bytes
+ * @param[in] len length of the packet on the wire
+ */
+void fg_pcap_writer_write(struct fg_pcap_writer *writer, uint32_t sec,
+			  uint32_t nsec, const unsigned char *packet,
+			  unsigned caplen, unsigned len);
+
+/**
+ * Hand the buffered packets of @p writer over to the I/O thread if they are
+ * buffered for a while, so the dump file keeps up with slow flows.
+ *
+ * @param[in,out] writer writer of the dump file
+ */
+void fg_pcap_writer_flush(struct fg_pcap_writer *writer);
+
+/**
+ * Get the number of packets dropped by @p writer.
+ *
+ * @param[in] writer writer of the dump file
+ * @return packets not written, since the buffers were exhausted or the dump
+ * file could not be written
+ */
+unsigned fg_pcap_writer_drops(const struct fg_pcap_writer *writer);
+
+/**
+ * Close the dump file of @p writer. The I/O thread writes the buffered
+ * packets, closes the file and releases the writer.
+ *
+ * @param[in] writer writer of the dump file
+ */
+void fg_pcap_writer_close(struct fg_pcap_writer *writer);
+
+#endif /* _FG_PCAP_WRITER_H_ */
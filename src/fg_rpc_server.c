@@ -36,6 +36,7 @@
 #include <syslog.h>
 
 #include "common.h"
+#include "fg_gate.h"
 #include "daemon.h"
 #include "fg_log.h"
 #include "fg_error.h"
@@ -43,6 +44,65 @@
 #include "debug.h"
 #include "fg_rpc_server.h"
 
+/**
+ * Read the rate schedule segments from the XML-RPC array @p schedule into
+ * @p settings. The segments are allocated and must be freed by the caller.
+ */
+static void read_rate_schedule(xmlrpc_env * const env,
+			       xmlrpc_value * const schedule,
+			       struct flow_settings *settings)
+{
+	double total = 0.0;
+	int num = xmlrpc_array_size(env, schedule);
+
+	settings->num_rate_segments = 0;
+	if (env->fault_occurred || !num)
+		return;
+	if (num > MAX_RATE_SEGMENTS) {
+		xmlrpc_env_set_fault(env, XMLRPC_TYPE_ERROR,
+				     "Rate schedule too long");
+		return;
+	}
+
+	settings->rate_schedule = malloc(num * sizeof(struct rate_segment));
+	if (!settings->rate_schedule) {
+		xmlrpc_env_set_fault(env, XMLRPC_INTERNAL_ERROR,
+				     "Could not allocate memory for rate "
+				     "schedule");
+		return;
+	}
+
+	for (int i = 0; i < num; i++) {
+		struct rate_segment *segment = &settings->rate_schedule[i];
+		xmlrpc_value *item;
+
+		xmlrpc_array_read_item(env, schedule, i, &item);
+		if (env->fault_occurred)
+			return;
+		xmlrpc_decompose_value(env, item, "{s:d,s:d,*}",
+				       "duration", &segment->duration,
+				       "rate", &segment->rate);
+		xmlrpc_DECREF(item);
+		if (env->fault_occurred)
+			return;
+		if (segment->duration <= 0 || segment->rate < 0) {
+			xmlrpc_env_set_fault(env, XMLRPC_TYPE_ERROR,
+					     "Rate schedule incorrect");
+			return;
+		}
+		total += segment->rate;
+	}
+
+	/* the schedule must not stall the flow forever */
+	if (settings->rate_schedule_loop ? !total :
+	    !settings->rate_schedule[num - 1].rate) {
+		xmlrpc_env_set_fault(env, XMLRPC_TYPE_ERROR,
+				     "Rate schedule incorrect");
+		return;
+	}
+	settings->num_rate_segments = num;
+}
+
 /**
  * Prepare data connection for source endpoint.
  *
@@ -71,8 +131,10 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 	char* cc_alg = 0;
 	char* bind_address = 0;
 	xmlrpc_value* extra_options = 0;
+	xmlrpc_value* rate_schedule = 0;
 
 	struct flow_settings settings;
+	settings.rate_schedule = NULL;
 	struct flow_source_settings source_settings;
 
 	struct request_add_flow_source* request = 0;
@@ -88,7 +150,7 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 		"{s:i,s:i,*}"
 		"{s:i,*}"
 		"{s:b,s:b,s:b,s:b,s:b,*}"
-		"{s:i,s:i,*}"
+		"{s:d,s:i,*}"
 		"{s:i,s:d,s:d,*}" /* request */
 		"{s:i,s:d,s:d,*}" /* response */
 		"{s:i,s:d,s:d,*}" /* interpacket_gap */
@@ -97,7 +159,18 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 		"{s:i,s:i,s:i,s:i,s:i,*}"
 		"{s:s,*}" /* for LIBPCAP dumps */
 		"{s:i,s:A,*}"
-		"{s:s,s:i,s:i,*}"
+		"{s:i,*}" /* request window */
+		"{s:i,*}" /* connections */
+		"{s:i,*}" /* kernel pacing */
+		"{s:i,s:d,s:i,*}" /* rate group */
+		"{s:A,s:b,*}" /* rate schedule */
+		"{s:i,*}" /* gate */
+		"{s:i,s:d,s:i,*}" /* query group */
+		"{s:i,*}" /* coflow */
+		"{s:d,*}" /* TCP state sampling */
+		"{s:i,*}" /* kernel trace */
+		"{s:i,s:i,s:b,*}" /* report group */
+		"{s:s,s:i,s:i,s:i,*}"
 		")",
 
 		/* general settings */
@@ -155,10 +228,40 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 		"num_extra_socket_options", &settings.num_extra_socket_options,
 		"extra_socket_options", &extra_options,
 
+		"request_window", &settings.request_window,
+
+		"connections", &settings.connections,
+
+		"kernel_pacing", &settings.kernel_pacing,
+
+		"rate_group", &settings.rate_group,
+		"rate_group_rate", &settings.rate_group_rate,
+		"rate_group_burst", &settings.rate_group_burst,
+
+		"rate_schedule", &rate_schedule,
+		"rate_schedule_loop", &settings.rate_schedule_loop,
+
+		"gate", &settings.gate,
+
+		"query_group", &settings.query_group,
+		"query_rate", &settings.query_rate,
+		"query_fanin", &settings.query_fanin,
+
+		"coflow", &settings.coflow,
+
+		"sample_period", &settings.sample_period,
+
+		"kernel_trace", &settings.kernel_trace,
+
+		"report_group", &settings.report_group,
+		"report_scope", &settings.report_scope,
+		"aggregate_only", &settings.aggregate_only,
+
 		/* source settings */
 		"destination_address", &destination_host,
 		"destination_port", &source_settings.destination_port,
-		"late_connect", &source_settings.late_connect);
+		"late_connect", &source_settings.late_connect,
+		"handshake", &source_settings.handshake);
 
 	if (env->fault_occurred)
 		goto cleanup;
@@ -167,6 +270,14 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 	if (settings.traffic_dump)
 		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Daemon was asked to dump traffic, but wasn't compiled with libpcap support");
 #endif
+#ifndef HAVE_LIBBPF
+	/* Tracing is optional, the flow runs untraced */
+	if (settings.kernel_trace) {
+		logging(LOG_WARNING, "asked to trace flow with eBPF, but not "
+			"compiled with libbpf support, flow runs untraced");
+		settings.kernel_trace = 0;
+	}
+#endif /* HAVE_LIBBPF */
 
 	/* Check for sanity */
 	if (strlen(bind_address) >= sizeof(settings.bind_address) - 1 ||
@@ -181,9 +292,25 @@ static xmlrpc_value * add_flow_source(xmlrpc_env * const env,
 		xmlrpc_array_size(env, extra_options) != settings.num_extra_socket_options ||
 		settings.dscp < 0 || settings.dscp > 255 ||
 		settings.write_rate < 0 ||
+		(settings.kernel_pacing && !settings.write_rate) ||
+		settings.rate_group < 0 || settings.rate_group_burst < 0 ||
+		settings.gate < 0 || settings.gate > MAX_GATES ||
+		(settings.rate_group && settings.rate_group_rate <= 0) ||
+		settings.query_group < 0 || settings.query_rate < 0 ||
+		(settings.query_group && settings.query_fanin < 1) ||
+		settings.connections < 1 || settings.connections > MAX_FLOWS_DAEMON ||
+		settings.coflow < 0 || settings.sample_period < 0 ||
+		settings.report_group < 0 ||
 		settings.reporting_interval < 0) {
 		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Flow settings incorrect");
 	}
+	if (settings.gate && !gates)
+		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Gates not enabled on this "
+			    "daemon (flowgrindd -g)");
+
+	read_rate_schedule(env, rate_schedule, &settings);
+	if (env->fault_occurred)
+		goto cleanup;
 
 	/* Parse extra socket options */
 	for (i = 0; i < settings.num_extra_socket_options; i++) {
@@ -250,6 +377,9 @@ cleanup:
 
 	if (extra_options)
 		xmlrpc_DECREF(extra_options);
+	if (rate_schedule)
+		xmlrpc_DECREF(rate_schedule);
+	free(settings.rate_schedule);
 
 	if (env->fault_occurred)
 		logging(LOG_WARNING, "method add_flow_source failed: %s",
@@ -287,8 +417,10 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 	char* cc_alg = 0;
 	char* bind_address = 0;
 	xmlrpc_value* extra_options = 0;
+	xmlrpc_value* rate_schedule = 0;
 
 	struct flow_settings settings;
+	settings.rate_schedule = NULL;
 
 	struct request_add_flow_destination* request = 0;
 
@@ -303,7 +435,7 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 		"{s:i,s:i,*}"
 		"{s:i,*}"
 		"{s:b,s:b,s:b,s:b,s:b,*}"
-		"{s:i,s:i,*}"
+		"{s:d,s:i,*}"
 		"{s:i,s:d,s:d,*}" /* request */
 		"{s:i,s:d,s:d,*}" /* response */
 		"{s:i,s:d,s:d,*}" /* interpacket_gap */
@@ -312,6 +444,17 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 		"{s:i,s:i,s:i,s:i,s:i,*}"
 		"{s:s,*}" /* For libpcap dumps */
 		"{s:i,s:A,*}"
+		"{s:i,*}" /* request window */
+		"{s:i,*}" /* connections */
+		"{s:i,*}" /* kernel pacing */
+		"{s:i,s:d,s:i,*}" /* rate group */
+		"{s:A,s:b,*}" /* rate schedule */
+		"{s:i,*}" /* gate */
+		"{s:i,s:d,s:i,*}" /* query group */
+		"{s:i,*}" /* coflow */
+		"{s:d,*}" /* TCP state sampling */
+		"{s:i,*}" /* kernel trace */
+		"{s:i,s:i,s:b,*}" /* report group */
 		")",
 
 		/* general settings */
@@ -367,7 +510,36 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 		"ipmtudiscover", &settings.ipmtudiscover,
 		"dump_prefix", &dump_prefix,
 		"num_extra_socket_options", &settings.num_extra_socket_options,
-		"extra_socket_options", &extra_options);
+		"extra_socket_options", &extra_options,
+
+		"request_window", &settings.request_window,
+
+		"connections", &settings.connections,
+
+		"kernel_pacing", &settings.kernel_pacing,
+
+		"rate_group", &settings.rate_group,
+		"rate_group_rate", &settings.rate_group_rate,
+		"rate_group_burst", &settings.rate_group_burst,
+
+		"rate_schedule", &rate_schedule,
+		"rate_schedule_loop", &settings.rate_schedule_loop,
+
+		"gate", &settings.gate,
+
+		"query_group", &settings.query_group,
+		"query_rate", &settings.query_rate,
+		"query_fanin", &settings.query_fanin,
+
+		"coflow", &settings.coflow,
+
+		"sample_period", &settings.sample_period,
+
+		"kernel_trace", &settings.kernel_trace,
+
+		"report_group", &settings.report_group,
+		"report_scope", &settings.report_scope,
+		"aggregate_only", &settings.aggregate_only);
 
 	if (env->fault_occurred)
 		goto cleanup;
@@ -376,6 +548,14 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 	if (settings.traffic_dump)
 		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Daemon was asked to dump traffic, but wasn't compiled with libpcap support");
 #endif
+#ifndef HAVE_LIBBPF
+	/* Tracing is optional, the flow runs untraced */
+	if (settings.kernel_trace) {
+		logging(LOG_WARNING, "asked to trace flow with eBPF, but not "
+			"compiled with libbpf support, flow runs untraced");
+		settings.kernel_trace = 0;
+	}
+#endif /* HAVE_LIBBPF */
 
 	/* Check for sanity */
 	if (strlen(bind_address) >= sizeof(settings.bind_address) - 1 ||
@@ -384,11 +564,27 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 		settings.requested_send_buffer_size < 0 || settings.requested_read_buffer_size < 0 ||
 		settings.maximum_block_size < MIN_BLOCK_SIZE ||
 		settings.write_rate < 0 ||
+		(settings.kernel_pacing && !settings.write_rate) ||
+		settings.rate_group < 0 || settings.rate_group_burst < 0 ||
+		settings.gate < 0 || settings.gate > MAX_GATES ||
+		(settings.rate_group && settings.rate_group_rate <= 0) ||
+		settings.query_group < 0 || settings.query_rate < 0 ||
+		(settings.query_group && settings.query_fanin < 1) ||
 		strlen(cc_alg) > TCP_CA_NAME_MAX ||
 		settings.num_extra_socket_options < 0 || settings.num_extra_socket_options > MAX_EXTRA_SOCKET_OPTIONS ||
-		xmlrpc_array_size(env, extra_options) != settings.num_extra_socket_options) {
+		xmlrpc_array_size(env, extra_options) != settings.num_extra_socket_options ||
+		settings.connections < 1 || settings.connections > MAX_FLOWS_DAEMON ||
+		settings.coflow < 0 || settings.sample_period < 0 ||
+		settings.report_group < 0) {
 		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Flow settings incorrect");
 	}
+	if (settings.gate && !gates)
+		XMLRPC_FAIL(env, XMLRPC_TYPE_ERROR, "Gates not enabled on this "
+			    "daemon (flowgrindd -g)");
+
+	read_rate_schedule(env, rate_schedule, &settings);
+	if (env->fault_occurred)
+		goto cleanup;
 
 	/* Parse extra socket options */
 	for (i = 0; i < settings.num_extra_socket_options; i++) {
@@ -440,9 +636,10 @@ static xmlrpc_value * add_flow_destination(xmlrpc_env * const env,
 		XMLRPC_FAIL(env, XMLRPC_INTERNAL_ERROR, request->r.error); /* goto cleanup on failure */
 
 	/* Return our result. */
-	ret = xmlrpc_build_value(env, "{s:i,s:i,s:i,s:i}",
+	ret = xmlrpc_build_value(env, "{s:i,s:i,s:i,s:i,s:i}",
 		"flow_id", request->flow_id,
 		"listen_data_port", request->listen_data_port,
+		"handshake", request->handshake,
 		"real_listen_send_buffer_size", request->real_listen_send_buffer_size,
 		"real_listen_read_buffer_size", request->real_listen_read_buffer_size);
 
@@ -453,6 +650,9 @@ cleanup:
 
 	if (extra_options)
 		xmlrpc_DECREF(extra_options);
+	if (rate_schedule)
+		xmlrpc_DECREF(rate_schedule);
+	free(settings.rate_schedule);
 
 	if (env->fault_occurred)
 		logging(LOG_WARNING, "method add_flow_destination failed: %s",
@@ -551,6 +751,16 @@ static xmlrpc_value * method_get_reports(xmlrpc_env * const env,
 			"{s:i,s:i,s:i,s:i,s:i}" /* TCP info */
 			"{s:i,s:i,s:i,s:i,s:i}" /* ...      */
 			"{s:i,s:i,s:i,s:i,s:i}" /* ...      */
+			"{s:i,s:i}" /* Response queue */
+			"{s:d,s:d,s:d,s:i,s:d,s:d}" /* Intended RTT, schedule slips */
+			"{s:i}" /* Connection */
+			"{s:d,s:i}" /* Connect */
+			"{s:d}" /* rate schedule */
+			"{s:i,s:d,s:d,s:d,s:d,s:d,s:d}" /* query completion time */
+			"{s:d,s:d,s:d,s:d,s:d,s:i,s:i}" /* TCP info: delivery, limits, ECN */
+			"{s:6,s:i}" /* TCP state samples */
+			"{s:i,s:i}" /* Traffic dump drops */
+			"{s:i,s:i,s:i,s:i,s:i,s:i}" /* Aggregate report */
 			"{s:i}"
 			")",
 
@@ -603,6 +813,53 @@ static xmlrpc_value * method_get_reports(xmlrpc_env * const env,
 			"tcpi_ca_state", (int)report->tcp_info.tcpi_ca_state,
 			"tcpi_snd_mss", (int)report->tcp_info.tcpi_snd_mss,
 
+			"response_queue_depth", report->response_queue_depth,
+			"response_queue_max", report->response_queue_max,
+
+			"rtt_intended_min", report->rtt_intended_min,
+			"rtt_intended_max", report->rtt_intended_max,
+			"rtt_intended_sum", report->rtt_intended_sum,
+			"schedule_slips", report->schedule_slips,
+			"schedule_slip_max", report->schedule_slip_max,
+			"schedule_slip_sum", report->schedule_slip_sum,
+
+			"connection", report->connection,
+
+			"connect_time", report->connect_time,
+			"connect_retries", report->connect_retries,
+
+			"scheduled_bytes", report->scheduled_bytes,
+
+			"query_rounds", report->query_rounds,
+			"qct_min", report->qct_min,
+			"qct_max", report->qct_max,
+			"qct_sum", report->qct_sum,
+			"qct_p50", report->qct_p50,
+			"qct_p99", report->qct_p99,
+			"qct_p999", report->qct_p999,
+
+			"tcpi_delivery_rate", (double)report->tcp_info.tcpi_delivery_rate,
+			"tcpi_bytes_acked", (double)report->tcp_info.tcpi_bytes_acked,
+			"tcpi_busy_time", (double)report->tcp_info.tcpi_busy_time,
+			"tcpi_rwnd_limited", (double)report->tcp_info.tcpi_rwnd_limited,
+			"tcpi_sndbuf_limited", (double)report->tcp_info.tcpi_sndbuf_limited,
+			"tcpi_ecn", report->tcp_info.tcpi_ecn,
+			"tcpi_delivered_ce", report->tcp_info.tcpi_delivered_ce,
+
+			"tcp_samples", report->samples ? report->samples :
+				       (unsigned char *)"", report->samples_size,
+			"tcp_samples_lost", report->samples_lost,
+
+			"dump_kernel_drops", report->dump_kernel_drops,
+			"dump_writer_drops", report->dump_writer_drops,
+
+			"aggregated", report->aggregated,
+			"aggregated_tcp_info", report->aggregated_tcp_info,
+			"tcpi_snd_cwnd_min", report->tcpi_snd_cwnd_min,
+			"tcpi_snd_cwnd_max", report->tcpi_snd_cwnd_max,
+			"tcpi_rtt_min", report->tcpi_rtt_min,
+			"tcpi_rtt_max", report->tcpi_rtt_max,
+
 			"status", report->status
 		);
 
@@ -611,6 +868,7 @@ static xmlrpc_value * method_get_reports(xmlrpc_env * const env,
 		xmlrpc_DECREF(rv);
 
 		struct report *next = report->next;
+		free(report->samples);
 		free(report);
 		report = next;
 	}
@@ -723,9 +981,11 @@ static xmlrpc_value * method_get_status(xmlrpc_env * const env,
 		XMLRPC_FAIL(env, XMLRPC_INTERNAL_ERROR, request->r.error); /* goto cleanup on failure */
 
 	/* Return our result. */
-	ret = xmlrpc_build_value(env, "{s:i,s:i}",
+	ret = xmlrpc_build_value(env, "{s:i,s:i,s:i,s:i}",
 		"started", request->started,
-		"num_flows", request->num_flows);
+		"num_flows", request->num_flows,
+		"source_ports_in_use", request->source_ports_in_use,
+		"source_ports_total", request->source_ports_total);
 
 cleanup:
 	if (request)
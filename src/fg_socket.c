@@ -297,6 +297,65 @@ int set_so_lcd(int fd)
 
 }
 
+int set_ip_bind_address_no_port(int fd)
+{
+#ifdef HAVE_SO_IP_BIND_ADDRESS_NO_PORT
+	const int opt = 1;
+
+	DEBUG_MSG(LOG_NOTICE, "setting IP_BIND_ADDRESS_NO_PORT on fd %d", fd);
+	return setsockopt(fd, SOL_IP, IP_BIND_ADDRESS_NO_PORT, &opt,
+			  sizeof(opt));
+
+#else /* HAVE_SO_IP_BIND_ADDRESS_NO_PORT */
+	UNUSED_ARGUMENT(fd);
+	return -1;
+#endif /* HAVE_SO_IP_BIND_ADDRESS_NO_PORT */
+}
+
+int set_max_pacing_rate(int fd, double rate)
+{
+#ifdef HAVE_SO_MAX_PACING_RATE
+	DEBUG_MSG(LOG_NOTICE, "setting SO_MAX_PACING_RATE on fd %d to %.0f",
+		  fd, rate);
+
+	/* Kernels before Linux 4.20 only take 32 bit rates */
+	if (rate <= UINT32_MAX) {
+		const uint32_t opt = (uint32_t)rate;
+		return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &opt,
+				  sizeof(opt));
+	} else {
+		const uint64_t opt = (uint64_t)rate;
+		return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &opt,
+				  sizeof(opt));
+	}
+
+#else /* HAVE_SO_MAX_PACING_RATE */
+	UNUSED_ARGUMENT(fd);
+	UNUSED_ARGUMENT(rate);
+	DEBUG_MSG(LOG_ERR, "cannot set SO_MAX_PACING_RATE for OS other than "
+		  "Linux");
+	errno = ENOPROTOOPT;
+	return -1;
+#endif /* HAVE_SO_MAX_PACING_RATE */
+}
+
+int set_tcp_notsent_lowat(int fd, unsigned bytes)
+{
+#ifdef HAVE_SO_TCP_NOTSENT_LOWAT
+	DEBUG_MSG(LOG_NOTICE, "setting TCP_NOTSENT_LOWAT on fd %d to %u", fd,
+		  bytes);
+	return setsockopt(fd, SOL_TCP, TCP_NOTSENT_LOWAT, &bytes,
+			  sizeof(bytes));
+#else /* HAVE_SO_TCP_NOTSENT_LOWAT */
+	UNUSED_ARGUMENT(fd);
+	UNUSED_ARGUMENT(bytes);
+	DEBUG_MSG(LOG_ERR, "cannot set TCP_NOTSENT_LOWAT for OS other than "
+		  "Linux");
+	errno = ENOPROTOOPT;
+	return -1;
+#endif /* HAVE_SO_TCP_NOTSENT_LOWAT */
+}
+
 int set_ip_mtu_discover(int fd)
 {
 #ifdef HAVE_SO_IP_MTU_DISCOVER
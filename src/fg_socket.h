@@ -53,6 +53,9 @@ int set_window_size(int, int);
 int set_window_size_directed(int, int, int);
 
 int set_ip_mtu_discover(int fd);
+int set_ip_bind_address_no_port(int fd);
+int set_max_pacing_rate(int fd, double rate);
+int set_tcp_notsent_lowat(int fd, unsigned bytes);
 int get_pmtu(int fd);
 int get_imtu(int fd);
 
@@ -0,0 +1,52 @@
+/**
+ * @file fg_stats.h
+ * @brief Statistics over samples, e.g. percentiles of completion times
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_STATS_H_
+#define _FG_STATS_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stddef.h>
+
+/**
+ * Sort @p n samples in ascending order.
+ *
+ * @param[in,out] samples samples to sort
+ * @param[in] n number of samples
+ */
+void fg_sort_samples(double *samples, size_t n);
+
+/**
+ * Percentile of sorted samples using the nearest rank method.
+ *
+ * @param[in] sorted samples sorted in ascending order
+ * @param[in] n number of samples
+ * @param[in] p percentile between 0 and 100
+ * @return smallest sample not exceeded by @p p percent of the samples, or 0
+ * if there are no samples
+ */
+double fg_percentile(const double *sorted, size_t n, double p);
+
+#endif /* _FG_STATS_H_ */
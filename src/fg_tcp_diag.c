@@ -0,0 +1,209 @@
+/**
+ * @file fg_tcp_diag.c
+ * @brief Bulk collection of TCP statistics via inet_diag netlink sockets
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+/* The kernel's struct tcp_info, as the one of the C library lacks fields */
+#include <linux/tcp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "fg_tcp_diag.h"
+
+/** Size of the receive buffer for dump replies. */
+#define TCP_DIAG_BUFFER_SIZE 32768
+
+/**
+ * Copy the kernel's TCP statistics @p kinfo of length @p len to @p info.
+ * Fields of newer kernels missing in @p kinfo stay zero.
+ */
+static void copy_tcp_info(struct fg_tcp_info *info, const void *kinfo,
+			  size_t len)
+{
+	struct tcp_info ti;
+
+	memset(&ti, 0, sizeof(ti));
+	memcpy(&ti, kinfo, len < sizeof(ti) ? len : sizeof(ti));
+	memset(info, 0, sizeof(struct fg_tcp_info));
+
+	#define CPY_INFO_MEMBER(a) info->a = (int) ti.a;
+	CPY_INFO_MEMBER(tcpi_snd_cwnd);
+	CPY_INFO_MEMBER(tcpi_snd_ssthresh);
+	CPY_INFO_MEMBER(tcpi_rtt);
+	CPY_INFO_MEMBER(tcpi_rttvar);
+	CPY_INFO_MEMBER(tcpi_rto);
+	CPY_INFO_MEMBER(tcpi_snd_mss);
+	CPY_INFO_MEMBER(tcpi_backoff);
+	CPY_INFO_MEMBER(tcpi_unacked);
+	CPY_INFO_MEMBER(tcpi_sacked);
+	CPY_INFO_MEMBER(tcpi_lost);
+	CPY_INFO_MEMBER(tcpi_retrans);
+	CPY_INFO_MEMBER(tcpi_retransmits);
+	CPY_INFO_MEMBER(tcpi_fackets);
+	CPY_INFO_MEMBER(tcpi_reordering);
+	CPY_INFO_MEMBER(tcpi_ca_state);
+	CPY_INFO_MEMBER(tcpi_pmtu);
+	CPY_INFO_MEMBER(tcpi_delivered_ce);
+	#undef CPY_INFO_MEMBER
+
+	info->tcpi_delivery_rate = ti.tcpi_delivery_rate;
+	info->tcpi_bytes_acked = ti.tcpi_bytes_acked;
+	info->tcpi_busy_time = ti.tcpi_busy_time;
+	info->tcpi_rwnd_limited = ti.tcpi_rwnd_limited;
+	info->tcpi_sndbuf_limited = ti.tcpi_sndbuf_limited;
+	info->tcpi_ecn = ti.tcpi_options & TCPI_OPT_ECN ? 1 : 0;
+	info->tcpi_pacing_rate = ti.tcpi_pacing_rate;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const ino_t x = ((const struct fg_tcp_diag_entry *)a)->inode;
+	const ino_t y = ((const struct fg_tcp_diag_entry *)b)->inode;
+
+	return (x > y) - (x < y);
+}
+
+int fg_tcp_diag_open(void)
+{
+	return socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+}
+
+void fg_tcp_diag_sort(struct fg_tcp_diag_entry *entries, size_t num)
+{
+	qsort(entries, num, sizeof(struct fg_tcp_diag_entry), compare_entries);
+}
+
+/**
+ * Find the statistics of @p entries in the dump reply @p nlh.
+ *
+ * @return 1 if the dump is complete, 0 if more replies follow, or -1 on
+ * error with errno set
+ */
+static int process_reply(struct nlmsghdr *nlh, int len,
+			 struct fg_tcp_diag_entry *entries, size_t num,
+			 int *found)
+{
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		const struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+		struct fg_tcp_diag_entry key, *entry;
+		struct rtattr *attr;
+		int attrlen;
+
+		if (nlh->nlmsg_type == NLMSG_DONE)
+			return 1;
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			const struct nlmsgerr *err = NLMSG_DATA(nlh);
+			errno = -err->error;
+			return -1;
+		}
+
+		key.inode = msg->idiag_inode;
+		entry = bsearch(&key, entries, num,
+				sizeof(struct fg_tcp_diag_entry),
+				compare_entries);
+		if (!entry)
+			continue;
+
+		attr = (struct rtattr *)(msg + 1);
+		attrlen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+		for (; RTA_OK(attr, attrlen); attr = RTA_NEXT(attr, attrlen)) {
+			if (attr->rta_type != INET_DIAG_INFO)
+				continue;
+			copy_tcp_info(&entry->info, RTA_DATA(attr),
+				      RTA_PAYLOAD(attr));
+			if (!entry->found)
+				(*found)++;
+			entry->found = 1;
+		}
+	}
+
+	return 0;
+}
+
+int fg_tcp_diag_dump(int fd, struct fg_tcp_diag_entry *entries, size_t num)
+{
+	static const int families[] = {AF_INET, AF_INET6};
+	static char buf[TCP_DIAG_BUFFER_SIZE];
+	int found = 0;
+
+	for (size_t i = 0; i < num; i++)
+		entries[i].found = 0;
+
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+		struct {
+			struct nlmsghdr nlh;
+			struct inet_diag_req_v2 req;
+		} request;
+		int rc = 0;
+
+		memset(&request, 0, sizeof(request));
+		request.nlh.nlmsg_len = sizeof(request);
+		request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+		request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		request.req.sdiag_family = families[i];
+		request.req.sdiag_protocol = IPPROTO_TCP;
+		request.req.idiag_states = ~0U;
+		request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+
+		if (send(fd, &request, sizeof(request), 0) == -1)
+			return -1;
+
+		while (!rc) {
+			const ssize_t len = recv(fd, buf, sizeof(buf), 0);
+
+			if (len == -1 && errno == EINTR)
+				continue;
+			if (len < 1) {
+				if (!len)
+					errno = EIO;
+				return -1;
+			}
+			rc = process_reply((struct nlmsghdr *)buf, len, entries,
+					   num, &found);
+			if (rc == -1)
+				return -1;
+		}
+	}
+
+	return found;
+}
+
+int fg_tcp_diag_get(int fd, struct fg_tcp_info *info)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+		return -1;
+	copy_tcp_info(info, &ti, len);
+	return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file fg_tcp_diag.h
+ * @brief Bulk collection of TCP statistics via inet_diag netlink sockets
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FG_TCP_DIAG_H_
+#define _FG_TCP_DIAG_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+/** Socket whose TCP statistics are collected by a dump. */
+struct fg_tcp_diag_entry {
+	/** Inode of the socket. */
+	ino_t inode;
+	/** Set if the dump found the socket. */
+	int found;
+	/** TCP statistics of the socket, if found. */
+	struct fg_tcp_info info;
+	/** Data of the caller, e.g. the flow of the socket. */
+	void *data;
+};
+
+/**
+ * Open the netlink socket for TCP statistics dumps.
+ *
+ * @return file descriptor, or -1 on error with errno set
+ */
+int fg_tcp_diag_open(void);
+
+/**
+ * Sort @p entries by inode, as fg_tcp_diag_dump() expects them.
+ *
+ * @param[in,out] entries sockets to collect the statistics of
+ * @param[in] num number of entries
+ */
+void fg_tcp_diag_sort(struct fg_tcp_diag_entry *entries, size_t num);
+
+/**
+ * Collect the TCP statistics of all @p entries with a single dump of the TCP
+ * sockets of each address family from the kernel.
+ *
+ * @param[in] fd netlink socket from fg_tcp_diag_open()
+ * @param[in,out] entries sockets sorted by fg_tcp_diag_sort()
+ * @param[in] num number of entries
+ * @return number of entries found, or -1 on error with errno set
+ */
+int fg_tcp_diag_dump(int fd, struct fg_tcp_diag_entry *entries, size_t num);
+
+/**
+ * Get the TCP statistics of a single socket, including the fields the
+ * struct tcp_info of the C library lacks.
+ *
+ * @param[in] fd socket
+ * @param[out] info TCP statistics
+ * @return 0 on success, or -1 on error with errno set
+ */
+int fg_tcp_diag_get(int fd, struct fg_tcp_info *info);
+
+#endif /* _FG_TCP_DIAG_H_ */
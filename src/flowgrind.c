@@ -43,11 +43,13 @@
 #include <netinet/ip.h>
 /* for CA states (on Linux only) */
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/utsname.h>
 #include <time.h>
@@ -69,6 +71,8 @@
 #include "fg_rpc_client.h"
 #include "fg_argparser.h"
 #include "fg_log.h"
+#include "fg_gate.h"
+#include "fg_stats.h"
 
 /** To show intermediated interval report columns. */
 #define SHOW_COLUMNS(...)                                                   \
@@ -124,6 +128,19 @@ static struct arg_parser parser;
 /** Number of currently active flows. */
 static unsigned int active_flows = 0;
 
+/** Trace replayed with option --trace. */
+static FILE *trace_stream = NULL;
+
+/** Options of each flow before it is set up, to set up the flow again once
+ * it ended (options --trace and --control). */
+static struct cflow *flow_template = NULL;
+
+/** Start of the test. Trace and injected flows start relative to it. */
+static struct timespec epoch;
+
+/** Control input given with option --control, -1 if none or closed. */
+static int control_fd = -1;
+
 /* To cover a gcc bug (http://gcc.gnu.org/bugzilla/show_bug.cgi?id=36446) */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
@@ -137,6 +154,10 @@ static struct column column_info[] = {
 	 .header.unit = "[s]", .state.visible = true},
 	{.type = COL_THROUGH, .header.name = "through",
 	 .header.unit = "[Mbit/s]", .state.visible = true},
+	{.type = COL_SCHED, .header.name = "sched",
+	 .header.unit = "[Mbit/s]", .state.visible = false},
+	{.type = COL_RATE, .header.name = "rate",
+	 .header.unit = "[%]", .state.visible = false},
 	{.type = COL_TRANSAC, .header.name = "transac",
 	 .header.unit = "[#/s]", .state.visible = true},
 	{.type = COL_BLOCK_REQU, .header.name = "requ",
@@ -149,6 +170,20 @@ static struct column column_info[] = {
 	 .header.unit = "[ms]", .state.visible = false},
 	{.type = COL_RTT_MAX, .header.name = "max RTT",
 	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_IRTT_MIN, .header.name = "min iRTT",
+	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_IRTT_AVG, .header.name = "avg iRTT",
+	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_IRTT_MAX, .header.name = "max iRTT",
+	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_QRY_ROUNDS, .header.name = "rounds",
+	 .header.unit = "[#]", .state.visible = false},
+	{.type = COL_QCT_MIN, .header.name = "min QCT",
+	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_QCT_AVG, .header.name = "avg QCT",
+	 .header.unit = "[ms]", .state.visible = false},
+	{.type = COL_QCT_MAX, .header.name = "max QCT",
+	 .header.unit = "[ms]", .state.visible = false},
 	{.type = COL_IAT_MIN, .header.name = "min IAT",
 	 .header.unit = "[ms]", .state.visible = true},
 	{.type = COL_IAT_AVG, .header.name = "avg IAT",
@@ -211,8 +246,13 @@ inline static void print_output(const char *fmt, ...)
 	__attribute__((format(printf, 1, 2)));
 static void fetch_reports(xmlrpc_client *);
 static void report_flow(struct report* report);
+static void finish_flows(void);
+static void process_control(xmlrpc_client *rpc_client, double timeout);
 static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 		                  struct report *report);
+static void print_aggregate_report(const struct daemon *daemon,
+				   unsigned daemon_index,
+				   struct report *report);
 
 /**
  * Print usage or error message and exit.
@@ -248,16 +288,23 @@ static void usage(short status)
 		"                 Allowed values for TYPE are: 'interval', 'through', 'transac',\n"
 		"                 'iat', 'kernel' (all show per default), and 'blocks', 'rtt',\n"
 #ifdef DEBUG
-		"                 'delay', 'status' (optional)\n"
+		"                 'irtt', 'delay', 'rate', 'qct', 'status' (optional)\n"
 #else /* DEBUG */
-		"                 'delay' (optional)\n"
+		"                 'irtt', 'delay', 'rate', 'qct' (optional)\n"
 #endif /* DEBUG */
+		"      --control=FILE\n"
+		"                 read commands from FILE (a FIFO, or '-' for stdin) while the\n"
+		"                 test runs: 'inject ID [START]' starts injected flow ID, at\n"
+		"                 START seconds after the start of the test if given;\n"
+		"                 'retire ID' stops flow ID; 'quit' ends the input. The test\n"
+		"                 runs until the input ended and all flows have ended\n"
 #ifdef DEBUG
 		"  -d, --debug    increase debugging verbosity. Add option multiple times to\n"
 		"                 increase the verbosity\n"
 #endif /* DEBUG */
 		"  -e, --dump-prefix=PRE\n"
-		"                 prepend prefix PRE to pcap dump filename (default: \"%3$s\")\n"
+		"                 prepend prefix PRE to pcap dump and TCP sample filenames\n"
+		"                 (default: \"%3$s\")\n"
 		"  -i, --report-interval=#.#\n"
 		"                 reporting interval, in seconds (default: 0.05s)\n"
 		"      --log-file[=FILE]\n"
@@ -270,6 +317,14 @@ static void usage(short status)
 		"  -s, --tcp-stack=TYPE\n"
 		"                 don't determine unit of source TCP stacks automatically. Force\n"
 		"                 unit to TYPE, where TYPE is 'segment' or 'byte'\n"
+		"      --trace=FILE\n"
+		"                 replay the flows of trace FILE. Each line holds a flow\n"
+		"                 'START SRC DST BYTES' with the start in seconds and the\n"
+		"                 endpoints in the syntax of option -H. Flow options apply to\n"
+		"                 each trace flow, option -n sets the maximum of concurrent flows\n"
+		"      --trace-window=#.#\n"
+		"                 set up trace flows this many seconds ahead of their start\n"
+		"                 (default: 2s)\n"
 		"  -w             write output to logfile (same as --log-file)\n\n"
 
 		"Flow options:\n"
@@ -323,6 +378,59 @@ static void usage(short status)
 		"                 truncates values if used with stochastic traffic generation\n"
 		"  -W x=#         set requested receiver buffer (advertised window), in bytes\n"
 		"  -Y x=#.#       set initial delay before the host starts to send, in seconds\n"
+		"      --window x=#\n"
+		"                 issue a new request only if less than # requests are awaiting\n"
+		"                 their response (closed loop). Requires responses, e.g. -A or\n"
+		"                 -G x=p:... (default: 0, no limit)\n"
+		"      --connections=#\n"
+		"                 open # parallel connections for the flow, which share its\n"
+		"                 rate (-R, --rate-schedule). Interval reports are printed\n"
+		"                 per connection and summed up by the daemon into a row\n"
+		"                 labeled with connection '*'. The final report sums up all\n"
+		"                 connections (default: 1)\n"
+		"      --coflow=ID\n"
+		"                 make the flow part of coflow ID, which completes with its\n"
+		"                 last flow. The flows of a coflow start at the same time on\n"
+		"                 all daemons, given their clocks are synchronized. A summary\n"
+		"                 per coflow follows the final reports\n"
+		"      --injected\n"
+		"                 do not start the flow with the test but on command 'inject'\n"
+		"                 of the control input. Its final report is printed when it\n"
+		"                 ends, after which it may be injected again\n"
+		"      --rate-group x=ID:#.#(z|k|M|G)(b|B)[:#]\n"
+		"                 draw the sending rate from token bucket ID which is shared\n"
+		"                 by all flows of the group on the same daemon. The bucket\n"
+		"                 refills at the given aggregate rate and holds at most the\n"
+		"                 optional burst size in bytes (default: 20ms worth of rate)\n"
+		"      --gate x=#\n"
+		"                 send only while gate # of the daemon is open. The gates are\n"
+		"                 opened and closed by another process, see flowgrindd -g\n"
+		"      --query x=ID[:#.#]\n"
+		"                 issue requests in rounds together with all flows of query\n"
+		"                 group ID on the same daemon (partition/aggregate). A round\n"
+		"                 completes once every flow got its response and starts the\n"
+		"                 next one, at most # rounds per second (default: 0, as fast\n"
+		"                 as possible). Requires responses, e.g. -A or -G x=p:...\n"
+		"      --rate-schedule x=FILE\n"
+		"                 send at the rates given by the schedule in FILE. Each line\n"
+		"                 holds a segment 'DURATION RATE' with the duration in seconds\n"
+		"                 and a rate as for -R. A line 'loop' repeats the schedule,\n"
+		"                 otherwise the last rate is kept after it ended\n"
+		"      --sample x=#.#\n"
+		"                 sample the TCP state (cwnd, RTT, pacing and delivery rate)\n"
+		"                 every #.# seconds, e.g. 0.0001, and write it to a binary\n"
+		"                 time series file per flow endpoint, named after option -e\n"
+		"      --kernel-trace x\n"
+		"                 trace every ACK and retransmission of the flow with eBPF\n"
+		"                 into a file per connection on the daemon. flowgrindd must\n"
+		"                 be run as root, otherwise the flow runs untraced\n"
+		"      --aggregate x=ID\n"
+		"                 sum up the interval reports of all flows of report group ID\n"
+		"                 on the same daemon into one report per interval, labeled\n"
+		"                 S*ID or D*ID. Flows of a group need the same report interval\n"
+		"      --aggregate-only\n"
+		"                 print only the aggregated interval reports of the flow, not\n"
+		"                 its own. Requires --aggregate or --connections\n"
 /*		"  -Z x=#.#       set amount of data to be send, in bytes (instead of -t)\n"*/,
 		progname,
 		MIN_BLOCK_SIZE
@@ -358,7 +466,11 @@ static void usage_sockopt(void)
 		"               set IP_MTU_DISCOVER on test socket if not already enabled by\n"
 		"               system default\n"
 		"  -O x=ROUTE_RECORD\n"
-		"               set ROUTE_RECORD on test socket\n\n"
+		"               set ROUTE_RECORD on test socket\n"
+		"  -O x=SO_MAX_PACING_RATE\n"
+		"               let the kernel pace the test socket at the rate set by -R\n"
+		"               instead of timing blocks in user space. Needs the fq qdisc\n"
+		"               or TCP internal pacing\n\n"
 
 		"Non-standard socket options:\n"
 		"  -O x=TCP_MTCP\n"
@@ -474,6 +586,15 @@ static void init_controller_options(void)
 	copt.mbyte = false;
 	copt.symbolic = true;
 	copt.force_unit = INT_MAX;
+	copt.trace_file = NULL;
+	copt.trace_window = 2.0;
+	copt.control_file = NULL;
+
+	int data = open("/dev/urandom", O_RDONLY);
+	int rc = read(data, &copt.report_scope, sizeof(int));
+	close(data);
+	if (rc == -1)
+		crit("read /dev/urandom failed");
 }
 
 /**
@@ -514,6 +635,24 @@ static void init_flow_options(int num_flows)
 			cflow[id].settings[*i].so_debug = 0;
 			cflow[id].settings[*i].dscp = 0;
 			cflow[id].settings[*i].ipmtudiscover = 0;
+			cflow[id].settings[*i].request_window = 0;
+			cflow[id].settings[*i].kernel_pacing = 0;
+			cflow[id].settings[*i].rate_group = 0;
+			cflow[id].settings[*i].rate_group_rate = 0;
+			cflow[id].settings[*i].rate_group_burst = 0;
+			cflow[id].settings[*i].rate_schedule = NULL;
+			cflow[id].settings[*i].num_rate_segments = 0;
+			cflow[id].settings[*i].rate_schedule_loop = 0;
+			cflow[id].settings[*i].gate = 0;
+			cflow[id].settings[*i].query_group = 0;
+			cflow[id].settings[*i].query_rate = 0;
+			cflow[id].settings[*i].query_fanin = 0;
+			cflow[id].settings[*i].sample_period = 0;
+			cflow[id].settings[*i].kernel_trace = 0;
+			cflow[id].settings[*i].report_group = 0;
+			cflow[id].settings[*i].aggregate_only = 0;
+			cflow[id].sample_file[*i] = NULL;
+			cflow[id].samples_lost[*i] = 0;
 
 			cflow[id].settings[*i].num_extra_socket_options = 0;
 		}
@@ -530,6 +669,8 @@ static void init_flow_options(int num_flows)
 		cflow[id].finished[1] = 0;
 		cflow[id].final_report[0] = NULL;
 		cflow[id].final_report[1] = NULL;
+		cflow[id].final_reports[0] = 0;
+		cflow[id].final_reports[1] = 0;
 
 		cflow[id].summarize_only = 0;
 		cflow[id].late_connect = 0;
@@ -538,6 +679,10 @@ static void init_flow_options(int num_flows)
 		cflow[id].total_blocks[0] = 0;
 		cflow[id].total_blocks[1] = 0;
 		cflow[id].random_seed = 0;
+		cflow[id].connections = 1;
+		cflow[id].coflow = 0;
+		cflow[id].injected = 0;
+		cflow[id].trace_record = 0;
 
 		int data = open("/dev/urandom", O_RDONLY);
 		int rc = read(data, &cflow[id].random_seed, sizeof (int) );
@@ -785,6 +930,9 @@ static void set_flow_endpoint_daemon(const char* server_uuid, char* server_url)
 	for (unsigned int id = 0; id < copt.num_flows; id++) {
 		foreach(int *i, SOURCE, DESTINATION) {
 			struct flow_endpoint* e = &cflow[id].endpoint[*i];
+			/* trace flows get their endpoints later */
+			if (!e->rpc_info)
+				continue;
 			if(!strcmp(e->rpc_info->server_url, server_url) && !e->daemon) {
 				e->daemon = set_unique_daemon_by_uuid(server_uuid,
 								      server_url);
@@ -829,6 +977,8 @@ static void find_daemon(xmlrpc_client *rpc_client)
 			xmlrpc_decompose_value(&rpc_env, resultP, "{s:s,*}", 
 					"server_uuid", &server_uuid);
 			set_flow_endpoint_daemon(server_uuid, flow_rpc_info->server_url);
+			flow_rpc_info->daemon = set_unique_daemon_by_uuid(
+				server_uuid, flow_rpc_info->server_url);
 			die_if_fault_occurred(&rpc_env);
 			xmlrpc_DECREF(resultP);
 		}
@@ -884,6 +1034,50 @@ static void check_idle(xmlrpc_client *rpc_client)
 	}
 }
 
+/**
+ * Print the utilisation of the source address pool of every daemon which has
+ * one (flowgrindd option -a), once the flows are prepared and their test
+ * sockets bound.
+ *
+ * @param[in] rpc_client to connect controller to daemon
+ */
+static void print_source_port_usage(xmlrpc_client *rpc_client)
+{
+	xmlrpc_value * resultP = 0;
+	const struct list_node *node = fg_list_front(&unique_daemons);
+
+	while (node) {
+		if (sigint_caught)
+			return;
+
+		struct daemon *daemon = node->data;
+		node = node->next;
+
+		xmlrpc_client_call2f(&rpc_env, rpc_client, daemon->url,
+				     "get_status", &resultP, "()");
+		die_if_fault_occurred(&rpc_env);
+		if (!resultP)
+			continue;
+
+		int in_use = 0, total = 0;
+		xmlrpc_decompose_value(&rpc_env, resultP,
+				       "{s:i,s:i,*}", "source_ports_in_use",
+				       &in_use, "source_ports_total", &total);
+		xmlrpc_DECREF(resultP);
+		/* Daemons of older versions do not report their pool */
+		if (rpc_env.fault_occurred) {
+			xmlrpc_env_clean(&rpc_env);
+			xmlrpc_env_init(&rpc_env);
+			continue;
+		}
+
+		if (total)
+			print_output("# %s: source ports in use = %d of %d "
+				     "(%.1f%%)\n", daemon->url, in_use, total,
+				     100.0 * in_use / total);
+	}
+}
+
 /**
  * To show/hide intermediated interval report columns.
  *
@@ -980,6 +1174,24 @@ static void print_headline(void)
 				COL_TCP_REOR, COL_TCP_BKOF);
 }
 
+/**
+ * Build the XML-RPC array of the rate schedule segments of @p settings.
+ */
+static xmlrpc_value *build_rate_schedule(const struct flow_settings *settings)
+{
+	xmlrpc_value *schedule = xmlrpc_array_new(&rpc_env);
+
+	for (int i = 0; i < settings->num_rate_segments; i++) {
+		xmlrpc_value *segment = xmlrpc_build_value(&rpc_env,
+			"{s:d,s:d}",
+			"duration", settings->rate_schedule[i].duration,
+			"rate", settings->rate_schedule[i].rate);
+		xmlrpc_array_append_item(&rpc_env, schedule, segment);
+		xmlrpc_DECREF(segment);
+	}
+	return schedule;
+}
+
 /**
  * Prepare test connection for a flow between source and destination daemons.
  * 
@@ -992,9 +1204,10 @@ static void print_headline(void)
  */
 static void prepare_flow(int id, xmlrpc_client *rpc_client)
 {
-	xmlrpc_value *resultP, *extra_options;
+	xmlrpc_value *resultP, *extra_options, *rate_schedule;
 
 	int listen_data_port;
+	int handshake;
 	DEBUG_MSG(LOG_WARNING, "prepare flow %d destination", id);
 
 	/* Contruct extra socket options array */
@@ -1013,6 +1226,8 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		xmlrpc_DECREF(value);
 		xmlrpc_DECREF(option);
 	}
+	rate_schedule = build_rate_schedule(&cflow[id].settings[DESTINATION]);
+
 	xmlrpc_client_call2f(&rpc_env, rpc_client,
 		cflow[id].endpoint[DESTINATION].rpc_info->server_url,
 		"add_flow_destination", &resultP,
@@ -1023,7 +1238,7 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"{s:i,s:i}"
 		"{s:i}"
 		"{s:b,s:b,s:b,s:b,s:b}"
-		"{s:i,s:i}"
+		"{s:d,s:i}"
 		"{s:i,s:d,s:d}" /* request */
 		"{s:i,s:d,s:d}" /* response */
 		"{s:i,s:d,s:d}" /* interpacket_gap */
@@ -1032,6 +1247,17 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"{s:i,s:i,s:i,s:i,s:i}"
 		"{s:s}"
 		"{s:i,s:A}"
+		"{s:i}" /* request window */
+		"{s:i}" /* connections */
+		"{s:i}" /* kernel pacing */
+		"{s:i,s:d,s:i}" /* rate group */
+		"{s:A,s:b}" /* rate schedule */
+		"{s:i}" /* gate */
+		"{s:i,s:d,s:i}" /* query group */
+		"{s:i}" /* coflow */
+		"{s:d}" /* TCP state sampling */
+		"{s:i}" /* kernel trace */
+		"{s:i,s:i,s:b}" /* report group */
 		")",
 
 		/* general flow settings */
@@ -1087,13 +1313,44 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"ipmtudiscover", cflow[id].settings[DESTINATION].ipmtudiscover,
 		"dump_prefix", copt.dump_prefix,
 		"num_extra_socket_options", cflow[id].settings[DESTINATION].num_extra_socket_options,
-		"extra_socket_options", extra_options);
+		"extra_socket_options", extra_options,
+
+		"request_window", cflow[id].settings[DESTINATION].request_window,
+
+		"connections", cflow[id].connections,
+
+		"kernel_pacing", cflow[id].settings[DESTINATION].kernel_pacing,
+
+		"rate_group", cflow[id].settings[DESTINATION].rate_group,
+		"rate_group_rate", cflow[id].settings[DESTINATION].rate_group_rate,
+		"rate_group_burst", cflow[id].settings[DESTINATION].rate_group_burst,
+
+		"rate_schedule", rate_schedule,
+		"rate_schedule_loop", cflow[id].settings[DESTINATION].rate_schedule_loop,
 
+		"gate", cflow[id].settings[DESTINATION].gate,
+
+		"query_group", cflow[id].settings[DESTINATION].query_group,
+		"query_rate", cflow[id].settings[DESTINATION].query_rate,
+		"query_fanin", cflow[id].settings[DESTINATION].query_fanin,
+
+		"coflow", cflow[id].coflow,
+
+		"sample_period", cflow[id].settings[DESTINATION].sample_period,
+
+		"kernel_trace", cflow[id].settings[DESTINATION].kernel_trace,
+
+		"report_group", cflow[id].settings[DESTINATION].report_group,
+		"report_scope", copt.report_scope,
+		"aggregate_only", cflow[id].settings[DESTINATION].aggregate_only);
+
+	xmlrpc_DECREF(rate_schedule);
 	die_if_fault_occurred(&rpc_env);
 
-	xmlrpc_parse_value(&rpc_env, resultP, "{s:i,s:i,s:i,s:i,*}",
+	xmlrpc_parse_value(&rpc_env, resultP, "{s:i,s:i,s:i,s:i,s:i,*}",
 		"flow_id", &cflow[id].endpoint_id[DESTINATION],
 		"listen_data_port", &listen_data_port,
+		"handshake", &handshake,
 		"real_listen_send_buffer_size", &cflow[id].endpoint[DESTINATION].send_buffer_size_real,
 		"real_listen_read_buffer_size", &cflow[id].endpoint[DESTINATION].receive_buffer_size_real);
 	die_if_fault_occurred(&rpc_env);
@@ -1120,6 +1377,8 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 	}
 	DEBUG_MSG(LOG_WARNING, "prepare flow %d source", id);
 
+	rate_schedule = build_rate_schedule(&cflow[id].settings[SOURCE]);
+
 	xmlrpc_client_call2f(&rpc_env, rpc_client,
 		cflow[id].endpoint[SOURCE].rpc_info->server_url,
 		"add_flow_source", &resultP,
@@ -1130,7 +1389,7 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"{s:i,s:i}"
 		"{s:i}"
 		"{s:b,s:b,s:b,s:b,s:b}"
-		"{s:i,s:i}"
+		"{s:d,s:i}"
 		"{s:i,s:d,s:d}" /* request */
 		"{s:i,s:d,s:d}" /* response */
 		"{s:i,s:d,s:d}" /* interpacket_gap */
@@ -1139,7 +1398,18 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"{s:i,s:i,s:i,s:i,s:i}"
 		"{s:s}"
 		"{s:i,s:A}"
-		"{s:s,s:i,s:i}"
+		"{s:i}" /* request window */
+		"{s:i}" /* connections */
+		"{s:i}" /* kernel pacing */
+		"{s:i,s:d,s:i}" /* rate group */
+		"{s:A,s:b}" /* rate schedule */
+		"{s:i}" /* gate */
+		"{s:i,s:d,s:i}" /* query group */
+		"{s:i}" /* coflow */
+		"{s:d}" /* TCP state sampling */
+		"{s:i}" /* kernel trace */
+		"{s:i,s:i,s:b}" /* report group */
+		"{s:s,s:i,s:i,s:i}"
 		")",
 
 		/* general flow settings */
@@ -1198,10 +1468,41 @@ static void prepare_flow(int id, xmlrpc_client *rpc_client)
 		"num_extra_socket_options", cflow[id].settings[SOURCE].num_extra_socket_options,
 		"extra_socket_options", extra_options,
 
+		"request_window", cflow[id].settings[SOURCE].request_window,
+
+		"connections", cflow[id].connections,
+
+		"kernel_pacing", cflow[id].settings[SOURCE].kernel_pacing,
+
+		"rate_group", cflow[id].settings[SOURCE].rate_group,
+		"rate_group_rate", cflow[id].settings[SOURCE].rate_group_rate,
+		"rate_group_burst", cflow[id].settings[SOURCE].rate_group_burst,
+
+		"rate_schedule", rate_schedule,
+		"rate_schedule_loop", cflow[id].settings[SOURCE].rate_schedule_loop,
+
+		"gate", cflow[id].settings[SOURCE].gate,
+
+		"query_group", cflow[id].settings[SOURCE].query_group,
+		"query_rate", cflow[id].settings[SOURCE].query_rate,
+		"query_fanin", cflow[id].settings[SOURCE].query_fanin,
+
+		"coflow", cflow[id].coflow,
+
+		"sample_period", cflow[id].settings[SOURCE].sample_period,
+
+		"kernel_trace", cflow[id].settings[SOURCE].kernel_trace,
+
+		"report_group", cflow[id].settings[SOURCE].report_group,
+		"report_scope", copt.report_scope,
+		"aggregate_only", cflow[id].settings[SOURCE].aggregate_only,
+
 		/* source settings */
 		"destination_address", cflow[id].endpoint[DESTINATION].test_address,
 		"destination_port", listen_data_port,
-		"late_connect", (int)cflow[id].late_connect);
+		"late_connect", (int)cflow[id].late_connect,
+		"handshake", handshake);
+	xmlrpc_DECREF(rate_schedule);
 	die_if_fault_occurred(&rpc_env);
 
 	xmlrpc_DECREF(extra_options);
@@ -1228,6 +1529,9 @@ static void prepare_all_flows(xmlrpc_client *rpc_client)
 	for (unsigned int id = 0; id < copt.num_flows; id++) {
 		if (sigint_caught)
 			return;
+		/* Injected flows are prepared on demand */
+		if (cflow[id].injected)
+			continue;
 		prepare_flow(id, rpc_client);
 	}
 }
@@ -1254,6 +1558,7 @@ static void start_all_flows(xmlrpc_client *rpc_client)
 	gettime(&lastreport_end);
 	gettime(&lastreport_begin);
 	gettime(&now);
+	epoch = now;
 
 	const struct list_node *node = fg_list_front(&unique_daemons);
 	while (node) {
@@ -1272,21 +1577,31 @@ static void start_all_flows(xmlrpc_client *rpc_client)
 			xmlrpc_DECREF(resultP);
 	}
 
-	active_flows = copt.num_flows;
+	active_flows = 0;
+	for (unsigned int id = 0; id < copt.num_flows; id++)
+		if (!cflow[id].injected)
+			active_flows++;
 
 	/* Reports are fetched from the daemons based on the
-	 * report interval duration */
+	 * report interval duration. In between, commands from the control
+	 * input are carried out */
 	while (!sigint_caught) {
 		if ( time_diff_now(&lastreport_begin) <  copt.reporting_interval ) {
-			usleep(copt.reporting_interval - time_diff(&lastreport_begin,&lastreport_end) );
+			if (control_fd != -1)
+				process_control(rpc_client,
+						copt.reporting_interval -
+						time_diff_now(&lastreport_begin));
+			else
+				usleep(copt.reporting_interval - time_diff(&lastreport_begin,&lastreport_end) );
 			continue;
 		}
 		gettime(&lastreport_begin);
 		fetch_reports(rpc_client);
+		finish_flows();
 		gettime(&lastreport_end);
 
-		/* All flows have ended */
-		if (active_flows < 1)
+		/* All flows have ended and no more are injected */
+		if (active_flows < 1 && control_fd == -1)
 			return;
 	}
 }
@@ -1305,8 +1620,9 @@ static void fetch_reports(xmlrpc_client *rpc_client)
 
 	xmlrpc_value * resultP = 0;
 	const struct list_node *node = fg_list_front(&unique_daemons);
+	unsigned daemon_index = 0;
 
-	while (node) {
+	for (; node; daemon_index++) {
 		struct daemon *daemon = node->data;
 		node = node->next;
 		int array_size, has_more;
@@ -1363,8 +1679,14 @@ has_more_reports:
 				int tcpi_backoff;
 				int tcpi_ca_state;
 				int tcpi_snd_mss;
+				double tcpi_delivery_rate, tcpi_bytes_acked;
+				double tcpi_busy_time, tcpi_rwnd_limited;
+				double tcpi_sndbuf_limited;
 				int bytes_read_low, bytes_read_high;
 				int bytes_written_low, bytes_written_high;
+				unsigned char *samples = NULL;
+				size_t samples_size = 0;
+				int aggregated, aggregated_tcp_info;
 
 				xmlrpc_decompose_value(&rpc_env, rv,
 					"("
@@ -1376,6 +1698,16 @@ has_more_reports:
 					"{s:i,s:i,s:i,s:i,s:i,*}" /* TCP info */
 					"{s:i,s:i,s:i,s:i,s:i,*}" /* ...      */
 					"{s:i,s:i,s:i,s:i,s:i,*}" /* ...      */
+					"{s:i,s:i,*}" /* Response queue */
+					"{s:d,s:d,s:d,s:i,s:d,s:d,*}" /* Intended RTT, schedule slips */
+					"{s:i,*}" /* Connection */
+					"{s:d,s:i,*}" /* Connect */
+					"{s:d,*}" /* rate schedule */
+					"{s:i,s:d,s:d,s:d,s:d,s:d,s:d,*}" /* query completion time */
+					"{s:d,s:d,s:d,s:d,s:d,s:i,s:i,*}" /* TCP info: delivery, limits, ECN */
+					"{s:6,s:i,*}" /* TCP state samples */
+					"{s:i,s:i,*}" /* Traffic dump drops */
+					"{s:i,s:i,s:i,s:i,s:i,s:i,*}" /* Aggregate report */
 					"{s:i,*}"
 					")",
 
@@ -1428,6 +1760,52 @@ has_more_reports:
 					"tcpi_ca_state", &tcpi_ca_state,
 					"tcpi_snd_mss", &tcpi_snd_mss,
 
+					"response_queue_depth", &report.response_queue_depth,
+					"response_queue_max", &report.response_queue_max,
+
+					"rtt_intended_min", &report.rtt_intended_min,
+					"rtt_intended_max", &report.rtt_intended_max,
+					"rtt_intended_sum", &report.rtt_intended_sum,
+					"schedule_slips", &report.schedule_slips,
+					"schedule_slip_max", &report.schedule_slip_max,
+					"schedule_slip_sum", &report.schedule_slip_sum,
+
+					"connection", &report.connection,
+
+					"connect_time", &report.connect_time,
+					"connect_retries", &report.connect_retries,
+
+					"scheduled_bytes", &report.scheduled_bytes,
+
+					"query_rounds", &report.query_rounds,
+					"qct_min", &report.qct_min,
+					"qct_max", &report.qct_max,
+					"qct_sum", &report.qct_sum,
+					"qct_p50", &report.qct_p50,
+					"qct_p99", &report.qct_p99,
+					"qct_p999", &report.qct_p999,
+
+					"tcpi_delivery_rate", &tcpi_delivery_rate,
+					"tcpi_bytes_acked", &tcpi_bytes_acked,
+					"tcpi_busy_time", &tcpi_busy_time,
+					"tcpi_rwnd_limited", &tcpi_rwnd_limited,
+					"tcpi_sndbuf_limited", &tcpi_sndbuf_limited,
+					"tcpi_ecn", &report.tcp_info.tcpi_ecn,
+					"tcpi_delivered_ce", &report.tcp_info.tcpi_delivered_ce,
+
+					"tcp_samples", &samples, &samples_size,
+					"tcp_samples_lost", &report.samples_lost,
+
+					"dump_kernel_drops", &report.dump_kernel_drops,
+					"dump_writer_drops", &report.dump_writer_drops,
+
+					"aggregated", &aggregated,
+					"aggregated_tcp_info", &aggregated_tcp_info,
+					"tcpi_snd_cwnd_min", &report.tcpi_snd_cwnd_min,
+					"tcpi_snd_cwnd_max", &report.tcpi_snd_cwnd_max,
+					"tcpi_rtt_min", &report.tcpi_rtt_min,
+					"tcpi_rtt_max", &report.tcpi_rtt_max,
+
 					"status", &report.status
 				);
 				xmlrpc_DECREF(rv);
@@ -1459,13 +1837,32 @@ has_more_reports:
 				report.tcp_info.tcpi_backoff = tcpi_backoff;
 				report.tcp_info.tcpi_ca_state = tcpi_ca_state;
 				report.tcp_info.tcpi_snd_mss = tcpi_snd_mss;
+				report.tcp_info.tcpi_delivery_rate = tcpi_delivery_rate;
+				report.tcp_info.tcpi_bytes_acked = tcpi_bytes_acked;
+				report.tcp_info.tcpi_busy_time = tcpi_busy_time;
+				report.tcp_info.tcpi_rwnd_limited = tcpi_rwnd_limited;
+				report.tcp_info.tcpi_sndbuf_limited = tcpi_sndbuf_limited;
 
 				report.begin.tv_sec = begin_sec;
 				report.begin.tv_nsec = begin_nsec;
 				report.end.tv_sec = end_sec;
 				report.end.tv_nsec = end_nsec;
 
-				report_flow(&report);
+				report.samples = samples;
+				report.samples_size = samples_size;
+
+				report.aggregated = aggregated;
+				report.aggregated_tcp_info = aggregated_tcp_info;
+
+				/* aggregates of the connections of a flow
+				 * are printed like the flow's own reports */
+				if (report.aggregated && report.connection >= 0)
+					print_aggregate_report(daemon,
+							       daemon_index,
+							       &report);
+				else
+					report_flow(&report);
+				free(samples);
 			}
 		}
 		xmlrpc_DECREF(resultP);
@@ -1475,6 +1872,166 @@ has_more_reports:
 	}
 }
 
+/**
+ * Merge the final report of one connection of a flow into another.
+ *
+ * Counters and accumulated values are summed up, extreme values and the
+ * reporting period are widened. TCP info and MTUs of the first connection are
+ * kept.
+ *
+ * @param[in,out] r final report to merge into
+ * @param[in] o final report of a further connection
+ */
+static void merge_final_report(struct report *r, const struct report *o)
+{
+	if (time_is_after(&r->begin, &o->begin))
+		r->begin = o->begin;
+	if (time_is_after(&o->end, &r->end))
+		r->end = o->end;
+
+	r->bytes_read += o->bytes_read;
+	r->bytes_written += o->bytes_written;
+	r->request_blocks_read += o->request_blocks_read;
+	r->request_blocks_written += o->request_blocks_written;
+	r->response_blocks_read += o->response_blocks_read;
+	r->response_blocks_written += o->response_blocks_written;
+
+	ASSIGN_MIN(r->iat_min, o->iat_min);
+	ASSIGN_MAX(r->iat_max, o->iat_max);
+	r->iat_sum += o->iat_sum;
+	ASSIGN_MIN(r->delay_min, o->delay_min);
+	ASSIGN_MAX(r->delay_max, o->delay_max);
+	r->delay_sum += o->delay_sum;
+	ASSIGN_MIN(r->rtt_min, o->rtt_min);
+	ASSIGN_MAX(r->rtt_max, o->rtt_max);
+	r->rtt_sum += o->rtt_sum;
+	ASSIGN_MIN(r->rtt_intended_min, o->rtt_intended_min);
+	ASSIGN_MAX(r->rtt_intended_max, o->rtt_intended_max);
+	r->rtt_intended_sum += o->rtt_intended_sum;
+
+	r->schedule_slips += o->schedule_slips;
+	ASSIGN_MAX(r->schedule_slip_max, o->schedule_slip_max);
+	r->schedule_slip_sum += o->schedule_slip_sum;
+
+	r->response_queue_depth += o->response_queue_depth;
+	ASSIGN_MAX(r->response_queue_max, o->response_queue_max);
+
+	ASSIGN_MAX(r->connect_time, o->connect_time);
+	r->connect_retries += o->connect_retries;
+
+	/* the connections share the interface and dump file of the flow */
+	ASSIGN_MAX(r->dump_kernel_drops, o->dump_kernel_drops);
+	ASSIGN_MAX(r->dump_writer_drops, o->dump_writer_drops);
+
+	r->scheduled_bytes += o->scheduled_bytes;
+
+	/* only one connection of a query group reports its rounds */
+	r->query_rounds += o->query_rounds;
+	ASSIGN_MIN(r->qct_min, o->qct_min);
+	ASSIGN_MAX(r->qct_max, o->qct_max);
+	r->qct_sum += o->qct_sum;
+	ASSIGN_MAX(r->qct_p50, o->qct_p50);
+	ASSIGN_MAX(r->qct_p99, o->qct_p99);
+	ASSIGN_MAX(r->qct_p999, o->qct_p999);
+
+	r->tcp_info.tcpi_delivery_rate += o->tcp_info.tcpi_delivery_rate;
+	r->tcp_info.tcpi_bytes_acked += o->tcp_info.tcpi_bytes_acked;
+	r->tcp_info.tcpi_busy_time += o->tcp_info.tcpi_busy_time;
+	r->tcp_info.tcpi_rwnd_limited += o->tcp_info.tcpi_rwnd_limited;
+	r->tcp_info.tcpi_sndbuf_limited += o->tcp_info.tcpi_sndbuf_limited;
+	r->tcp_info.tcpi_ecn |= o->tcp_info.tcpi_ecn;
+	r->tcp_info.tcpi_delivered_ce += o->tcp_info.tcpi_delivered_ce;
+}
+
+/**
+ * Write the TCP state samples shipped with @p report to the time series file
+ * of the flow endpoint, which is created with the first samples.
+ *
+ * @param[in] id flow ID
+ * @param[in] endpoint flow endpoint the samples belong to
+ * @param[in] report report with samples
+ */
+static void write_samples(unsigned id, int endpoint, struct report *report)
+{
+	struct cflow *f = &cflow[id];
+
+	if (!f->sample_file[endpoint]) {
+		static char timestamp[30] = "";
+		unsigned char header[24];
+		uint64_t period = f->settings[endpoint].sample_period * 1e9;
+		const char e = endpoint == SOURCE ? 's' : 'd';
+		char *filename;
+		int rc;
+
+		/* one timestamp for the files of all flows of the test */
+		if (!*timestamp)
+			ctimenow_r(timestamp, sizeof(timestamp), false);
+		/* each run of a flow set up again gets a file of its own */
+		if (f->injected)
+			rc = asprintf(&filename, "%s%s-%u.%u-%c.tcps",
+				      copt.dump_prefix, timestamp, id,
+				      f->injections, e);
+		else if (f->trace_record)
+			rc = asprintf(&filename, "%s%s-%u.%lu-%c.tcps",
+				      copt.dump_prefix, timestamp, id,
+				      f->trace_record, e);
+		else
+			rc = asprintf(&filename, "%s%s-%u-%c.tcps",
+				      copt.dump_prefix, timestamp, id, e);
+		if (rc == -1)
+			critx("could not allocate memory for sample filename");
+		if (!copt.clobber && access(filename, R_OK) == 0)
+			critx("sample file '%s' exists", filename);
+
+		f->sample_file[endpoint] = fopen(filename, "w");
+		if (!f->sample_file[endpoint])
+			crit("could not open sample file '%s'", filename);
+		DEBUG_MSG(LOG_NOTICE, "writing TCP state samples of flow %u "
+			  "to '%s'", id, filename);
+		free(filename);
+
+		memcpy(header, "FGTS", 4);
+		header[4] = 0;
+		header[5] = 1;
+		header[6] = TCP_SAMPLE_SIZE >> 8;
+		header[7] = TCP_SAMPLE_SIZE & 0xff;
+		for (int n = 0; n < 4; n++) {
+			header[8 + n] = id >> (24 - 8 * n);
+			header[12 + n] = endpoint >> (24 - 8 * n);
+		}
+		for (int n = 0; n < 8; n++)
+			header[16 + n] = period >> (56 - 8 * n);
+		if (fwrite(header, sizeof(header), 1, f->sample_file[endpoint])
+		    != 1)
+			crit("could not write sample file header");
+	}
+
+	if (fwrite(report->samples, report->samples_size, 1,
+		   f->sample_file[endpoint]) != 1)
+		crit("could not write TCP state samples of flow %u", id);
+}
+
+/**
+ * Close the time series file of the TCP state samples of a flow endpoint.
+ *
+ * @param[in] id flow ID
+ * @param[in] endpoint flow endpoint
+ */
+static void close_sample_file(unsigned id, int endpoint)
+{
+	struct cflow *f = &cflow[id];
+
+	if (f->samples_lost[endpoint])
+		warnx("flow %u: %lu TCP state samples of the %s were lost", id,
+		      f->samples_lost[endpoint],
+		      endpoint == SOURCE ? "source" : "destination");
+	if (!f->sample_file[endpoint])
+		return;
+	if (fclose(f->sample_file[endpoint]) == EOF)
+		crit("could not close sample file of flow %u", id);
+	f->sample_file[endpoint] = NULL;
+}
+
 /**
  * Reports are fetched from the flow endpoint daemon
  *
@@ -1508,18 +2065,43 @@ static void report_flow(struct report* report)
 	}
 exit_outer_loop:
 
+	if (id == copt.num_flows) {
+		DEBUG_MSG(LOG_WARNING, "received report for unknown flow %d",
+			  report->id);
+		return;
+	}
+
 	if (f->start_timestamp[*i].tv_sec == 0)
 		f->start_timestamp[*i] = report->begin;
 
+	/* The sample file of a flow stopped by the controller is closed */
+	if (report->samples_size && !f->finished[*i])
+		write_samples(id, *i, report);
+	f->samples_lost[*i] += report->samples_lost;
+	/* the samples are freed by the caller */
+	report->samples = NULL;
+	report->samples_size = 0;
+
 	if (report->type == FINAL) {
-		DEBUG_MSG(LOG_DEBUG, "received final report for flow %d", id);
-		/* Final report, keep it for later */
-		free(f->final_report[*i]);
-		f->final_report[*i] = malloc(sizeof(struct report));
-		*f->final_report[*i] = *report;
+		DEBUG_MSG(LOG_DEBUG, "received final report for flow %d "
+			  "connection %d", id, report->connection);
+		/* Final report, keep it for later. Reports of further
+		 * connections are merged into the first one */
+		if (f->connections > 1 && f->final_reports[*i]) {
+			merge_final_report(f->final_report[*i], report);
+		} else {
+			free(f->final_report[*i]);
+			f->final_report[*i] = malloc(sizeof(struct report));
+			*f->final_report[*i] = *report;
+		}
+
+		/* Flow endpoint is finished once all connections are */
+		if (++f->final_reports[*i] < f->connections)
+			return;
 
 		if (!f->finished[*i]) {
 			f->finished[*i] = 1;
+			close_sample_file(id, *i);
 			if (f->finished[1 - *i]) {
 				active_flows--;
 				DEBUG_MSG(LOG_DEBUG, "remaining active flows: "
@@ -1533,58 +2115,68 @@ exit_outer_loop:
 }
 
 /**
- * Stop test connections for all flows in a test
+ * Stop the test connections of flow @p id.
  *
- * All the test connection are stopped, but the test connection flow in the
- * controller and in daemon are different. In the controller, test connection
- * are respective to number of flows in a test,but in daemons test connection
- * are respective to flow endpoints. Single daemons can maintain multiple flows
- * endpoints, So controller should stop a daemon only once.
+ * @param[in] id ID of the flow
  */
-static void close_all_flows(void)
+static void close_flow(unsigned int id)
 {
 	xmlrpc_env env;
 	xmlrpc_client *client;
 
-	for (unsigned int id = 0; id < copt.num_flows; id++) {
-		DEBUG_MSG(LOG_WARNING, "closing flow %u", id);
+	DEBUG_MSG(LOG_WARNING, "closing flow %u", id);
 
-		if (cflow[id].finished[SOURCE] && cflow[id].finished[DESTINATION])
-			continue;
+	if (cflow[id].finished[SOURCE] && cflow[id].finished[DESTINATION])
+		return;
 
-		/* We use new env and client, old one might be in fault condition */
-		xmlrpc_env_init(&env);
-		xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "Flowgrind", FLOWGRIND_VERSION, NULL, 0, &client);
-		die_if_fault_occurred(&env);
-		xmlrpc_env_clean(&env);
+	/* We use new env and client, old one might be in fault condition */
+	xmlrpc_env_init(&env);
+	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "Flowgrind", FLOWGRIND_VERSION, NULL, 0, &client);
+	die_if_fault_occurred(&env);
+	xmlrpc_env_clean(&env);
 
-		foreach(int *i, SOURCE, DESTINATION) {
-			xmlrpc_value * resultP = 0;
+	foreach(int *i, SOURCE, DESTINATION) {
+		xmlrpc_value * resultP = 0;
 
-			if (cflow[id].endpoint_id[*i] == -1 ||
-			    cflow[id].finished[*i])
-				/* Endpoint does not need closing */
-				continue;
+		if (cflow[id].endpoint_id[*i] == -1 ||
+		    cflow[id].finished[*i])
+			/* Endpoint does not need closing */
+			continue;
 
-			cflow[id].finished[*i] = 1;
+		cflow[id].finished[*i] = 1;
+		close_sample_file(id, *i);
 
-			xmlrpc_env_init(&env);
-			xmlrpc_client_call2f(&env, client,
-					     cflow[id].endpoint[*i].rpc_info->server_url,
-					     "stop_flow", &resultP, "({s:i})",
-					     "flow_id", cflow[id].endpoint_id[*i]);
-			if (resultP)
-				xmlrpc_DECREF(resultP);
+		xmlrpc_env_init(&env);
+		xmlrpc_client_call2f(&env, client,
+				     cflow[id].endpoint[*i].rpc_info->server_url,
+				     "stop_flow", &resultP, "({s:i})",
+				     "flow_id", cflow[id].endpoint_id[*i]);
+		if (resultP)
+			xmlrpc_DECREF(resultP);
 
-			xmlrpc_env_clean(&env);
-		}
+		xmlrpc_env_clean(&env);
+	}
 
-		if (active_flows > 0)
-			active_flows--;
+	if (active_flows > 0)
+		active_flows--;
 
-		xmlrpc_client_destroy(client);
-		DEBUG_MSG(LOG_WARNING, "closed flow %u", id);
-	}
+	xmlrpc_client_destroy(client);
+	DEBUG_MSG(LOG_WARNING, "closed flow %u", id);
+}
+
+/**
+ * Stop test connections for all flows in a test
+ *
+ * All the test connection are stopped, but the test connection flow in the
+ * controller and in daemon are different. In the controller, test connection
+ * are respective to number of flows in a test,but in daemons test connection
+ * are respective to flow endpoints. Single daemons can maintain multiple flows
+ * endpoints, So controller should stop a daemon only once.
+ */
+static void close_all_flows(void)
+{
+	for (unsigned int id = 0; id < copt.num_flows; id++)
+		close_flow(id);
 }
 
 /**
@@ -1765,17 +2357,31 @@ static bool print_column(char **header1, char **header2, char **data,
 }
 
 /**
- * Print interval report @p report for endpoint @p e of flow @p flow_id.
+ * Check if the daemon paces the blocks of an endpoint with @p settings, i.e.
+ * schedules their sending times, which its intended RTT is measured from.
+ */
+static bool endpoint_paced(const struct flow_settings *settings)
+{
+	return (settings->write_rate && !settings->kernel_pacing) ||
+		settings->num_rate_segments ||
+		settings->interpacket_gap_trafgen_options.param_one;
+}
+
+/**
+ * Print the row of interval report @p report, labeled with @p label.
  *
  * In addition, if the width of one intermediated interval report columns has
  * been changed, the interval column header will be printed again.
  *
- * @param[in] flow_id flow an interval report will be created for
- * @param[in] e flow endpoint (SOURCE or DESTINATION)
+ * @param[in] label content of the flow ID column
+ * @param[in] start point in time the begin and end of the report refer to
+ * @param[in] write_rate sending rate (option -R) of the reporting endpoint, or 0
+ * @param[in] finished whether the reporting endpoint has stopped
  * @param[in] report interval report to be printed
  */
-static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
-				  struct report *report)
+static void print_report_row(const char *label, const struct timespec *start,
+			     double write_rate, bool finished,
+			     struct report *report)
 {
 	/* Whether or not column width has been changed */
 	bool changed = false;
@@ -1785,14 +2391,12 @@ static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 	/* Flow ID and endpoint (source or destination) */
 	if (asprintf(&header1, "%s", column_info[COL_FLOW_ID].header.name) == -1 ||
 	    asprintf(&header2, "%s", column_info[COL_FLOW_ID].header.unit) == -1 ||
-	    asprintf(&data, "%s%3d", e ? "D" : "S", flow_id) == -1)
+	    asprintf(&data, "%s", label) == -1)
 		critx("could not allocate memory for interval report");
 
 	/* Calculate time */
-	double diff_first_last = time_diff(&cflow[flow_id].start_timestamp[e],
-					   &report->begin);
-	double diff_first_now = time_diff(&cflow[flow_id].start_timestamp[e],
-					  &report->end);
+	double diff_first_last = time_diff(start, &report->begin);
+	double diff_first_now = time_diff(start, &report->end);
 	changed |= print_column(&header1, &header2, &data, COL_BEGIN,
 				diff_first_last, 3);
 	changed |= print_column(&header1, &header2, &data, COL_END,
@@ -1805,6 +2409,23 @@ static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 	changed |= print_column(&header1, &header2, &data, COL_THROUGH,
 				thruput, 6);
 
+	/* Sending rate of the rate schedule in this interval */
+	double sched = scale_thruput(report->scheduled_bytes /
+				     (diff_first_now - diff_first_last));
+	changed |= print_column(&header1, &header2, &data, COL_SCHED,
+				sched, 6);
+
+	/* Achieved rate relative to the sending rate (option -R or
+	 * --rate-schedule) */
+	double rate = 0.0;
+	if (report->scheduled_bytes)
+		rate = (double)report->bytes_written /
+		       report->scheduled_bytes * 100.0;
+	else if (write_rate)
+		rate = (double)report->bytes_written /
+		       (diff_first_now - diff_first_last) / write_rate * 100.0;
+	changed |= print_column(&header1, &header2, &data, COL_RATE, rate, 1);
+
 	/* Transactions */
 	double transac = (double)report->response_blocks_read /
 			 (diff_first_now - diff_first_last);
@@ -1831,6 +2452,36 @@ static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 	changed |= print_column(&header1, &header2, &data, COL_RTT_MAX,
 				report->rtt_max * 1e3, 3);
 
+	/* RTT from the scheduled sending time */
+	double irtt_avg = 0.0;
+	if (report->response_blocks_read && report->rtt_intended_sum)
+		irtt_avg = report->rtt_intended_sum /
+			   (double)(report->response_blocks_read);
+	else
+		report->rtt_intended_min = report->rtt_intended_max =
+			irtt_avg = INFINITY;
+	changed |= print_column(&header1, &header2, &data, COL_IRTT_MIN,
+				report->rtt_intended_min * 1e3, 3);
+	changed |= print_column(&header1, &header2, &data, COL_IRTT_AVG,
+				irtt_avg * 1e3, 3);
+	changed |= print_column(&header1, &header2, &data, COL_IRTT_MAX,
+				report->rtt_intended_max * 1e3, 3);
+
+	/* Query completion time */
+	double qct_avg = 0.0;
+	if (report->query_rounds)
+		qct_avg = report->qct_sum / (double)(report->query_rounds);
+	else
+		report->qct_min = report->qct_max = qct_avg = INFINITY;
+	changed |= print_column(&header1, &header2, &data, COL_QRY_ROUNDS,
+				report->query_rounds, 0);
+	changed |= print_column(&header1, &header2, &data, COL_QCT_MIN,
+				report->qct_min * 1e3, 3);
+	changed |= print_column(&header1, &header2, &data, COL_QCT_AVG,
+				qct_avg * 1e3, 3);
+	changed |= print_column(&header1, &header2, &data, COL_QCT_MAX,
+				report->qct_max * 1e3, 3);
+
 	/* IAT */
 	double iat_avg = 0.0;
 	if (report->request_blocks_read && report->iat_sum)
@@ -1918,10 +2569,12 @@ static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 				report->pmtu, 0);
 
 /* Internal flowgrind state */
-#ifdef DEBUG
+#ifndef DEBUG
+	UNUSED_ARGUMENT(finished);
+#else /* DEBUG */
 	int rc = 0;
 	char *fg_state = NULL;
-	if (cflow[flow_id].finished[e]) {
+	if (finished) {
 		rc = asprintf(&fg_state, "(stopped)");
 	} else {
 		/* Write status */
@@ -1960,6 +2613,104 @@ static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
 	free_all(header1, header2, data);
 }
 
+/**
+ * Print interval report @p report for endpoint @p e of flow @p flow_id.
+ *
+ * The report of one connection of a multi-connection flow is labeled with the
+ * connection, the sum of all connections the daemon sends with a '*'.
+ *
+ * @param[in] flow_id flow an interval report will be created for
+ * @param[in] e flow endpoint (SOURCE or DESTINATION)
+ * @param[in] report interval report to be printed
+ */
+static void print_interval_report(unsigned short flow_id, enum endpoint_t e,
+				  struct report *report)
+{
+	char *label = NULL;
+	int rc;
+
+	if (cflow[flow_id].connections > 1 && report->connection < 0)
+		rc = asprintf(&label, "%s%3d/*", e ? "D" : "S", flow_id);
+	else if (cflow[flow_id].connections > 1)
+		rc = asprintf(&label, "%s%3d/%d", e ? "D" : "S", flow_id,
+			      report->connection);
+	else
+		rc = asprintf(&label, "%s%3d", e ? "D" : "S", flow_id);
+	if (rc == -1)
+		critx("could not allocate memory for interval report");
+
+	print_report_row(label, &cflow[flow_id].start_timestamp[e],
+			 cflow[flow_id].settings[e].write_rate,
+			 cflow[flow_id].finished[e], report);
+	free(label);
+}
+
+/**
+ * Print aggregated interval report @p report of a report group (option
+ * --aggregate) of the daemon with index @p daemon_index.
+ *
+ * The report is labeled with the group ID, and with the daemon if several
+ * daemons take part in the test. Its times refer to the start of the
+ * earliest flow of the group, like the rows of the flows themselves. The row
+ * is followed by a comment with the number of flows summed up and the
+ * distribution of their cwnd and RTT, as the TCP info columns hold the mean
+ * over the flows.
+ *
+ * @param[in] daemon reporting daemon
+ * @param[in] daemon_index position of the reporting daemon in the daemon list
+ * @param[in] report aggregated interval report to be printed
+ */
+static void print_aggregate_report(const struct daemon *daemon,
+				   unsigned daemon_index,
+				   struct report *report)
+{
+	const struct timespec *start = NULL;
+	char *label = NULL, *buf = NULL;
+	int e = report->endpoint;
+	int rc;
+
+	/* Flows which only report into the group get their start from it */
+	for (unsigned id = 0; id < copt.num_flows; id++) {
+		struct timespec *ts = &cflow[id].start_timestamp[e];
+
+		if (cflow[id].settings[e].report_group != report->id ||
+		    cflow[id].endpoint[e].daemon != daemon)
+			continue;
+		if (ts->tv_sec == 0)
+			*ts = report->begin;
+		if (!start || time_is_after(start, ts))
+			start = ts;
+	}
+	if (!start)
+		start = &report->begin;
+
+	if (fg_list_size(&unique_daemons) > 1)
+		rc = asprintf(&label, "%s*%d@%u", report->endpoint ? "D" : "S",
+			      report->id, daemon_index);
+	else
+		rc = asprintf(&label, "%s*%d", report->endpoint ? "D" : "S",
+			      report->id);
+	if (rc == -1)
+		critx("could not allocate memory for aggregate report");
+
+	print_report_row(label, start, 0, false, report);
+
+	if (asprintf(&buf, "# %s: %u reports", label,
+		     report->aggregated) == -1)
+		critx("could not allocate memory for aggregate report");
+	if (report->aggregated_tcp_info)
+		asprintf_append(&buf, ", cwnd = %d/%d/%d, krtt = "
+				"%.3f/%.3f/%.3f (min/avg/max)",
+				report->tcpi_snd_cwnd_min,
+				report->tcp_info.tcpi_snd_cwnd,
+				report->tcpi_snd_cwnd_max,
+				report->tcpi_rtt_min / 1e3,
+				report->tcp_info.tcpi_rtt / 1e3,
+				report->tcpi_rtt_max / 1e3);
+	print_output("%s\n", buf);
+	free_all(label, buf);
+}
+
 /**
  * Maps common MTU sizes to network known technologies.
  *
@@ -2037,6 +2788,11 @@ static void print_final_report(unsigned short flow_id, enum endpoint_t e)
 	asprintf_append(&buf, " (%s %s), ",
 			endpoint->daemon->os_name, endpoint->daemon->os_release);
 
+	/* Trace record replayed by the flow */
+	if (cflow[flow_id].trace_record)
+		asprintf_append(&buf, "trace record: %lu, ",
+				cflow[flow_id].trace_record);
+
 	/* Random seed */
 	asprintf_append(&buf, "random seed: %u, ", cflow[flow_id].random_seed);
 
@@ -2110,6 +2866,23 @@ static void print_final_report(unsigned short flow_id, enum endpoint_t e)
 		asprintf_append(&buf, "through = " "%.6f/%.6f [Mbit/s] (out/in)",
 				thruput_write, thruput_read);
 
+	/* Delivery and what limited the sender, as seen by the kernel */
+	if (report->tcp_info.tcpi_busy_time) {
+		asprintf_append(&buf, ", delivery rate = %.6f [%s]",
+				scale_thruput(report->tcp_info.tcpi_delivery_rate),
+				copt.mbyte ? "MiB/s" : "Mbit/s");
+		asprintf_append(&buf, ", bytes acked = %llu [B]",
+				(unsigned long long)report->tcp_info.tcpi_bytes_acked);
+		asprintf_append(&buf, ", busy/rwnd/sndbuf limited = "
+				"%.3f/%.3f/%.3f [s]",
+				report->tcp_info.tcpi_busy_time / 1e6,
+				report->tcp_info.tcpi_rwnd_limited / 1e6,
+				report->tcp_info.tcpi_sndbuf_limited / 1e6);
+	}
+	if (report->tcp_info.tcpi_ecn)
+		asprintf_append(&buf, ", ECN CE marks = %d [#]",
+				report->tcp_info.tcpi_delivered_ce);
+
 	/* Transactions */
 	double trans = report->response_blocks_read / MAX(real_read, real_write);
 	if (isnan(trans))
@@ -2127,6 +2900,12 @@ static void print_final_report(unsigned short flow_id, enum endpoint_t e)
 				report->response_blocks_written,
 				report->response_blocks_read);
 
+	/* Pending responses */
+	if (report->response_queue_max)
+		asprintf_append(&buf, ", response queue = %u/%u [#] (end/max)",
+				report->response_queue_depth,
+				report->response_queue_max);
+
 	/* RTT */
 	if (report->response_blocks_read) {
 		double rtt_avg = report->rtt_sum /
@@ -2136,6 +2915,36 @@ static void print_final_report(unsigned short flow_id, enum endpoint_t e)
 				report->rtt_max * 1e3);
 	}
 
+	/* Query completion time of the query group */
+	if (report->query_rounds) {
+		double qct_avg = report->qct_sum /
+				 (double)(report->query_rounds);
+		asprintf_append(&buf, ", queries = %u [#], QCT = %.3f/%.3f/%.3f "
+				"[ms] (min/avg/max), %.3f/%.3f/%.3f [ms] "
+				"(p50/p99/p99.9)", report->query_rounds,
+				report->qct_min * 1e3, qct_avg * 1e3,
+				report->qct_max * 1e3, report->qct_p50 * 1e3,
+				report->qct_p99 * 1e3, report->qct_p999 * 1e3);
+	}
+
+	/* RTT measured from the scheduled sending time of paced flows */
+	if (report->response_blocks_read && endpoint_paced(settings)) {
+		double rtt_avg = report->rtt_intended_sum /
+				 (double)(report->response_blocks_read);
+		asprintf_append(&buf, ", intended RTT = %.3f/%.3f/%.3f [ms] "
+				"(min/avg/max)", report->rtt_intended_min * 1e3,
+				rtt_avg * 1e3, report->rtt_intended_max * 1e3);
+	}
+
+	/* Blocks sent behind schedule */
+	if (report->schedule_slips) {
+		double slip_avg = report->schedule_slip_sum /
+				  (double)(report->schedule_slips);
+		asprintf_append(&buf, ", schedule slips = %u [#], slip = "
+				"%.3f/%.3f [ms] (avg/max)", report->schedule_slips,
+				slip_avg * 1e3, report->schedule_slip_max * 1e3);
+	}
+
 	/* IAT */
 	if (report->request_blocks_read) {
 		double iat_avg = report->iat_sum /
@@ -2154,9 +2963,59 @@ static void print_final_report(unsigned short flow_id, enum endpoint_t e)
 				report->delay_max * 1e3);
 	}
 
+	/* Connection setup */
+	if (report->connect_time)
+		asprintf_append(&buf, ", connect = %.3f [ms]",
+				report->connect_time * 1e3);
+	if (report->connect_retries)
+		asprintf_append(&buf, ", connect retries = %u",
+				report->connect_retries);
+
+	/* Completeness of the traffic dump */
+	if (settings->traffic_dump)
+		asprintf_append(&buf, ", dump drops = %u/%u [#] "
+				"(kernel/writer)", report->dump_kernel_drops,
+				report->dump_writer_drops);
+
+	/* Parallel connections */
+	if (cflow[flow_id].connections > 1)
+		asprintf_append(&buf, ", connections = %d",
+				cflow[flow_id].connections);
+
+	/* Closed loop request/response */
+	if (settings->request_window)
+		asprintf_append(&buf, ", request window = %d [#]",
+				settings->request_window);
+
 	/* Fixed sending rate per second was set */
-	if (settings->write_rate_str)
+	if (settings->write_rate_str) {
 		asprintf_append(&buf, ", rate = %s", settings->write_rate_str);
+		asprintf_append(&buf, " (achieved %.1f%%%s)",
+				report->bytes_written / MAX(real_read, real_write) /
+				settings->write_rate * 100.0,
+				settings->kernel_pacing ? ", kernel pacing" : "");
+	}
+	if (settings->rate_group)
+		asprintf_append(&buf, ", rate group = %d", settings->rate_group);
+	if (settings->query_group) {
+		asprintf_append(&buf, ", query group = %d (fan-in %d",
+				settings->query_group, settings->query_fanin);
+		if (settings->query_rate)
+			asprintf_append(&buf, ", %.1f rounds/s",
+					settings->query_rate);
+		asprintf_append(&buf, ")");
+	}
+	if (settings->gate)
+		asprintf_append(&buf, ", gate = %d", settings->gate);
+	if (settings->num_rate_segments) {
+		asprintf_append(&buf, ", rate schedule = %d segments%s",
+				settings->num_rate_segments,
+				settings->rate_schedule_loop ? " (loop)" : "");
+		if (report->scheduled_bytes)
+			asprintf_append(&buf, " (achieved %.1f%%)",
+					report->bytes_written /
+					report->scheduled_bytes * 100.0);
+	}
 
 	/* Socket options */
 	if (settings->elcn)
@@ -2184,46 +3043,181 @@ out:
 }
 
 /**
- * Print final report (i.e. summary line) for all configured flows.
+ * Get the time span a flow was active in from the final reports of both its
+ * endpoints.
+ *
+ * @param[in] flow_id flow to get the time span for
+ * @param[out] begin time the flow started
+ * @param[out] end time the last block of the flow was sent or received
+ * @return 0 on success, -1 if a final report is missing
  */
-static void print_all_final_reports(void)
+static int flow_active_span(unsigned flow_id, struct timespec *begin,
+			    struct timespec *end)
 {
-	for (unsigned int id = 0; id < copt.num_flows; id++) {
-		print_output("\n");
-		foreach(int *i, SOURCE, DESTINATION) {
-			print_final_report(id, *i);
-			free(cflow[id].final_report[*i]);
-		}
+	foreach(int *i, SOURCE, DESTINATION) {
+		const struct report *report = cflow[flow_id].final_report[*i];
+
+		if (!report)
+			return -1;
+		if (*i == SOURCE || time_is_after(begin, &report->begin))
+			*begin = report->begin;
+		if (*i == SOURCE || time_is_after(&report->end, end))
+			*end = report->end;
 	}
+	/* a flow which did not transfer anything ends right away */
+	if (time_is_after(begin, end))
+		*end = *begin;
+	return 0;
 }
 
 /**
- * Add the flow endpoint XML RPC data to the Global linked list.
- *
- * @param[in] XML-RPC connection url
- * @param[in] server_name flow endpoints IP address
- * @param[in] server_port controller - daemon XML-RPC connection port Nr
- * @return rpc_info flow endpoint XML RPC structure data 
+ * Print the distribution of @p n samples, which are sorted in place.
  */
-static struct rpc_info * add_flow_endpoint_by_url(const char* server_url,
-					  const char* server_name,
-					  unsigned short server_port)
+static void asprintf_append_distribution(char **buf, double *samples,
+					 unsigned n)
 {
-	struct rpc_info *flow_rpc_info;
-	flow_rpc_info = malloc((sizeof(struct rpc_info)));
-
-	if (!flow_rpc_info ) {
-		logging(LOG_ALERT, "could not allocate memory for flows rpc info");
-		return 0;
-	}
-
-	memset(flow_rpc_info, 0, sizeof(struct rpc_info));
-	
-	strcpy(flow_rpc_info->server_url, server_url);
-	strcpy(flow_rpc_info->server_name, server_name);
-	flow_rpc_info->server_port = server_port;
-	fg_list_push_back(&flows_rpc_info, flow_rpc_info);
-	return flow_rpc_info;
+	fg_sort_samples(samples, n);
+	asprintf_append(buf, "%.6f/%.6f/%.6f/%.6f/%.6f [s] "
+			"(min/p50/p90/p99/max)", samples[0],
+			fg_percentile(samples, n, 50),
+			fg_percentile(samples, n, 90),
+			fg_percentile(samples, n, 99), samples[n - 1]);
+}
+
+/**
+ * Print a summary of each coflow: its completion time, i.e. the time from
+ * the start of its flows until its last flow finished, the flow which
+ * finished last (straggler) and the distribution of the completion times of
+ * its flows. The times are taken from the daemons, so their clocks need to
+ * be synchronized.
+ */
+static void print_coflow_reports(void)
+{
+	unsigned num_coflows = 0, first = 0;
+	double *fct = malloc(copt.num_flows * sizeof(double));
+	double *gct = malloc(copt.num_flows * sizeof(double));
+
+	if (!fct || !gct)
+		critx("could not allocate memory for coflow reports");
+
+	while (first < copt.num_flows && !cflow[first].coflow)
+		first++;
+
+	for (unsigned int id = 0; id < copt.num_flows; id++) {
+		const int coflow = cflow[id].coflow;
+		struct timespec start = {0, 0}, end = {0, 0}, begin, stop;
+		unsigned flows = 0, missing = 0, straggler = id;
+		char *buf = NULL;
+
+		/* report each coflow once, at its first flow */
+		if (!coflow)
+			continue;
+		for (unsigned int prev = 0; prev < id; prev++)
+			if (cflow[prev].coflow == coflow)
+				goto next;
+
+		for (unsigned int other = id; other < copt.num_flows; other++) {
+			if (cflow[other].coflow != coflow)
+				continue;
+			if (flow_active_span(other, &begin, &stop) == -1) {
+				missing++;
+				continue;
+			}
+			if (!flows || time_is_after(&start, &begin))
+				start = begin;
+			if (!flows || time_is_after(&stop, &end)) {
+				end = stop;
+				straggler = other;
+			}
+			fct[flows++] = time_diff(&begin, &stop);
+		}
+
+		/* separate the coflows from the final reports of the flows */
+		if (asprintf(&buf, "%s# coflow %d: ", id == first ? "\n" : "",
+			     coflow) == -1)
+			critx("could not allocate memory for coflow report");
+		if (!flows) {
+			asprintf_append(&buf, "Error: no final reports received");
+			goto out;
+		}
+
+		gct[num_coflows++] = time_diff(&start, &end);
+		asprintf_append(&buf, "flows = %u, completion = %.6f [s], "
+				"straggler = ID %u, FCT = ", flows,
+				time_diff(&start, &end), straggler);
+		asprintf_append_distribution(&buf, fct, flows);
+		if (missing)
+			asprintf_append(&buf, ", %u flows without final report",
+					missing);
+out:
+		print_output("%s\n", buf);
+		free(buf);
+next:
+		;
+	}
+
+	if (num_coflows > 1) {
+		char *buf = NULL;
+		if (asprintf(&buf, "# coflows = %u, completion = ",
+			     num_coflows) == -1)
+			critx("could not allocate memory for coflow report");
+		asprintf_append_distribution(&buf, gct, num_coflows);
+		print_output("%s\n", buf);
+		free(buf);
+	}
+
+	free(fct);
+	free(gct);
+}
+
+/**
+ * Print final report (i.e. summary line) for all configured flows.
+ */
+static void print_all_final_reports(void)
+{
+	for (unsigned int id = 0; id < copt.num_flows; id++) {
+		/* Reported as soon as they ended */
+		if (cflow[id].injected)
+			continue;
+		print_output("\n");
+		foreach(int *i, SOURCE, DESTINATION)
+			print_final_report(id, *i);
+	}
+
+	print_coflow_reports();
+
+	for (unsigned int id = 0; id < copt.num_flows; id++)
+		foreach(int *i, SOURCE, DESTINATION)
+			free(cflow[id].final_report[*i]);
+}
+
+/**
+ * Add the flow endpoint XML RPC data to the Global linked list.
+ *
+ * @param[in] XML-RPC connection url
+ * @param[in] server_name flow endpoints IP address
+ * @param[in] server_port controller - daemon XML-RPC connection port Nr
+ * @return rpc_info flow endpoint XML RPC structure data 
+ */
+static struct rpc_info * add_flow_endpoint_by_url(const char* server_url,
+					  const char* server_name,
+					  unsigned short server_port)
+{
+	struct rpc_info *flow_rpc_info;
+	flow_rpc_info = malloc((sizeof(struct rpc_info)));
+
+	if (!flow_rpc_info ) {
+		logging(LOG_ALERT, "could not allocate memory for flows rpc info");
+		return 0;
+	}
+
+	memset(flow_rpc_info, 0, sizeof(struct rpc_info));
+	
+	strcpy(flow_rpc_info->server_url, server_url);
+	strcpy(flow_rpc_info->server_name, server_name);
+	flow_rpc_info->server_port = server_port;
+	fg_list_push_back(&flows_rpc_info, flow_rpc_info);
+	return flow_rpc_info;
 }
 
 /**
@@ -2353,13 +3347,14 @@ static void parse_trafgen_option(const char *params, int flow_id, int endpoint_i
 }
 
 /**
- * Parse argument for option -R, which specifies the rate the endpoint will send.
+ * Parse a rate in the form of #.#(z|k|M|G)(b|B).
  *
- * @param[in] arg argument for option -R in form of #.#(z|k|M|G)(b|B|o)
+ * @param[in] arg rate string
+ * @param[in] opt_string the cmdline option the rate was given to
  * @param[in] flow_id ID of flow to apply option to
- * @param[in] endpoint_id endpoint to apply option to
+ * @return rate in bytes per second
  */
-static void parse_rate_option(const char *arg, int flow_id, int endpoint_id)
+static double parse_rate(const char *arg, const char *opt_string, int flow_id)
 {
 	char unit = 0, type = 0;
 	double optdouble = 0.0;
@@ -2367,10 +3362,11 @@ static void parse_rate_option(const char *arg, int flow_id, int endpoint_id)
 	int rc = sscanf(arg, "%lf%c%c%c",
 			&optdouble, &unit, &type, &unit);
 	if (rc < 1 || rc > 4)
-		PARSE_ERR("flow %i: option -R: malformed rate", flow_id);
+		PARSE_ERR("flow %i: option %s: malformed rate", flow_id,
+			  opt_string);
 
 	if (optdouble == 0.0)
-		PARSE_ERR("flow %i: option -R: rate of 0", flow_id);
+		PARSE_ERR("flow %i: option %s: rate of 0", flow_id, opt_string);
 
 
 	switch (unit) {
@@ -2391,24 +3387,132 @@ static void parse_rate_option(const char *arg, int flow_id, int endpoint_id)
 		break;
 
 	default:
-		PARSE_ERR("flow %i: option -R: illegal unit specifier", flow_id);
+		PARSE_ERR("flow %i: option %s: illegal unit specifier", flow_id,
+			  opt_string);
 		break;
 	}
 
 	if (type != 'b' && type != 'B')
-		PARSE_ERR("flow %i: option -R: illegal type specifier "
-			  "(either 'b' or 'B')", flow_id);
+		PARSE_ERR("flow %i: option %s: illegal type specifier "
+			  "(either 'b' or 'B')", flow_id, opt_string);
 	if (type == 'b')
 		optdouble /=  8;
 
-	if (optdouble > 5e9)
-		warnx("rate of flow %d too high", flow_id);
+	return optdouble;
+}
 
+/**
+ * Parse argument for option -R, which specifies the rate the endpoint will send.
+ *
+ * @param[in] arg argument for option -R in form of #.#(z|k|M|G)(b|B|o)
+ * @param[in] flow_id ID of flow to apply option to
+ * @param[in] endpoint_id endpoint to apply option to
+ */
+static void parse_rate_option(const char *arg, int flow_id, int endpoint_id)
+{
 	cflow[flow_id].settings[endpoint_id].write_rate_str = strdup(arg);
-	cflow[flow_id].settings[endpoint_id].write_rate = optdouble;
+	cflow[flow_id].settings[endpoint_id].write_rate =
+		parse_rate(arg, "-R", flow_id);
 }
 
+/**
+ * Parse argument for option --rate-group, which lets the endpoint draw its
+ * sending rate from a token bucket shared with other flows.
+ *
+ * @param[in] arg argument for option --rate-group in form of ID:RATE[:BURST]
+ * @param[in] flow_id ID of flow to apply option to
+ * @param[in] endpoint_id endpoint to apply option to
+ */
+static void parse_rate_group_option(const char *arg, int flow_id,
+				    int endpoint_id)
+{
+	struct flow_settings *settings = &cflow[flow_id].settings[endpoint_id];
+	char rate[30] = "";
+	int group = 0, burst = 0;
+
+	int rc = sscanf(arg, "%d:%29[^:]:%d", &group, rate, &burst);
+	if (rc < 2 || group < 1 || burst < 0)
+		PARSE_ERR("flow %i: option --rate-group: malformed argument, "
+			  "expected positive ID:RATE[:BURST]", flow_id);
+
+	settings->rate_group = group;
+	settings->rate_group_rate = parse_rate(rate, "--rate-group", flow_id);
+	settings->rate_group_burst = burst;
+}
 
+/**
+ * Parse argument for option --rate-schedule, which loads the rates the
+ * endpoint will send at from a file.
+ *
+ * Each line of the file holds a segment 'DURATION RATE', with the duration
+ * in seconds and the rate in the format of option -R. A rate of 0 pauses the
+ * flow. The keyword 'loop' makes the schedule repeat. Empty lines and lines
+ * starting with '#' are ignored.
+ *
+ * @param[in] arg argument for option --rate-schedule, the file name
+ * @param[in] flow_id ID of flow to apply option to
+ * @param[in] endpoint_id endpoint to apply option to
+ */
+static void parse_rate_schedule_option(const char *arg, int flow_id,
+				       int endpoint_id)
+{
+	struct flow_settings *settings = &cflow[flow_id].settings[endpoint_id];
+	struct rate_segment *schedule;
+	char line[256], rate[64];
+	double duration, total = 0.0;
+	int num = 0, loop = 0, lineno = 0;
+
+	FILE *fp = fopen(arg, "r");
+	if (!fp)
+		PARSE_ERR("flow %i: option --rate-schedule: could not open %s: "
+			  "%s", flow_id, arg, strerror(errno));
+
+	schedule = malloc(MAX_RATE_SEGMENTS * sizeof(struct rate_segment));
+	if (!schedule)
+		critx("could not allocate memory for rate schedule");
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = line + strspn(line, " \t");
+		lineno++;
+
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+		if (!strncmp(p, "loop", 4) && strspn(p + 4, " \t\n") ==
+		    strlen(p + 4)) {
+			loop = 1;
+			continue;
+		}
+		if (sscanf(p, "%lf %63s", &duration, rate) != 2 ||
+		    duration <= 0)
+			PARSE_ERR("flow %i: option --rate-schedule: %s:%d: "
+				  "malformed segment", flow_id, arg, lineno);
+		if (num >= MAX_RATE_SEGMENTS)
+			PARSE_ERR("flow %i: option --rate-schedule: %s: more "
+				  "than %d segments", flow_id, arg,
+				  MAX_RATE_SEGMENTS);
+
+		schedule[num].duration = duration;
+		/* a rate of zero is allowed here, the flow pauses */
+		schedule[num].rate = strtod(rate, NULL) == 0.0 ? 0.0 :
+			parse_rate(rate, "--rate-schedule", flow_id);
+		total += schedule[num].rate;
+		num++;
+	}
+	fclose(fp);
+
+	if (!num)
+		PARSE_ERR("flow %i: option --rate-schedule: %s: no segments",
+			  flow_id, arg);
+	if (loop ? !total : !schedule[num - 1].rate)
+		PARSE_ERR("flow %i: option --rate-schedule: %s: %s", flow_id,
+			  arg, loop ? "all rates are zero" :
+			  "last rate must not be zero");
+
+	free(settings->rate_schedule);
+	settings->rate_schedule = schedule;
+	settings->num_rate_segments = num;
+	settings->rate_schedule_loop = loop;
+}
 
 /**
  * Parse argument for option -H, which specifies the endpoints of a flow.
@@ -2562,6 +3666,8 @@ static void parse_flow_option_endpoint(int code, const char* arg,
 			settings->so_debug = 1;
 		} else if (!strcmp(arg, "IP_MTU_DISCOVER")) {
 			settings->ipmtudiscover = 1;
+		} else if (!strcmp(arg, "SO_MAX_PACING_RATE")) {
+			settings->kernel_pacing = 1;
 		} else {
 			PARSE_ERR("in flow %i: option %s: unknown socket "
 				  "option or socket option not implemented",
@@ -2616,6 +3722,58 @@ static void parse_flow_option_endpoint(int code, const char* arg,
 				  flow_id, opt_string);
 		settings->delay[WRITE] = optdouble;
 		break;
+	case WINDOW_OPTION:
+		if (sscanf(arg, "%u", &optint) != 1 || optint < 0)
+			PARSE_ERR("in flow %i: option %s needs non-negative number",
+				  flow_id, opt_string);
+		settings->request_window = optint;
+		break;
+	case RATE_GROUP_OPTION:
+		if (!*arg)
+			PARSE_ERR("in flow %i: option %s requires a value "
+				  "for each given endpoint", flow_id, opt_string);
+		parse_rate_group_option(arg, flow_id, endpoint_id);
+		break;
+	case GATE_OPTION:
+		if (sscanf(arg, "%u", &optint) != 1 || optint < 1 ||
+		    optint > MAX_GATES)
+			PARSE_ERR("in flow %i: option %s needs an integer in "
+				  "[1..%d]", flow_id, opt_string, MAX_GATES);
+		settings->gate = optint;
+		break;
+	case QUERY_OPTION:
+		if (sscanf(arg, "%d:%lf", &optint, &optdouble) < 1 ||
+		    optint < 1 || optdouble < 0)
+			PARSE_ERR("in flow %i: option %s needs a positive ID "
+				  "and a non-negative round rate", flow_id,
+				  opt_string);
+		settings->query_group = optint;
+		settings->query_rate = optdouble;
+		SHOW_COLUMNS(COL_QRY_ROUNDS, COL_QCT_MIN, COL_QCT_AVG,
+			     COL_QCT_MAX);
+		break;
+	case RATE_SCHEDULE_OPTION:
+		if (!*arg)
+			PARSE_ERR("in flow %i: option %s requires a value "
+				  "for each given endpoint", flow_id, opt_string);
+		parse_rate_schedule_option(arg, flow_id, endpoint_id);
+		SHOW_COLUMNS(COL_SCHED, COL_RATE);
+		break;
+	case SAMPLE_OPTION:
+		if (sscanf(arg, "%lf", &optdouble) != 1 || optdouble <= 0)
+			PARSE_ERR("in flow %i: option %s needs a positive number "
+				  "(in seconds)", flow_id, opt_string);
+		settings->sample_period = optdouble;
+		break;
+	case KERNEL_TRACE_OPTION:
+		settings->kernel_trace = 1;
+		break;
+	case AGGREGATE_OPTION:
+		if (sscanf(arg, "%d", &optint) != 1 || optint < 1)
+			PARSE_ERR("in flow %i: option %s needs a positive ID",
+				  flow_id, opt_string);
+		settings->report_group = optint;
+		break;
 	}
 }
 
@@ -2665,6 +3823,27 @@ static void parse_flow_option(int code, const char* arg, const char* opt_string,
 	case 'Q':
 		cflow[flow_id].summarize_only = 1;
 		break;
+	case INJECTED_OPTION:
+		cflow[flow_id].injected = 1;
+		break;
+	case CONNECTIONS_OPTION:
+		if (sscanf(arg, "%u", &optunsigned) != 1 || optunsigned < 1 ||
+		    optunsigned > MAX_FLOWS_DAEMON)
+			PARSE_ERR("option %s needs an integer argument in "
+				  "[1..%d]", opt_string, MAX_FLOWS_DAEMON);
+		cflow[flow_id].connections = optunsigned;
+		break;
+	case COFLOW_OPTION:
+		if (sscanf(arg, "%u", &optunsigned) != 1 || optunsigned < 1 ||
+		    optunsigned > INT_MAX)
+			PARSE_ERR("option %s needs a positive integer",
+				  opt_string);
+		cflow[flow_id].coflow = optunsigned;
+		break;
+	case AGGREGATE_ONLY_OPTION:
+		foreach(int *i, SOURCE, DESTINATION)
+			cflow[flow_id].settings[*i].aggregate_only = 1;
+		break;
 	}
 }
 
@@ -2677,9 +3856,12 @@ static void parse_flow_option(int code, const char* arg, const char* opt_string,
 static void parse_colon_option(const char *arg)
 {
 	/* To make it easy (independed of default values), hide all colons */
-	HIDE_COLUMNS(COL_BEGIN, COL_END, COL_THROUGH, COL_TRANSAC,
+	HIDE_COLUMNS(COL_BEGIN, COL_END, COL_THROUGH, COL_SCHED, COL_RATE,
+		     COL_TRANSAC,
 		     COL_BLOCK_REQU, COL_BLOCK_RESP, COL_RTT_MIN, COL_RTT_AVG,
-		     COL_RTT_MAX, COL_IAT_MIN, COL_IAT_AVG, COL_IAT_MAX,
+		     COL_RTT_MAX, COL_IRTT_MIN, COL_IRTT_AVG, COL_IRTT_MAX,
+		     COL_QRY_ROUNDS, COL_QCT_MIN, COL_QCT_AVG,
+		     COL_QCT_MAX, COL_IAT_MIN, COL_IAT_AVG, COL_IAT_MAX,
 		     COL_DLY_MIN, COL_DLY_AVG, COL_DLY_MAX, COL_TCP_CWND,
 		     COL_TCP_SSTH, COL_TCP_UACK, COL_TCP_SACK, COL_TCP_LOST,
 		     COL_TCP_RETR, COL_TCP_TRET, COL_TCP_FACK, COL_TCP_REOR,
@@ -2699,10 +3881,17 @@ static void parse_colon_option(const char *arg)
 			SHOW_COLUMNS(COL_THROUGH);
 		else if (!strcmp(token, "transac"))
 			SHOW_COLUMNS(COL_TRANSAC);
+		else if (!strcmp(token, "rate"))
+			SHOW_COLUMNS(COL_SCHED, COL_RATE);
 		else if (!strcmp(token, "blocks"))
 			SHOW_COLUMNS(COL_BLOCK_REQU, COL_BLOCK_RESP);
 		else if (!strcmp(token, "rtt"))
 			SHOW_COLUMNS(COL_RTT_MIN, COL_RTT_AVG, COL_RTT_MAX);
+		else if (!strcmp(token, "irtt"))
+			SHOW_COLUMNS(COL_IRTT_MIN, COL_IRTT_AVG, COL_IRTT_MAX);
+		else if (!strcmp(token, "qct"))
+			SHOW_COLUMNS(COL_QRY_ROUNDS, COL_QCT_MIN, COL_QCT_AVG,
+				     COL_QCT_MAX);
 		else if (!strcmp(token, "iat"))
 			SHOW_COLUMNS(COL_IAT_MIN, COL_IAT_AVG, COL_IAT_MAX);
 		else if (!strcmp(token, "delay"))
@@ -2780,6 +3969,7 @@ static void parse_general_option(int code, const char* arg, const char* opt_stri
 	case 'm':
 		copt.mbyte = true;
 		column_info[COL_THROUGH].header.unit = " [MiB/s]";
+		column_info[COL_SCHED].header.unit = " [MiB/s]";
 		break;
 	case 'n':
 		if (sscanf(arg, "%u", &copt.num_flows) != 1 ||
@@ -2805,6 +3995,18 @@ static void parse_general_option(int code, const char* arg, const char* opt_stri
 			PARSE_ERR("invalid argument '%s' for option %s",
 				  arg, opt_string);
 		break;
+	case CONTROL_OPTION:
+		copt.control_file = strdup(arg);
+		break;
+	case TRACE_OPTION:
+		copt.trace_file = strdup(arg);
+		break;
+	case TRACE_WINDOW_OPTION:
+		if (sscanf(arg, "%lf", &copt.trace_window) != 1 ||
+		    copt.trace_window < 0)
+			PARSE_ERR("option %s needs a non-negative number "
+				  "(in seconds)", opt_string);
+		break;
 	case 'w':
 		copt.log_to_file = true;
 		break;
@@ -2913,6 +4115,7 @@ static void parse_cmdline(int argc, char *argv[], int num_flows)
 
 	const struct ap_Option options[] = {
 		{'c', "show-colon", ap_yes, OPT_CONTROLLER, 0},
+		{CONTROL_OPTION, "control", ap_yes, OPT_CONTROLLER, 0},
 #ifdef DEBUG
 		{'d', "debug", ap_no, OPT_CONTROLLER, 0},
 #endif /* DEBUG */
@@ -2926,6 +4129,8 @@ static void parse_cmdline(int argc, char *argv[], int num_flows)
 		{'p', 0, ap_no, OPT_CONTROLLER, 0},
 		{'q', "quiet", ap_no, OPT_CONTROLLER, 0},
 		{'s', "tcp-stack", ap_yes, OPT_CONTROLLER, 0},
+		{TRACE_OPTION, "trace", ap_yes, OPT_CONTROLLER, 0},
+		{TRACE_WINDOW_OPTION, "trace-window", ap_yes, OPT_CONTROLLER, 0},
 		{'v', "version", ap_no, OPT_CONTROLLER, 0},
 		{'w', 0, ap_no, OPT_CONTROLLER, 0},
 		{'A', 0, ap_yes, OPT_FLOW_ENDPOINT, (int[]){1,0}},
@@ -2952,6 +4157,18 @@ static void parse_cmdline(int argc, char *argv[], int num_flows)
 		{'Y', 0, ap_yes, OPT_FLOW_ENDPOINT, 0},
 		{'X', 0, ap_yes, OPT_FLOW, 0},
 		{'Z', 0, ap_yes, OPT_FLOW, 0},
+		{WINDOW_OPTION, "window", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{CONNECTIONS_OPTION, "connections", ap_yes, OPT_FLOW, 0},
+		{COFLOW_OPTION, "coflow", ap_yes, OPT_FLOW, 0},
+		{INJECTED_OPTION, "injected", ap_no, OPT_FLOW, 0},
+		{RATE_GROUP_OPTION, "rate-group", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{RATE_SCHEDULE_OPTION, "rate-schedule", ap_yes, OPT_FLOW_ENDPOINT, (int[]){2,0}},
+		{GATE_OPTION, "gate", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{QUERY_OPTION, "query", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{SAMPLE_OPTION, "sample", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{KERNEL_TRACE_OPTION, "kernel-trace", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{AGGREGATE_OPTION, "aggregate", ap_yes, OPT_FLOW_ENDPOINT, 0},
+		{AGGREGATE_ONLY_OPTION, "aggregate-only", ap_no, OPT_FLOW, 0},
 		{0, 0, ap_no, 0, 0}
 	};
 
@@ -3068,8 +4285,17 @@ static void parse_cmdline(int argc, char *argv[], int num_flows)
 		cflow[id].settings[DESTINATION].delay[READ] = cflow[id].settings[SOURCE].delay[WRITE];
 
 		foreach(int *i, SOURCE, DESTINATION) {
-			/* Default to localhost, if no endpoints were set for a flow */
-			if (!cflow[id].endpoint[*i].rpc_info) {
+			/* Paced request/response flows show their RTT from
+			 * the scheduled sending time */
+			if (cflow[id].settings[*i].response_trafgen_options.param_one &&
+			    endpoint_paced(&cflow[id].settings[*i]))
+				SHOW_COLUMNS(COL_IRTT_MIN, COL_IRTT_AVG,
+					     COL_IRTT_MAX);
+
+			/* Default to localhost, if no endpoints were set for a
+			 * flow. Trace flows get their endpoints from the trace */
+			if (!cflow[id].endpoint[*i].rpc_info &&
+			    !copt.trace_file) {
 				cflow[id].endpoint[*i].rpc_info = set_rpc_info(
 					"http://localhost:5999/RPC2", "localhost", DEFAULT_LISTEN_PORT);
 			}
@@ -3086,6 +4312,35 @@ static void parse_cmdline(int argc, char *argv[], int num_flows)
  */
 static void sanity_check(void)
 {
+	if (copt.trace_file && copt.control_file) {
+		errx("options --trace and --control are mutually exclusive");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int id = 0; id < copt.num_flows; id++) {
+		if (cflow[id].injected && !copt.control_file) {
+			errx("flow %d is injected but there is no control "
+			     "input", id);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (unsigned int id = 0; copt.trace_file && id < copt.num_flows;
+	     id++) {
+		if (cflow[id].endpoint[SOURCE].rpc_info ||
+		    cflow[id].endpoint[DESTINATION].rpc_info) {
+			errx("option -H does not apply to trace flows, the "
+			     "trace sets their endpoints");
+			exit(EXIT_FAILURE);
+		}
+		if (cflow[id].coflow ||
+		    cflow[id].settings[SOURCE].query_group ||
+		    cflow[id].settings[DESTINATION].query_group) {
+			errx("options --coflow and --query do not apply to "
+			     "trace flows");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	for (unsigned int id = 0; id < copt.num_flows; id++) {
 		DEBUG_MSG(LOG_DEBUG, "sanity checking parameter set of flow %d", id);
 		if (cflow[id].settings[DESTINATION].duration[WRITE] > 0 &&
@@ -3121,6 +4376,13 @@ static void sanity_check(void)
 				exit(EXIT_FAILURE);
 			}
 
+			if (cflow[id].settings[*i].kernel_pacing &&
+			    !cflow[id].settings[*i].write_rate_str) {
+				errx("flow %d has kernel pacing enabled but no "
+				      "rate", id);
+				exit(EXIT_FAILURE);
+			}
+
 			if (cflow[id].settings[*i].write_rate &&
 			    (cflow[id].settings[*i].write_rate /
 			     cflow[id].settings[*i].maximum_block_size) < 1) {
@@ -3128,9 +4390,469 @@ static void sanity_check(void)
 				      "specified rate", id);
 				exit(EXIT_FAILURE);
 			}
+
+			if (cflow[id].settings[*i].report_group &&
+			    cflow[id].summarize_only) {
+				errx("flow %d is in a report group but prints "
+				     "no interval reports", id);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (cflow[id].settings[SOURCE].aggregate_only &&
+		    cflow[id].connections < 2 &&
+		    !cflow[id].settings[SOURCE].report_group &&
+		    !cflow[id].settings[DESTINATION].report_group) {
+			errx("flow %d prints aggregated reports only but is in "
+			     "no report group and has a single connection", id);
+			exit(EXIT_FAILURE);
 		}
 		DEBUG_MSG(LOG_DEBUG, "sanity check parameter set of flow %d completed", id);
 	}
+
+	/* A query group consists of all connections of the flows with the
+	 * same query group ID on the same daemon */
+	for (unsigned int id = 0; id < copt.num_flows; id++) {
+		foreach(int *i, SOURCE, DESTINATION) {
+			struct flow_settings *settings = &cflow[id].settings[*i];
+
+			if (!settings->query_group)
+				continue;
+
+			if (!settings->response_trafgen_options.param_one) {
+				errx("flow %d is in a query group but requests "
+				     "no responses", id);
+				exit(EXIT_FAILURE);
+			}
+
+			settings->query_fanin = 0;
+			for (unsigned int other = 0; other < copt.num_flows;
+			     other++) {
+				for (int j = SOURCE; j <= DESTINATION; j++) {
+					struct flow_settings *o =
+						&cflow[other].settings[j];
+
+					if (o->query_group != settings->query_group ||
+					    cflow[other].endpoint[j].rpc_info !=
+					    cflow[id].endpoint[*i].rpc_info)
+						continue;
+					if (o->query_rate != settings->query_rate) {
+						errx("flows %d and %d of query "
+						     "group %d have different "
+						     "round rates", id, other,
+						     settings->query_group);
+						exit(EXIT_FAILURE);
+					}
+					settings->query_fanin +=
+						cflow[other].connections;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Read the next flow from the trace.
+ *
+ * @param[in,out] record last record read, zeroed before the first call
+ * @return true if a record was read, false at the end of the trace
+ */
+static bool read_trace_record(struct trace_record *record)
+{
+	char line[1024];
+
+	while (fgets(line, sizeof(line), trace_stream)) {
+		char *p = line + strspn(line, " \t");
+		double start;
+
+		record->line++;
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+
+		if (sscanf(p, "%lf %255s %255s %llu", &start, record->source,
+			   record->destination, &record->bytes) != 4 ||
+		    start < 0 || !record->bytes)
+			critx("%s:%lu: malformed trace record", copt.trace_file,
+			      record->line);
+		if (start < record->start)
+			critx("%s:%lu: trace record starts before the previous "
+			      "one", copt.trace_file, record->line);
+		record->start = start;
+		return true;
+	}
+
+	if (ferror(trace_stream))
+		crit("could not read trace %s", copt.trace_file);
+	return false;
+}
+
+/**
+ * Keep the options of all flows, to set up flows again once they ended.
+ */
+static void save_flow_templates(void)
+{
+	flow_template = malloc(sizeof(struct cflow) * copt.num_flows);
+	if (!flow_template)
+		critx("could not allocate memory for flow templates");
+	memcpy(flow_template, cflow, sizeof(struct cflow) * copt.num_flows);
+}
+
+/**
+ * Check the trace and collect the daemons of its flows.
+ *
+ * The daemons have to be known before the replay, so that they can be
+ * checked like the daemons of flows given on the command line. The options
+ * of the flows are kept as template for the trace records they replay.
+ */
+static void prepare_trace(void)
+{
+	struct trace_record record = {.line = 0};
+	unsigned long records = 0;
+
+	trace_stream = fopen(copt.trace_file, "r");
+	if (!trace_stream)
+		crit("could not open trace %s", copt.trace_file);
+
+	/* The destination has to see the end of a trace flow */
+	for (unsigned int id = 0; id < copt.num_flows; id++)
+		cflow[id].shutdown = 1;
+
+	save_flow_templates();
+
+	while (read_trace_record(&record)) {
+		parse_host_option(record.source, 0, SOURCE);
+		parse_host_option(record.destination, 0, DESTINATION);
+		records++;
+	}
+	if (!records)
+		critx("%s: no flows in trace", copt.trace_file);
+
+	cflow[0] = flow_template[0];
+	rewind(trace_stream);
+}
+
+/**
+ * Set up flow @p id to replay trace record @p record.
+ *
+ * @param[in] id ID of a flow that replays no record
+ * @param[in] record trace record
+ * @param[in] delay time until the flow starts, in seconds
+ */
+static void setup_trace_flow(unsigned int id, const struct trace_record *record,
+			     double delay)
+{
+	struct cflow *f = &cflow[id];
+	const unsigned long long block_size =
+		f->settings[SOURCE].maximum_block_size;
+	const unsigned long long blocks =
+		(record->bytes + block_size - 1) / block_size;
+
+	f->trace_record = record->line;
+	f->total_blocks[SOURCE] = blocks < INT_MAX ? (int)blocks : INT_MAX;
+	parse_host_option(record->source, id, SOURCE);
+	parse_host_option(record->destination, id, DESTINATION);
+
+	foreach(int *i, SOURCE, DESTINATION) {
+		f->endpoint[*i].daemon = f->endpoint[*i].rpc_info->daemon;
+		f->settings[*i].delay[WRITE] += delay;
+		f->settings[*i].delay[READ] += delay;
+	}
+}
+
+/**
+ * Start the flows set up on the daemons since the last call. Flows already
+ * running on the daemons are not affected.
+ *
+ * @param[in,out] rpc_client to connect controller to daemon
+ */
+static void start_pending_flows(xmlrpc_client *rpc_client)
+{
+	xmlrpc_value *resultP = 0;
+	struct timespec now;
+	const struct list_node *node = fg_list_front(&unique_daemons);
+
+	gettime(&now);
+	while (node) {
+		struct daemon *daemon = node->data;
+		node = node->next;
+
+		if (!daemon->start_pending)
+			continue;
+		daemon->start_pending = false;
+
+		xmlrpc_client_call2f(&rpc_env, rpc_client, daemon->url,
+				     "start_flows", &resultP, "({s:i})",
+				     "start_timestamp", now.tv_sec);
+		die_if_fault_occurred(&rpc_env);
+		if (resultP)
+			xmlrpc_DECREF(resultP);
+	}
+}
+
+/**
+ * Print the final reports of the trace flows and injected flows which have
+ * ended, and make the flows available to be set up again.
+ */
+static void finish_flows(void)
+{
+	for (unsigned int id = 0; id < copt.num_flows; id++) {
+		struct cflow *f = &cflow[id];
+
+		if ((!f->trace_record && !f->injected) ||
+		    !f->finished[SOURCE] || !f->finished[DESTINATION])
+			continue;
+
+		/* A flow stopped by the controller waits for its reports */
+		if (f->final_reports[SOURCE] < f->connections ||
+		    f->final_reports[DESTINATION] < f->connections)
+			continue;
+
+		print_output("\n");
+		foreach(int *i, SOURCE, DESTINATION) {
+			print_final_report(id, *i);
+			free(f->final_report[*i]);
+		}
+		const unsigned injections = f->injections;
+		*f = flow_template[id];
+		f->injections = injections;
+	}
+}
+
+/**
+ * Replay the flows of the trace.
+ *
+ * The flows given by option -n take turns replaying the trace records. A
+ * record is set up on its daemons once its start is less than the trace
+ * window ahead, and its flow is free again as soon as its final reports are
+ * in. Thus neither the controller nor the daemons hold more than the flows
+ * of the window, however long the trace is.
+ *
+ * @param[in,out] rpc_client to connect controller to daemon
+ */
+static void replay_trace(xmlrpc_client *rpc_client)
+{
+	struct trace_record record = {.line = 0};
+	struct timespec lastreport;
+	unsigned long replayed = 0, late = 0;
+	bool more = read_trace_record(&record);
+
+	/* Trace records start relative to the start of the replay */
+	gettime(&epoch);
+	lastreport = epoch;
+	active_flows = 0;
+
+	while (!sigint_caught && (more || active_flows)) {
+		const double elapsed = time_diff_now(&epoch);
+		unsigned int id = 0;
+
+		while (more && record.start < elapsed + copt.trace_window) {
+			while (id < copt.num_flows && cflow[id].trace_record)
+				id++;
+			/* All flows busy, the record has to wait */
+			if (id == copt.num_flows)
+				break;
+
+			if (record.start < elapsed)
+				late++;
+			setup_trace_flow(id, &record, record.start > elapsed ?
+					 record.start - elapsed : 0);
+			prepare_flow(id, rpc_client);
+			foreach(int *i, SOURCE, DESTINATION)
+				cflow[id].endpoint[*i].daemon->start_pending =
+					true;
+
+			active_flows++;
+			replayed++;
+			more = read_trace_record(&record);
+		}
+		start_pending_flows(rpc_client);
+
+		if (time_diff_now(&lastreport) >= copt.reporting_interval) {
+			gettime(&lastreport);
+			fetch_reports(rpc_client);
+			finish_flows();
+		}
+
+		/* Sleep until the next reports are due or the next record
+		 * enters the window */
+		double wait = copt.reporting_interval -
+			time_diff_now(&lastreport);
+		if (more && id < copt.num_flows)
+			ASSIGN_MIN(wait, record.start - copt.trace_window -
+				   time_diff_now(&epoch));
+		if (wait > 0)
+			usleep(wait * 1e6);
+	}
+
+	print_output("\n# trace %s: %lu flows replayed, %lu started late\n",
+		     copt.trace_file, replayed, late);
+	fclose(trace_stream);
+}
+
+/**
+ * Open the control input given with option --control. A FIFO is opened for
+ * writing as well, so it stays open while no writer is attached.
+ */
+static void open_control(void)
+{
+	struct stat st;
+
+	if (!strcmp(copt.control_file, "-")) {
+		control_fd = STDIN_FILENO;
+		return;
+	}
+
+	if (stat(copt.control_file, &st) == -1)
+		crit("could not open control input %s", copt.control_file);
+	control_fd = open(copt.control_file,
+			  S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY);
+	if (control_fd == -1)
+		crit("could not open control input %s", copt.control_file);
+}
+
+/**
+ * Close the control input. The test ends once the running flows have ended.
+ */
+static void close_control(void)
+{
+	if (control_fd != STDIN_FILENO)
+		close(control_fd);
+	control_fd = -1;
+}
+
+/**
+ * Set up injected flow @p id and start it @p start seconds after the start
+ * of the test, or right away if that time has passed.
+ *
+ * @param[in,out] rpc_client to connect controller to daemon
+ * @param[in] id ID of the flow
+ * @param[in] start start of the flow relative to the start of the test
+ */
+static void inject_flow(xmlrpc_client *rpc_client, unsigned int id,
+			double start)
+{
+	struct cflow *f = &cflow[id];
+	const double delay = start - time_diff_now(&epoch);
+
+	if (!f->injected) {
+		warnx("flow %u is not injected (option --injected)", id);
+		return;
+	}
+	if (f->endpoint_id[SOURCE] != -1 || f->endpoint_id[DESTINATION] != -1) {
+		warnx("flow %u is still running", id);
+		return;
+	}
+
+	foreach(int *i, SOURCE, DESTINATION) {
+		if (delay > 0) {
+			f->settings[*i].delay[WRITE] += delay;
+			f->settings[*i].delay[READ] += delay;
+		}
+		f->endpoint[*i].daemon->start_pending = true;
+	}
+	f->injections++;
+
+	prepare_flow(id, rpc_client);
+	start_pending_flows(rpc_client);
+	active_flows++;
+}
+
+/**
+ * Stop flow @p id. Its final report follows with the next reports of its
+ * daemons.
+ *
+ * @param[in] id ID of the flow
+ */
+static void retire_flow(unsigned int id)
+{
+	if (cflow[id].endpoint_id[SOURCE] == -1 &&
+	    cflow[id].endpoint_id[DESTINATION] == -1) {
+		warnx("flow %u is not running", id);
+		return;
+	}
+
+	close_flow(id);
+}
+
+/**
+ * Carry out the control command @p command.
+ *
+ * @param[in,out] rpc_client to connect controller to daemon
+ * @param[in] command command line without newline
+ */
+static void run_control_command(xmlrpc_client *rpc_client,
+				const char *command)
+{
+	char op[16];
+	unsigned int id;
+	double start = 0;
+	const int rc = sscanf(command, "%15s %u %lf", op, &id, &start);
+
+	/* Empty line or comment */
+	if (rc < 1 || *op == '#')
+		return;
+
+	if (!strcmp(op, "quit")) {
+		close_control();
+		return;
+	}
+
+	if (rc < 2 || id >= copt.num_flows) {
+		warnx("invalid control command '%s'", command);
+		return;
+	}
+
+	if (!strcmp(op, "inject"))
+		inject_flow(rpc_client, id, start);
+	else if (!strcmp(op, "retire") && rc == 2)
+		retire_flow(id);
+	else
+		warnx("invalid control command '%s'", command);
+}
+
+/**
+ * Wait up to @p timeout seconds for commands on the control input and carry
+ * them out.
+ *
+ * @param[in,out] rpc_client to connect controller to daemon
+ * @param[in] timeout time to wait, in seconds
+ */
+static void process_control(xmlrpc_client *rpc_client, double timeout)
+{
+	/* Commands may arrive in pieces */
+	static char buf[1024];
+	static size_t len = 0;
+	struct pollfd pfd = {.fd = control_fd, .events = POLLIN};
+	char *line, *eol;
+
+	if (poll(&pfd, 1, timeout > 0 ? timeout * 1e3 : 0) < 1)
+		return;
+
+	const ssize_t rc = read(control_fd, buf + len, sizeof(buf) - len - 1);
+	if (rc == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (rc < 1) {
+		if (rc == -1)
+			warn("could not read control input");
+		close_control();
+		return;
+	}
+	len += rc;
+	buf[len] = '\0';
+
+	for (line = buf; (eol = strchr(line, '\n')); line = eol + 1) {
+		*eol = '\0';
+		run_control_command(rpc_client, line);
+		if (control_fd == -1)
+			break;
+	}
+
+	len -= line - buf;
+	memmove(buf, line, len);
+	if (len == sizeof(buf) - 1) {
+		warnx("control command too long");
+		len = 0;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -3205,6 +4927,10 @@ int main(int argc, char *argv[])
 	init_flow_options(num_flows);
 	parse_cmdline(argc, argv, num_flows);
 	sanity_check();
+	if (copt.trace_file)
+		prepare_trace();
+	if (copt.control_file)
+		open_control();
 	open_logfile();
 	prepare_xmlrpc_client(&rpc_client);
 
@@ -3220,16 +4946,25 @@ int main(int argc, char *argv[])
 	if (!sigint_caught)
 		check_idle(rpc_client);
 
+	/* Injected flows set up again start from their initial options */
+	if (!sigint_caught && copt.control_file)
+		save_flow_templates();
+
+	/* Trace and injected flows are prepared while the test runs */
 	DEBUG_MSG(LOG_WARNING, "prepare all flows");
-	if (!sigint_caught)
+	if (!sigint_caught && !copt.trace_file)
 		prepare_all_flows(rpc_client);
 
 	DEBUG_MSG(LOG_WARNING, "print headline");
 	if (!sigint_caught)
 		print_headline();
+	if (!sigint_caught && !copt.trace_file)
+		print_source_port_usage(rpc_client);
 
 	DEBUG_MSG(LOG_WARNING, "start all flows");
-	if (!sigint_caught)
+	if (!sigint_caught && copt.trace_file)
+		replay_trace(rpc_client);
+	else if (!sigint_caught)
 		start_all_flows(rpc_client);
 
 	DEBUG_MSG(LOG_WARNING, "close all flows");
@@ -3237,7 +4972,11 @@ int main(int argc, char *argv[])
 
 	DEBUG_MSG(LOG_WARNING, "print all final report");
 	fetch_reports(rpc_client);
-	print_all_final_reports();
+	finish_flows();
+	if (!copt.trace_file)
+		print_all_final_reports();
+	if (control_fd != -1)
+		close_control();
 
 	fg_list_clear(&flows_rpc_info);
 	fg_list_clear(&unique_daemons);
@@ -102,6 +102,10 @@ enum column_id {
 	COL_END,                                            /** @} */
 	/** Throughput per seconds. */
 	COL_THROUGH,
+	/** Sending rate given by the rate schedule. */
+	COL_SCHED,
+	/** Achieved rate relative to the sending rate. */
+	COL_RATE,
 	/** Transactions per second. */
 	COL_TRANSAC,
 	/** Blocks per second. @{ */
@@ -111,6 +115,15 @@ enum column_id {
 	COL_RTT_MIN,
 	COL_RTT_AVG,
 	COL_RTT_MAX,                                        /** @} */
+	/** Round-trip time from the scheduled sending time. @{ */
+	COL_IRTT_MIN,
+	COL_IRTT_AVG,
+	COL_IRTT_MAX,                                       /** @} */
+	/** Query rounds and their completion time. @{ */
+	COL_QRY_ROUNDS,
+	COL_QCT_MIN,
+	COL_QCT_AVG,
+	COL_QCT_MAX,                                        /** @} */
 	/** Application level inter-arrival time. @{ */
 	COL_IAT_MIN,
 	COL_IAT_AVG,
@@ -172,6 +185,36 @@ enum mutex_context_t {
 enum long_opt_only {
 	/** Pseudo short option for option --log-file. */
 	LOG_FILE_OPTION = CHAR_MAX + 1,
+	/** Pseudo short option for option --window. */
+	WINDOW_OPTION,
+	/** Pseudo short option for option --connections. */
+	CONNECTIONS_OPTION,
+	/** Pseudo short option for option --rate-group. */
+	RATE_GROUP_OPTION,
+	/** Pseudo short option for option --rate-schedule. */
+	RATE_SCHEDULE_OPTION,
+	/** Pseudo short option for option --gate. */
+	GATE_OPTION,
+	/** Pseudo short option for option --query. */
+	QUERY_OPTION,
+	/** Pseudo short option for option --coflow. */
+	COFLOW_OPTION,
+	/** Pseudo short option for option --trace. */
+	TRACE_OPTION,
+	/** Pseudo short option for option --trace-window. */
+	TRACE_WINDOW_OPTION,
+	/** Pseudo short option for option --control. */
+	CONTROL_OPTION,
+	/** Pseudo short option for option --injected. */
+	INJECTED_OPTION,
+	/** Pseudo short option for option --sample. */
+	SAMPLE_OPTION,
+	/** Pseudo short option for option --kernel-trace. */
+	KERNEL_TRACE_OPTION,
+	/** Pseudo short option for option --aggregate. */
+	AGGREGATE_OPTION,
+	/** Pseudo short option for option --aggregate-only. */
+	AGGREGATE_ONLY_OPTION,
 };
 
 /** Controller options. */
@@ -194,6 +237,17 @@ struct controller_options {
 	bool symbolic;
 	/** Force kernel output to specific unit  (option -s). */
 	enum tcp_stack_t force_unit;
+	/** Trace of flows to replay (option --trace). */
+	const char *trace_file;
+	/** How far ahead of their start trace flows are set up, in seconds
+	 * (option --trace-window). */
+	double trace_window;
+	/** Input of commands to inject and retire flows while the test runs
+	 * (option --control). */
+	const char *control_file;
+	/** Random ID of the test, keeping its report groups apart from those
+	 * of other tests on the same daemons. */
+	int report_scope;
 };
 
 /** Infos about a flowgrind daemon. */
@@ -209,6 +263,8 @@ struct daemon {
 	char os_release[257];
 	/** Pointer to daemon XMLPRC URL. */
 	char *url;
+	/** Flows were added that the daemon has not been told to start yet. */
+	bool start_pending;
 };
 
 /** Infos about a flowgrind daemon and daemon-controller connection. */
@@ -219,6 +275,8 @@ struct rpc_info {
 	char server_name[257];
 	/** Port of the XMLRPC server. */
 	unsigned short server_port;
+	/** Daemon behind this URL. */
+	struct daemon *daemon;
 };
 
 /** Infos about the flow endpoint. */
@@ -256,6 +314,18 @@ struct cflow {
   int total_blocks[2];
 	/** Random seed for stochastic traffic generation (option -J). */
 	unsigned random_seed;
+	/** Number of parallel connections of the flow (option --connections). */
+	int connections;
+	/** Coflow the flow belongs to, 0 for none (option --coflow). */
+	int coflow;
+	/** Flow does not start with the test but on a control command
+	 * (option --injected). */
+	char injected;
+	/** Line of the trace record the flow replays, 0 for none. */
+	unsigned long trace_record;
+	/** Number of times the flow was injected. Kept when the flow is set
+	 * up again, as it tells the sample files of the runs apart. */
+	unsigned injections;
 
 	/* For the following arrays: 0 stands for source; 1 for destination */
 
@@ -271,6 +341,27 @@ struct cflow {
 	char finished[2];
 	/** Final report from the daemon. */
 	struct report *final_report[2];
+	/** Number of final reports received, one per connection. */
+	int final_reports[2];
+	/** Time series file of the TCP state samples (option --sample). */
+	FILE *sample_file[2];
+	/** TCP state samples the daemon lost. */
+	unsigned long samples_lost[2];
+};
+
+/** Flow of a trace (option --trace). */
+struct trace_record {
+	/** Line of the record in the trace. */
+	unsigned long line;
+	/** Start of the flow relative to the start of the replay, in
+	 * seconds. */
+	double start;
+	/** Source, in the syntax of option -H. */
+	char source[256];
+	/** Destination, in the syntax of option -H. */
+	char destination[256];
+	/** Bytes sent by the source. */
+	unsigned long long bytes;
 };
 
 /** Header of an intermediated interval report column. */
@@ -0,0 +1,329 @@
+/**
+ * @file flowgrind_gate.c
+ * @brief Utility to open and close the gates of a Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "fg_definitions.h"
+#include "fg_error.h"
+#include "fg_gate.h"
+#include "fg_progname.h"
+#include "fg_time.h"
+#include "fg_argparser.h"
+
+/* External global variables. */
+extern const char *progname;
+
+/** Command line option parser. */
+static struct arg_parser parser;
+
+/** Segment of a gate schedule: gates open for a given time. */
+struct gate_segment {
+	/** Duration of the segment in seconds. */
+	double duration;
+	/** Bit i set if gate i + 1 is open during the segment. */
+	uint64_t open;
+};
+
+/* Forward declarations. */
+static void usage(short status) __attribute__((noreturn));
+
+/**
+ * Print flowgrind-gate usage and exit.
+ */
+static void usage(short status)
+{
+	/* Syntax error. Emit 'try help' to stderr and exit */
+	if (status != EXIT_SUCCESS) {
+		fprintf(stderr, "Try '%s -h' for more information\n", progname);
+		exit(status);
+	}
+
+	fprintf(stdout,
+		"Usage: %1$s [OPTION]... FILE [SCHEDULE]\n"
+		"Open and close the gates of the daemon using the gate region FILE.\n\n"
+
+		"With SCHEDULE, replay the gate schedule in the file SCHEDULE. Each line\n"
+		"holds a segment 'DURATION GATE[,GATE]...' with the duration in seconds\n"
+		"and the gates open during the segment, or '-' for none. A line 'loop'\n"
+		"repeats the schedule, otherwise the gates of the last segment stay.\n\n"
+
+		"Mandatory arguments to long options are mandatory for short options too.\n"
+		"  -c #           close gate #\n"
+		"  -h, --help     display this help and exit\n"
+		"  -o #           open gate #\n"
+		"  -s             print the counters of all used gates\n"
+		"  -v, --version  print version information and exit\n\n"
+
+		"Example:\n"
+		"   flowgrindd -g /dev/shm/fg-gates\n"
+		"   %1$s /dev/shm/fg-gates slots.txt\n",
+		progname);
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Parse the gate number @p arg.
+ *
+ * @return gate number between 1 and #MAX_GATES
+ */
+static int parse_gate(const char *arg)
+{
+	int gate;
+
+	if (sscanf(arg, "%d", &gate) != 1 || gate < 1 || gate > MAX_GATES) {
+		errx("gate must be an integer in [1..%d]", MAX_GATES);
+		usage(EXIT_FAILURE);
+	}
+	return gate;
+}
+
+/**
+ * Read the gate schedule from file @p filename.
+ *
+ * @param[in] filename file of the schedule
+ * @param[out] num number of segments
+ * @param[out] loop set if the schedule repeats
+ * @return segments of the schedule
+ */
+static struct gate_segment *read_schedule(const char *filename, int *num,
+					  int *loop)
+{
+	struct gate_segment *schedule = NULL;
+	char line[1024], gates[1000];
+	int lineno = 0, size = 0;
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		crit("could not open schedule %s", filename);
+
+	*num = *loop = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = line + strspn(line, " \t");
+		struct gate_segment segment = {.open = 0};
+		lineno++;
+
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+		if (!strncmp(p, "loop", 4) &&
+		    strspn(p + 4, " \t\n") == strlen(p + 4)) {
+			*loop = 1;
+			continue;
+		}
+		if (sscanf(p, "%lf %999s", &segment.duration, gates) != 2 ||
+		    segment.duration <= 0)
+			critx("%s:%d: malformed segment", filename, lineno);
+
+		if (strcmp(gates, "-")) {
+			for (char *tok = strtok(gates, ","); tok;
+			     tok = strtok(NULL, ","))
+				segment.open |= UINT64_C(1) << (parse_gate(tok) - 1);
+		}
+
+		if (*num == size) {
+			size = size ? 2 * size : 64;
+			schedule = realloc(schedule,
+					   size * sizeof(struct gate_segment));
+			if (!schedule)
+				critx("could not allocate memory for schedule");
+		}
+		schedule[(*num)++] = segment;
+	}
+	fclose(fp);
+
+	if (!*num)
+		critx("%s: no segments", filename);
+
+	return schedule;
+}
+
+/**
+ * Set all gates of @p region according to the bit mask @p open and wake up
+ * the daemon.
+ */
+static void set_gates(struct fg_gate_region *region, int fifo, uint64_t open)
+{
+	for (int i = 0; i < MAX_GATES; i++)
+		region->open[i] = (open >> i) & 1;
+	if (fg_gate_notify(fifo) == -1)
+		warn("failed to wake up daemon");
+}
+
+/**
+ * Replay the gate schedule in file @p filename. Segments start at absolute
+ * times, so the schedule does not drift.
+ */
+static void replay_schedule(struct fg_gate_region *region, int fifo,
+			    const char *filename)
+{
+	struct timespec next;
+	int num, loop;
+	struct gate_segment *schedule = read_schedule(filename, &num, &loop);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	do {
+		for (int i = 0; i < num; i++) {
+			set_gates(region, fifo, schedule[i].open);
+			if (i == num - 1 && !loop)
+				break;
+
+			time_add(&next, schedule[i].duration);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &next, NULL) == EINTR)
+				;
+		}
+	} while (loop);
+
+	free(schedule);
+}
+
+/**
+ * Print the counters the daemon maintains for the gates of @p region.
+ */
+static void print_stats(struct fg_gate_region *region)
+{
+	for (int i = 0; i < MAX_GATES; i++) {
+		const struct fg_gate_stats *st = &region->stats[i];
+		double open = st->open_ns / 1e9;
+
+		if (!st->opens && !st->bytes)
+			continue;
+
+		printf("gate %2d: %s, opened %" PRIu64 " times for %.6f s, "
+		       "%" PRIu64 " bytes (%.3f Mbit/s while open), held back "
+		       "%" PRIu64 " times\n", i + 1,
+		       region->open[i] ? "open" : "closed", st->opens, open,
+		       st->bytes, open ? st->bytes * 8 / open / 1e6 : 0.0,
+		       st->blocked);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL, *schedule = NULL;
+	struct fg_gate_region *region;
+	int fifo;
+
+	/* update progname from argv[0] */
+	set_progname(argv[0]);
+
+	const struct ap_Option options[] = {
+		{'c', 0, ap_yes, 0, 0},
+		{'h', "help", ap_no, 0, 0},
+		{'o', 0, ap_yes, 0, 0},
+		{'s', 0, ap_no, 0, 0},
+		{'v', "version", ap_no, 0, 0},
+		{0, 0, ap_no, 0, 0}
+	};
+
+	if (!ap_init(&parser, argc, (const char* const*) argv, options, 0))
+		critx("could not allocate memory for option parser");
+	if (ap_error(&parser)) {
+		errx("%s", ap_error(&parser));
+		usage(EXIT_FAILURE);
+	}
+
+	/* first pass: find the gate region and the schedule */
+	for (int argind = 0; argind < ap_arguments(&parser); argind++) {
+		const int code = ap_code(&parser, argind);
+		const char *arg = ap_argument(&parser, argind);
+
+		switch (code) {
+		case 0:
+			if (!path)
+				path = arg;
+			else if (!schedule)
+				schedule = arg;
+			else {
+				errx("too many arguments: %s", arg);
+				usage(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		case 'v':
+			fprintf(stdout, "%s %s\n%s\n%s\n\n%s\n", progname,
+				FLOWGRIND_VERSION, FLOWGRIND_COPYRIGHT,
+				FLOWGRIND_COPYING, FLOWGRIND_AUTHORS);
+			exit(EXIT_SUCCESS);
+			break;
+		case 'c':
+		case 'o':
+		case 's':
+			break;
+		default:
+			errx("uncaught option: %s", arg);
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (!path) {
+		errx("no gate region given");
+		usage(EXIT_FAILURE);
+	}
+
+	region = fg_gate_map(path);
+	if (!region)
+		crit("could not map gate region %s", path);
+	fifo = fg_gate_open_fifo(path);
+	if (fifo == -1)
+		crit("could not open FIFO of gate region %s", path);
+
+	/* second pass: apply the options in the given order */
+	for (int argind = 0; argind < ap_arguments(&parser); argind++) {
+		const int code = ap_code(&parser, argind);
+		const char *arg = ap_argument(&parser, argind);
+
+		switch (code) {
+		case 'c':
+			region->open[parse_gate(arg) - 1] = 0;
+			if (fg_gate_notify(fifo) == -1)
+				warn("failed to wake up daemon");
+			break;
+		case 'o':
+			region->open[parse_gate(arg) - 1] = 1;
+			if (fg_gate_notify(fifo) == -1)
+				warn("failed to wake up daemon");
+			break;
+		case 's':
+			print_stats(region);
+			break;
+		}
+	}
+
+	if (schedule)
+		replay_schedule(region, fifo, schedule);
+
+	ap_free(&parser);
+}
@@ -0,0 +1,1375 @@
+/**
+ * @file flowgrind_pcap.c
+ * @brief Utility to analyze the traffic dumps of the Flowgrind daemon
+ */
+
+/*
+ * This file is part of Flowgrind.
+ *
+ * Flowgrind is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Flowgrind is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Flowgrind.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif /* HAVE_LIBZ */
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif /* HAVE_LIBZSTD */
+
+#include "common.h"
+#include "fg_definitions.h"
+#include "fg_error.h"
+#include "fg_pcap_format.h"
+#include "fg_progname.h"
+#include "fg_argparser.h"
+
+/** Magic number of the columnar output files. */
+#define FGC_MAGIC "FGCT"
+
+/** Version of the format of the columnar output files. */
+#define FGC_VERSION 1
+
+/** Length of a column name in the columnar output files, including the
+ * terminating null byte. */
+#define FGC_NAME_LEN 28
+
+/** Length of the rotation index in the name of a rotated dump file. */
+#define ROTATION_DIGITS 4
+
+/* External global variables. */
+extern const char *progname;
+
+/** Command line option parser. */
+static struct arg_parser parser;
+
+/** Length of the intervals of the throughput time series, in ns. */
+static uint64_t interval_ns = 1000000000;
+
+/** Dumped flows, analyzed by the worker threads. */
+static struct dump_flow *flows;
+
+/** Number of dumped flows. */
+static unsigned num_flows;
+
+/** Next flow to analyze by a worker thread. */
+static unsigned next_flow;
+
+/** Statistics of one interval and direction of a connection. */
+struct interval_stats {
+	/** Payload bytes of new data. */
+	uint64_t bytes;
+	/** Segments, including pure ACKs. */
+	uint64_t segments;
+	/** Segments which carry no new data. */
+	uint64_t retransmits;
+	/** Segments which start beyond the highest sequence number seen. */
+	uint64_t reordered;
+	/** Number, sum, minimum and maximum of the RTT samples, in ns. */
+	uint64_t rtt_count;
+	uint64_t rtt_sum;
+	uint64_t rtt_min;
+	uint64_t rtt_max;
+};
+
+/** Unacknowledged data whose ACK yields an RTT sample. */
+struct pending_segment {
+	/** Sequence number following the segment. */
+	uint32_t end_seq;
+	/** Set if the data was retransmitted (Karn's algorithm). */
+	int ambiguous;
+	/** Time the segment was seen, in ns. */
+	uint64_t time;
+};
+
+/** One direction of a TCP connection. */
+struct direction {
+	/** Set once the first segment was seen. */
+	int seen;
+	/** Highest sequence number seen so far, plus one. */
+	uint32_t high_seq;
+	/** Statistics per interval, indexed from the start of the flow. */
+	struct interval_stats *intervals;
+	/** First interval with segments and number of allocated intervals. */
+	unsigned first, num_intervals;
+	/** Totals over all intervals. */
+	struct interval_stats total;
+	/** Ring of unacknowledged segments, sorted by sequence number. */
+	struct pending_segment *pending;
+	unsigned pending_head, pending_num, pending_size;
+};
+
+/** TCP connection of a dumped flow. Direction 0 is sent by the side which
+ * opened the connection, or the first segment seen if the SYN is missing. */
+struct connection {
+	/** Addresses and ports of the sender of direction 0. IPv4 addresses are
+	 * mapped to IPv6, ports are in host byte order. */
+	uint8_t addr[2][16];
+	uint16_t port[2];
+	/** Time of the first and last segment, in ns since the UNIX epoch. */
+	uint64_t first_time, last_time;
+	/** Both directions of the connection. */
+	struct direction dir[2];
+};
+
+/** Row of the table of intervals. */
+struct interval_row {
+	uint32_t flow_id;
+	uint8_t endpoint;
+	uint8_t dir;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint32_t connection;
+	uint64_t begin;
+	uint64_t end;
+	uint64_t bytes;
+	uint64_t segments;
+	uint64_t retransmits;
+	uint64_t reordered;
+	double throughput;
+	double rtt_min;
+	double rtt_avg;
+	double rtt_max;
+};
+
+/** Row of the table of RTT samples. */
+struct rtt_row {
+	uint32_t flow_id;
+	uint8_t endpoint;
+	uint8_t dir;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint32_t connection;
+	uint64_t time;
+	double rtt;
+};
+
+/** Type of a column of the columnar output files. */
+enum column_type {
+	COLUMN_U8 = 1,
+	COLUMN_U16,
+	COLUMN_U32,
+	COLUMN_U64,
+	COLUMN_F64,
+};
+
+/** Column of a table: a member of the rows of the table. */
+struct column {
+	const char *name;
+	enum column_type type;
+	size_t offset;
+};
+
+#define COLUMN(row, type, member) {#member, type, offsetof(struct row, member)}
+
+/** Columns of the table of intervals. */
+static const struct column interval_columns[] = {
+	COLUMN(interval_row, COLUMN_U32, flow_id),
+	COLUMN(interval_row, COLUMN_U8, endpoint),
+	COLUMN(interval_row, COLUMN_U32, connection),
+	COLUMN(interval_row, COLUMN_U8, dir),
+	COLUMN(interval_row, COLUMN_U16, src_port),
+	COLUMN(interval_row, COLUMN_U16, dst_port),
+	COLUMN(interval_row, COLUMN_U64, begin),
+	COLUMN(interval_row, COLUMN_U64, end),
+	COLUMN(interval_row, COLUMN_U64, bytes),
+	COLUMN(interval_row, COLUMN_U64, segments),
+	COLUMN(interval_row, COLUMN_U64, retransmits),
+	COLUMN(interval_row, COLUMN_U64, reordered),
+	COLUMN(interval_row, COLUMN_F64, throughput),
+	COLUMN(interval_row, COLUMN_F64, rtt_min),
+	COLUMN(interval_row, COLUMN_F64, rtt_avg),
+	COLUMN(interval_row, COLUMN_F64, rtt_max),
+};
+
+/** Columns of the table of RTT samples. */
+static const struct column rtt_columns[] = {
+	COLUMN(rtt_row, COLUMN_U32, flow_id),
+	COLUMN(rtt_row, COLUMN_U8, endpoint),
+	COLUMN(rtt_row, COLUMN_U32, connection),
+	COLUMN(rtt_row, COLUMN_U8, dir),
+	COLUMN(rtt_row, COLUMN_U16, src_port),
+	COLUMN(rtt_row, COLUMN_U16, dst_port),
+	COLUMN(rtt_row, COLUMN_U64, time),
+	COLUMN(rtt_row, COLUMN_F64, rtt),
+};
+
+/** Dump file of a flow. */
+struct dump_file {
+	const char *path;
+	/** Rotation index, 0 if the file is not rotated. */
+	unsigned index;
+};
+
+/** Dumped flow: the dump files one endpoint wrote for a flow. */
+struct dump_flow {
+	/** Name of the dump files without rotation index. */
+	char *key;
+	/** Flow id, or -1 if the file name does not contain it. */
+	int id;
+	/** Endpoint which wrote the dump, 's'ource or 'd'estination. */
+	char endpoint;
+	/** Dump files of the flow, sorted by rotation index. */
+	struct dump_file *files;
+	unsigned num_files;
+
+	/* Results of the analysis */
+
+	/** Time of the first packet, in ns since the UNIX epoch. */
+	uint64_t start;
+	/** Connections of the flow. */
+	struct connection *connections;
+	unsigned num_connections;
+	/** RTT samples, in the format of the output. */
+	struct rtt_row *rtts;
+	size_t num_rtts, size_rtts;
+	/** Number of packets which are no TCP segments or truncated. */
+	uint64_t skipped;
+};
+
+/* Forward declarations. */
+static void usage(short status) __attribute__((noreturn));
+
+/**
+ * Print flowgrind-pcap usage and exit.
+ */
+static void usage(short status)
+{
+	/* Syntax error. Emit 'try help' to stderr and exit */
+	if (status != EXIT_SUCCESS) {
+		fprintf(stderr, "Try '%s -h' for more information\n", progname);
+		exit(status);
+	}
+
+	fprintf(stdout,
+		"Usage: %1$s [OPTION]... FILE...\n"
+		"Analyze the traffic dumps FILE written by the daemon with option -M.\n\n"
+
+		"Print a summary of each dumped connection and write the throughput, the\n"
+		"retransmissions, the out-of-order segments and the RTT per interval as\n"
+		"well as all RTT samples into columnar tables. The rotated files of a flow\n"
+		"are analyzed in order, different flows are analyzed in parallel. Dumps\n"
+		"compressed with gzip or zstd are decompressed in memory.\n\n"
+
+		"Mandatory arguments to long options are mandatory for short options too.\n"
+		"  -h, --help     display this help and exit\n"
+		"  -i #.#         length of the intervals in seconds (default: 1.0)\n"
+		"  -j #           number of threads (default: number of online CPUs)\n"
+		"  -o PREFIX      prefix of the output files PREFIXintervals.fgc and\n"
+		"                 PREFIXrtt.fgc (default: none)\n"
+		"  -q             do not print the summary of each connection\n"
+		"  -v, --version  print version information and exit\n\n"
+
+		"Example:\n"
+		"   %1$s -i 0.1 -o run1- flowgrind-*.pcap\n",
+		progname);
+	exit(EXIT_SUCCESS);
+}
+
+/** Compare sequence numbers with wrap around: is @p a before @p b? */
+static inline int seq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/**
+ * Parse the name of the dump file @p path, which is
+ * [PREFIX]TIMESTAMP-HOST-INTERFACE-ID-ENDPOINT[-INDEX].pcap[.gz|.zst].
+ *
+ * @param[in] path path of the dump file
+ * @param[out] flow flow the file belongs to, cleared except for key, id and
+ * endpoint
+ * @param[out] file dump file, the rotation index is set
+ */
+static void parse_filename(const char *path, struct dump_flow *flow,
+			   struct dump_file *file)
+{
+	char *key = strdup(path);
+	char *end, *dash;
+	size_t len;
+
+	if (!key)
+		critx("could not allocate memory for file name");
+
+	memset(flow, 0, sizeof(*flow));
+	flow->id = -1;
+	flow->endpoint = '?';
+	file->index = 0;
+	flow->key = key;
+
+	/* Leave the key intact for unknown names, so they are a flow each */
+	len = strlen(key);
+	if (len > 3 && !strcmp(key + len - 3, ".gz"))
+		len -= 3;
+	else if (len > 4 && !strcmp(key + len - 4, ".zst"))
+		len -= 4;
+	if (len < 5 || strncmp(key + len - 5, ".pcap", 5))
+		return;
+	end = key + len - 5;
+
+	/* Rotation index */
+	dash = end - ROTATION_DIGITS - 1;
+	if (dash > key && *dash == '-' && dash[-2] == '-' &&
+	    (dash[-1] == 's' || dash[-1] == 'd') &&
+	    strspn(dash + 1, "0123456789") == ROTATION_DIGITS) {
+		file->index = (unsigned)strtoul(dash + 1, NULL, 10);
+		end = dash;
+	}
+
+	/* Endpoint and flow id */
+	if (end - key < 4 || end[-2] != '-' ||
+	    (end[-1] != 's' && end[-1] != 'd'))
+		return;
+	flow->endpoint = end[-1];
+	for (dash = end - 3; dash > key && isdigit((unsigned char)*dash);
+	     dash--)
+		;
+	if (dash < end - 3 && *dash == '-')
+		flow->id = atoi(dash + 1);
+
+	*end = '\0';
+}
+
+/** Compare dump files by rotation index for qsort(). */
+static int compare_files(const void *a, const void *b)
+{
+	const struct dump_file *fa = a, *fb = b;
+
+	return (fa->index > fb->index) - (fa->index < fb->index);
+}
+
+/**
+ * Group the dump files @p paths into flows, with their files sorted by
+ * rotation index.
+ *
+ * @param[in] paths paths of the dump files
+ * @param[in] num number of dump files
+ */
+static void group_files(const char **paths, unsigned num)
+{
+	flows = calloc(num, sizeof(struct dump_flow));
+	if (!flows)
+		critx("could not allocate memory for flows");
+
+	for (unsigned i = 0; i < num; i++) {
+		struct dump_flow parsed, *flow = NULL;
+		struct dump_file file = {.path = paths[i]};
+
+		parse_filename(paths[i], &parsed, &file);
+		for (unsigned j = 0; j < num_flows && !flow; j++)
+			if (!strcmp(flows[j].key, parsed.key))
+				flow = &flows[j];
+		if (flow) {
+			free(parsed.key);
+		} else {
+			flow = &flows[num_flows++];
+			*flow = parsed;
+		}
+
+		flow->files = realloc(flow->files, (flow->num_files + 1) *
+				      sizeof(struct dump_file));
+		if (!flow->files)
+			critx("could not allocate memory for flows");
+		flow->files[flow->num_files++] = file;
+	}
+
+	for (unsigned i = 0; i < num_flows; i++)
+		qsort(flows[i].files, flows[i].num_files,
+		      sizeof(struct dump_file), compare_files);
+}
+
+/**
+ * Get the statistics of interval @p index of direction @p dir, growing its
+ * intervals as needed.
+ */
+static struct interval_stats *get_interval(struct direction *dir,
+					   unsigned index)
+{
+	if (index >= dir->num_intervals) {
+		unsigned num = dir->num_intervals ? dir->num_intervals : 64;
+
+		while (num <= index)
+			num *= 2;
+		dir->intervals = realloc(dir->intervals,
+					 num * sizeof(struct interval_stats));
+		if (!dir->intervals)
+			critx("could not allocate memory for intervals");
+		memset(dir->intervals + dir->num_intervals, 0,
+		       (num - dir->num_intervals) *
+		       sizeof(struct interval_stats));
+		dir->num_intervals = num;
+	}
+	if (!dir->seen)
+		dir->first = index;
+	return &dir->intervals[index];
+}
+
+/** Add the RTT sample @p rtt to the statistics @p stats. */
+static void add_rtt(struct interval_stats *stats, uint64_t rtt)
+{
+	if (!stats->rtt_count || rtt < stats->rtt_min)
+		stats->rtt_min = rtt;
+	ASSIGN_MAX(stats->rtt_max, rtt);
+	stats->rtt_sum += rtt;
+	stats->rtt_count++;
+}
+
+/** Append the unacknowledged segment ending at @p end_seq to @p dir. */
+static void push_pending(struct direction *dir, uint32_t end_seq,
+			 uint64_t time)
+{
+	if (dir->pending_num == dir->pending_size) {
+		unsigned size = dir->pending_size ? 2 * dir->pending_size : 256;
+		struct pending_segment *pending =
+			malloc(size * sizeof(struct pending_segment));
+
+		if (!pending)
+			critx("could not allocate memory for segments");
+		for (unsigned i = 0; i < dir->pending_num; i++)
+			pending[i] = dir->pending[(dir->pending_head + i) %
+						  dir->pending_size];
+		free(dir->pending);
+		dir->pending = pending;
+		dir->pending_head = 0;
+		dir->pending_size = size;
+	}
+
+	dir->pending[(dir->pending_head + dir->pending_num++) %
+		     dir->pending_size] = (struct pending_segment) {
+		.end_seq = end_seq, .time = time};
+}
+
+/** Mark the unacknowledged data of @p dir from @p seq on as retransmitted. */
+static void mark_pending(struct direction *dir, uint32_t seq)
+{
+	for (unsigned i = dir->pending_num; i > 0; i--) {
+		struct pending_segment *p =
+			&dir->pending[(dir->pending_head + i - 1) %
+				      dir->pending_size];
+
+		if (!seq_before(seq, p->end_seq))
+			break;
+		p->ambiguous = 1;
+	}
+}
+
+/**
+ * Acknowledge the data of @p dir up to @p ack.
+ *
+ * @return time the newest acknowledged segment was seen, or 0 if no segment
+ * was acknowledged or the newest one is ambiguous
+ */
+static uint64_t ack_pending(struct direction *dir, uint32_t ack)
+{
+	uint64_t time = 0;
+
+	while (dir->pending_num) {
+		struct pending_segment *p = &dir->pending[dir->pending_head];
+
+		if (seq_before(ack, p->end_seq))
+			break;
+		time = p->ambiguous ? 0 : p->time;
+		dir->pending_head = (dir->pending_head + 1) % dir->pending_size;
+		dir->pending_num--;
+	}
+	return time;
+}
+
+/** Parsed headers of a TCP segment. */
+struct segment {
+	uint8_t src[16], dst[16];
+	uint16_t sport, dport;
+	uint32_t seq, ack;
+	uint8_t flags;
+	/** Payload length, taken from the IP header as the payload is usually
+	 * not dumped. */
+	uint32_t len;
+};
+
+/** TCP flags. */
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+/**
+ * Parse the IP and TCP headers of the packet @p data.
+ *
+ * @param[in] data packet, starting with the IP header
+ * @param[in] caplen captured length of the packet
+ * @param[out] seg headers of the segment
+ * @return 0 on success, or -1 if the packet is no TCP segment or truncated
+ */
+static int parse_packet(const uint8_t *data, uint32_t caplen,
+			struct segment *seg)
+{
+	uint32_t ip_len, total_len, tcp_len;
+	uint8_t proto;
+
+	if (caplen < 1)
+		return -1;
+
+	if ((data[0] >> 4) == 4) {
+		static const uint8_t mapped[12] = {[10] = 0xff, [11] = 0xff};
+
+		ip_len = (data[0] & 0xf) * 4;
+		if (caplen < 20 || ip_len < 20)
+			return -1;
+		/* Fragments other than the first one have no TCP header */
+		if (ntohs(*(const uint16_t *)(data + 6)) & 0x1fff)
+			return -1;
+		total_len = ntohs(*(const uint16_t *)(data + 2));
+		proto = data[9];
+		memcpy(seg->src, mapped, 12);
+		memcpy(seg->src + 12, data + 12, 4);
+		memcpy(seg->dst, mapped, 12);
+		memcpy(seg->dst + 12, data + 16, 4);
+	} else if ((data[0] >> 4) == 6) {
+		if (caplen < 40)
+			return -1;
+		ip_len = 40;
+		total_len = 40 + ntohs(*(const uint16_t *)(data + 4));
+		proto = data[6];
+		memcpy(seg->src, data + 8, 16);
+		memcpy(seg->dst, data + 24, 16);
+
+		/* Hop-by-hop, routing and destination options */
+		while (proto == 0 || proto == 43 || proto == 60) {
+			if (caplen < ip_len + 8)
+				return -1;
+			proto = data[ip_len];
+			ip_len += (data[ip_len + 1] + 1) * 8;
+		}
+	} else {
+		return -1;
+	}
+
+	if (proto != 6 || caplen < ip_len + 20)
+		return -1;
+	data += ip_len;
+	tcp_len = (data[12] >> 4) * 4;
+	if (tcp_len < 20 || total_len < ip_len + tcp_len)
+		return -1;
+
+	seg->sport = ntohs(*(const uint16_t *)data);
+	seg->dport = ntohs(*(const uint16_t *)(data + 2));
+	seg->seq = ntohl(*(const uint32_t *)(data + 4));
+	seg->ack = ntohl(*(const uint32_t *)(data + 8));
+	seg->flags = data[13];
+	seg->len = total_len - ip_len - tcp_len;
+	return 0;
+}
+
+/**
+ * Get the connection of segment @p seg within @p flow, adding it if needed.
+ *
+ * @param[out] index index of the connection
+ * @param[out] dir direction of the segment within the connection
+ */
+static struct connection *get_connection(struct dump_flow *flow,
+					 const struct segment *seg,
+					 unsigned *index, int *dir)
+{
+	struct connection *conn;
+
+	for (unsigned i = 0; i < flow->num_connections; i++) {
+		conn = &flow->connections[i];
+		for (int d = 0; d < 2; d++) {
+			if (conn->port[d] == seg->sport &&
+			    conn->port[!d] == seg->dport &&
+			    !memcmp(conn->addr[d], seg->src, 16) &&
+			    !memcmp(conn->addr[!d], seg->dst, 16)) {
+				*index = i;
+				*dir = d;
+				return conn;
+			}
+		}
+	}
+
+	flow->connections = realloc(flow->connections,
+				    (flow->num_connections + 1) *
+				    sizeof(struct connection));
+	if (!flow->connections)
+		critx("could not allocate memory for connections");
+	*index = flow->num_connections++;
+	conn = &flow->connections[*index];
+	memset(conn, 0, sizeof(struct connection));
+
+	/* A SYN/ACK is sent by the side which did not open the connection */
+	*dir = (seg->flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK);
+	memcpy(conn->addr[*dir], seg->src, 16);
+	memcpy(conn->addr[!*dir], seg->dst, 16);
+	conn->port[*dir] = seg->sport;
+	conn->port[!*dir] = seg->dport;
+	return conn;
+}
+
+/**
+ * Account the segment @p seg seen at @p time to its connection in @p flow.
+ */
+static void analyze_segment(struct dump_flow *flow, const struct segment *seg,
+			    uint64_t time)
+{
+	unsigned index;
+	int d;
+	struct connection *conn = get_connection(flow, seg, &index, &d);
+	struct direction *dir = &conn->dir[d], *rev = &conn->dir[!d];
+	struct interval_stats *stats = get_interval(dir,
+		(unsigned)((time - flow->start) / interval_ns));
+	/* SYN and FIN occupy a sequence number */
+	uint32_t end_seq = seg->seq + seg->len + !!(seg->flags & TCP_SYN) +
+			   !!(seg->flags & TCP_FIN);
+
+	if (!conn->first_time)
+		conn->first_time = time;
+	conn->last_time = time;
+
+	stats->segments++;
+	dir->total.segments++;
+
+	if (end_seq != seg->seq) {
+		if (!dir->seen || seq_before(dir->high_seq, end_seq)) {
+			uint32_t new_seq = dir->seen && seq_before(seg->seq,
+				dir->high_seq) ? dir->high_seq : seg->seq;
+			uint32_t bytes = end_seq - new_seq;
+
+			if (seg->flags & TCP_SYN)
+				bytes--;
+			if ((seg->flags & TCP_FIN) && bytes)
+				bytes--;
+			/* Data behind a hole arrived ahead of missing data */
+			if (dir->seen && seq_before(dir->high_seq, seg->seq)) {
+				stats->reordered++;
+				dir->total.reordered++;
+			}
+			if (dir->seen && new_seq != seg->seq)
+				mark_pending(dir, seg->seq);
+			stats->bytes += bytes;
+			dir->total.bytes += bytes;
+			dir->high_seq = end_seq;
+			push_pending(dir, end_seq, time);
+		} else {
+			stats->retransmits++;
+			dir->total.retransmits++;
+			mark_pending(dir, seg->seq);
+		}
+	}
+	dir->seen = 1;
+
+	/* The ACK yields an RTT sample of the reverse direction */
+	if (seg->flags & TCP_ACK && rev->pending_num) {
+		uint64_t sent = ack_pending(rev, seg->ack);
+
+		if (sent) {
+			struct interval_stats *rev_stats = get_interval(rev,
+				(unsigned)((time - flow->start) / interval_ns));
+			struct rtt_row *row;
+
+			add_rtt(rev_stats, time - sent);
+			add_rtt(&rev->total, time - sent);
+
+			if (flow->num_rtts == flow->size_rtts) {
+				flow->size_rtts = flow->size_rtts ?
+					2 * flow->size_rtts : 1024;
+				flow->rtts = realloc(flow->rtts,
+						     flow->size_rtts *
+						     sizeof(struct rtt_row));
+				if (!flow->rtts)
+					critx("could not allocate memory for "
+					      "RTT samples");
+			}
+			row = &flow->rtts[flow->num_rtts++];
+			*row = (struct rtt_row) {
+				.flow_id = (uint32_t)flow->id,
+				.endpoint = (uint8_t)flow->endpoint,
+				.connection = index,
+				.dir = (uint8_t)!d,
+				.src_port = conn->port[!d],
+				.dst_port = conn->port[d],
+				.time = time,
+				.rtt = (time - sent) / 1e6,
+			};
+		}
+	}
+}
+
+/** Byte swap @p x if @p swap is set. */
+static inline uint32_t swap32(uint32_t x, int swap)
+{
+	return swap ? __builtin_bswap32(x) : x;
+}
+
+/** Whether the @p len bytes at @p data start with the gzip magic. */
+static inline int is_gzip(const uint8_t *data, size_t len)
+{
+	return len >= 2 && data[0] == 0x1f && data[1] == 0x8b;
+}
+
+/** Whether the @p len bytes at @p data start with the zstd magic. */
+static inline int is_zstd(const uint8_t *data, size_t len)
+{
+	return len >= 4 && !memcmp(data, "\x28\xb5\x2f\xfd", 4);
+}
+
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+/**
+ * Double the @p size of the decompression buffer @p buf, or allocate it with
+ * @p size bytes if @p buf is NULL.
+ *
+ * @param[in] path path of the dump file, for messages
+ * @return the buffer
+ */
+static uint8_t *grow_buffer(uint8_t *buf, size_t *size, const char *path)
+{
+	if (buf)
+		*size *= 2;
+	buf = realloc(buf, *size);
+	if (!buf)
+		critx("could not allocate memory to decompress %s", path);
+	return buf;
+}
+#endif /* HAVE_LIBZ || HAVE_LIBZSTD */
+
+/**
+ * Decompress the gzip compressed dump file @p path into memory.
+ *
+ * @param[in] path path of the dump file, for messages
+ * @param[in] in compressed content of the file
+ * @param[in] in_len size of @p in
+ * @param[out] out_len size of the decompressed content
+ * @return the decompressed content, to be freed by the caller, or NULL on
+ * failure
+ */
+static uint8_t *decompress_gzip(const char *path, const uint8_t *in,
+				size_t in_len, size_t *out_len)
+{
+#ifdef HAVE_LIBZ
+	size_t size = in_len * 4, len = 0;
+	uint8_t *out = NULL;
+	z_stream zs;
+	int rc;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 added to the window bits selects the gzip format */
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+		warnx("%s: could not set up gzip decompression", path);
+		return NULL;
+	}
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = in_len;
+	do {
+		if (!out || len == size)
+			out = grow_buffer(out, &size, path);
+		zs.next_out = out + len;
+		zs.avail_out = size - len;
+		rc = inflate(&zs, Z_NO_FLUSH);
+		len = size - zs.avail_out;
+	} while (rc == Z_OK);
+	inflateEnd(&zs);
+
+	/* The stream of a daemon which did not exit cleanly ends early */
+	if (rc == Z_BUF_ERROR && !zs.avail_in) {
+		warnx("%s: truncated gzip stream", path);
+	} else if (rc != Z_STREAM_END) {
+		warnx("%s: corrupt gzip stream", path);
+		free(out);
+		return NULL;
+	}
+	*out_len = len;
+	return out;
+#else /* HAVE_LIBZ */
+	UNUSED_ARGUMENT(in);
+	UNUSED_ARGUMENT(in_len);
+	UNUSED_ARGUMENT(out_len);
+	warnx("%s: compressed with gzip, which this build does not support, "
+	      "decompress it first", path);
+	return NULL;
+#endif /* HAVE_LIBZ */
+}
+
+/**
+ * Decompress the zstd compressed dump file @p path into memory.
+ *
+ * @param[in] path path of the dump file, for messages
+ * @param[in] in compressed content of the file
+ * @param[in] in_len size of @p in
+ * @param[out] out_len size of the decompressed content
+ * @return the decompressed content, to be freed by the caller, or NULL on
+ * failure
+ */
+static uint8_t *decompress_zstd(const char *path, const uint8_t *in,
+				size_t in_len, size_t *out_len)
+{
+#ifdef HAVE_LIBZSTD
+	ZSTD_inBuffer zin = { in, in_len, 0 };
+	ZSTD_outBuffer zout = { NULL, in_len * 4, 0 };
+	ZSTD_DCtx *zctx = ZSTD_createDCtx();
+	size_t rc;
+
+	if (!zctx) {
+		warnx("%s: could not set up zstd decompression", path);
+		return NULL;
+	}
+	/* rc is 0 once the frame is complete */
+	do {
+		if (!zout.dst || zout.pos == zout.size)
+			zout.dst = grow_buffer(zout.dst, &zout.size, path);
+		rc = ZSTD_decompressStream(zctx, &zout, &zin);
+	} while (!ZSTD_isError(rc) && rc &&
+		 (zin.pos < zin.size || zout.pos == zout.size));
+	ZSTD_freeDCtx(zctx);
+
+	/* The stream of a daemon which did not exit cleanly ends early */
+	if (ZSTD_isError(rc)) {
+		warnx("%s: corrupt zstd stream", path);
+		free(zout.dst);
+		return NULL;
+	} else if (rc) {
+		warnx("%s: truncated zstd stream", path);
+	}
+	*out_len = zout.pos;
+	return zout.dst;
+#else /* HAVE_LIBZSTD */
+	UNUSED_ARGUMENT(in);
+	UNUSED_ARGUMENT(in_len);
+	UNUSED_ARGUMENT(out_len);
+	warnx("%s: compressed with zstd, which this build does not support, "
+	      "decompress it first", path);
+	return NULL;
+#endif /* HAVE_LIBZSTD */
+}
+
+/**
+ * Analyze the packets in the dump file @p path.
+ *
+ * @param[in,out] flow flow the file belongs to
+ * @param[in] path path of the dump file
+ */
+static void analyze_file(struct dump_flow *flow, const char *path)
+{
+	const struct pcap_file_header_ns *header;
+	const uint8_t *map, *data, *p, *end;
+	uint8_t *decompressed = NULL;
+	uint32_t linktype, magic;
+	unsigned link_len;
+	uint64_t ts_scale;
+	struct stat st;
+	size_t size;
+	int fd, swap;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		warn("could not open %s", path);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		warnx("%s: not a pcap file", path);
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("could not map %s", path);
+		return;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	data = map;
+	size = st.st_size;
+
+	/* Compressed dumps (flowgrindd -Z) are decompressed into memory */
+	if (is_gzip(map, st.st_size) || is_zstd(map, st.st_size)) {
+		if (is_gzip(map, st.st_size))
+			decompressed = decompress_gzip(path, map, st.st_size,
+						       &size);
+		else
+			decompressed = decompress_zstd(path, map, st.st_size,
+						       &size);
+		if (!decompressed)
+			goto out;
+		data = decompressed;
+		if (size < sizeof(*header)) {
+			warnx("%s: not a pcap file", path);
+			goto out;
+		}
+	}
+
+	header = (const struct pcap_file_header_ns *)data;
+	magic = header->magic;
+	swap = magic == __builtin_bswap32(PCAP_MAGIC_NSEC) ||
+	       magic == __builtin_bswap32(PCAP_MAGIC_USEC);
+	magic = swap32(magic, swap);
+	if (magic != PCAP_MAGIC_NSEC && magic != PCAP_MAGIC_USEC) {
+		warnx("%s: not a pcap file", path);
+		goto out;
+	}
+	ts_scale = magic == PCAP_MAGIC_NSEC ? 1 : 1000;
+
+	linktype = swap32(header->linktype, swap);
+	switch (linktype) {
+	case LINKTYPE_RAW:
+		link_len = 0;
+		break;
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		link_len = 4;
+		break;
+	case LINKTYPE_ETHERNET:
+		link_len = 14;
+		break;
+	default:
+		warnx("%s: unsupported link type %u", path, linktype);
+		goto out;
+	}
+
+	p = data + sizeof(*header);
+	end = data + size;
+	while (p < end) {
+		const struct pcap_record_header_ns *record =
+			(const struct pcap_record_header_ns *)p;
+		uint32_t caplen, offset = link_len;
+		struct segment seg;
+		uint64_t time;
+
+		if ((size_t)(end - p) < sizeof(*record)) {
+			warnx("%s: truncated packet header", path);
+			break;
+		}
+		caplen = swap32(record->caplen, swap);
+		p += sizeof(*record);
+		if ((size_t)(end - p) < caplen) {
+			warnx("%s: truncated packet", path);
+			break;
+		}
+
+		/* Skip VLAN tags */
+		if (linktype == LINKTYPE_ETHERNET)
+			while (caplen >= offset + 4 &&
+			       p[offset - 2] == 0x81 && p[offset - 1] == 0x00)
+				offset += 4;
+
+		time = (uint64_t)swap32(record->ts_sec, swap) * 1000000000 +
+		       (uint64_t)swap32(record->ts_nsec, swap) * ts_scale;
+		if (!flow->start)
+			flow->start = time;
+
+		/* Packets are dumped in order per capture thread, but guard
+		 * against time stepping backwards */
+		if (caplen < offset || time < flow->start ||
+		    parse_packet(p + offset, caplen - offset, &seg) == -1)
+			flow->skipped++;
+		else
+			analyze_segment(flow, &seg, time);
+		p += caplen;
+	}
+
+out:
+	free(decompressed);
+	munmap((void *)map, st.st_size);
+}
+
+/**
+ * Worker thread: analyze the flows not yet taken by other workers.
+ */
+static void *analyze_flows(void *arg)
+{
+	unsigned i;
+
+	UNUSED_ARGUMENT(arg);
+
+	while ((i = __atomic_fetch_add(&next_flow, 1, __ATOMIC_RELAXED)) <
+	       num_flows)
+		for (unsigned j = 0; j < flows[i].num_files; j++)
+			analyze_file(&flows[i], flows[i].files[j].path);
+	return NULL;
+}
+
+/**
+ * Fill the row of interval @p index of direction @p d of the connection
+ * @p conn_index of @p flow.
+ */
+static void fill_interval_row(struct interval_row *row,
+			      const struct dump_flow *flow,
+			      unsigned conn_index, int d, unsigned index)
+{
+	const struct connection *conn = &flow->connections[conn_index];
+	const struct interval_stats *stats = &conn->dir[d].intervals[index];
+
+	*row = (struct interval_row) {
+		.flow_id = (uint32_t)flow->id,
+		.endpoint = (uint8_t)flow->endpoint,
+		.connection = conn_index,
+		.dir = (uint8_t)d,
+		.src_port = conn->port[d],
+		.dst_port = conn->port[!d],
+		.begin = flow->start + index * interval_ns,
+		.end = flow->start + (index + 1) * interval_ns,
+		.bytes = stats->bytes,
+		.segments = stats->segments,
+		.retransmits = stats->retransmits,
+		.reordered = stats->reordered,
+		.throughput = stats->bytes * 8 / (interval_ns / 1e9) / 1e6,
+		.rtt_min = stats->rtt_count ? stats->rtt_min / 1e6 : NAN,
+		.rtt_avg = stats->rtt_count ?
+			(double)stats->rtt_sum / stats->rtt_count / 1e6 : NAN,
+		.rtt_max = stats->rtt_count ? stats->rtt_max / 1e6 : NAN,
+	};
+}
+
+/**
+ * Collect the rows of the table of intervals. Each direction of a connection
+ * has a row for every interval from its first to its last segment.
+ */
+static struct interval_row *collect_intervals(size_t *num_rows)
+{
+	struct interval_row *rows = NULL;
+	size_t size = 0;
+
+	*num_rows = 0;
+	for (unsigned i = 0; i < num_flows; i++) {
+		const struct dump_flow *flow = &flows[i];
+
+		for (unsigned c = 0; c < flow->num_connections; c++) {
+			const struct connection *conn = &flow->connections[c];
+
+			for (int d = 0; d < 2; d++) {
+				const struct direction *dir = &conn->dir[d];
+				unsigned last;
+
+				if (!dir->seen)
+					continue;
+				last = (unsigned)((conn->last_time -
+						   flow->start) / interval_ns);
+				for (unsigned k = dir->first; k <= last &&
+				     k < dir->num_intervals; k++) {
+					if (*num_rows == size) {
+						size = size ? 2 * size : 1024;
+						rows = realloc(rows, size *
+							sizeof(struct interval_row));
+						if (!rows)
+							critx("could not allocate "
+							      "memory for rows");
+					}
+					fill_interval_row(&rows[(*num_rows)++],
+							  flow, c, d, k);
+				}
+			}
+		}
+	}
+	return rows;
+}
+
+/** Size of a value of column type @p type, in bytes. */
+static size_t column_size(enum column_type type)
+{
+	switch (type) {
+	case COLUMN_U8:
+		return 1;
+	case COLUMN_U16:
+		return 2;
+	case COLUMN_U32:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+/**
+ * Write a table in the columnar format to file @p filename.
+ *
+ * The file starts with the magic number #FGC_MAGIC, the format version, the
+ * number of columns and the number of rows. A descriptor of each column with
+ * its name and type follows, then the values of each column in turn. All
+ * numbers are in host byte order, each column is padded to 8 bytes.
+ *
+ * @param[in] filename name of the output file
+ * @param[in] columns columns of the table
+ * @param[in] num_columns number of columns
+ * @param[in] parts rows of the table, in one or more parts
+ * @param[in] part_rows number of rows of each part
+ * @param[in] num_parts number of parts
+ * @param[in] row_size size of a row
+ */
+static void write_table(const char *filename, const struct column *columns,
+			unsigned num_columns, const void *const *parts,
+			const size_t *part_rows, unsigned num_parts,
+			size_t row_size)
+{
+	static const uint8_t padding[8];
+	uint32_t version = FGC_VERSION, ncols = num_columns;
+	uint64_t nrows = 0;
+	FILE *fp;
+
+	for (unsigned i = 0; i < num_parts; i++)
+		nrows += part_rows[i];
+
+	fp = fopen(filename, "w");
+	if (!fp)
+		crit("could not create %s", filename);
+
+	fwrite(FGC_MAGIC, 4, 1, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	fwrite(&ncols, sizeof(ncols), 1, fp);
+	fwrite(padding, 4, 1, fp);
+	fwrite(&nrows, sizeof(nrows), 1, fp);
+
+	for (unsigned c = 0; c < num_columns; c++) {
+		char name[FGC_NAME_LEN] = "";
+		uint32_t type = columns[c].type;
+
+		strncpy(name, columns[c].name, FGC_NAME_LEN - 1);
+		fwrite(name, FGC_NAME_LEN, 1, fp);
+		fwrite(&type, sizeof(type), 1, fp);
+	}
+
+	for (unsigned c = 0; c < num_columns; c++) {
+		size_t size = column_size(columns[c].type);
+
+		for (unsigned i = 0; i < num_parts; i++) {
+			const uint8_t *row = parts[i];
+
+			for (size_t r = 0; r < part_rows[i]; r++,
+			     row += row_size)
+				fwrite(row + columns[c].offset, size, 1, fp);
+		}
+		if ((nrows * size) % 8)
+			fwrite(padding, 8 - (nrows * size) % 8, 1, fp);
+	}
+
+	if (ferror(fp) | fclose(fp))
+		crit("could not write %s", filename);
+}
+
+/** Format the IPv6 or IPv4-mapped address @p addr into @p buf. */
+static const char *format_address(const uint8_t *addr, char *buf,
+				  socklen_t size)
+{
+	static const uint8_t mapped[12] = {[10] = 0xff, [11] = 0xff};
+
+	if (!memcmp(addr, mapped, 12))
+		return inet_ntop(AF_INET, addr + 12, buf, size);
+	return inet_ntop(AF_INET6, addr, buf, size);
+}
+
+/** Print a summary of each connection of @p flow. */
+static void print_summary(const struct dump_flow *flow)
+{
+	for (unsigned c = 0; c < flow->num_connections; c++) {
+		const struct connection *conn = &flow->connections[c];
+		double duration = (conn->last_time - conn->first_time) / 1e9;
+		char addr[2][INET6_ADDRSTRLEN];
+
+		format_address(conn->addr[0], addr[0], INET6_ADDRSTRLEN);
+		format_address(conn->addr[1], addr[1], INET6_ADDRSTRLEN);
+		printf("flow %d (%c) connection %u: %s:%u <-> %s:%u, %.6f s\n",
+		       flow->id, flow->endpoint, c, addr[0], conn->port[0],
+		       addr[1], conn->port[1], duration);
+
+		for (int d = 0; d < 2; d++) {
+			const struct interval_stats *t = &conn->dir[d].total;
+
+			printf("  %s: %" PRIu64 " bytes, %.3f Mbit/s, %" PRIu64
+			       " segments, %" PRIu64 " retransmits, %" PRIu64
+			       " out-of-order", d ? "<-" : "->", t->bytes,
+			       duration ? t->bytes * 8 / duration / 1e6 : 0.0,
+			       t->segments, t->retransmits, t->reordered);
+			if (t->rtt_count)
+				printf(", rtt = %.3f/%.3f/%.3f ms "
+				       "(min/avg/max)", t->rtt_min / 1e6,
+				       (double)t->rtt_sum / t->rtt_count / 1e6,
+				       t->rtt_max / 1e6);
+			printf("\n");
+		}
+	}
+	if (flow->skipped)
+		printf("flow %d (%c): skipped %" PRIu64 " packets which are no "
+		       "TCP segments\n", flow->id, flow->endpoint,
+		       flow->skipped);
+}
+
+int main(int argc, char *argv[])
+{
+	const char **paths = NULL, *prefix = "";
+	unsigned num_paths = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int quiet = 0;
+	pthread_t *workers;
+	char *filename;
+
+	/* update progname from argv[0] */
+	set_progname(argv[0]);
+
+	const struct ap_Option options[] = {
+		{'h', "help", ap_no, 0, 0},
+		{'i', 0, ap_yes, 0, 0},
+		{'j', 0, ap_yes, 0, 0},
+		{'o', 0, ap_yes, 0, 0},
+		{'q', 0, ap_no, 0, 0},
+		{'v', "version", ap_no, 0, 0},
+		{0, 0, ap_no, 0, 0}
+	};
+
+	if (!ap_init(&parser, argc, (const char* const*) argv, options, 0))
+		critx("could not allocate memory for option parser");
+	if (ap_error(&parser)) {
+		errx("%s", ap_error(&parser));
+		usage(EXIT_FAILURE);
+	}
+
+	paths = malloc(ap_arguments(&parser) * sizeof(char *));
+	if (!paths)
+		critx("could not allocate memory for file names");
+
+	for (int argind = 0; argind < ap_arguments(&parser); argind++) {
+		const int code = ap_code(&parser, argind);
+		const char *arg = ap_argument(&parser, argind);
+		double interval;
+
+		switch (code) {
+		case 0:
+			paths[num_paths++] = arg;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		case 'i':
+			if (sscanf(arg, "%lf", &interval) != 1 ||
+			    interval < 1e-6) {
+				errx("interval must be a positive number of "
+				     "seconds");
+				usage(EXIT_FAILURE);
+			}
+			interval_ns = (uint64_t)(interval * 1e9);
+			break;
+		case 'j':
+			if (sscanf(arg, "%ld", &threads) != 1 || threads < 1) {
+				errx("number of threads must be a positive "
+				     "integer");
+				usage(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			prefix = arg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'v':
+			fprintf(stdout, "%s %s\n%s\n%s\n\n%s\n", progname,
+				FLOWGRIND_VERSION, FLOWGRIND_COPYRIGHT,
+				FLOWGRIND_COPYING, FLOWGRIND_AUTHORS);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			errx("uncaught option: %s", arg);
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (!num_paths) {
+		errx("no dump file given");
+		usage(EXIT_FAILURE);
+	}
+
+	/* A flow is analyzed by a single thread, as its packets depend on
+	 * each other */
+	group_files(paths, num_paths);
+	if (threads < 1)
+		threads = 1;
+	if ((unsigned long)threads > num_flows)
+		threads = num_flows;
+
+	workers = malloc(threads * sizeof(pthread_t));
+	if (!workers)
+		critx("could not allocate memory for threads");
+	for (long i = 0; i < threads; i++) {
+		errno = pthread_create(&workers[i], NULL, analyze_flows, NULL);
+		if (errno)
+			crit("could not create thread");
+	}
+	for (long i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+
+	if (!quiet)
+		for (unsigned i = 0; i < num_flows; i++)
+			print_summary(&flows[i]);
+
+	/* Intervals */
+	size_t num_rows;
+	struct interval_row *rows = collect_intervals(&num_rows);
+	const void *part = rows;
+
+	if (asprintf(&filename, "%sintervals.fgc", prefix) == -1)
+		critx("could not allocate memory for file name");
+	write_table(filename, interval_columns,
+		    sizeof(interval_columns) / sizeof(struct column), &part,
+		    &num_rows, 1, sizeof(struct interval_row));
+	free(filename);
+	free(rows);
+
+	/* RTT samples, in parts per flow */
+	const void **parts = malloc(num_flows * sizeof(void *));
+	size_t *part_rows = malloc(num_flows * sizeof(size_t));
+
+	if (!parts || !part_rows)
+		critx("could not allocate memory for RTT samples");
+	for (unsigned i = 0; i < num_flows; i++) {
+		parts[i] = flows[i].rtts;
+		part_rows[i] = flows[i].num_rtts;
+	}
+	if (asprintf(&filename, "%srtt.fgc", prefix) == -1)
+		critx("could not allocate memory for file name");
+	write_table(filename, rtt_columns,
+		    sizeof(rtt_columns) / sizeof(struct column),
+		    (const void *const *)parts, part_rows, num_flows,
+		    sizeof(struct rtt_row));
+	free(filename);
+	free(parts);
+	free(part_rows);
+
+	for (unsigned i = 0; i < num_flows; i++) {
+		for (unsigned c = 0; c < flows[i].num_connections; c++) {
+			free(flows[i].connections[c].dir[0].intervals);
+			free(flows[i].connections[c].dir[0].pending);
+			free(flows[i].connections[c].dir[1].intervals);
+			free(flows[i].connections[c].dir[1].pending);
+		}
+		free_all(flows[i].connections, flows[i].rtts, flows[i].files,
+			 flows[i].key);
+	}
+	free_all(flows, workers, paths);
+	ap_free(&parser);
+}
@@ -44,6 +44,7 @@
 #include <signal.h>
 #include <syslog.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -63,6 +64,7 @@
 #include "fg_log.h"
 #include "fg_affinity.h"
 #include "fg_error.h"
+#include "fg_gate.h"
 #include "fg_math.h"
 #include "fg_progname.h"
 #include "fg_string.h"
@@ -71,6 +73,7 @@
 #include "debug.h"
 #include "fg_argparser.h"
 #include "fg_rpc_server.h"
+#include "source.h"
 
 #ifdef HAVE_LIBPCAP
 #include "fg_pcap.h"
@@ -100,6 +103,11 @@ static char *rpc_bind_addr = NULL;
 /** CPU core to which flowgrindd should bind to. */
 static int core;
 
+#ifdef HAVE_LIBPCAP
+/** Options of the packet capture of dumped flows. */
+static struct fg_pcap_options capture_options = { .core = -1 };
+#endif /* HAVE_LIBPCAP */
+
 /** Command line option parser. */
 static struct arg_parser parser;
 
@@ -128,21 +136,52 @@ static void usage(short status)
 		"Advanced TCP traffic generator for Linux, FreeBSD, and Mac OS X.\n\n"
 
 		"Mandatory arguments to long options are mandatory for short options too.\n"
+		"  -a ADDR[/LOW-HIGH]\n"
+		"                 bind test connections of source flows to local address ADDR,\n"
+		"                 using ports LOW to HIGH. Without a port range the kernel\n"
+		"                 picks the port at connect time. Add option multiple times\n"
+		"                 to spread connections over several addresses\n"
 		"  -b ADDR        XML-RPC server bind address\n"
 		"  -c #           bound daemon to specific CPU. First CPU is 0\n"
+#ifdef HAVE_LIBPCAP
+		"  -C #           bound packet capture threads of dumped flows to specific\n"
+		"                 CPU. First CPU is 0\n"
+#endif /* HAVE_LIBPCAP */
 #ifdef DEBUG
 		"  -d, --debug    increase debugging verbosity. Add option multiple times to\n"
 		"                 increase the verbosity (no daemon, log to stderr)\n"
 #else /* DEBUG */
 		"  -d             don't fork into background, log to stderr\n"
 #endif /* DEBUG */
+		"  -g FILE        let another process open and close gates for flows with\n"
+		"                 option --gate through the shared memory region FILE, e.g. on\n"
+		"                 /dev/shm. Changes are signalled through the FIFO FILE.fifo\n"
 		"  -h, --help     display this help and exit\n"
 		"  -p #           XML-RPC server port\n"
 #ifdef HAVE_LIBPCAP
-		"  -w DIR         target directory for dump files. The daemon must be run as root\n"
+		"  -P #           dump # bytes of payload beyond the TCP header of each\n"
+		"                 segment of dumped flows (default: 0, headers only)\n"
+#endif /* HAVE_LIBPCAP */
+		"  -q #           number of bytes each flow may send and receive per scheduling\n"
+		"                 round before other flows are served (default: %2$u).\n"
+		"                 0 lets pushy flows run until their socket blocks\n"
+		"  -r #           issue at most # connects per second. Further connects are\n"
+		"                 queued and issued in order (default: 0, no limit)\n"
+#ifdef HAVE_LIBPCAP
+		"  -R SIZE[:TIME] start a new dump file once a dump file reached SIZE MiB or\n"
+		"                 is TIME seconds old. 0 disables the respective limit\n"
+#endif /* HAVE_LIBPCAP */
+		"  -s             accept test connections of all flows on one shared listen\n"
+		"                 socket. Connections are matched to their flow by a handshake\n"
+#if defined HAVE_LIBPCAP || defined HAVE_LIBBPF
+		"  -w DIR         target directory for dump and kernel trace files. The daemon\n"
+		"                 must be run as root\n"
+#endif /* HAVE_LIBPCAP || HAVE_LIBBPF */
+#ifdef HAVE_LIBPCAP
+		"  -Z ALG         compress dump files with ALG, either 'gzip' or 'zstd'\n"
 #endif /* HAVE_LIBPCAP */
 		"  -v, --version  print version information and exit\n",
-		progname);
+		progname, DEFAULT_SCHEDULE_QUANTUM);
 	exit(EXIT_SUCCESS);
 }
 
@@ -212,7 +251,7 @@ void bind_daemon_to_core(void)
 			  progname, getpid(), core);
 }
 
-#ifdef HAVE_LIBPCAP
+#if defined HAVE_LIBPCAP || defined HAVE_LIBBPF
 int process_dump_dir() {
 	if (!dump_dir)
 		dump_dir = getcwd(NULL, 0);
@@ -243,6 +282,26 @@ int process_dump_dir() {
 
 	return 1;
 }
+#endif /* HAVE_LIBPCAP || HAVE_LIBBPF */
+
+#ifdef HAVE_LIBPCAP
+/**
+ * Parse the rotation limits of dump files.
+ *
+ * @param[in] arg limits given as SIZE[:TIME], the size in MiB and the age in
+ * seconds. A limit of 0 is no limit
+ * @return 0 on success, or -1 on failure
+ */
+static int parse_rotation(const char *arg)
+{
+	double size = 0, age = 0;
+
+	if (sscanf(arg, "%lf:%lf", &size, &age) < 1 || size < 0 || age < 0)
+		return -1;
+	capture_options.rotate_size = size * (1 << 20);
+	capture_options.rotate_time = age;
+	return 0;
+}
 #endif /* HAVE_LIBPCAP */
 
 /**
@@ -254,20 +313,31 @@ int process_dump_dir() {
 static void parse_cmdline(int argc, char *argv[])
 {
 	const struct ap_Option options[] = {
+		{'a', 0, ap_yes, 0, 0},
 		{'b', 0, ap_yes, 0, 0},
 		{'c', 0, ap_yes, 0, 0},
+#ifdef HAVE_LIBPCAP
+		{'C', 0, ap_yes, 0, 0},
+		{'P', 0, ap_yes, 0, 0},
+		{'R', 0, ap_yes, 0, 0},
+		{'Z', 0, ap_yes, 0, 0},
+#endif /* HAVE_LIBPCAP */
 #ifdef DEBUG
 		{'d', "debug", ap_no, 0, 0},
 #else /* DEBUG */
 		{'d', 0, ap_no, 0, 0},
 #endif
+		{'g', 0, ap_yes, 0, 0},
 		{'h', "help", ap_no, 0, 0},
 		{'o', 0, ap_yes, 0, 0},
 		{'p', 0, ap_yes, 0, 0},
+		{'q', 0, ap_yes, 0, 0},
+		{'r', 0, ap_yes, 0, 0},
+		{'s', 0, ap_no, 0, 0},
 		{'v', "version", ap_no, 0, 0},
-#ifdef HAVE_LIBPCAP
+#if defined HAVE_LIBPCAP || defined HAVE_LIBBPF
 		{'w', 0, ap_yes, 0, 0},
-#endif /* HAVE_LIBPCAP */
+#endif /* HAVE_LIBPCAP || HAVE_LIBBPF */
 		{0, 0, ap_no, 0, 0}
 	};
 
@@ -284,6 +354,11 @@ static void parse_cmdline(int argc, char *argv[])
 		switch (code) {
 		case 0:
 			PARSE_ERR("invalid argument: %s", arg);
+		case 'a':
+			if (add_source_address(arg) == -1)
+				PARSE_ERR("failed to parse source address %s",
+					  arg);
+			break;
 		case 'b':
 			rpc_bind_addr = strdup(arg);
 			if (sscanf(arg, "%s", rpc_bind_addr) != 1)
@@ -293,11 +368,45 @@ static void parse_cmdline(int argc, char *argv[])
 			if (sscanf(arg, "%u", &core) != 1)
 				PARSE_ERR("failed to parse CPU number");
 			break;
+#ifdef HAVE_LIBPCAP
+		case 'C':
+			if (sscanf(arg, "%d", &capture_options.core) != 1 ||
+			    capture_options.core < 0)
+				PARSE_ERR("failed to parse CPU number");
+			break;
+		case 'P':
+			if (sscanf(arg, "%u", &capture_options.payload) != 1)
+				PARSE_ERR("failed to parse payload bytes");
+			break;
+		case 'R':
+			if (parse_rotation(arg) == -1)
+				PARSE_ERR("failed to parse dump file rotation "
+					  "%s", arg);
+			break;
+		case 'Z':
+			if (!strcmp(arg, "gzip"))
+				capture_options.compression = PCAP_COMPRESS_GZIP;
+			else if (!strcmp(arg, "zstd"))
+				capture_options.compression = PCAP_COMPRESS_ZSTD;
+			else
+				PARSE_ERR("unknown compression %s", arg);
+			break;
+#endif /* HAVE_LIBPCAP */
 		case 'd':
 #ifdef DEBUG
 			increase_debuglevel();
 #endif /* DEBUG */
 			break;
+		case 'g':
+			gates = fg_gate_map(arg);
+			if (!gates)
+				PARSE_ERR("failed to map gate region %s: %s",
+					  arg, strerror(errno));
+			gate_fifo = fg_gate_open_fifo(arg);
+			if (gate_fifo == -1)
+				PARSE_ERR("failed to open FIFO of gate region "
+					  "%s: %s", arg, strerror(errno));
+			break;
 		case 'h':
 			usage(EXIT_SUCCESS);
 			break;
@@ -305,11 +414,23 @@ static void parse_cmdline(int argc, char *argv[])
 			if (sscanf(arg, "%u", &port) != 1)
 				PARSE_ERR("failed to parse port number");
 			break;
-#ifdef HAVE_LIBPCAP
+		case 'q':
+			if (sscanf(arg, "%u", &schedule_quantum) != 1 ||
+			    schedule_quantum > INT_MAX / 2)
+				PARSE_ERR("failed to parse scheduling quantum");
+			break;
+		case 'r':
+			if (sscanf(arg, "%u", &connect_rate) != 1)
+				PARSE_ERR("failed to parse connect rate");
+			break;
+		case 's':
+			shared_listen = 1;
+			break;
+#if defined HAVE_LIBPCAP || defined HAVE_LIBBPF
 		case 'w':
 			dump_dir = strdup(arg);
 			break;
-#endif /* HAVE_LIBPCAP */
+#endif /* HAVE_LIBPCAP || HAVE_LIBBPF */
 		case 'v':
 			fprintf(stdout, "%s %s\%s\n%s\n\n%s\n", progname,
 				FLOWGRIND_VERSION, FLOWGRIND_COPYRIGHT,
@@ -322,18 +443,18 @@ static void parse_cmdline(int argc, char *argv[])
 		}
 	}
 
-#ifdef HAVE_LIBPCAP
+#if defined HAVE_LIBPCAP || defined HAVE_LIBBPF
 	if (!process_dump_dir()) {
 		if (ap_is_used(&parser, 'w'))
 			PARSE_ERR("the dump directory %s for tcpdumps does "
 				  "either not exist or you have insufficient "
 				  "permissions to write to it", dump_dir);
 		else
-			warnx("tcpdumping will not be available since you "
-			      "don't have sufficient permissions to write to "
-			      "%s", dump_dir);
+			warnx("tcpdumping and kernel tracing will not be "
+			      "available since you don't have sufficient "
+			      "permissions to write to %s", dump_dir);
 	}
-#endif /* HAVE_LIBPCAP */
+#endif /* HAVE_LIBPCAP || HAVE_LIBBPF */
 }
 
 static void sanity_check(void)
@@ -349,6 +470,14 @@ static void sanity_check(void)
 		exit(EXIT_FAILURE);
 	}
 
+#ifdef HAVE_LIBPCAP
+	if (capture_options.core > get_ncores(NCORE_CURRENT)) {
+		errx("CPU binding of packet capture failed. Given CPU ID is "
+		     "higher then available CPU cores");
+		exit(EXIT_FAILURE);
+	}
+#endif /* HAVE_LIBPCAP */
+
 	/* TODO more sanity checks... (e.g. if port is in valid range) */
 }
 
@@ -393,9 +522,14 @@ int main(int argc, char *argv[])
         init_logging(LOGGING_SYSLOG);
 
 	fg_list_init(&flows);
+	fg_list_init(&shared_listeners);
+	fg_list_init(&pending_connections);
+	fg_list_init(&rate_buckets);
+	fg_list_init(&query_groups);
+	fg_list_init(&report_groups);
 
 #ifdef HAVE_LIBPCAP
-	fg_pcap_init();
+	fg_pcap_init(&capture_options);
 #endif /* HAVE_LIBPCAP */
 
 	init_rpc_server(&server, rpc_bind_addr, port);
@@ -64,7 +64,7 @@
 #include "fg_pcap.h"
 #endif /* HAVE_LIBPCAP */
 
-void remove_flow(unsigned i);
+void remove_flow(struct flow * const flow);
 
 #ifdef HAVE_TCP_INFO
 int get_tcp_info(struct flow *flow, struct tcp_info *info);
@@ -73,14 +73,47 @@ int get_tcp_info(struct flow *flow, struct tcp_info *info);
 void init_flow(struct flow* flow, int is_source);
 void uninit_flow(struct flow *flow);
 
-static int name2socket(struct flow *flow, char *server_name, unsigned port, struct sockaddr **saptr,
-		socklen_t *lenp,
-		const int read_buffer_size_req, int *read_buffer_size,
-		const int send_buffer_size_req, int *send_buffer_size)
+/** Resolved destination address of source flows. */
+struct addrinfo_cache_entry {
+	char host[256];
+	unsigned port;
+	/** Time the address was resolved. */
+	struct timespec resolved;
+	struct addrinfo *res;
+	struct addrinfo_cache_entry *next;
+};
+
+/* Only accessed from the daemon thread */
+static struct addrinfo_cache_entry *addrinfo_cache = NULL;
+
+/**
+ * Resolve @p server_name and @p port, using a cached result if possible.
+ *
+ * Flows to the same destination share one getaddrinfo() call, which keeps
+ * name resolution out of mass connection setup.
+ *
+ * @param[in,out] flow flow the address is resolved for
+ * @param[in] server_name host name or address
+ * @param[in] port port of the destination
+ * @return address list owned by the cache, or NULL on error (the error is set
+ * on @p flow)
+ */
+static struct addrinfo *resolve_cached(struct flow *flow, char *server_name,
+				       unsigned port)
 {
-	int fd, n;
-	struct addrinfo hints, *res, *ressave;
+	struct addrinfo_cache_entry *entry;
+	struct addrinfo hints, *res;
+	struct timespec now;
 	char service[7];
+	int n;
+
+	gettime(&now);
+	for (entry = addrinfo_cache; entry; entry = entry->next)
+		if (entry->port == port && !strcmp(entry->host, server_name))
+			break;
+
+	if (entry && time_diff(&entry->resolved, &now) < ADDRINFO_CACHE_TTL)
+		return entry->res;
 
 	bzero(&hints, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
@@ -91,9 +124,281 @@ static int name2socket(struct flow *flow, char *server_name, unsigned port, stru
 	if ((n = getaddrinfo(server_name, service, &hints, &res)) != 0) {
 		flow_error(flow, "getaddrinfo() failed: %s",
 				gai_strerror(n));
+		return NULL;
+	}
+
+	if (!entry) {
+		entry = malloc(sizeof(struct addrinfo_cache_entry));
+		if (!entry) {
+			freeaddrinfo(res);
+			flow_error(flow, "could not allocate memory for "
+				   "address cache");
+			return NULL;
+		}
+		strncpy(entry->host, server_name, sizeof(entry->host) - 1);
+		entry->host[sizeof(entry->host) - 1] = 0;
+		entry->port = port;
+		entry->next = addrinfo_cache;
+		addrinfo_cache = entry;
+	} else {
+		freeaddrinfo(entry->res);
+	}
+	entry->res = res;
+	entry->resolved = now;
+
+	return res;
+}
+
+/* Configured at startup, afterwards only accessed from the daemon thread */
+static struct source_address *source_addresses = NULL;
+/** Source address to try first on the next allocation. */
+static struct source_address *next_source_address = NULL;
+
+/**
+ * Add a local address to the pool of addresses source flows bind to.
+ *
+ * @param[in] arg address with optional port range, i.e. ADDR[/LOW-HIGH]
+ * @return 0 on success, -1 if @p arg can not be parsed
+ */
+int add_source_address(const char *arg)
+{
+	struct source_address *sa, **last;
+	struct addrinfo hints, *res;
+	unsigned low = 0, high = 0;
+	char *host, *range;
+
+	host = strdup(arg);
+	if (!host)
+		crit("strdup(): failed");
+
+	range = strchr(host, '/');
+	if (range) {
+		*range++ = 0;
+		if (sscanf(range, "%u-%u", &low, &high) != 2 || !low ||
+		    low > high || high > 65535) {
+			free(host);
+			return -1;
+		}
+	}
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		free(host);
 		return -1;
 	}
-	ressave = res;
+	free(host);
+
+	sa = calloc(1, sizeof(struct source_address));
+	if (!sa)
+		crit("calloc(): failed");
+	memcpy(&sa->addr, res->ai_addr, res->ai_addrlen);
+	sa->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	sa->port_low = low;
+	sa->port_high = high;
+	sa->next_port = low;
+	if (low) {
+		sa->in_use = calloc(high - low + 1, sizeof(char));
+		sa->released = calloc(high - low + 1, sizeof(time_t));
+		if (!sa->in_use || !sa->released)
+			crit("calloc(): failed");
+	}
+
+	/* keep the configured order */
+	for (last = &source_addresses; *last; last = &(*last)->next);
+	*last = sa;
+	if (!next_source_address)
+		next_source_address = sa;
+
+	return 0;
+}
+
+/**
+ * Number of ports the kernel picks ephemeral ports from, as configured by
+ * sysctl net.ipv4.ip_local_port_range, or 0 if unknown.
+ */
+static unsigned ephemeral_port_count(void)
+{
+	unsigned low, high;
+	FILE *f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%u %u", &low, &high) != 2 || high < low)
+		low = high + 1;
+	fclose(f);
+	return high - low + 1;
+}
+
+/**
+ * Get the utilisation of the source address pool.
+ *
+ * An address without a port range shares the kernel's ephemeral ports among
+ * the destinations, so its share of @p total is the ephemeral port range,
+ * i.e. the connections it can hold towards a single destination.
+ *
+ * @param[out] in_use test sockets bound to a source address
+ * @param[out] total number of ports in the port ranges of the addresses
+ */
+void get_source_port_usage(unsigned *in_use, unsigned *total)
+{
+	const unsigned ephemeral = ephemeral_port_count();
+
+	*in_use = *total = 0;
+	for (struct source_address *sa = source_addresses; sa; sa = sa->next) {
+		*in_use += sa->sockets;
+		if (sa->port_low)
+			*total += sa->port_high - sa->port_low + 1;
+		else
+			*total += ephemeral;
+	}
+}
+
+static void set_sockaddr_port(struct sockaddr_storage *addr, unsigned port)
+{
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+/**
+ * Bind the test socket of @p flow to source address @p sa.
+ *
+ * Without a port range the kernel picks the port only at connect time
+ * (IP_BIND_ADDRESS_NO_PORT), thus a port can be used towards several
+ * destinations. Otherwise the next port of the range is taken which is
+ * neither bound by another flow nor in quarantine after its last use.
+ *
+ * @return 0 on success, -1 if @p sa has no usable port left
+ */
+static int bind_source_port(struct flow *flow, struct source_address *sa,
+			    struct timespec *now)
+{
+	struct sockaddr_storage addr = sa->addr;
+	unsigned range;
+
+	if (!sa->port_low) {
+		/* Without the option bind() reserves an ephemeral port. Dumped
+		 * flows need their port before connect() to capture the SYN */
+		if (!flow->settings.traffic_dump)
+			set_ip_bind_address_no_port(flow->fd);
+		if (bind(flow->fd, (struct sockaddr *)&addr, sa->addr_len) == -1)
+			return -1;
+		flow->source_address = sa;
+		flow->source_port = 0;
+		sa->sockets++;
+		return 0;
+	}
+
+	range = sa->port_high - sa->port_low + 1;
+	for (unsigned tries = 0; tries < range; tries++) {
+		unsigned port = sa->next_port;
+		unsigned idx = port - sa->port_low;
+
+		sa->next_port = port == sa->port_high ? sa->port_low : port + 1;
+
+		if (sa->in_use[idx] || (sa->released[idx] &&
+		    now->tv_sec - sa->released[idx] < SOURCE_PORT_QUARANTINE))
+			continue;
+
+		set_sockaddr_port(&addr, port);
+		if (bind(flow->fd, (struct sockaddr *)&addr, sa->addr_len) == -1) {
+			/* port is used by someone else */
+			if (errno == EADDRINUSE)
+				continue;
+			return -1;
+		}
+
+		sa->in_use[idx] = 1;
+		sa->sockets++;
+		flow->source_address = sa;
+		flow->source_port = port;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Bind the test socket of @p flow to an address of the source address pool.
+ *
+ * The addresses of the destination's address family are used round robin.
+ *
+ * @return 0 on success or if no pool is configured, -1 on error
+ */
+static int bind_source_address(struct flow *flow)
+{
+	struct source_address *sa = next_source_address;
+	unsigned in_use, total;
+	struct timespec now;
+
+	if (!source_addresses)
+		return 0;
+
+	gettime(&now);
+	do {
+		struct source_address *current = sa;
+
+		sa = sa->next ? sa->next : source_addresses;
+		if (current->addr.ss_family == flow->addr->sa_family &&
+		    bind_source_port(flow, current, &now) == 0) {
+			next_source_address = sa;
+			return 0;
+		}
+	} while (sa != next_source_address);
+
+	get_source_port_usage(&in_use, &total);
+	logging(LOG_WARNING, "source address pool exhausted (%u of %u ports "
+		"in use)", in_use, total);
+	flow_error(flow, "no free source address: %u of %u ports in use",
+		   in_use, total);
+	return -1;
+}
+
+/**
+ * Return the source port of @p flow to the source address pool.
+ *
+ * The port is quarantined for SOURCE_PORT_QUARANTINE seconds, so that a new
+ * connection does not collide with the TIME_WAIT state of the old one.
+ */
+void release_source_port(struct flow *flow)
+{
+	struct source_address *sa = flow->source_address;
+
+	if (!sa)
+		return;
+
+	if (flow->source_port) {
+		struct timespec now;
+		unsigned idx = flow->source_port - sa->port_low;
+
+		gettime(&now);
+		sa->in_use[idx] = 0;
+		sa->released[idx] = now.tv_sec;
+	}
+	sa->sockets--;
+
+	flow->source_address = NULL;
+	flow->source_port = 0;
+}
+
+static int name2socket(struct flow *flow, char *server_name, unsigned port, struct sockaddr **saptr,
+		socklen_t *lenp,
+		const int read_buffer_size_req, int *read_buffer_size,
+		const int send_buffer_size_req, int *send_buffer_size)
+{
+	int fd;
+	struct addrinfo *res;
+
+	res = resolve_cached(flow, server_name, port);
+	if (!res)
+		return -1;
 
 	do {
 
@@ -109,7 +414,6 @@ static int name2socket(struct flow *flow, char *server_name, unsigned port, stru
 		        flow_error(flow, "failed to create listen socket: too many"
 		                "file descriptors in use by this daemon");
 		        close(fd);
-		        freeaddrinfo(ressave);
 			return -1;
 		}
 
@@ -125,7 +429,6 @@ static int name2socket(struct flow *flow, char *server_name, unsigned port, stru
 	if (res == NULL) {
 		flow_error(flow, "Could not create socket for "
 				"\"%s:%d\": %s", server_name, port, strerror(errno));
-		freeaddrinfo(ressave);
 		return -1;
 	}
 
@@ -137,8 +440,6 @@ static int name2socket(struct flow *flow, char *server_name, unsigned port, stru
 		*lenp = res->ai_addrlen;
 	}
 
-	freeaddrinfo(ressave);
-
 	return fd;
 }
 
@@ -153,6 +454,11 @@ static int name2socket(struct flow *flow, char *server_name, unsigned port, stru
 int do_connect(struct flow *flow) {
 	int rc;
 
+#ifdef HAVE_LIBPCAP
+	/* the connections of a flow share its dump file */
+	fg_pcap_go(flow);
+#endif /* HAVE_LIBPCAP */
+	gettime(&flow->connect_timestamp);
 	rc = connect(flow->fd, flow->addr, flow->addr_len);
 	if (rc == -1 && errno != EINPROGRESS) {
 		flow_error(flow, "connect() failed: %s",
@@ -166,15 +472,63 @@ int do_connect(struct flow *flow) {
 }
 
 /**
- * To set daemon flow as source endpoint
+ * Prepare a new connect attempt after the connection of a flow failed.
  *
- * To set the flow options and settings as source endpoint. Depending upon the 
- * late connection option the data connection is established to connect the 
- * destination daemon listening port address with source daemon. 
+ * The test socket is replaced by a fresh one which is connected after an
+ * exponentially growing backoff.
  *
- * @param[in,out] request Contain the test option and parameter for daemon source endpoint 
+ * @param[in,out] flow source flow whose connection failed
+ * @return 0 if the connect will be retried, -1 if the flow has to be given up
  */
-int add_flow_source(struct request_add_flow_source *request)
+int retry_connect(struct flow *flow)
+{
+	int read_buffer_size, send_buffer_size;
+
+	if (flow->connect_retries >= CONNECT_RETRIES) {
+		flow_error(flow, "connect failed %u times, giving up",
+			   flow->connect_retries + 1);
+		return -1;
+	}
+
+	logging(LOG_NOTICE, "connect of flow %d failed, retrying in %.3fs",
+		flow->id, CONNECT_BACKOFF * (1 << flow->connect_retries));
+
+	release_source_port(flow);
+	close(flow->fd);
+	/* the cached inode belongs to the closed socket */
+	flow->inode = 0;
+	free(flow->addr);
+	flow->addr = NULL;
+
+	flow->fd = name2socket(flow, flow->source_settings.destination_host,
+			flow->source_settings.destination_port,
+			&flow->addr, &flow->addr_len,
+			flow->settings.requested_read_buffer_size, &read_buffer_size,
+			flow->settings.requested_send_buffer_size, &send_buffer_size);
+	if (flow->fd == -1 || bind_source_address(flow) == -1 ||
+	    set_flow_tcp_options(flow) == -1)
+		return -1;
+
+	gettime(&flow->next_connect_timestamp);
+	time_add(&flow->next_connect_timestamp,
+		 CONNECT_BACKOFF * (1 << flow->connect_retries));
+	flow->connect_retries++;
+	flow->connect_called = 0;
+	flow->handshake_bytes_written = 0;
+
+	return 0;
+}
+
+/**
+ * Add one connection of a source flow.
+ *
+ * @param[in,out] request request to add the source flow
+ * @param[in] connection index of the connection within the flow
+ * @return the added connection, or NULL on error
+ */
+static struct flow *
+add_flow_source_connection(struct request_add_flow_source *request,
+			   int connection)
 {
 #ifdef HAVE_SO_TCP_CONGESTION
 	socklen_t opt_len = 0;
@@ -187,35 +541,72 @@ int add_flow_source(struct request_add_flow_source *request)
 		request_error(&request->r,
 			"Can not accept another flow, already "
 			"handling %zu flows.", fg_list_size(&flows));
-		return -1;
+		return NULL;
 	}
 
 	flow = malloc(sizeof(struct flow));
 	if (!flow) {
 		logging(LOG_ALERT, "could not allocate memory for flow");
-		return -1;
+		return NULL;
 	}
 
 	init_flow(flow, 1);
 
+	flow->connection = connection;
 	flow->settings = request->settings;
+	if (dup_rate_schedule(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return NULL;
+	}
+	split_connection_rate(flow);
+	/* do not let all connections draw the same random numbers */
+	flow->settings.random_seed += connection;
 	flow->source_settings = request->source_settings;
 	/* be greedy with buffer sizes */
 	flow->write_block = calloc(1, flow->settings.maximum_block_size);
 	flow->read_block = calloc(1, flow->settings.maximum_block_size);
+	flow->response_block = calloc(1, flow->settings.maximum_block_size);
 	/* Controller flow ID is set in the daemon */
 	flow->id = flow->settings.flow_id;
-	if (flow->write_block == NULL || flow->read_block == NULL) {
+	if (flow->write_block == NULL || flow->read_block == NULL ||
+	    flow->response_block == NULL) {
 		logging(LOG_ALERT, "could not allocate memory for read/write "
 			"blocks");
 		request_error(&request->r, "could not allocate memory for read/write blocks");
 		uninit_flow(flow);
-		return -1;
+		return NULL;
 	}
 	if (flow->settings.byte_counting) {
 		int byte_idx;
 		for (byte_idx = 0; byte_idx < flow->settings.maximum_block_size; byte_idx++)
-			*(flow->write_block + byte_idx) = (unsigned char)(byte_idx & 0xff);
+			*(flow->write_block + byte_idx) =
+				*(flow->response_block + byte_idx) =
+				(unsigned char)(byte_idx & 0xff);
+	}
+
+	if (join_rate_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return NULL;
+	}
+
+	if (join_query_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return NULL;
+	}
+
+	if (join_report_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return NULL;
+	}
+
+	if (join_connection_group(flow) == -1) {
+		request_error(&request->r, "%s", flow->error);
+		uninit_flow(flow);
+		return NULL;
 	}
 
 	flow->state = GRIND_WAIT_CONNECT;
@@ -229,14 +620,21 @@ int add_flow_source(struct request_add_flow_source *request)
 			flow->error);
 		request_error(&request->r, "Could not create data socket: %s", flow->error);
 		uninit_flow(flow);
-		return -1;
+		return NULL;
+	}
+
+	if (bind_source_address(flow) == -1) {
+		request_error(&request->r, "Could not bind data socket: %s",
+			      flow->error);
+		uninit_flow(flow);
+		return NULL;
 	}
 
 	if (set_flow_tcp_options(flow) == -1) {
 		request->r.error = flow->error;
 		flow->error = NULL;
 		uninit_flow(flow);
-		return -1;
+		return NULL;
 	}
 
 #ifdef HAVE_SO_TCP_CONGESTION
@@ -246,20 +644,18 @@ int add_flow_source(struct request_add_flow_source *request)
 		request_error(&request->r, "failed to determine actual congestion control algorithm: %s",
 			strerror(errno));
 		uninit_flow(flow);
-		return -1;
+		return NULL;
 	}
 #endif /* HAVE_SO_TCP_CONGESTION */
 
-#ifdef HAVE_LIBPCAP
-	fg_pcap_go(flow);
-#endif /* HAVE_LIBPCAP */
-	if (!flow->source_settings.late_connect) {
+	/* Connects beyond the connect rate are issued by the daemon loop */
+	if (!flow->source_settings.late_connect && connect_slot_available()) {
 		DEBUG_MSG(4, "(early) connecting test socket (fd=%u)", flow->fd);
 		if (do_connect(flow) == -1) {
 			request->r.error = flow->error;
 			flow->error = NULL;
 			uninit_flow(flow);
-			return -1;
+			return NULL;
 		}
 	}
 
@@ -267,5 +663,46 @@ int add_flow_source(struct request_add_flow_source *request)
 
 	fg_list_push_back(&flows, flow);
 
+	return flow;
+}
+
+/**
+ * To set daemon flow as source endpoint
+ *
+ * To set the flow options and settings as source endpoint. Depending upon the 
+ * late connection option the data connection is established to connect the 
+ * destination daemon listening port address with source daemon. A flow with
+ * multiple connections opens all of them.
+ *
+ * @param[in,out] request Contain the test option and parameter for daemon source endpoint 
+ */
+int add_flow_source(struct request_add_flow_source *request)
+{
+	const int connections = request->settings.connections;
+	struct flow **added = calloc(connections, sizeof(struct flow *));
+
+	if (!added) {
+		logging(LOG_ALERT, "could not allocate memory for connections");
+		request_error(&request->r, "could not allocate memory for "
+			      "connections");
+		return -1;
+	}
+
+	for (int connection = 0; connection < connections; connection++) {
+		added[connection] = add_flow_source_connection(request,
+							       connection);
+		if (added[connection])
+			continue;
+
+		/* remove the connections added so far by this request */
+		for (int i = 0; i < connection; i++) {
+			uninit_flow(added[i]);
+			remove_flow(added[i]);
+		}
+		free(added);
+		return -1;
+	}
+
+	free(added);
 	return 0;
 }
@@ -34,5 +34,9 @@
 
 int add_flow_source(struct request_add_flow_source *request);
 int do_connect(struct flow *flow);
+int retry_connect(struct flow *flow);
+int add_source_address(const char *arg);
+void get_source_port_usage(unsigned *in_use, unsigned *total);
+void release_source_port(struct flow *flow);
 
 #endif /* _SOURCE_H_ */
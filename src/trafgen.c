@@ -35,6 +35,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -43,6 +44,7 @@
 #include "daemon.h"
 #include "debug.h"
 #include "fg_math.h"
+#include "fg_time.h"
 #include "trafgen.h"
 
 #define MAX_RUNS_PER_DISTRIBUTION 10
@@ -170,10 +172,111 @@ int next_response_block_size(struct flow *flow)
 
 }
 
+/**
+ * Bytes the rate schedule of @p settings allows from its start up to
+ * @p t seconds into the schedule.
+ */
+static double schedule_bytes_until(const struct flow_settings *settings,
+				   double t)
+{
+	const struct rate_segment *seg = settings->rate_schedule;
+	const int n = settings->num_rate_segments;
+	double period = 0.0, period_bytes = 0.0, bytes = 0.0;
+
+	if (t <= 0)
+		return 0.0;
+
+	for (int i = 0; i < n; i++) {
+		period += seg[i].duration;
+		period_bytes += seg[i].duration * seg[i].rate;
+	}
+
+	if (t >= period) {
+		if (!settings->rate_schedule_loop)
+			return period_bytes + (t - period) * seg[n - 1].rate;
+		double periods = floor(t / period);
+		bytes = periods * period_bytes;
+		t -= periods * period;
+	}
+
+	for (int i = 0; i < n && t > 0; i++) {
+		bytes += MIN(t, seg[i].duration) * seg[i].rate;
+		t -= seg[i].duration;
+	}
+	return bytes;
+}
+
+/**
+ * Time into the rate schedule of @p settings at which it has allowed
+ * @p bytes bytes. Inverse of schedule_bytes_until().
+ */
+static double schedule_time_of(const struct flow_settings *settings,
+			       double bytes)
+{
+	const struct rate_segment *seg = settings->rate_schedule;
+	const int n = settings->num_rate_segments;
+	double period = 0.0, period_bytes = 0.0, t = 0.0;
+
+	for (int i = 0; i < n; i++) {
+		period += seg[i].duration;
+		period_bytes += seg[i].duration * seg[i].rate;
+	}
+
+	if (bytes >= period_bytes) {
+		if (!settings->rate_schedule_loop)
+			return period + (bytes - period_bytes) / seg[n - 1].rate;
+		double periods = floor(bytes / period_bytes);
+		t = periods * period;
+		bytes -= periods * period_bytes;
+	}
+
+	for (int i = 0; i < n && bytes > 0; i++) {
+		if (seg[i].rate * seg[i].duration >= bytes)
+			return t + bytes / seg[i].rate;
+		bytes -= seg[i].rate * seg[i].duration;
+		t += seg[i].duration;
+	}
+	return t;
+}
+
+/**
+ * Bytes the rate schedule of @p settings allows between @p from and @p to
+ * seconds after the flow started to write.
+ */
+double rate_schedule_bytes(const struct flow_settings *settings, double from,
+			   double to)
+{
+	if (!settings->num_rate_segments || to <= from)
+		return 0.0;
+
+	return schedule_bytes_until(settings, to) -
+		schedule_bytes_until(settings, from);
+}
+
+/**
+ * Gap after the block just written by @p flow that keeps it on its rate
+ * schedule. Blocks that span a segment boundary are sent at the rate of
+ * each segment they overlap, segments with a rate of zero are skipped.
+ */
+static double rate_schedule_gap(struct flow *flow)
+{
+	double t = time_diff(&flow->start_timestamp[WRITE],
+			     &flow->next_write_block_timestamp);
+	double bytes = schedule_bytes_until(&flow->settings, t) +
+		flow->current_write_block_size;
+
+	return schedule_time_of(&flow->settings, bytes) - t;
+}
+
 double next_interpacket_gap(struct flow *flow) {
 
 	double gap = 0.0;
-	if (flow->settings.write_rate)
+	/* The kernel paces, we only keep the socket buffer full */
+	if (flow->settings.kernel_pacing)
+		gap = 0.0;
+	else if (flow->settings.num_rate_segments)
+		gap = rate_schedule_gap(flow);
+	else if (flow->settings.write_rate)
 		gap = ((double)flow->settings.maximum_block_size)/flow->settings.write_rate;
 	else
 		gap = calculate(flow,
@@ -33,5 +33,7 @@
 extern int next_request_block_size(struct flow *);
 extern int next_response_block_size(struct flow *);
 extern double next_interpacket_gap(struct flow *);
+extern double rate_schedule_bytes(const struct flow_settings *, double,
+				  double);
 
 #endif /* _TRAFGEN_H_ */